@@ -166,6 +166,9 @@ static void open_filesystem(char *device, int open_flags, blk64_t superblock,
 	}
 	if (catastrophic)
 		open_flags |= EXT2_FLAG_SKIP_MMP;
+	else
+		/* Only read in the bitmaps of groups we actually touch */
+		open_flags |= EXT2_FLAG_LAZY_BITMAPS;
 
 	if (undo_file) {
 		retval = debugfs_setup_tdb(device, undo_file, &io_ptr);
@@ -192,6 +192,24 @@ extern void do_get_quota(int argc, char *argv[]);
 extern __s64 string_to_time(const char *arg);
 errcode_t read_list(char *str, blk64_t **list, size_t *len);
 
+/*
+ * Identifies the state of a filesystem, so that the indexes which
+ * icheck -x and ncheck -x save to disk can tell when they are stale.
+ * All fields are little-endian.
+ */
+struct fs_state_key {
+	__u8	uuid[16];
+	__u32	mnt_count;
+	__u32	wtime;
+	__u64	kbytes_written;
+	__u64	free_blocks;
+	__u32	free_inodes;
+	__u32	reserved;
+};
+
+extern void get_fs_state_key(ext2_filsys fs, struct fs_state_key *key);
+extern int fs_changed_in_session(ext2_filsys fs);
+
 /* xattrs.c */
 void dump_inode_attributes(FILE *out, ext2_ino_t ino);
 void do_get_xattr(int argc, char **argv);
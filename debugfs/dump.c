@@ -23,6 +23,9 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <utime.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 #ifdef HAVE_GETOPT_H
 #include <getopt.h>
 #else
@@ -144,23 +147,593 @@ static void dump_file(const char *cmdname, ext2_ino_t ino, int fd,
 	return;
 }
 
+/*
+ * Recovery mode
+ *
+ * Dumping a tree file by file through ext2fs_file_read() seeks all over
+ * the device.  In recovery mode ("rdump -r", "dump -r") we instead plan
+ * the whole tree first: directories and symlinks are created as they
+ * are found, and the extents of every regular file are collected.  The
+ * extents are then sorted by physical block and read in that order,
+ * while a pool of writer threads copies the data into the output
+ * files.  Holes and unwritten extents are never read or written, so
+ * the output files are sparse.  Blocks which can't be read are left as
+ * zeroes.
+ *
+ * A file's data may be spread over the whole device, so only a limited
+ * number of output files are kept open; the least recently used idle
+ * one is closed to make room, and reopened when more of its data turns
+ * up.
+ */
+
+#define RDUMP_CHUNK_SIZE	(1024 * 1024)
+#define RDUMP_MAX_THREADS	64
+#define RDUMP_QUEUE_PER_THREAD	4
+#define RDUMP_MAX_OPEN		256
+
+struct rdump_file {
+	ext2_ino_t		ino;
+	struct ext2_inode	inode;
+	char			*name;
+	int			fd;
+	int			preserve;
+	blk64_t			chunks_left;
+	int			opened;
+	int			busy;
+	struct rdump_file	*lru_prev, *lru_next;
+};
+
+struct rdump_extent {
+	blk64_t			pblk;
+	blk64_t			lblk;
+	__u32			len;
+	__u32			file;
+};
+
+struct rdump_chunk {
+	struct rdump_chunk	*next;
+	struct rdump_file	*file;
+	blk64_t			lblk;
+	__u32			len;
+	char			*buf;
+};
+
+struct rdump_plan {
+	struct rdump_file	*files;
+	unsigned int		num_files, size_files;
+	struct rdump_extent	*extents;
+	blk64_t			num_extents, size_extents;
+	struct rdump_file	*dirs;
+	unsigned int		num_dirs, size_dirs;
+	struct rdump_file	*lru_head, *lru_tail;
+	unsigned int		num_open;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		lock;
+	pthread_cond_t		have_work;
+	pthread_cond_t		have_room;
+	struct rdump_chunk	*head, *tail;
+	unsigned int		queued, max_queued;
+	int			done;
+#endif
+};
+
+static errcode_t rdump_add_extent(struct rdump_plan *plan, __u32 file,
+				  blk64_t pblk, blk64_t lblk, __u32 len)
+{
+	struct rdump_extent	*ext;
+	errcode_t		retval;
+
+	if (plan->num_extents) {
+		ext = &plan->extents[plan->num_extents - 1];
+		if (ext->file == file && ext->pblk + ext->len == pblk &&
+		    ext->lblk + ext->len == lblk && ext->len + len > ext->len) {
+			ext->len += len;
+			return 0;
+		}
+	}
+	if (plan->num_extents >= plan->size_extents) {
+		blk64_t new_size = plan->size_extents ?
+			plan->size_extents * 2 : 1024;
+
+		retval = ext2fs_resize_mem(plan->size_extents *
+					   sizeof(struct rdump_extent),
+					   new_size * sizeof(struct rdump_extent),
+					   &plan->extents);
+		if (retval)
+			return retval;
+		plan->size_extents = new_size;
+	}
+	ext = &plan->extents[plan->num_extents++];
+	ext->pblk = pblk;
+	ext->lblk = lblk;
+	ext->len = len;
+	ext->file = file;
+	return 0;
+}
+
+static errcode_t rdump_add_file(struct rdump_file **files, unsigned int *num,
+				unsigned int *size, ext2_ino_t ino,
+				struct ext2_inode *inode, const char *name,
+				int preserve)
+{
+	struct rdump_file	*f;
+	errcode_t		retval;
+
+	if (*num >= *size) {
+		unsigned int new_size = *size ? *size * 2 : 256;
+
+		retval = ext2fs_resize_mem(*size * sizeof(struct rdump_file),
+					   new_size * sizeof(struct rdump_file),
+					   files);
+		if (retval)
+			return retval;
+		*size = new_size;
+	}
+	f = &(*files)[*num];
+	memset(f, 0, sizeof(struct rdump_file));
+	retval = ext2fs_get_mem(strlen(name) + 1, &f->name);
+	if (retval)
+		return retval;
+	strcpy(f->name, name);
+	f->ino = ino;
+	f->inode = *inode;
+	f->fd = -1;
+	f->preserve = preserve;
+	(*num)++;
+	return 0;
+}
+
+struct rdump_block_struct {
+	struct rdump_plan	*plan;
+	__u32			file;
+	errcode_t		retval;
+};
+
+static int rdump_block_proc(ext2_filsys fs EXT2FS_ATTR((unused)),
+			    blk64_t *block_nr, e2_blkcnt_t blockcnt,
+			    blk64_t ref_block EXT2FS_ATTR((unused)),
+			    int ref_offset EXT2FS_ATTR((unused)),
+			    void *private)
+{
+	struct rdump_block_struct *rb = private;
+
+	rb->retval = rdump_add_extent(rb->plan, rb->file, *block_nr,
+				      blockcnt, 1);
+	return rb->retval ? BLOCK_ABORT : 0;
+}
+
+/* Collect the extents of the file most recently added to the plan */
+static errcode_t rdump_plan_extents(struct rdump_plan *plan)
+{
+	__u32			file = plan->num_files - 1;
+	struct rdump_file	*f = &plan->files[file];
+	struct rdump_block_struct rb;
+	ext2_extent_handle_t	handle;
+	struct ext2fs_extent	extent;
+	errcode_t		retval;
+
+	if (!(f->inode.i_flags & EXT4_EXTENTS_FL)) {
+		rb.plan = plan;
+		rb.file = file;
+		rb.retval = 0;
+		retval = ext2fs_block_iterate3(current_fs, f->ino,
+				BLOCK_FLAG_READ_ONLY | BLOCK_FLAG_DATA_ONLY,
+				0, rdump_block_proc, &rb);
+		return retval ? retval : rb.retval;
+	}
+
+	retval = ext2fs_extent_open2(current_fs, f->ino, &f->inode, &handle);
+	if (retval)
+		return retval;
+	retval = ext2fs_extent_get(handle, EXT2_EXTENT_ROOT, &extent);
+	while (!retval) {
+		if ((extent.e_flags & EXT2_EXTENT_FLAGS_LEAF) &&
+		    !(extent.e_flags & EXT2_EXTENT_FLAGS_UNINIT) &&
+		    extent.e_len) {
+			retval = rdump_add_extent(plan, file, extent.e_pblk,
+						  extent.e_lblk, extent.e_len);
+			if (retval)
+				break;
+		}
+		retval = ext2fs_extent_get(handle, EXT2_EXTENT_NEXT_LEAF,
+					   &extent);
+	}
+	if (retval == EXT2_ET_EXTENT_NO_NEXT ||
+	    retval == EXT2_ET_NO_CURRENT_NODE)
+		retval = 0;
+	ext2fs_extent_free(handle);
+	return retval;
+}
+
+static void rdump_lru_remove(struct rdump_plan *plan, struct rdump_file *f)
+{
+	if (f->lru_prev)
+		f->lru_prev->lru_next = f->lru_next;
+	else
+		plan->lru_head = f->lru_next;
+	if (f->lru_next)
+		f->lru_next->lru_prev = f->lru_prev;
+	else
+		plan->lru_tail = f->lru_prev;
+	f->lru_prev = f->lru_next = NULL;
+}
+
+static void rdump_lru_append(struct rdump_plan *plan, struct rdump_file *f)
+{
+	f->lru_next = NULL;
+	f->lru_prev = plan->lru_tail;
+	if (plan->lru_tail)
+		plan->lru_tail->lru_next = f;
+	else
+		plan->lru_head = f;
+	plan->lru_tail = f;
+}
+
+static void rdump_close_fd(const char *cmd, struct rdump_plan *plan,
+			   struct rdump_file *f)
+{
+	if (close(f->fd) != 0)
+		com_err(cmd, errno, "while closing %s", f->name);
+	f->fd = -1;
+	rdump_lru_remove(plan, f);
+	plan->num_open--;
+}
+
+/* Close the least recently used file which no writer is using */
+static int rdump_close_idle(const char *cmd, struct rdump_plan *plan)
+{
+	struct rdump_file	*f;
+
+	for (f = plan->lru_head; f; f = f->lru_next) {
+		if (!f->busy) {
+			rdump_close_fd(cmd, plan, f);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Open (or reopen) an output file.  It is only created and sized the
+ * first time round.
+ */
+static int rdump_open_file(const char *cmd, struct rdump_plan *plan,
+			   struct rdump_file *f)
+{
+	int	flags = O_WRONLY | O_LARGEFILE;
+
+	if (!f->opened)
+		flags |= O_CREAT | O_TRUNC;
+	while (plan->num_open >= RDUMP_MAX_OPEN &&
+	       rdump_close_idle(cmd, plan))
+		;
+	while ((f->fd = open(f->name, flags,
+			     f->preserve ? S_IRWXU : 0666)) < 0) {
+		if ((errno != EMFILE && errno != ENFILE) ||
+		    !rdump_close_idle(cmd, plan)) {
+			com_err(cmd, errno, "while opening %s", f->name);
+			return -1;
+		}
+	}
+	if (!f->opened &&
+	    ftruncate(f->fd, EXT2_I_SIZE(&f->inode)) < 0)
+		com_err(cmd, errno, "while setting the size of %s", f->name);
+	f->opened = 1;
+	rdump_lru_append(plan, f);
+	plan->num_open++;
+	return 0;
+}
+
+static void rdump_close_file(const char *cmd, struct rdump_plan *plan,
+			     struct rdump_file *f)
+{
+	if (f->fd < 0)
+		return;
+	if (f->preserve)
+		fix_perms(cmd, &f->inode, f->fd, f->name);
+	rdump_close_fd(cmd, plan, f);
+}
+
+/*
+ * Write one chunk of file data.  Data past i_size is dropped; the file
+ * was already extended to i_size when it was opened.  Called without
+ * the plan lock held, except for opening and closing the file.
+ */
+static void rdump_write_chunk(struct rdump_plan *plan, struct rdump_chunk *c)
+{
+	struct rdump_file	*f = c->file;
+	unsigned int		blocksize = current_fs->blocksize;
+	__u64			offset = c->lblk * blocksize;
+	__u64			size = EXT2_I_SIZE(&f->inode);
+	size_t			count = (size_t) c->len * blocksize;
+	char			*p = c->buf;
+	ssize_t			ret;
+	int			fd;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&plan->lock);
+#endif
+	if (f->fd < 0 && f->chunks_left)
+		rdump_open_file("rdump", plan, f);
+	else if (f->fd >= 0) {
+		/* Most recently used goes to the back of the queue */
+		rdump_lru_remove(plan, f);
+		rdump_lru_append(plan, f);
+	}
+	fd = f->fd;
+	f->busy++;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&plan->lock);
+#endif
+
+	if (offset + count > size)
+		count = offset < size ? size - offset : 0;
+	while (fd >= 0 && count) {
+		ret = pwrite(fd, p, count, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			com_err("rdump", errno, "while writing %s", f->name);
+			break;
+		}
+		p += ret;
+		offset += ret;
+		count -= ret;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&plan->lock);
+#endif
+	f->busy--;
+	if (--f->chunks_left == 0)
+		rdump_close_file("rdump", plan, f);
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&plan->lock);
+#endif
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *rdump_writer(void *arg)
+{
+	struct rdump_plan	*plan = arg;
+	struct rdump_chunk	*c;
+
+	while (1) {
+		pthread_mutex_lock(&plan->lock);
+		while (!plan->head && !plan->done)
+			pthread_cond_wait(&plan->have_work, &plan->lock);
+		c = plan->head;
+		if (!c) {
+			pthread_mutex_unlock(&plan->lock);
+			break;
+		}
+		plan->head = c->next;
+		if (!plan->head)
+			plan->tail = NULL;
+		plan->queued--;
+		pthread_cond_signal(&plan->have_room);
+		pthread_mutex_unlock(&plan->lock);
+
+		rdump_write_chunk(plan, c);
+		free(c->buf);
+		free(c);
+	}
+	return NULL;
+}
+
+static void rdump_queue_chunk(struct rdump_plan *plan, struct rdump_chunk *c)
+{
+	pthread_mutex_lock(&plan->lock);
+	while (plan->queued >= plan->max_queued)
+		pthread_cond_wait(&plan->have_room, &plan->lock);
+	c->next = NULL;
+	if (plan->tail)
+		plan->tail->next = c;
+	else
+		plan->head = c;
+	plan->tail = c;
+	plan->queued++;
+	pthread_cond_signal(&plan->have_work);
+	pthread_mutex_unlock(&plan->lock);
+}
+#endif
+
+/*
+ * Read a chunk's data.  If the read fails, retry it a block at a time
+ * and zero the blocks which still can't be read, so that the rest of
+ * the chunk is kept and nothing uninitialized is written out.
+ */
+static errcode_t rdump_read_chunk(struct rdump_chunk *c, blk64_t pblk)
+{
+	unsigned int	blocksize = current_fs->blocksize;
+	char		*p;
+	__u32		i;
+	errcode_t	retval, err;
+
+	retval = io_channel_read_blk64(current_fs->io, pblk, c->len, c->buf);
+	if (!retval)
+		return 0;
+	retval = 0;
+	for (i = 0, p = c->buf; i < c->len; i++, p += blocksize) {
+		err = io_channel_read_blk64(current_fs->io, pblk + i, 1, p);
+		if (!err)
+			continue;
+		com_err("rdump", err, "while reading block %llu of %s",
+			pblk + i, c->file->name);
+		memset(p, 0, blocksize);
+		retval = err;
+	}
+	return retval;
+}
+
+static int rdump_extent_cmp(const void *a, const void *b)
+{
+	const struct rdump_extent *ea = a, *eb = b;
+
+	if (ea->pblk != eb->pblk)
+		return ea->pblk < eb->pblk ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Read the planned extents in physical block order and hand them to
+ * the writer threads.  Returns the first error met while reading.
+ */
+static errcode_t rdump_copy_data(struct rdump_plan *plan, int nthreads)
+{
+	unsigned int		blocksize = current_fs->blocksize;
+	__u32			chunk_blocks = RDUMP_CHUNK_SIZE / blocksize;
+	struct rdump_extent	*ext;
+	struct rdump_chunk	*c;
+	struct rdump_file	*f;
+	blk64_t			i, done;
+	__u32			len;
+	errcode_t		retval = 0, err;
+#ifdef HAVE_PTHREAD_H
+	pthread_t		threads[RDUMP_MAX_THREADS];
+	int			started = 0;
+#endif
+
+	if (!chunk_blocks)
+		chunk_blocks = 1;
+	for (i = 0; i < plan->num_extents; i++) {
+		ext = &plan->extents[i];
+		plan->files[ext->file].chunks_left +=
+			(ext->len + chunk_blocks - 1) / chunk_blocks;
+	}
+	/* Files without any data blocks can be finished right away */
+	for (i = 0; i < plan->num_files; i++) {
+		f = &plan->files[i];
+		if (!f->chunks_left && rdump_open_file("rdump", plan, f) == 0)
+			rdump_close_file("rdump", plan, f);
+	}
+
+	qsort(plan->extents, plan->num_extents, sizeof(struct rdump_extent),
+	      rdump_extent_cmp);
+
+#ifdef HAVE_PTHREAD_H
+	plan->head = plan->tail = NULL;
+	plan->queued = plan->done = 0;
+	plan->max_queued = nthreads * RDUMP_QUEUE_PER_THREAD;
+	pthread_mutex_init(&plan->lock, NULL);
+	pthread_cond_init(&plan->have_work, NULL);
+	pthread_cond_init(&plan->have_room, NULL);
+	for (started = 0; started < nthreads; started++)
+		if (pthread_create(&threads[started], NULL, rdump_writer,
+				   plan))
+			break;
+#endif
+
+	for (i = 0; i < plan->num_extents; i++) {
+		ext = &plan->extents[i];
+		for (done = 0; done < ext->len; done += len) {
+			len = ext->len - done;
+			if (len > chunk_blocks)
+				len = chunk_blocks;
+			c = malloc(sizeof(struct rdump_chunk));
+			if (c)
+				c->buf = malloc((size_t) len * blocksize);
+			if (!c || !c->buf) {
+				com_err("rdump", ENOMEM,
+					"while allocating memory");
+				free(c);
+				if (!retval)
+					retval = ENOMEM;
+				goto out;
+			}
+			c->file = &plan->files[ext->file];
+			c->lblk = ext->lblk + done;
+			c->len = len;
+			err = rdump_read_chunk(c, ext->pblk + done);
+			if (err && !retval)
+				retval = err;
+#ifdef HAVE_PTHREAD_H
+			if (started) {
+				rdump_queue_chunk(plan, c);
+				continue;
+			}
+#endif
+			rdump_write_chunk(plan, c);
+			free(c->buf);
+			free(c);
+		}
+	}
+out:
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&plan->lock);
+	plan->done = 1;
+	pthread_cond_broadcast(&plan->have_work);
+	pthread_mutex_unlock(&plan->lock);
+	while (started > 0)
+		pthread_join(threads[--started], NULL);
+	pthread_cond_destroy(&plan->have_room);
+	pthread_cond_destroy(&plan->have_work);
+	pthread_mutex_destroy(&plan->lock);
+#endif
+	/* Close anything left open after an error */
+	for (i = 0; i < plan->num_files; i++)
+		rdump_close_file("rdump", plan, &plan->files[i]);
+	return retval;
+}
+
+static errcode_t rdump_finish_plan(struct rdump_plan *plan, int nthreads)
+{
+	unsigned int	i;
+	errcode_t	retval;
+
+	retval = rdump_copy_data(plan, nthreads);
+
+	/* Children were planned before their parents */
+	for (i = 0; i < plan->num_dirs; i++)
+		fix_perms("rdump", &plan->dirs[i].inode, -1,
+			  plan->dirs[i].name);
+
+	for (i = 0; i < plan->num_files; i++)
+		ext2fs_free_mem(&plan->files[i].name);
+	for (i = 0; i < plan->num_dirs; i++)
+		ext2fs_free_mem(&plan->dirs[i].name);
+	ext2fs_free_mem(&plan->files);
+	ext2fs_free_mem(&plan->dirs);
+	ext2fs_free_mem(&plan->extents);
+	return retval;
+}
+
+static int parse_threads(const char *cmd, const char *str)
+{
+	char	*tmp;
+	long	n = strtol(str, &tmp, 0);
+
+	if (*tmp || n < 1 || n > RDUMP_MAX_THREADS) {
+		com_err(cmd, 0, "Bad number of threads - %s", str);
+		return -1;
+	}
+	return n;
+}
+
 void do_dump(int argc, char **argv)
 {
 	ext2_ino_t	inode;
 	int		fd;
 	int		c;
 	int		preserve = 0;
+	int		recover = 0;
+	errcode_t	retval;
 	char		*in_fn, *out_fn;
+	struct ext2_inode inode_buf;
+	struct rdump_plan plan;
 
 	reset_getopt();
-	while ((c = getopt (argc, argv, "p")) != EOF) {
+	while ((c = getopt (argc, argv, "pr")) != EOF) {
 		switch (c) {
 		case 'p':
 			preserve++;
 			break;
+		case 'r':
+			recover++;
+			break;
 		default:
 		print_usage:
-			com_err(argv[0], 0, "Usage: dump_inode [-p] "
+			com_err(argv[0], 0, "Usage: dump_inode [-p] [-r] "
 				"<file> <output_file>");
 			return;
 		}
@@ -178,6 +751,30 @@ void do_dump(int argc, char **argv)
 	if (!inode)
 		return;
 
+	if (recover) {
+		if (debugfs_read_inode(inode, &inode_buf, argv[0]))
+			return;
+		if (LINUX_S_ISREG(inode_buf.i_mode) &&
+		    !(inode_buf.i_flags & EXT4_INLINE_DATA_FL)) {
+			memset(&plan, 0, sizeof(plan));
+			retval = rdump_add_file(&plan.files, &plan.num_files,
+						&plan.size_files, inode,
+						&inode_buf, out_fn, preserve);
+			if (!retval)
+				retval = rdump_plan_extents(&plan);
+			if (retval)
+				com_err(argv[0], retval, "while planning %s",
+					in_fn);
+			else {
+				retval = rdump_finish_plan(&plan, 1);
+				if (retval)
+					com_err(argv[0], retval,
+						"while dumping %s", in_fn);
+			}
+			return;
+		}
+	}
+
 	fd = open(out_fn, O_CREAT | O_WRONLY | O_TRUNC | O_LARGEFILE, 0666);
 	if (fd < 0) {
 		com_err(argv[0], errno, "while opening %s for dump_inode",
@@ -247,10 +844,18 @@ errout:
 
 static int rdump_dirent(struct ext2_dir_entry *, int, int, char *, void *);
 
+struct rdump_dir_struct {
+	const char		*dumproot;
+	struct rdump_plan	*plan;
+};
+
 static void rdump_inode(ext2_ino_t ino, struct ext2_inode *inode,
-			const char *name, const char *dumproot)
+			const char *name, const char *dumproot,
+			struct rdump_plan *plan)
 {
 	char *fullname;
+	struct rdump_dir_struct rd;
+	errcode_t retval;
 
 	/* There are more efficient ways to do this, but this method
 	 * requires only minimal debugging. */
@@ -263,6 +868,17 @@ static void rdump_inode(ext2_ino_t ino, struct ext2_inode *inode,
 
 	if (LINUX_S_ISLNK(inode->i_mode))
 		rdump_symlink(ino, inode, fullname);
+	else if (LINUX_S_ISREG(inode->i_mode) && plan &&
+		 !(inode->i_flags & EXT4_INLINE_DATA_FL)) {
+		retval = rdump_add_file(&plan->files, &plan->num_files,
+					&plan->size_files, ino, inode,
+					fullname, 1);
+		if (!retval)
+			retval = rdump_plan_extents(plan);
+		if (retval)
+			com_err("rdump", retval, "while planning %s",
+				fullname);
+	}
 	else if (LINUX_S_ISREG(inode->i_mode)) {
 		int fd;
 		fd = open(fullname, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, S_IRWXU);
@@ -277,8 +893,6 @@ static void rdump_inode(ext2_ino_t ino, struct ext2_inode *inode,
 		}
 	}
 	else if (LINUX_S_ISDIR(inode->i_mode) && strcmp(name, ".") && strcmp(name, "..")) {
-		errcode_t retval;
-
 		/* Create the directory with 0700 permissions, because we
 		 * expect to have to create entries it.  Then fix its perms
 		 * once we've done the traversal. */
@@ -287,12 +901,24 @@ static void rdump_inode(ext2_ino_t ino, struct ext2_inode *inode,
 			goto errout;
 		}
 
+		rd.dumproot = fullname;
+		rd.plan = plan;
 		retval = ext2fs_dir_iterate(current_fs, ino, 0, 0,
-					    rdump_dirent, (void *) fullname);
+					    rdump_dirent, &rd);
 		if (retval)
 			com_err("rdump", retval, "while dumping %s", fullname);
 
-		fix_perms("rdump", inode, -1, fullname);
+		/* In recovery mode the directory's contents are only
+		 * written later, so defer fixing its permissions. */
+		if (plan) {
+			retval = rdump_add_file(&plan->dirs, &plan->num_dirs,
+						&plan->size_dirs, ino, inode,
+						fullname, 1);
+			if (retval)
+				com_err("rdump", retval, "while planning %s",
+					fullname);
+		} else
+			fix_perms("rdump", inode, -1, fullname);
 	}
 	/* else do nothing (don't dump device files, sockets, fifos, etc.) */
 
@@ -307,7 +933,7 @@ static int rdump_dirent(struct ext2_dir_entry *dirent,
 {
 	char name[EXT2_NAME_LEN + 1];
 	int thislen;
-	const char *dumproot = private;
+	struct rdump_dir_struct *rd = private;
 	struct ext2_inode inode;
 
 	thislen = ext2fs_dirent_name_len(dirent);
@@ -317,7 +943,7 @@ static int rdump_dirent(struct ext2_dir_entry *dirent,
 	if (debugfs_read_inode(dirent->inode, &inode, name))
 		return 0;
 
-	rdump_inode(dirent->inode, &inode, name, dumproot);
+	rdump_inode(dirent->inode, &inode, name, rd->dumproot, rd->plan);
 
 	return 0;
 }
@@ -325,11 +951,33 @@ static int rdump_dirent(struct ext2_dir_entry *dirent,
 void do_rdump(int argc, char **argv)
 {
 	struct stat st;
+	struct rdump_plan plan, *planp = NULL;
 	char *dest_dir;
-	int i;
+	int i, c;
+	int nthreads = 4;
 
-	if (common_args_process(argc, argv, 3, INT_MAX, "rdump",
-				"<directory>... <native directory>", 0))
+	reset_getopt();
+	while ((c = getopt(argc, argv, "rj:")) != EOF) {
+		switch (c) {
+		case 'j':
+			nthreads = parse_threads(argv[0], optarg);
+			if (nthreads < 0)
+				return;
+			/* fall through */
+		case 'r':
+			planp = &plan;
+			break;
+		default:
+			goto print_usage;
+		}
+	}
+	if (argc - optind < 2) {
+	print_usage:
+		com_err(argv[0], 0, "Usage: rdump [-r] [-j threads] "
+			"<directory>... <native directory>");
+		return;
+	}
+	if (check_fs_open(argv[0]))
 		return;
 
 	/* Pull out last argument */
@@ -346,7 +994,8 @@ void do_rdump(int argc, char **argv)
 		return;
 	}
 
-	for (i = 1; i < argc; i++) {
+	memset(&plan, 0, sizeof(plan));
+	for (i = optind; i < argc; i++) {
 		char *arg = argv[i], *basename;
 		struct ext2_inode inode;
 		ext2_ino_t ino = string_to_inode(arg);
@@ -362,7 +1011,13 @@ void do_rdump(int argc, char **argv)
 		else
 			basename = arg;
 
-		rdump_inode(ino, &inode, basename, dest_dir);
+		rdump_inode(ino, &inode, basename, dest_dir, planp);
+	}
+	if (planp) {
+		errcode_t retval = rdump_finish_plan(planp, nthreads);
+
+		if (retval)
+			com_err("rdump", retval, "while copying file data");
 	}
 }
 
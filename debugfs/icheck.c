@@ -16,6 +16,12 @@
 #include <errno.h>
 #endif
 #include <sys/types.h>
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#else
+extern int optind;
+extern char *optarg;
+#endif
 
 #include "debugfs.h"
 
@@ -53,24 +59,467 @@ static int icheck_proc(ext2_filsys fs EXT2FS_ATTR((unused)),
 	return 0;
 }
 
+/*
+ * Reverse (block -> inode) index
+ *
+ * Scanning every inode for each icheck query takes far too long on a
+ * large filesystem.  With "icheck -x index_file" we instead build a
+ * table of (physical extent, inode) intervals once, sorted by physical
+ * block, save it in index_file, and answer queries by binary search.
+ * On a damaged filesystem the intervals of different inodes may
+ * overlap, so each entry also records the furthest end of any interval
+ * up to it, which tells the search how far back it has to look.
+ * A saved index is only reused if the filesystem's UUID, mount count,
+ * last write time, lifetime writes and free counts still match, and if
+ * nothing has been changed in this debugfs session; otherwise it is
+ * rebuilt.
+ */
+
+#define ICHECK_INDEX_MAGIC	"E2ICHKX1"
+
+struct icheck_extent {
+	blk64_t		pblk;
+	__u32		len;
+	ext2_ino_t	ino;
+	blk64_t		max_end;	/* not saved; see index_max_ends() */
+};
+
+struct icheck_index {
+	struct icheck_extent	*ext;
+	__u64			count;
+	__u64			size;
+};
+
+/* On-disk header, all fields little-endian; followed by the extents */
+struct icheck_index_header {
+	char			magic[8];
+	struct fs_state_key	key;
+	__u64			count;
+};
+
+/* On-disk extent record, all fields little-endian */
+struct icheck_index_rec {
+	__u64	pblk;
+	__u32	len;
+	__u32	ino;
+};
+
+struct index_walk_struct {
+	struct icheck_index	*idx;
+	ext2_ino_t		ino;
+	errcode_t		retval;
+};
+
+static errcode_t index_add(struct icheck_index *idx, blk64_t pblk,
+			   __u32 len, ext2_ino_t ino)
+{
+	struct icheck_extent *last;
+	errcode_t	retval;
+
+	if (idx->count) {
+		last = &idx->ext[idx->count - 1];
+		if (last->ino == ino && last->pblk + last->len == pblk &&
+		    last->len + len > last->len) {
+			last->len += len;
+			return 0;
+		}
+	}
+	if (idx->count >= idx->size) {
+		__u64 new_size = idx->size ? idx->size * 2 : 1024;
+
+		retval = ext2fs_resize_mem(idx->size *
+					   sizeof(struct icheck_extent),
+					   new_size *
+					   sizeof(struct icheck_extent),
+					   &idx->ext);
+		if (retval)
+			return retval;
+		idx->size = new_size;
+	}
+	last = &idx->ext[idx->count++];
+	last->pblk = pblk;
+	last->len = len;
+	last->ino = ino;
+	return 0;
+}
+
+static int index_block_proc(ext2_filsys fs EXT2FS_ATTR((unused)),
+			    blk64_t *block_nr,
+			    e2_blkcnt_t blockcnt EXT2FS_ATTR((unused)),
+			    blk64_t ref_block EXT2FS_ATTR((unused)),
+			    int ref_offset EXT2FS_ATTR((unused)),
+			    void *private)
+{
+	struct index_walk_struct *iw = (struct index_walk_struct *) private;
+
+	iw->retval = index_add(iw->idx, *block_nr, 1, iw->ino);
+	return iw->retval ? BLOCK_ABORT : 0;
+}
+
+/*
+ * Add the blocks of an extent-mapped inode, one interval per extent
+ * plus one for each block of the extent tree itself.
+ */
+static errcode_t index_extents(ext2_filsys fs, ext2_ino_t ino,
+			       struct ext2_inode *inode,
+			       struct icheck_index *idx)
+{
+	ext2_extent_handle_t	handle;
+	struct ext2fs_extent	extent;
+	errcode_t		retval;
+	int			op = EXT2_EXTENT_ROOT;
+
+	retval = ext2fs_extent_open2(fs, ino, inode, &handle);
+	if (retval)
+		return retval;
+	while (1) {
+		retval = ext2fs_extent_get(handle, op, &extent);
+		if (retval) {
+			if (retval == EXT2_ET_EXTENT_NO_NEXT)
+				retval = 0;
+			break;
+		}
+		op = EXT2_EXTENT_NEXT;
+		if (!(extent.e_flags & EXT2_EXTENT_FLAGS_LEAF)) {
+			if (extent.e_flags & EXT2_EXTENT_FLAGS_SECOND_VISIT)
+				continue;
+			retval = index_add(idx, extent.e_pblk, 1, ino);
+		} else if (extent.e_len)
+			retval = index_add(idx, extent.e_pblk, extent.e_len,
+					   ino);
+		if (retval)
+			break;
+	}
+	ext2fs_extent_free(handle);
+	return retval;
+}
+
+/* Record the furthest end of the intervals up to each one */
+static void index_max_ends(struct icheck_index *idx)
+{
+	blk64_t	end, max_end = 0;
+	__u64	i;
+
+	for (i = 0; i < idx->count; i++) {
+		end = idx->ext[i].pblk + idx->ext[i].len;
+		if (end > max_end)
+			max_end = end;
+		idx->ext[i].max_end = max_end;
+	}
+}
+
+static int icheck_extent_cmp(const void *a, const void *b)
+{
+	const struct icheck_extent *ea = a, *eb = b;
+
+	if (ea->pblk != eb->pblk)
+		return ea->pblk < eb->pblk ? -1 : 1;
+	if (ea->ino != eb->ino)
+		return ea->ino < eb->ino ? -1 : 1;
+	return 0;
+}
+
+static errcode_t build_icheck_index(ext2_filsys fs, struct icheck_index *idx)
+{
+	struct index_walk_struct iw;
+	ext2_inode_scan		scan = 0;
+	ext2_ino_t		ino;
+	struct ext2_inode	inode;
+	struct icheck_extent	*ext, *out;
+	char			*block_buf = 0;
+	blk64_t			blk;
+	__u64			i;
+	errcode_t		retval;
+
+	retval = ext2fs_get_array(3, fs->blocksize, &block_buf);
+	if (retval)
+		return retval;
+	retval = ext2fs_open_inode_scan(fs, 0, &scan);
+	if (retval)
+		goto errout;
+
+	iw.idx = idx;
+	while (1) {
+		do {
+			retval = ext2fs_get_next_inode(scan, &ino, &inode);
+		} while (retval == EXT2_ET_BAD_BLOCK_IN_INODE_TABLE);
+		if (retval)
+			goto errout;
+		if (!ino)
+			break;
+		if (!inode.i_links_count)
+			continue;
+
+		blk = ext2fs_file_acl_block(fs, &inode);
+		if (blk) {
+			retval = index_add(idx, blk, 1, ino);
+			if (retval)
+				goto errout;
+		}
+		if (!ext2fs_inode_has_valid_blocks2(fs, &inode) ||
+		    inode.i_dtime)
+			continue;
+
+		if (inode.i_flags & EXT4_EXTENTS_FL) {
+			retval = index_extents(fs, ino, &inode, idx);
+		} else {
+			iw.ino = ino;
+			iw.retval = 0;
+			retval = ext2fs_block_iterate3(fs, ino,
+						BLOCK_FLAG_READ_ONLY, block_buf,
+						index_block_proc, &iw);
+			if (!retval)
+				retval = iw.retval;
+		}
+		if (retval == EXT2_ET_NO_MEMORY)
+			goto errout;
+		if (retval)
+			com_err("icheck", retval,
+				"while indexing blocks of inode %u", ino);
+	}
+
+	/* Sort by block, and merge intervals split across the walk */
+	qsort(idx->ext, idx->count, sizeof(struct icheck_extent),
+	      icheck_extent_cmp);
+	for (i = 0, ext = out = idx->ext; i < idx->count; i++, ext++) {
+		if (out != idx->ext && out[-1].ino == ext->ino &&
+		    out[-1].pblk + out[-1].len == ext->pblk &&
+		    out[-1].len + ext->len > out[-1].len) {
+			out[-1].len += ext->len;
+			continue;
+		}
+		*out++ = *ext;
+	}
+	idx->count = out - idx->ext;
+	index_max_ends(idx);
+	retval = 0;
+
+errout:
+	if (scan)
+		ext2fs_close_inode_scan(scan);
+	ext2fs_free_mem(&block_buf);
+	return retval;
+}
+
+static void icheck_index_key(ext2_filsys fs, struct icheck_index_header *hdr)
+{
+	memset(hdr, 0, sizeof(struct icheck_index_header));
+	memcpy(hdr->magic, ICHECK_INDEX_MAGIC, sizeof(hdr->magic));
+	get_fs_state_key(fs, &hdr->key);
+}
+
+/*
+ * Load a saved index, returning EXT2_ET_INVALID_ARGUMENT if it doesn't
+ * belong to the current state of the filesystem.
+ */
+static errcode_t load_icheck_index(ext2_filsys fs, const char *fn,
+				   struct icheck_index *idx)
+{
+	struct icheck_index_header hdr, key;
+	struct icheck_index_rec	rec;
+	FILE			*f;
+	__u64			i;
+	errcode_t		retval = EXT2_ET_INVALID_ARGUMENT;
+
+	f = fopen(fn, "r");
+	if (!f)
+		return errno;
+	icheck_index_key(fs, &key);
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1)
+		goto errout;
+	hdr.count = ext2fs_le64_to_cpu(hdr.count);
+	key.count = hdr.count;
+	if (memcmp(&hdr, &key, sizeof(hdr)))
+		goto errout;
+
+	retval = ext2fs_get_array(hdr.count ? hdr.count : 1,
+				  sizeof(struct icheck_extent), &idx->ext);
+	if (retval)
+		goto errout;
+	idx->size = hdr.count;
+	for (i = 0; i < hdr.count; i++) {
+		if (fread(&rec, sizeof(rec), 1, f) != 1) {
+			retval = EXT2_ET_SHORT_READ;
+			goto errout;
+		}
+		idx->ext[i].pblk = ext2fs_le64_to_cpu(rec.pblk);
+		idx->ext[i].len = ext2fs_le32_to_cpu(rec.len);
+		idx->ext[i].ino = ext2fs_le32_to_cpu(rec.ino);
+	}
+	idx->count = hdr.count;
+	index_max_ends(idx);
+	retval = 0;
+errout:
+	fclose(f);
+	return retval;
+}
+
+static errcode_t save_icheck_index(ext2_filsys fs, const char *fn,
+				   struct icheck_index *idx)
+{
+	struct icheck_index_header hdr;
+	struct icheck_index_rec	rec;
+	char			*tmp_fn;
+	FILE			*f;
+	__u64			i;
+	errcode_t		retval;
+
+	/* Write a temporary file and rename it, so readers never see
+	 * a partially written index. */
+	retval = ext2fs_get_mem(strlen(fn) + 5, &tmp_fn);
+	if (retval)
+		return retval;
+	sprintf(tmp_fn, "%s.tmp", fn);
+	f = fopen(tmp_fn, "w");
+	if (!f) {
+		retval = errno;
+		goto out;
+	}
+	icheck_index_key(fs, &hdr);
+	hdr.count = ext2fs_cpu_to_le64(idx->count);
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+		goto write_err;
+	for (i = 0; i < idx->count; i++) {
+		rec.pblk = ext2fs_cpu_to_le64(idx->ext[i].pblk);
+		rec.len = ext2fs_cpu_to_le32(idx->ext[i].len);
+		rec.ino = ext2fs_cpu_to_le32(idx->ext[i].ino);
+		if (fwrite(&rec, sizeof(rec), 1, f) != 1)
+			goto write_err;
+	}
+	if (fclose(f)) {
+		f = NULL;
+		goto write_err;
+	}
+	if (rename(tmp_fn, fn) < 0) {
+		retval = errno;
+		unlink(tmp_fn);
+	}
+	goto out;
+
+write_err:
+	retval = errno ? errno : EXT2_ET_SHORT_WRITE;
+	if (f)
+		fclose(f);
+	unlink(tmp_fn);
+out:
+	ext2fs_free_mem(&tmp_fn);
+	return retval;
+}
+
+/*
+ * Like the inode scan, report the lowest numbered inode which uses the
+ * block.
+ */
+static ext2_ino_t lookup_icheck_index(struct icheck_index *idx, blk64_t blk)
+{
+	__u64		low = 0, high = idx->count, mid;
+	ext2_ino_t	ino = 0;
+
+	/* Find the last interval starting at or before blk */
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (idx->ext[mid].pblk <= blk)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	/* Earlier intervals can only cover blk while max_end is past it */
+	for (; low > 0 && idx->ext[low - 1].max_end > blk; low--) {
+		if (blk - idx->ext[low - 1].pblk < idx->ext[low - 1].len &&
+		    (!ino || idx->ext[low - 1].ino < ino))
+			ino = idx->ext[low - 1].ino;
+	}
+	return ino;
+}
+
+static void do_icheck_index(const char *cmd, const char *fn,
+			    int argc, char **argv)
+{
+	struct icheck_index	idx;
+	blk64_t			*blocks;
+	ext2_ino_t		ino;
+	errcode_t		retval = EXT2_ET_INVALID_ARGUMENT;
+	int			i;
+
+	memset(&idx, 0, sizeof(idx));
+	blocks = malloc(sizeof(blk64_t) * argc);
+	if (!blocks) {
+		com_err(cmd, ENOMEM, "while allocating block array");
+		return;
+	}
+	for (i = 0; i < argc; i++) {
+		if (strtoblk(cmd, argv[i], NULL, &blocks[i]))
+			goto out;
+	}
+
+	if (!fs_changed_in_session(current_fs))
+		retval = load_icheck_index(current_fs, fn, &idx);
+	if (retval) {
+		ext2fs_free_mem(&idx.ext);
+		memset(&idx, 0, sizeof(idx));
+		retval = build_icheck_index(current_fs, &idx);
+		if (retval) {
+			com_err(cmd, retval, "while building block index");
+			goto out;
+		}
+		retval = save_icheck_index(current_fs, fn, &idx);
+		if (retval)
+			com_err(cmd, retval, "while saving block index to %s",
+				fn);
+	}
+
+	printf("Block\tInode number\n");
+	for (i = 0; i < argc; i++) {
+		ino = lookup_icheck_index(&idx, blocks[i]);
+		if (ino == 0) {
+			printf("%llu\t<block not found>\n", blocks[i]);
+			continue;
+		}
+		printf("%llu\t%u\n", blocks[i], ino);
+	}
+out:
+	ext2fs_free_mem(&idx.ext);
+	free(blocks);
+}
+
 void do_icheck(int argc, char **argv)
 {
 	struct block_walk_struct bw;
 	struct block_info	*binfo;
-	int			i;
+	int			c, i;
 	ext2_inode_scan		scan = 0;
 	ext2_ino_t		ino;
 	struct ext2_inode	inode;
 	errcode_t		retval;
 	char			*block_buf;
+	char			*index_fn = NULL;
+
+	reset_getopt();
+	while ((c = getopt (argc, argv, "x:")) != EOF) {
+		switch (c) {
+		case 'x':
+			index_fn = optarg;
+			break;
+		default:
+			goto print_usage;
+		}
+	}
 
-	if (argc < 2) {
-		com_err(argv[0], 0, "Usage: icheck <block number> ...");
+	if (optind >= argc) {
+	print_usage:
+		com_err(argv[0], 0,
+			"Usage: icheck [-x index_file] <block number> ...");
 		return;
 	}
 	if (check_fs_open(argv[0]))
 		return;
 
+	if (index_fn) {
+		do_icheck_index(argv[0], index_fn, argc - optind,
+				argv + optind);
+		return;
+	}
+
 	bw.barray = malloc(sizeof(struct block_info) * argc);
 	if (!bw.barray) {
 		com_err("icheck", ENOMEM,
@@ -85,12 +534,13 @@ void do_icheck(int argc, char **argv)
 		goto error_out;
 	}
 
-	for (i=1; i < argc; i++) {
-		if (strtoblk(argv[0], argv[i], NULL, &bw.barray[i-1].blk))
+	for (i = optind; i < argc; i++) {
+		if (strtoblk(argv[0], argv[i], NULL,
+			     &bw.barray[i - optind].blk))
 			goto error_out;
 	}
 
-	bw.num_blocks = bw.blocks_left = argc-1;
+	bw.num_blocks = bw.blocks_left = argc - optind;
 
 	retval = ext2fs_open_inode_scan(current_fs, 0, &scan);
 	if (retval) {
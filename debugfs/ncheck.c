@@ -90,6 +90,409 @@ static int ncheck_proc(struct ext2_dir_entry *dirent,
 	return 0;
 }
 
+/*
+ * Parent table
+ *
+ * Scanning every directory for each batch of inodes is slow on large
+ * filesystems, and resolving each parent with ext2fs_get_pathname()
+ * rescans directories again.  With "ncheck -p" we instead read all of
+ * the directory blocks once, in physical block order, and build a
+ * table of every (inode, parent directory, name) link.  Paths for any
+ * number of inodes are then resolved from the table alone.  With
+ * "ncheck -x table_file" the table is also saved, and reused for as
+ * long as the filesystem has not changed (as for icheck -x).
+ */
+
+#define NCHECK_TABLE_MAGIC	"E2NCHKX1"
+#define NCHECK_MAX_DEPTH	4096
+
+struct ncheck_link {
+	ext2_ino_t	ino;
+	ext2_ino_t	dir;
+	__u32		name_off;
+	__u16		name_len;
+	__u8		filetype;
+	__u8		reserved;
+};
+
+struct ncheck_table {
+	struct ncheck_link	*links;
+	__u64			count, size;
+	char			*names;
+	__u64			names_len, names_size;
+	errcode_t		retval;
+};
+
+/* On-disk header; followed by the links and then the names */
+struct ncheck_table_header {
+	char			magic[8];
+	struct fs_state_key	key;
+	__u64			count;
+	__u64			names_len;
+};
+
+static int table_dirent_proc(ext2_ino_t dir, int entry,
+			     struct ext2_dir_entry *dirent,
+			     int offset EXT2FS_ATTR((unused)),
+			     int blocksize EXT2FS_ATTR((unused)),
+			     char *buf EXT2FS_ATTR((unused)),
+			     void *private)
+{
+	struct ncheck_table	*tbl = (struct ncheck_table *) private;
+	struct ncheck_link	*link;
+	int			name_len = ext2fs_dirent_name_len(dirent);
+	errcode_t		retval;
+
+	if (entry != DIRENT_OTHER_FILE || !dirent->inode)
+		return 0;
+	/* Inline data directories don't flag their . and .. entries */
+	if (dirent->name[0] == '.' &&
+	    (name_len == 1 || (name_len == 2 && dirent->name[1] == '.')))
+		return 0;
+
+	if (tbl->count >= tbl->size) {
+		__u64 new_size = tbl->size ? tbl->size * 2 : 1024;
+
+		retval = ext2fs_resize_mem(tbl->size *
+					   sizeof(struct ncheck_link),
+					   new_size *
+					   sizeof(struct ncheck_link),
+					   &tbl->links);
+		if (retval)
+			goto errout;
+		tbl->size = new_size;
+	}
+	if (tbl->names_len + name_len > tbl->names_size) {
+		__u64 new_size = tbl->names_size ? tbl->names_size * 2 : 65536;
+
+		retval = ext2fs_resize_mem(tbl->names_size, new_size,
+					   &tbl->names);
+		if (retval)
+			goto errout;
+		tbl->names_size = new_size;
+	}
+
+	link = &tbl->links[tbl->count++];
+	link->ino = dirent->inode;
+	link->dir = dir;
+	link->name_off = tbl->names_len;
+	link->name_len = name_len;
+	link->filetype = ext2fs_dirent_file_type(dirent);
+	link->reserved = 0;
+	memcpy(tbl->names + tbl->names_len, dirent->name, name_len);
+	tbl->names_len += name_len;
+	return 0;
+
+errout:
+	tbl->retval = retval;
+	return DIRENT_ABORT;
+}
+
+static int table_block_proc(ext2_filsys fs EXT2FS_ATTR((unused)),
+			    blk64_t *block_nr, e2_blkcnt_t blockcnt,
+			    blk64_t ref_block EXT2FS_ATTR((unused)),
+			    int ref_offset EXT2FS_ATTR((unused)),
+			    void *private)
+{
+	struct inode_walk_struct *iw = (struct inode_walk_struct *) private;
+	errcode_t	retval;
+
+	retval = ext2fs_add_dir_block2(current_fs->dblist, iw->dir,
+				       *block_nr, blockcnt);
+	return retval ? BLOCK_ABORT : 0;
+}
+
+static int ncheck_link_cmp(const void *a, const void *b)
+{
+	const struct ncheck_link *la = a, *lb = b;
+
+	if (la->ino != lb->ino)
+		return la->ino < lb->ino ? -1 : 1;
+	if (la->dir != lb->dir)
+		return la->dir < lb->dir ? -1 : 1;
+	return la->name_off < lb->name_off ? -1 : 1;
+}
+
+static errcode_t build_ncheck_table(ext2_filsys fs, struct ncheck_table *tbl)
+{
+	struct inode_walk_struct iw;
+	ext2_dblist		save_dblist = fs->dblist;
+	ext2_inode_scan		scan = 0;
+	ext2_ino_t		ino;
+	struct ext2_inode	inode;
+	errcode_t		retval;
+
+	/* Collect every directory block, then read them in disk order */
+	fs->dblist = 0;
+	retval = ext2fs_init_dblist(fs, 0);
+	if (retval)
+		goto errout;
+	retval = ext2fs_open_inode_scan(fs, 0, &scan);
+	if (retval)
+		goto errout;
+	while (1) {
+		do {
+			retval = ext2fs_get_next_inode(scan, &ino, &inode);
+		} while (retval == EXT2_ET_BAD_BLOCK_IN_INODE_TABLE);
+		if (retval)
+			goto errout;
+		if (!ino)
+			break;
+		if (!inode.i_links_count || inode.i_dtime ||
+		    !LINUX_S_ISDIR(inode.i_mode))
+			continue;
+		if (inode.i_flags & EXT4_INLINE_DATA_FL) {
+			retval = ext2fs_add_dir_block2(fs->dblist, ino, 0, 0);
+			if (retval)
+				goto errout;
+			continue;
+		}
+		iw.dir = ino;
+		retval = ext2fs_block_iterate3(fs, ino,
+				BLOCK_FLAG_READ_ONLY | BLOCK_FLAG_DATA_ONLY,
+				0, table_block_proc, &iw);
+		if (retval)
+			com_err("ncheck", retval,
+				"while iterating over directory %u", ino);
+	}
+	ext2fs_dblist_sort2(fs->dblist, 0);
+
+	retval = ext2fs_dblist_dir_iterate(fs->dblist, 0, 0,
+					   table_dirent_proc, tbl);
+	if (!retval)
+		retval = tbl->retval;
+	if (retval)
+		goto errout;
+
+	qsort(tbl->links, tbl->count, sizeof(struct ncheck_link),
+	      ncheck_link_cmp);
+
+errout:
+	if (scan)
+		ext2fs_close_inode_scan(scan);
+	if (fs->dblist)
+		ext2fs_free_dblist(fs->dblist);
+	fs->dblist = save_dblist;
+	return retval;
+}
+
+static void ncheck_table_key(ext2_filsys fs, struct ncheck_table_header *hdr)
+{
+	memset(hdr, 0, sizeof(struct ncheck_table_header));
+	memcpy(hdr->magic, NCHECK_TABLE_MAGIC, sizeof(hdr->magic));
+	get_fs_state_key(fs, &hdr->key);
+}
+
+/*
+ * Load a saved table, returning EXT2_ET_INVALID_ARGUMENT if it doesn't
+ * belong to the current state of the filesystem.
+ */
+static errcode_t load_ncheck_table(ext2_filsys fs, const char *fn,
+				   struct ncheck_table *tbl)
+{
+	struct ncheck_table_header hdr, key;
+	struct ncheck_link	*link;
+	FILE			*f;
+	__u64			i;
+	errcode_t		retval = EXT2_ET_INVALID_ARGUMENT;
+
+	f = fopen(fn, "r");
+	if (!f)
+		return errno;
+	ncheck_table_key(fs, &key);
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1)
+		goto errout;
+	key.count = hdr.count;
+	key.names_len = hdr.names_len;
+	if (memcmp(&hdr, &key, sizeof(hdr)))
+		goto errout;
+	tbl->count = ext2fs_le64_to_cpu(hdr.count);
+	tbl->names_len = ext2fs_le64_to_cpu(hdr.names_len);
+
+	retval = ext2fs_get_array(tbl->count ? tbl->count : 1,
+				  sizeof(struct ncheck_link), &tbl->links);
+	if (retval)
+		goto errout;
+	tbl->size = tbl->count;
+	retval = ext2fs_get_mem(tbl->names_len ? tbl->names_len : 1,
+				&tbl->names);
+	if (retval)
+		goto errout;
+	tbl->names_size = tbl->names_len;
+
+	retval = EXT2_ET_SHORT_READ;
+	if ((tbl->count &&
+	     fread(tbl->links, sizeof(struct ncheck_link), tbl->count,
+		   f) != tbl->count) ||
+	    (tbl->names_len &&
+	     fread(tbl->names, tbl->names_len, 1, f) != 1))
+		goto errout;
+	for (i = 0, link = tbl->links; i < tbl->count; i++, link++) {
+		link->ino = ext2fs_le32_to_cpu(link->ino);
+		link->dir = ext2fs_le32_to_cpu(link->dir);
+		link->name_off = ext2fs_le32_to_cpu(link->name_off);
+		link->name_len = ext2fs_le16_to_cpu(link->name_len);
+		if ((__u64) link->name_off + link->name_len > tbl->names_len) {
+			retval = EXT2_ET_INVALID_ARGUMENT;
+			goto errout;
+		}
+	}
+	retval = 0;
+errout:
+	fclose(f);
+	return retval;
+}
+
+static errcode_t save_ncheck_table(ext2_filsys fs, const char *fn,
+				   struct ncheck_table *tbl)
+{
+	struct ncheck_table_header hdr;
+	struct ncheck_link	link;
+	char			*tmp_fn;
+	FILE			*f;
+	__u64			i;
+	errcode_t		retval;
+
+	/* Write a temporary file and rename it, so readers never see
+	 * a partially written table. */
+	retval = ext2fs_get_mem(strlen(fn) + 5, &tmp_fn);
+	if (retval)
+		return retval;
+	sprintf(tmp_fn, "%s.tmp", fn);
+	f = fopen(tmp_fn, "w");
+	if (!f) {
+		retval = errno;
+		goto out;
+	}
+	ncheck_table_key(fs, &hdr);
+	hdr.count = ext2fs_cpu_to_le64(tbl->count);
+	hdr.names_len = ext2fs_cpu_to_le64(tbl->names_len);
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+		goto write_err;
+	for (i = 0; i < tbl->count; i++) {
+		link = tbl->links[i];
+		link.ino = ext2fs_cpu_to_le32(link.ino);
+		link.dir = ext2fs_cpu_to_le32(link.dir);
+		link.name_off = ext2fs_cpu_to_le32(link.name_off);
+		link.name_len = ext2fs_cpu_to_le16(link.name_len);
+		if (fwrite(&link, sizeof(link), 1, f) != 1)
+			goto write_err;
+	}
+	if (tbl->names_len &&
+	    fwrite(tbl->names, tbl->names_len, 1, f) != 1)
+		goto write_err;
+	if (fclose(f)) {
+		f = NULL;
+		goto write_err;
+	}
+	if (rename(tmp_fn, fn) < 0) {
+		retval = errno;
+		unlink(tmp_fn);
+	}
+	goto out;
+
+write_err:
+	retval = errno ? errno : EXT2_ET_SHORT_WRITE;
+	if (f)
+		fclose(f);
+	unlink(tmp_fn);
+out:
+	ext2fs_free_mem(&tmp_fn);
+	return retval;
+}
+
+/* Return the first link to ino in the table, or NULL */
+static struct ncheck_link *find_ncheck_link(struct ncheck_table *tbl,
+					    ext2_ino_t ino)
+{
+	__u64	low = 0, high = tbl->count, mid;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (tbl->links[mid].ino < ino)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	if (low < tbl->count && tbl->links[low].ino == ino)
+		return &tbl->links[low];
+	return NULL;
+}
+
+/*
+ * Print the pathname of directory dir, the way ext2fs_get_pathname()
+ * would.
+ */
+static void print_dir_path(struct ncheck_table *tbl, ext2_ino_t dir,
+			   int depth)
+{
+	struct ncheck_link *link;
+
+	if (dir == EXT2_ROOT_INO) {
+		if (!depth)
+			putc('/', stdout);
+		return;
+	}
+	link = find_ncheck_link(tbl, dir);
+	if (!link || depth > NCHECK_MAX_DEPTH) {
+		printf("/<%u>", dir);
+		return;
+	}
+	print_dir_path(tbl, link->dir, depth + 1);
+	printf("/%.*s", link->name_len, tbl->names + link->name_off);
+}
+
+static void ncheck_from_table(struct inode_walk_struct *iw, const char *fn)
+{
+	struct ncheck_table	tbl;
+	struct ncheck_link	*link, *end;
+	struct ext2_inode	inode;
+	errcode_t		retval = EXT2_ET_INVALID_ARGUMENT;
+	int			i;
+
+	memset(&tbl, 0, sizeof(tbl));
+	if (fn && !fs_changed_in_session(current_fs))
+		retval = load_ncheck_table(current_fs, fn, &tbl);
+	if (retval) {
+		ext2fs_free_mem(&tbl.links);
+		ext2fs_free_mem(&tbl.names);
+		memset(&tbl, 0, sizeof(tbl));
+		retval = build_ncheck_table(current_fs, &tbl);
+		if (retval) {
+			com_err("ncheck", retval,
+				"while building parent table");
+			goto out;
+		}
+		if (fn) {
+			retval = save_ncheck_table(current_fs, fn, &tbl);
+			if (retval)
+				com_err("ncheck", retval,
+					"while saving parent table to %s", fn);
+		}
+	}
+
+	printf("Inode\tPathname\n");
+	end = tbl.links + tbl.count;
+	for (i = 0; i < iw->num_inodes; i++) {
+		link = find_ncheck_link(&tbl, iw->iarray[i]);
+		for (; link && link < end && link->ino == iw->iarray[i];
+		     link++) {
+			printf("%u\t", link->ino);
+			print_dir_path(&tbl, link->dir, 0);
+			printf("/%.*s", link->name_len,
+			       tbl.names + link->name_off);
+			if (iw->check_dirent && link->filetype &&
+			    !debugfs_read_inode(link->ino, &inode, "ncheck") &&
+			    link->filetype != ext2_file_type(inode.i_mode))
+				printf("  <--- BAD FILETYPE");
+			putc('\n', stdout);
+		}
+	}
+out:
+	ext2fs_free_mem(&tbl.links);
+	ext2fs_free_mem(&tbl.names);
+}
+
 void do_ncheck(int argc, char **argv)
 {
 	struct inode_walk_struct iw;
@@ -99,23 +502,33 @@ void do_ncheck(int argc, char **argv)
 	struct ext2_inode	inode;
 	errcode_t		retval;
 	char			*tmp;
+	char			*table_fn = NULL;
+	int			use_table = 0;
 
 	iw.check_dirent = 0;
 
 	reset_getopt();
-	while ((c = getopt (argc, argv, "c")) != EOF) {
+	while ((c = getopt (argc, argv, "cpx:")) != EOF) {
 		switch (c) {
 		case 'c':
 			iw.check_dirent = 1;
 			break;
+		case 'p':
+			use_table = 1;
+			break;
+		case 'x':
+			table_fn = optarg;
+			use_table = 1;
+			break;
 		default:
 			goto print_usage;
 		}
 	}
 
-	if (argc <= 1) {
+	if (optind >= argc) {
 	print_usage:
-		com_err(argv[0], 0, "Usage: ncheck [-c] <inode number> ...");
+		com_err(argv[0], 0, "Usage: ncheck [-c] [-p] [-x table_file] "
+			"<inode number> ...");
 		return;
 	}
 	if (check_fs_open(argv[0]))
@@ -141,6 +554,11 @@ void do_ncheck(int argc, char **argv)
 
 	iw.num_inodes = iw.inodes_left = argc;
 
+	if (use_table) {
+		ncheck_from_table(&iw, table_fn);
+		goto error_out;
+	}
+
 	retval = ext2fs_open_inode_scan(current_fs, 0, &scan);
 	if (retval) {
 		com_err("ncheck", retval, "while opening inode scan");
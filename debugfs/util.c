@@ -563,3 +563,26 @@ err:
 	free(lst);
 	return retval;
 }
+
+void get_fs_state_key(ext2_filsys fs, struct fs_state_key *key)
+{
+	memset(key, 0, sizeof(struct fs_state_key));
+	memcpy(key->uuid, fs->super->s_uuid, sizeof(key->uuid));
+	key->mnt_count = ext2fs_cpu_to_le32(fs->super->s_mnt_count);
+	key->wtime = ext2fs_cpu_to_le32(fs->super->s_wtime);
+	key->kbytes_written = ext2fs_cpu_to_le64(fs->super->s_kbytes_written);
+	key->free_blocks =
+		ext2fs_cpu_to_le64(ext2fs_free_blocks_count(fs->super));
+	key->free_inodes = ext2fs_cpu_to_le32(fs->super->s_free_inodes_count);
+}
+
+/*
+ * Changes made in this session aren't reflected in the superblock
+ * until the filesystem is closed, so a saved index can't be trusted
+ * once anything has been modified.
+ */
+int fs_changed_in_session(ext2_filsys fs)
+{
+	return (fs->flags & (EXT2_FLAG_DIRTY | EXT2_FLAG_BB_DIRTY |
+			     EXT2_FLAG_IB_DIRTY)) != 0;
+}
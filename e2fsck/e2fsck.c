@@ -215,6 +215,16 @@ void e2fsck_free_context(e2fsck_t ctx)
 	if (ctx->logf)
 		fclose(ctx->logf);
 
+	e2fsck_problem_log_close(ctx, -1);
+	if (ctx->problem_log_fn)
+		free(ctx->problem_log_fn);
+
+	e2fsck_stats_free(ctx);
+	if (ctx->stats_fn)
+		free(ctx->stats_fn);
+	if (ctx->snapshot_fn)
+		free(ctx->snapshot_fn);
+
 	ext2fs_free_mem(&ctx);
 }
 
@@ -148,6 +148,11 @@ struct resource_track {
 	void	*brk_start;
 	unsigned long long bytes_read;
 	unsigned long long bytes_written;
+	unsigned long long read_ops;
+	unsigned long long write_ops;
+	unsigned long long cache_hits;
+	unsigned long long cache_misses;
+	unsigned long long readahead_bytes;
 };
 #endif
 
@@ -172,6 +177,7 @@ struct resource_track {
 #define E2F_OPT_FIXES_ONLY	0x8000 /* skip all optimizations */
 #define E2F_OPT_NOOPT_EXTENTS	0x10000 /* don't optimize extents */
 #define E2F_OPT_ICOUNT_FULLMAP	0x20000 /* use an array for inode counts */
+#define E2F_OPT_VERIFY_ONLY	0x40000 /* checksum sweep, full check if needed */
 
 /*
  * E2fsck flags
@@ -196,6 +202,7 @@ struct resource_track {
 #define E2F_FLAG_TIME_INSANE	0x2000 /* Time is insane */
 #define E2F_FLAG_PROBLEMS_FIXED	0x4000 /* At least one problem was fixed */
 #define E2F_FLAG_ALLOC_OK	0x8000 /* Can we allocate blocks? */
+#define E2F_FLAG_ICOUNT_TDB	0x10000 /* An icount lives in a tdb file */
 
 #define E2F_RESET_FLAGS (E2F_FLAG_TIME_INSANE | E2F_FLAG_PROBLEMS_FIXED)
 
@@ -407,6 +414,29 @@ struct e2fsck_struct {
 
 	/* Undo file */
 	char *undo_file;
+
+	/*
+	 * Filesystem block writes deferred during journal replay, so
+	 * they can be issued once per block in block number order.
+	 */
+	int			replay_defer;
+	int			replay_count;
+	int			replay_size;
+	unsigned long long	replay_bytes;
+	struct replay_write	*replay_writes;
+	errcode_t		replay_err;	/* first failed write */
+
+	/* Resource usage statistics (-E stats=<file>) */
+	char *stats_fn;
+	struct e2fsck_stats *stats;
+
+	/* Per-group digests kept between -E verify_only runs */
+	char *snapshot_fn;
+	struct verify_snapshot *verify_snap;
+
+	/* Machine-readable log of the problems found */
+	char *problem_log_fn;
+	struct problem_log *problem_log;
 };
 
 /* Data structures to evaluate whether an extent tree needs rebuilding. */
@@ -521,6 +551,10 @@ extern int e2fsck_fix_ext3_journal_hint(e2fsck_t ctx);
 /* logfile.c */
 extern void set_up_logging(e2fsck_t ctx);
 
+/* problem_log.c */
+extern void e2fsck_problem_log_open(e2fsck_t ctx, FILE *f);
+extern void e2fsck_problem_log_close(e2fsck_t ctx, int exit_value);
+
 /* quota.c */
 extern void e2fsck_hide_quota(e2fsck_t ctx);
 extern void e2fsck_validate_quota_inodes(e2fsck_t ctx);
@@ -584,11 +618,27 @@ void e2fsck_rehash_directories(e2fsck_t ctx);
 /* sigcatcher.c */
 void sigcatcher_setup(void);
 
+/* stats.c */
+#ifdef RESOURCE_TRACK
+extern void e2fsck_stats_record(e2fsck_t ctx, const char *desc,
+				struct resource_track *track,
+				io_channel channel);
+extern void e2fsck_stats_write(e2fsck_t ctx);
+extern void e2fsck_stats_free(e2fsck_t ctx);
+#else
+#define e2fsck_stats_write(ctx) do { } while (0)
+#define e2fsck_stats_free(ctx) do { } while (0)
+#endif
+
 /* super.c */
 void check_super_block(e2fsck_t ctx);
 int check_backup_super_block(e2fsck_t ctx);
 void check_resize_inode(e2fsck_t ctx);
 
+/* verify.c */
+extern int e2fsck_verify_metadata(e2fsck_t ctx);
+extern dgrp_t e2fsck_verify_snapshot_done(e2fsck_t ctx, int clean);
+
 /* util.c */
 extern void *e2fsck_allocate_memory(e2fsck_t ctx, unsigned int size,
 				    const char *description);
@@ -657,6 +707,9 @@ extern errcode_t e2fsck_allocate_subcluster_bitmap(ext2_filsys fs,
 						   const char *profile_name,
 						   ext2fs_block_bitmap *ret);
 unsigned long long get_memory_size(void);
+extern int e2fsck_worker_threads(e2fsck_t ctx, const char *relation, int max);
+extern errcode_t e2fsck_open_worker_fs(e2fsck_t ctx, ext2_filsys *ret_fs);
+extern void e2fsck_close_worker_fs(e2fsck_t ctx, ext2_filsys wfs);
 
 /* unix.c */
 extern void e2fsck_clear_progbar(e2fsck_t ctx);
@@ -13,6 +13,9 @@
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 #include "e2fsck.h"
 #include "problem.h"
 
@@ -66,16 +69,41 @@ struct extent_list {
 	unsigned int ext_read;
 	errcode_t retval;
 	ext2_ino_t ino;
+	blk64_t *nodes;		/* old tree blocks, released by the writer */
+	unsigned int nodes_size;
 };
 
-static errcode_t load_extents(e2fsck_t ctx, struct extent_list *list)
+/*
+ * Remember a block of the old tree.  It is only released when the new
+ * tree is written, since the gathering may run outside the main thread.
+ */
+static errcode_t add_node(struct extent_list *list, blk64_t blk)
+{
+	errcode_t retval;
+
+#if defined(DEBUG) || defined(DEBUG_FREE)
+	printf("ino=%d free=%llu bf=%llu\n", list->ino, blk,
+			list->blocks_freed + 1);
+#endif
+	if (list->blocks_freed == list->nodes_size) {
+		retval = ext2fs_resize_mem(0, (list->nodes_size + 16) *
+					   sizeof(blk64_t), &list->nodes);
+		if (retval)
+			return retval;
+		list->nodes_size += 16;
+	}
+	list->nodes[list->blocks_freed++] = blk;
+	return 0;
+}
+
+static errcode_t load_extents(ext2_filsys fs, struct extent_list *list,
+			      struct ext2_inode *inode)
 {
-	ext2_filsys		fs = ctx->fs;
 	ext2_extent_handle_t	handle;
 	struct ext2fs_extent	extent;
 	errcode_t		retval;
 
-	retval = ext2fs_extent_open(fs, list->ino, &handle);
+	retval = ext2fs_extent_open2(fs, list->ino, inode, &handle);
 	if (retval)
 		return retval;
 
@@ -89,12 +117,9 @@ static errcode_t load_extents(e2fsck_t ctx, struct extent_list *list)
 
 		/* Internal node; free it and we'll re-allocate it later */
 		if (!(extent.e_flags & EXT2_EXTENT_FLAGS_LEAF)) {
-#if defined(DEBUG) || defined(DEBUG_FREE)
-			printf("ino=%d free=%llu bf=%llu\n", list->ino,
-					extent.e_pblk, list->blocks_freed + 1);
-#endif
-			list->blocks_freed++;
-			ext2fs_block_alloc_stats2(fs, extent.e_pblk, -1);
+			retval = add_node(list, extent.e_pblk);
+			if (retval)
+				goto out;
 			goto next;
 		}
 
@@ -148,7 +173,8 @@ out:
 	return retval;
 }
 
-static int find_blocks(ext2_filsys fs, blk64_t *blocknr, e2_blkcnt_t blockcnt,
+static int find_blocks(ext2_filsys fs EXT2FS_ATTR((unused)),
+		       blk64_t *blocknr, e2_blkcnt_t blockcnt,
 		       blk64_t ref_blk EXT2FS_ATTR((unused)),
 		       int ref_offset EXT2FS_ATTR((unused)), void *priv_data)
 {
@@ -156,12 +182,9 @@ static int find_blocks(ext2_filsys fs, blk64_t *blocknr, e2_blkcnt_t blockcnt,
 
 	/* Internal node? */
 	if (blockcnt < 0) {
-#if defined(DEBUG) || defined(DEBUG_FREE)
-		printf("ino=%d free=%llu bf=%llu\n", list->ino, *blocknr,
-				list->blocks_freed + 1);
-#endif
-		list->blocks_freed++;
-		ext2fs_block_alloc_stats2(fs, *blocknr, -1);
+		list->retval = add_node(list, *blocknr);
+		if (list->retval)
+			return BLOCK_ABORT;
 		return 0;
 	}
 
@@ -206,124 +229,186 @@ static int find_blocks(ext2_filsys fs, blk64_t *blocknr, e2_blkcnt_t blockcnt,
 	return 0;
 }
 
-static errcode_t rebuild_extent_tree(e2fsck_t ctx, struct extent_list *list,
-				     ext2_ino_t ino)
+/*
+ * Cut the collected extents down to the longest ones an extent tree
+ * entry can describe, so that the writer only has to insert them.
+ */
+static errcode_t split_extents(struct extent_list *list)
+{
+	struct ext2fs_extent	*ex, orig;
+	unsigned int		i, j, k, n, pieces, max;
+	errcode_t		retval;
+
+	n = 0;
+	for (i = 0, ex = list->extents; i < list->count; i++, ex++) {
+		ex->e_flags &= EXT2_EXTENT_FLAGS_UNINIT;
+		max = (ex->e_flags & EXT2_EXTENT_FLAGS_UNINIT) ?
+			EXT_UNINIT_MAX_LEN : EXT_INIT_MAX_LEN;
+		n += ex->e_len > max ? (ex->e_len + max - 1) / max : 1;
+	}
+	if (n == list->count)
+		return 0;
+
+	if (n > list->size) {
+		retval = ext2fs_resize_mem(0, n * sizeof(struct ext2fs_extent),
+					   &list->extents);
+		if (retval)
+			return retval;
+		list->size = n;
+	}
+
+	/* Spread the extents out from the end of the array */
+	j = n;
+	for (i = list->count; i-- > 0; ) {
+		orig = list->extents[i];
+		max = (orig.e_flags & EXT2_EXTENT_FLAGS_UNINIT) ?
+			EXT_UNINIT_MAX_LEN : EXT_INIT_MAX_LEN;
+		pieces = orig.e_len > max ? (orig.e_len + max - 1) / max : 1;
+		for (k = pieces; k-- > 0; ) {
+			ex = list->extents + --j;
+			*ex = orig;
+			ex->e_lblk += (blk64_t) k * max;
+			ex->e_pblk += (blk64_t) k * max;
+			if (k < pieces - 1)
+				ex->e_len = max;
+			else
+				ex->e_len = orig.e_len - k * max;
+		}
+	}
+	list->count = n;
+	return 0;
+}
+
+/*
+ * Collect the lblk->pblk mappings of an inode.  This only reads from
+ * fs, so it can run on a private copy of the file system handle.
+ */
+static errcode_t gather_extents(ext2_filsys fs, struct extent_list *list,
+				ext2_ino_t ino, struct ext2_inode *inode)
 {
-	struct ext2_inode_large	inode;
 	errcode_t		retval;
-	ext2_extent_handle_t	handle;
-	unsigned int		i, ext_written;
-	struct ext2fs_extent	*ex, extent;
-	blk64_t			start_val, delta;
 
 	list->count = 0;
 	list->blocks_freed = 0;
 	list->ino = ino;
 	list->ext_read = 0;
-	e2fsck_read_inode_full(ctx, ino, EXT2_INODE(&inode), sizeof(inode),
-			       "rebuild_extents");
-
-	/* Skip deleted inodes and inline data files */
-	if (inode.i_links_count == 0 ||
-	    inode.i_flags & EXT4_INLINE_DATA_FL)
-		return 0;
+	list->retval = 0;
 
-	/* Collect lblk->pblk mappings */
-	if (inode.i_flags & EXT4_EXTENTS_FL) {
-		retval = load_extents(ctx, list);
+	if (inode->i_flags & EXT4_EXTENTS_FL) {
+		retval = load_extents(fs, list, inode);
 		if (retval)
-			goto err;
-		goto extents_loaded;
+			return retval;
+	} else {
+		retval = ext2fs_block_iterate3(fs, ino, BLOCK_FLAG_READ_ONLY,
+					       0, find_blocks, list);
+		if (retval)
+			return retval;
+		if (list->retval)
+			return list->retval;
 	}
+	return split_extents(list);
+}
 
-	retval = ext2fs_block_iterate3(ctx->fs, ino, BLOCK_FLAG_READ_ONLY, 0,
-				       find_blocks, list);
-	if (retval)
-		goto err;
-	if (list->retval) {
-		retval = list->retval;
-		goto err;
-	}
+/* Release the old tree and write the gathered extents out as a new one */
+static errcode_t write_extent_tree(e2fsck_t ctx, struct extent_list *list,
+				   struct ext2_inode_large *inode)
+{
+	ext2_ino_t		ino = list->ino;
+	errcode_t		retval;
+	ext2_extent_handle_t	handle;
+	unsigned int		i, ext_written;
+	blk64_t			start_val, delta;
+
+	for (i = 0; i < list->blocks_freed; i++)
+		ext2fs_block_alloc_stats2(ctx->fs, list->nodes[i], -1);
 
-extents_loaded:
 	/* Reset extent tree */
-	inode.i_flags &= ~EXT4_EXTENTS_FL;
-	memset(inode.i_block, 0, sizeof(inode.i_block));
+	inode->i_flags &= ~EXT4_EXTENTS_FL;
+	memset(inode->i_block, 0, sizeof(inode->i_block));
 
 	/* Make a note of freed blocks */
-	quota_data_sub(ctx->qctx, &inode, ino,
+	quota_data_sub(ctx->qctx, inode, ino,
 		       list->blocks_freed * ctx->fs->blocksize);
-	retval = ext2fs_iblk_sub_blocks(ctx->fs, EXT2_INODE(&inode),
+	retval = ext2fs_iblk_sub_blocks(ctx->fs, EXT2_INODE(inode),
 					list->blocks_freed);
 	if (retval)
-		goto err;
+		return retval;
 
 	/* Now stuff extents into the file */
-	retval = ext2fs_extent_open2(ctx->fs, ino, EXT2_INODE(&inode), &handle);
+	retval = ext2fs_extent_open2(ctx->fs, ino, EXT2_INODE(inode), &handle);
 	if (retval)
-		goto err;
+		return retval;
 
 	ext_written = 0;
-	start_val = ext2fs_inode_i_blocks(ctx->fs, EXT2_INODE(&inode));
-	for (i = 0, ex = list->extents; i < list->count; i++, ex++) {
-		memcpy(&extent, ex, sizeof(struct ext2fs_extent));
-		extent.e_flags &= EXT2_EXTENT_FLAGS_UNINIT;
-		if (extent.e_flags & EXT2_EXTENT_FLAGS_UNINIT) {
-			if (extent.e_len > EXT_UNINIT_MAX_LEN) {
-				extent.e_len = EXT_UNINIT_MAX_LEN;
-				ex->e_pblk += EXT_UNINIT_MAX_LEN;
-				ex->e_lblk += EXT_UNINIT_MAX_LEN;
-				ex->e_len -= EXT_UNINIT_MAX_LEN;
-				ex--;
-				i--;
-			}
-		} else {
-			if (extent.e_len > EXT_INIT_MAX_LEN) {
-				extent.e_len = EXT_INIT_MAX_LEN;
-				ex->e_pblk += EXT_INIT_MAX_LEN;
-				ex->e_lblk += EXT_INIT_MAX_LEN;
-				ex->e_len -= EXT_INIT_MAX_LEN;
-				ex--;
-				i--;
-			}
-		}
-
+	start_val = ext2fs_inode_i_blocks(ctx->fs, EXT2_INODE(inode));
+	for (i = 0; i < list->count; i++) {
 #ifdef DEBUG
 		printf("W: ino=%d pblk=%llu lblk=%llu len=%u\n", ino,
-				extent.e_pblk, extent.e_lblk, extent.e_len);
+				list->extents[i].e_pblk,
+				list->extents[i].e_lblk,
+				list->extents[i].e_len);
 #endif
 		retval = ext2fs_extent_insert(handle, EXT2_EXTENT_INSERT_AFTER,
-					      &extent);
+					      list->extents + i);
 		if (retval)
-			goto err2;
+			goto err;
 		retval = ext2fs_extent_fix_parents(handle);
 		if (retval)
-			goto err2;
+			goto err;
 		ext_written++;
 	}
 
-	delta = ext2fs_inode_i_blocks(ctx->fs, EXT2_INODE(&inode)) - start_val;
+	delta = ext2fs_inode_i_blocks(ctx->fs, EXT2_INODE(inode)) - start_val;
 	if (delta) {
 		if (!ext2fs_has_feature_huge_file(ctx->fs->super) ||
-		    !(inode.i_flags & EXT4_HUGE_FILE_FL))
+		    !(inode->i_flags & EXT4_HUGE_FILE_FL))
 			delta <<= 9;
 		else
 			delta *= ctx->fs->blocksize;
-		quota_data_add(ctx->qctx, &inode, ino, delta);
+		quota_data_add(ctx->qctx, inode, ino, delta);
 	}
 
 #if defined(DEBUG) || defined(DEBUG_SUMMARY)
 	printf("rebuild: ino=%d extents=%d->%d\n", ino, list->ext_read,
 	       ext_written);
 #endif
-	e2fsck_write_inode(ctx, ino, EXT2_INODE(&inode), "rebuild_extents");
+	e2fsck_write_inode(ctx, ino, EXT2_INODE(inode), "rebuild_extents");
 
-err2:
-	ext2fs_extent_free(handle);
 err:
+	ext2fs_extent_free(handle);
 	return retval;
 }
 
+/* Skip deleted inodes and inline data files */
+static int skip_rebuild(struct ext2_inode_large *inode)
+{
+	return (inode->i_links_count == 0 ||
+		inode->i_flags & EXT4_INLINE_DATA_FL);
+}
+
+static errcode_t rebuild_extent_tree(e2fsck_t ctx, struct extent_list *list,
+				     ext2_ino_t ino)
+{
+	struct ext2_inode_large	inode;
+	errcode_t		retval;
+
+	e2fsck_read_inode_full(ctx, ino, EXT2_INODE(&inode), sizeof(inode),
+			       "rebuild_extents");
+	if (skip_rebuild(&inode))
+		return 0;
+
+	retval = gather_extents(ctx->fs, list, ino, EXT2_INODE(&inode));
+	if (retval)
+		return retval;
+	return write_extent_tree(ctx, list, &inode);
+}
+
+static void free_extent_list(struct extent_list *list)
+{
+	ext2fs_free_mem(&list->extents);
+	ext2fs_free_mem(&list->nodes);
+}
+
 /* Rebuild the extents immediately */
 static errcode_t e2fsck_rebuild_extents(e2fsck_t ctx, ext2_ino_t ino)
 {
@@ -343,20 +428,131 @@ static errcode_t e2fsck_rebuild_extents(e2fsck_t ctx, ext2_ino_t ino)
 		return err;
 	list.size = NUM_EXTENTS;
 	err = rebuild_extent_tree(ctx, &list, ino);
-	ext2fs_free_mem(&list.extents);
+	free_extent_list(&list);
 
 	return err;
 }
 
+/*
+ * Pass 1E works through the inodes in batches.  The main thread reads
+ * the inodes of a batch, the extent mappings of all of them are then
+ * gathered (by a pool of threads, if we have them), and finally the
+ * main thread releases the old trees and writes the new ones in inode
+ * order, so the result is the same as rebuilding one inode at a time.
+ */
+#define REBUILD_BATCH		256
+#define REBUILD_MAX_THREADS	16
+
+struct rebuild_item {
+	ext2_ino_t		ino;
+	errcode_t		retval;
+	struct ext2_inode_large	inode;
+	struct extent_list	list;
+};
+
+struct rebuild_batch {
+	struct rebuild_item	*items;
+	int			count;
+	int			next;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		lock;
+#endif
+};
+
+static void gather_batch(ext2_filsys fs, struct rebuild_batch *batch)
+{
+	struct rebuild_item	*item;
+	int			i;
+
+	while (1) {
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_lock(&batch->lock);
+#endif
+		i = batch->next++;
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_unlock(&batch->lock);
+#endif
+		if (i >= batch->count)
+			break;
+		item = batch->items + i;
+		item->retval = gather_extents(fs, &item->list, item->ino,
+					      EXT2_INODE(&item->inode));
+	}
+}
+
+#ifdef HAVE_PTHREAD_H
+struct rebuild_worker {
+	struct rebuild_batch	*batch;
+	ext2_filsys		fs;
+	pthread_t		thread;
+};
+
+static void *rebuild_worker(void *arg)
+{
+	struct rebuild_worker *w = arg;
+
+	gather_batch(w->fs, w->batch);
+	return NULL;
+}
+
+/*
+ * Gather the batch with a pool of workers.  Returns nonzero if the
+ * pool could not be set up; the caller then does the work itself.
+ */
+static int gather_batch_threaded(e2fsck_t ctx, struct rebuild_batch *batch,
+				 int threads)
+{
+	struct rebuild_worker	w[REBUILD_MAX_THREADS];
+	int			i, n;
+
+	if (threads > batch->count)
+		threads = batch->count;
+	if (threads < 2)
+		return 1;
+
+	/* The workers read the device directly; push our writes out first */
+	if (io_channel_flush(ctx->fs->io))
+		return 1;
+
+	for (n = 0; n < threads; n++) {
+		w[n].batch = batch;
+		if (e2fsck_open_worker_fs(ctx, &w[n].fs))
+			break;
+	}
+	if (n < 2) {
+		for (i = 0; i < n; i++)
+			e2fsck_close_worker_fs(ctx, w[i].fs);
+		return 1;
+	}
+
+	for (i = 1; i < n; i++)
+		if (pthread_create(&w[i].thread, NULL, rebuild_worker, &w[i]))
+			break;
+	gather_batch(w[0].fs, batch);
+	while (--i > 0)
+		pthread_join(w[i].thread, NULL);
+
+	for (i = 0; i < n; i++)
+		e2fsck_close_worker_fs(ctx, w[i].fs);
+	return 0;
+}
+#endif /* HAVE_PTHREAD_H */
+
 static void rebuild_extents(e2fsck_t ctx, const char *pass_name, int pr_header)
 {
 	struct problem_context	pctx;
 #ifdef RESOURCE_TRACK
 	struct resource_track	rtrack;
 #endif
-	struct extent_list	list;
+	struct rebuild_batch	batch;
+	struct rebuild_item	*item;
 	int			first = 1;
+	int			i;
+#ifdef HAVE_PTHREAD_H
+	int			threads;
+#endif
 	ext2_ino_t		ino = 0;
+	unsigned long long	total = 0, done = 0;
 	errcode_t		retval;
 
 	if (!ext2fs_has_feature_extents(ctx->fs->super) ||
@@ -374,37 +570,96 @@ static void rebuild_extents(e2fsck_t ctx, const char *pass_name, int pr_header)
 	clear_problem_context(&pctx);
 	e2fsck_read_bitmaps(ctx);
 
-	memset(&list, 0, sizeof(list));
-	retval = ext2fs_get_mem(sizeof(struct ext2fs_extent) * NUM_EXTENTS,
-				&list.extents);
-	list.size = NUM_EXTENTS;
+	/* Count the inodes so that progress can be reported per inode */
+	while (ext2fs_find_first_set_inode_bitmap2(ctx->inodes_to_rebuild,
+				ino + 1, ctx->fs->super->s_inodes_count,
+				&ino) == 0)
+		total++;
+	ino = 0;
+
+	memset(&batch, 0, sizeof(batch));
+	retval = ext2fs_get_arrayzero(REBUILD_BATCH,
+				      sizeof(struct rebuild_item),
+				      &batch.items);
+	if (retval) {
+		pctx.errcode = retval;
+		fix_problem(ctx, PR_1E_OPTIMIZE_EXT_ERR, &pctx);
+		goto out;
+	}
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&batch.lock, NULL);
+	threads = e2fsck_worker_threads(ctx, "extent_rebuild_threads",
+				       REBUILD_MAX_THREADS);
+#endif
+
 	while (1) {
-		retval = ext2fs_find_first_set_inode_bitmap2(
-				ctx->inodes_to_rebuild, ino + 1,
-				ctx->fs->super->s_inodes_count, &ino);
-		if (retval)
-			break;
-		pctx.ino = ino;
-		if (first) {
-			fix_problem(ctx, pr_header, &pctx);
-			first = 0;
+		/* Read the inodes of the next batch */
+		batch.count = 0;
+		batch.next = 0;
+		while (batch.count < REBUILD_BATCH) {
+			retval = ext2fs_find_first_set_inode_bitmap2(
+					ctx->inodes_to_rebuild, ino + 1,
+					ctx->fs->super->s_inodes_count, &ino);
+			if (retval)
+				break;
+			pctx.ino = ino;
+			if (first) {
+				fix_problem(ctx, pr_header, &pctx);
+				first = 0;
+			}
+			item = batch.items + batch.count++;
+			item->ino = ino;
+			e2fsck_read_inode_full(ctx, ino,
+					       EXT2_INODE(&item->inode),
+					       sizeof(item->inode),
+					       "rebuild_extents");
+			if (skip_rebuild(&item->inode)) {
+				batch.count--;
+				done++;
+			}
 		}
-		pctx.errcode = rebuild_extent_tree(ctx, &list, ino);
-		if (pctx.errcode) {
-			end_problem_latch(ctx, PR_LATCH_OPTIMIZE_EXT);
-			fix_problem(ctx, PR_1E_OPTIMIZE_EXT_ERR, &pctx);
+		if (batch.count == 0 && retval)
+			break;
+
+		/* Gather their mappings */
+#ifdef HAVE_PTHREAD_H
+		if (threads < 2 ||
+		    gather_batch_threaded(ctx, &batch, threads))
+#endif
+			gather_batch(ctx->fs, &batch);
+
+		/* ...and write the new trees out in inode order */
+		for (i = 0, item = batch.items; i < batch.count; i++, item++) {
+			pctx.ino = item->ino;
+			pctx.errcode = item->retval;
+			if (!pctx.errcode)
+				pctx.errcode = write_extent_tree(ctx,
+						&item->list, &item->inode);
+			if (pctx.errcode) {
+				end_problem_latch(ctx, PR_LATCH_OPTIMIZE_EXT);
+				fix_problem(ctx, PR_1E_OPTIMIZE_EXT_ERR, &pctx);
+			}
+			done++;
+			if (ctx->progress && !ctx->progress_fd)
+				e2fsck_simple_progress(ctx,
+					"Rebuilding extents",
+					100.0 * (float) done / (float) total,
+					item->ino);
 		}
-		if (ctx->progress && !ctx->progress_fd)
-			e2fsck_simple_progress(ctx, "Rebuilding extents",
-					100.0 * (float) ino /
-					(float) ctx->fs->super->s_inodes_count,
-					ino);
+		if (retval)
+			break;
 	}
 	end_problem_latch(ctx, PR_LATCH_OPTIMIZE_EXT);
 
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&batch.lock);
+#endif
+	for (i = 0; i < REBUILD_BATCH; i++)
+		free_extent_list(&batch.items[i].list);
+	ext2fs_free_mem(&batch.items);
+out:
 	ext2fs_free_inode_bitmap(ctx->inodes_to_rebuild);
 	ctx->inodes_to_rebuild = NULL;
-	ext2fs_free_mem(&list.extents);
 
 	print_resource_track(ctx, pass_name, &rtrack, ctx->fs->io);
 }
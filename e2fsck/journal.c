@@ -144,16 +144,151 @@ struct buffer_head *getblk(kdev_t kdev, blk64_t blocknr, int blocksize)
 	return bh;
 }
 
+/*
+ * During journal replay, the recovery code writes each journalled
+ * block to its home location as soon as it is found in the log, so a
+ * block that is modified by many transactions is written many times,
+ * in log order rather than disk order.  Instead, we hold on to the
+ * dirty buffers released during replay, and write them out in block
+ * number order, once per block (the last version found in the log
+ * wins), merging adjacent blocks into large writes.  The buffers are
+ * written out when the journal code syncs the filesystem device, or
+ * whenever more than REPLAY_MAX_BYTES are pending.
+ */
+#define REPLAY_MAX_BYTES	(64 * 1024 * 1024)
+#define REPLAY_MAX_RUN		256
+
+struct replay_write {
+	struct buffer_head	*bh;
+	unsigned int		seq;
+};
+
+static EXT2_QSORT_TYPE replay_write_cmp(const void *a, const void *b)
+{
+	const struct replay_write *wa = (const struct replay_write *) a;
+	const struct replay_write *wb = (const struct replay_write *) b;
+
+	if (wa->bh->b_blocknr != wb->bh->b_blocknr)
+		return wa->bh->b_blocknr < wb->bh->b_blocknr ? -1 : 1;
+	return wa->seq < wb->seq ? -1 : (wa->seq > wb->seq);
+}
+
+static errcode_t flush_replay_writes(e2fsck_t ctx)
+{
+	struct replay_write	*w = ctx->replay_writes;
+	struct buffer_head	*bh;
+	char			*buf = NULL;
+	errcode_t		retval, ret_err = 0;
+	int			i, j, n, run;
+
+	if (!ctx->replay_count)
+		return 0;
+
+	qsort(w, ctx->replay_count, sizeof(struct replay_write),
+	      replay_write_cmp);
+
+	/* Keep only the last version of each block */
+	for (i = 0, n = 0; i < ctx->replay_count; i++) {
+		if (i + 1 < ctx->replay_count &&
+		    w[i].bh->b_blocknr == w[i + 1].bh->b_blocknr) {
+			jfs_debug(3, "dropping block %llu/%p (total %d)\n",
+				  w[i].bh->b_blocknr, (void *) w[i].bh,
+				  --bh_count);
+			ext2fs_free_mem(&w[i].bh);
+			continue;
+		}
+		w[n++] = w[i];
+	}
+
+	retval = ext2fs_get_mem(REPLAY_MAX_RUN * ctx->fs->blocksize, &buf);
+	for (i = 0; i < n; i += run) {
+		bh = w[i].bh;
+		for (run = 1; buf && i + run < n && run < REPLAY_MAX_RUN; run++)
+			if (w[i + run].bh->b_blocknr != bh->b_blocknr + run ||
+			    w[i + run].bh->b_io != bh->b_io ||
+			    w[i + run].bh->b_size != ctx->fs->blocksize)
+				break;
+		if (run == 1) {
+			retval = io_channel_write_blk64(bh->b_io,
+							bh->b_blocknr, 1,
+							bh->b_data);
+		} else {
+			for (j = 0; j < run; j++)
+				memcpy(buf + j * ctx->fs->blocksize,
+				       w[i + j].bh->b_data,
+				       ctx->fs->blocksize);
+			retval = io_channel_write_blk64(bh->b_io,
+							bh->b_blocknr, run,
+							buf);
+		}
+		if (retval) {
+			com_err(ctx->device_name, retval,
+				"while writing blocks %llu-%llu\n",
+				bh->b_blocknr, bh->b_blocknr + run - 1);
+			ret_err = retval;
+		}
+		for (j = 0; j < run; j++) {
+			jfs_debug(3, "freeing block %llu/%p (total %d)\n",
+				  w[i + j].bh->b_blocknr,
+				  (void *) w[i + j].bh, --bh_count);
+			ext2fs_free_mem(&w[i + j].bh);
+		}
+	}
+	if (buf)
+		ext2fs_free_mem(&buf);
+	ctx->replay_count = 0;
+	ctx->replay_bytes = 0;
+	if (!ctx->replay_err)
+		ctx->replay_err = ret_err;
+	return ret_err;
+}
+
+/*
+ * Take ownership of a dirty buffer released during journal replay.
+ * Returns 0 if the write has been deferred.  Otherwise the pending
+ * writes have been flushed, so that an older copy of the block can't
+ * be written over it later.  Errors from flushing are kept in
+ * ctx->replay_err, and returned by sync_blockdev().
+ */
+static int defer_replay_write(struct buffer_head *bh)
+{
+	e2fsck_t	ctx = bh->b_ctx;
+	errcode_t	retval;
+
+	if (ctx->replay_count >= ctx->replay_size) {
+		retval = ext2fs_resize_mem(ctx->replay_size *
+					   sizeof(struct replay_write),
+					   (ctx->replay_size + 1024) *
+					   sizeof(struct replay_write),
+					   &ctx->replay_writes);
+		if (retval) {
+			flush_replay_writes(ctx);
+			return retval;
+		}
+		ctx->replay_size += 1024;
+	}
+	ctx->replay_writes[ctx->replay_count].bh = bh;
+	ctx->replay_writes[ctx->replay_count].seq = ctx->replay_count;
+	ctx->replay_count++;
+	ctx->replay_bytes += bh->b_size;
+	if (ctx->replay_bytes > REPLAY_MAX_BYTES)
+		flush_replay_writes(ctx);
+	return 0;
+}
+
 int sync_blockdev(kdev_t kdev)
 {
 	io_channel	io;
+	errcode_t	retval = 0;
 
-	if (kdev->k_dev == K_DEV_FS)
+	if (kdev->k_dev == K_DEV_FS) {
 		io = kdev->k_ctx->fs->io;
-	else
+		flush_replay_writes(kdev->k_ctx);
+		retval = kdev->k_ctx->replay_err;
+	} else
 		io = kdev->k_ctx->journal_io;
 
-	return io_channel_flush(io) ? EIO : 0;
+	return (io_channel_flush(io) || retval) ? EIO : 0;
 }
 
 void ll_rw_block(int rw, int nr, struct buffer_head *bhp[])
@@ -213,6 +348,9 @@ static void mark_buffer_clean(struct buffer_head * bh)
 
 void brelse(struct buffer_head *bh)
 {
+	if (bh->b_dirty && bh->b_ctx->replay_defer &&
+	    defer_replay_write(bh) == 0)
+		return;
 	if (bh->b_dirty)
 		ll_rw_block(WRITE, 1, &bh);
 	jfs_debug(3, "freeing block %llu/%p (total %d)\n",
@@ -938,7 +1076,10 @@ static errcode_t recover_ext3_journal(e2fsck_t ctx)
 	if (retval)
 		goto errout;
 
+	ctx->replay_defer = 1;
+	ctx->replay_err = 0;
 	retval = -journal_recover(journal);
+	ctx->replay_defer = 0;
 	if (retval)
 		goto errout;
 
@@ -952,6 +1093,12 @@ static errcode_t recover_ext3_journal(e2fsck_t ctx)
 	journal->j_tail_sequence = journal->j_transaction_sequence;
 
 errout:
+	flush_replay_writes(ctx);
+	if (!retval)
+		retval = ctx->replay_err;
+	if (ctx->replay_writes)
+		ext2fs_free_mem(&ctx->replay_writes);
+	ctx->replay_size = 0;
 	journal_destroy_revoke(journal);
 	journal_destroy_revoke_caches();
 	e2fsck_journal_release(ctx, journal, 1, 0);
@@ -965,6 +1112,9 @@ errcode_t e2fsck_run_ext3_journal(e2fsck_t ctx)
 	errcode_t	retval, recover_retval;
 	io_stats	stats = 0;
 	unsigned long long kbytes_written = 0;
+#ifdef RESOURCE_TRACK
+	struct resource_track	rtrack;
+#endif
 
 	printf(_("%s: recovering journal\n"), ctx->device_name);
 	if (ctx->options & E2F_OPT_READONLY) {
@@ -976,7 +1126,10 @@ errcode_t e2fsck_run_ext3_journal(e2fsck_t ctx)
 	if (ctx->fs->flags & EXT2_FLAG_DIRTY)
 		ext2fs_flush(ctx->fs);	/* Force out any modifications */
 
+	init_resource_track(&rtrack, ctx->fs->io);
 	recover_retval = recover_ext3_journal(ctx);
+	print_resource_track(ctx, N_("Journal recovery"), &rtrack,
+			     ctx->fs->io);
 
 	/*
 	 * Reload the filesystem context to get up-to-date data from disk
@@ -285,22 +285,32 @@ static FILE *save_output(const char *s0, const char *s1, const char *s2)
 }
 
 #ifndef TEST_PROGRAM
-void set_up_logging(e2fsck_t ctx)
+/*
+ * Open the log file named by fn, or else by the <key>_filename relation,
+ * placing it in the <key>_dir or <key>_dir_fallback directories.
+ */
+static FILE *set_up_log_file(e2fsck_t ctx, const char *key, const char *fn)
 {
+	FILE *f = NULL;
 	struct string s, s1, s2;
 	char *s0 = 0, *log_dir = 0, *log_fn = 0;
 	int log_dir_wait = 0;
+	char relation[64];
 
 	s.s = s1.s = s2.s = 0;
 
-	profile_get_boolean(ctx->profile, "options", "log_dir_wait", 0, 0,
+	snprintf(relation, sizeof(relation), "%s_dir_wait", key);
+	profile_get_boolean(ctx->profile, "options", relation, 0, 0,
 			    &log_dir_wait);
-	if (ctx->log_fn)
-		log_fn = string_copy(ctx, ctx->log_fn, 0);
-	else
-		profile_get_string(ctx->profile, "options", "log_filename",
+	if (fn)
+		log_fn = string_copy(ctx, fn, 0);
+	else {
+		snprintf(relation, sizeof(relation), "%s_filename", key);
+		profile_get_string(ctx->profile, "options", relation,
 				   0, 0, &log_fn);
-	profile_get_string(ctx->profile, "options", "log_dir", 0, 0, &log_dir);
+	}
+	snprintf(relation, sizeof(relation), "%s_dir", key);
+	profile_get_string(ctx->profile, "options", relation, 0, 0, &log_dir);
 
 	if (!log_fn || !log_fn[0])
 		goto out;
@@ -317,7 +327,8 @@ void set_up_logging(e2fsck_t ctx)
 	}
 
 	free(log_dir);
-	profile_get_string(ctx->profile, "options", "log_dir_fallback", 0, 0,
+	snprintf(relation, sizeof(relation), "%s_dir_fallback", key);
+	profile_get_string(ctx->profile, "options", relation, 0, 0,
 			   &log_dir);
 	if (log_dir && log_dir[0]) {
 		alloc_string(&s2, strlen(log_dir) + strlen(s.s) + 2);
@@ -328,13 +339,13 @@ void set_up_logging(e2fsck_t ctx)
 	}
 
 	if (s0)
-		ctx->logf = fopen(s0, "w");
-	if (!ctx->logf && s1.s)
-		ctx->logf = fopen(s1.s, "w");
-	if (!ctx->logf && s2.s)
-		ctx->logf = fopen(s2.s, "w");
-	if (!ctx->logf && log_dir_wait)
-		ctx->logf = save_output(s0, s1.s, s2.s);
+		f = fopen(s0, "w");
+	if (!f && s1.s)
+		f = fopen(s1.s, "w");
+	if (!f && s2.s)
+		f = fopen(s2.s, "w");
+	if (!f && log_dir_wait)
+		f = save_output(s0, s1.s, s2.s);
 
 out:
 	free(s.s);
@@ -342,7 +353,17 @@ out:
 	free(s2.s);
 	free(log_fn);
 	free(log_dir);
-	return;
+	return f;
+}
+
+void set_up_logging(e2fsck_t ctx)
+{
+	FILE *f;
+
+	ctx->logf = set_up_log_file(ctx, "log", ctx->log_fn);
+	f = set_up_log_file(ctx, "problem_log", ctx->problem_log_fn);
+	if (f)
+		e2fsck_problem_log_open(ctx, f);
 }
 #else
 void *e2fsck_allocate_memory(e2fsck_t ctx, unsigned int size,
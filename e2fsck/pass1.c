@@ -838,8 +838,10 @@ extern errcode_t e2fsck_setup_icount(e2fsck_t ctx, const char *icount_name,
 	    (!threshold || num_dirs > threshold)) {
 		retval = ext2fs_create_icount_tdb(ctx->fs, tdb_dir,
 						  flags, ret);
-		if (retval == 0)
+		if (retval == 0) {
+			ctx->flags |= E2F_FLAG_ICOUNT_TDB;
 			return 0;
+		}
 	}
 	e2fsck_set_bitmap_type(ctx->fs, EXT2FS_BMAP64_RBTREE, icount_name,
 			       &save_type);
@@ -2063,7 +2065,7 @@ endit:
 	ctx->lost_and_found = 0;
 
 	if ((ctx->flags & E2F_FLAG_SIGNAL_MASK) == 0)
-		print_resource_track(ctx, _("Pass 1"), &rtrack, ctx->fs->io);
+		print_resource_track(ctx, N_("Pass 1"), &rtrack, ctx->fs->io);
 	else
 		ctx->invalid_bitmaps++;
 }
@@ -304,7 +304,7 @@ void e2fsck_pass2(e2fsck_t ctx)
 		}
 	}
 
-	print_resource_track(ctx, _("Pass 2"), &rtrack, fs->io);
+	print_resource_track(ctx, N_("Pass 2"), &rtrack, fs->io);
 cleanup:
 	ext2fs_free_mem(&buf);
 }
@@ -358,12 +358,15 @@ static EXT2_QSORT_TYPE special_dir_block_cmp(const void *a, const void *b)
 		return -1;
 
 	if (db_a->blk != db_b->blk)
-		return (int) (db_a->blk - db_b->blk);
+		return db_a->blk < db_b->blk ? -1 : 1;
 
 	if (db_a->ino != db_b->ino)
-		return (int) (db_a->ino - db_b->ino);
+		return db_a->ino < db_b->ino ? -1 : 1;
 
-	return (int) (db_a->blockcnt - db_b->blockcnt);
+	if (db_a->blockcnt != db_b->blockcnt)
+		return db_a->blockcnt < db_b->blockcnt ? -1 : 1;
+
+	return 0;
 }
 
 
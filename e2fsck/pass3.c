@@ -83,7 +83,7 @@ void e2fsck_pass3(e2fsck_t ctx)
 		ctx->flags |= E2F_FLAG_ABORT;
 		goto abort_exit;
 	}
-	print_resource_track(ctx, _("Peak memory"), &ctx->global_rtrack, NULL);
+	print_resource_track(ctx, N_("Peak memory"), &ctx->global_rtrack, NULL);
 
 	check_root(ctx);
 	if (ctx->flags & E2F_FLAG_SIGNAL_MASK)
@@ -146,7 +146,7 @@ abort_exit:
 		ctx->root_repair_block = 0;
 	}
 
-	print_resource_track(ctx, _("Pass 3"), &rtrack, ctx->fs->io);
+	print_resource_track(ctx, N_("Pass 3"), &rtrack, ctx->fs->io);
 }
 
 /*
@@ -15,6 +15,9 @@
  */
 
 #include "config.h"
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 #include "e2fsck.h"
 #include "problem.h"
 #include <ext2fs/ext2_ext_attr.h>
@@ -134,19 +137,370 @@ static void check_ea_inode(e2fsck_t ctx, ext2_ino_t i,
 	}
 }
 
-void e2fsck_pass4(e2fsck_t ctx)
+/*
+ * Check the link count of inode i against the number of references
+ * found to it, and fix it if need be.  Returns 1 if the inode had no
+ * references and was cleared or reconnected, since that may change the
+ * counts of other inodes (lost+found, for one).
+ */
+static int check_link_count(e2fsck_t ctx, ext2_ino_t i,
+			    struct ext2_inode_large *inode, char **buf)
+{
+	ext2_filsys fs = ctx->fs;
+	int inode_size = EXT2_INODE_SIZE(fs->super);
+	struct problem_context	pctx;
+	__u16	link_count, link_counted;
+	int	isdir, disconnected = 0;
+
+	ext2fs_icount_fetch(ctx->inode_link_info, i, &link_count);
+	ext2fs_icount_fetch(ctx->inode_count, i, &link_counted);
+
+	if (link_counted == 0) {
+		/*
+		 * link_counted is expected to be 0 for an ea_inode.
+		 * check_ea_inode() will update link_counted if
+		 * necessary.
+		 */
+		check_ea_inode(ctx, i, inode, &link_counted);
+	}
+
+	if (link_counted == 0) {
+		if (!*buf)
+			*buf = e2fsck_allocate_memory(ctx,
+			     fs->blocksize, "bad_inode buffer");
+		if (e2fsck_process_bad_inode(ctx, 0, i, *buf))
+			return 1;
+		if (disconnect_inode(ctx, i, inode))
+			return 1;
+		ext2fs_icount_fetch(ctx->inode_link_info, i,
+				    &link_count);
+		ext2fs_icount_fetch(ctx->inode_count, i,
+				    &link_counted);
+		disconnected = 1;
+	}
+	isdir = ext2fs_test_inode_bitmap2(ctx->inode_dir_map, i);
+	if (isdir && (link_counted > EXT2_LINK_MAX))
+		link_counted = 1;
+	if (link_counted != link_count) {
+		e2fsck_read_inode_full(ctx, i, EXT2_INODE(inode),
+				       inode_size, "pass4");
+		clear_problem_context(&pctx);
+		pctx.ino = i;
+		pctx.inode = EXT2_INODE(inode);
+		if ((link_count != inode->i_links_count) && !isdir &&
+		    (inode->i_links_count <= EXT2_LINK_MAX)) {
+			pctx.num = link_count;
+			fix_problem(ctx,
+				    PR_4_INCONSISTENT_COUNT, &pctx);
+		}
+		pctx.num = link_counted;
+		/* i_link_count was previously exceeded, but no longer
+		 * is, fix this but don't consider it an error */
+		if ((isdir && link_counted > 1 &&
+		     (inode->i_flags & EXT2_INDEX_FL) &&
+		     link_count == 1 && !(ctx->options & E2F_OPT_NO)) ||
+		    fix_problem(ctx, PR_4_BAD_REF_COUNT, &pctx)) {
+			inode->i_links_count = link_counted;
+			e2fsck_write_inode_full(ctx, i,
+						EXT2_INODE(inode),
+						inode_size, "pass4");
+		}
+	}
+	return disconnected;
+}
+
+/*
+ * Inodes which pass 4 never looks at.
+ */
+static int skip_inode(e2fsck_t ctx, ext2_ino_t i)
+{
+	ext2_filsys fs = ctx->fs;
+
+	return (i == quota_type2inum(PRJQUOTA, fs->super) ||
+		i == EXT2_BAD_INO ||
+		(i > EXT2_ROOT_INO && i < EXT2_FIRST_INODE(fs->super)));
+}
+
+/*
+ * Rather than fetching the counts of every inode one at a time, pass 4
+ * scans the inode table in slices: it copies out the bitmaps and both
+ * icounts for a whole slice, skips the words of the used bitmap which
+ * are empty, and notes the inodes whose counts don't agree.  The slices
+ * only read the bitmaps and icounts, so they can be spread over several
+ * threads; the inodes noted are then checked in order by the caller.
+ */
+#define PASS4_SLICE		65536	/* inodes per slice */
+#define PASS4_ROUND		4	/* slices per thread per round */
+#define PASS4_MAX_THREADS	16
+
+struct pass4_slice {
+	ext2_ino_t	start;
+	ext2_ino_t	num;
+	ext2_ino_t	*cand;		/* inodes which need a closer look */
+	ext2_ino_t	nr_cand;
+	ext2_ino_t	max_cand;
+	errcode_t	retval;		/* if set, check every inode */
+};
+
+struct pass4_scan {
+	e2fsck_t		ctx;
+	struct pass4_slice	*slices;
+	int			count;
+	int			next;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		lock;
+#endif
+};
+
+static errcode_t get_bitmap_range(ext2fs_inode_bitmap map, ext2_ino_t start,
+				  ext2_ino_t num, __u64 *out)
+{
+	memset(out, 0, ((num + 63) / 64) * sizeof(__u64));
+	if (!map)
+		return 0;
+	return ext2fs_get_inode_bitmap_range2(map, start, num, out);
+}
+
+static errcode_t scan_slice(e2fsck_t ctx, struct pass4_slice *slice)
+{
+	ext2_ino_t	start = slice->start, num = slice->num;
+	ext2_ino_t	words = (num + 63) / 64, w, bit, end, ino;
+	__u64		*used = 0, *skip = 0, *dirs = 0;
+	__u16		*link_count = 0, *link_counted = 0, counted;
+	errcode_t	retval;
+
+	slice->nr_cand = 0;
+	retval = ext2fs_get_array(words, sizeof(__u64), &used);
+	if (!retval)
+		retval = ext2fs_get_array(words, sizeof(__u64), &skip);
+	if (!retval)
+		retval = ext2fs_get_array(words, sizeof(__u64), &dirs);
+	if (!retval)
+		retval = ext2fs_get_array(num, sizeof(__u16), &link_count);
+	if (!retval)
+		retval = ext2fs_get_array(num, sizeof(__u16), &link_counted);
+	if (retval)
+		goto out;
+
+	/* Imagic and bad block inodes are skipped like unused ones */
+	retval = get_bitmap_range(ctx->inode_imagic_map, start, num, skip);
+	if (retval)
+		goto out;
+	retval = get_bitmap_range(ctx->inode_bb_map, start, num, used);
+	if (retval)
+		goto out;
+	for (w = 0; w < words; w++)
+		skip[w] |= used[w];
+	retval = get_bitmap_range(ctx->inode_used_map, start, num, used);
+	if (retval)
+		goto out;
+	for (w = 0; w < words; w++)
+		used[w] &= ~skip[w];
+	retval = get_bitmap_range(ctx->inode_dir_map, start, num, dirs);
+	if (retval)
+		goto out;
+	retval = ext2fs_icount_fetch_range(ctx->inode_link_info, start, num,
+					   link_count);
+	if (retval)
+		goto out;
+	retval = ext2fs_icount_fetch_range(ctx->inode_count, start, num,
+					   link_counted);
+	if (retval)
+		goto out;
+
+	for (w = 0; w < words; w++) {
+		if (!used[w])
+			continue;
+		end = (w + 1) * 64;
+		if (end > num)
+			end = num;
+		for (bit = w * 64; bit < end; bit++) {
+			if (!ext2fs_test_bit(bit, used))
+				continue;
+			ino = start + bit;
+			counted = link_counted[bit];
+			if (counted > EXT2_LINK_MAX &&
+			    ext2fs_test_bit(bit, dirs))
+				counted = 1;
+			if ((counted && counted == link_count[bit]) ||
+			    skip_inode(ctx, ino))
+				continue;
+			if (slice->nr_cand >= slice->max_cand) {
+				ext2_ino_t new_max = slice->max_cand ?
+					slice->max_cand * 2 : 256;
+
+				retval = ext2fs_resize_mem(slice->max_cand *
+						sizeof(ext2_ino_t),
+						new_max * sizeof(ext2_ino_t),
+						&slice->cand);
+				if (retval)
+					goto out;
+				slice->max_cand = new_max;
+			}
+			slice->cand[slice->nr_cand++] = ino;
+		}
+	}
+out:
+	if (used)
+		ext2fs_free_mem(&used);
+	if (skip)
+		ext2fs_free_mem(&skip);
+	if (dirs)
+		ext2fs_free_mem(&dirs);
+	if (link_count)
+		ext2fs_free_mem(&link_count);
+	if (link_counted)
+		ext2fs_free_mem(&link_counted);
+	return retval;
+}
+
+static void scan_slices(struct pass4_scan *scan)
+{
+	struct pass4_slice	*slice;
+	int			i;
+
+	while (1) {
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_lock(&scan->lock);
+#endif
+		i = scan->next++;
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_unlock(&scan->lock);
+#endif
+		if (i >= scan->count)
+			break;
+		slice = scan->slices + i;
+		slice->retval = scan_slice(scan->ctx, slice);
+	}
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *pass4_worker(void *arg)
+{
+	scan_slices(arg);
+	return NULL;
+}
+
+/*
+ * Scan the slices with a pool of threads, the calling thread being one
+ * of them.  If a thread can't be started the others pick up its share.
+ */
+static void scan_slices_threaded(struct pass4_scan *scan, int threads)
+{
+	pthread_t	thread[PASS4_MAX_THREADS];
+	int		i;
+
+	for (i = 1; i < threads; i++)
+		if (pthread_create(&thread[i], NULL, pass4_worker, scan))
+			break;
+	scan_slices(scan);
+	while (--i > 0)
+		pthread_join(thread[i], NULL);
+}
+#endif /* HAVE_PTHREAD_H */
+
+/*
+ * Report progress for each group boundary passed on the way to ino.
+ */
+static int pass4_progress(e2fsck_t ctx, ext2_ino_t ino, dgrp_t *group)
 {
 	ext2_filsys fs = ctx->fs;
-	ext2_ino_t	i;
+
+	while (*group < ino / fs->super->s_inodes_per_group) {
+		(*group)++;
+		if (ctx->progress &&
+		    (ctx->progress)(ctx, 4, *group, fs->group_desc_count))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Reconnecting an inode changes the counts of lost+found, and of the
+ * root directory if lost+found had to be created.  If the scan of this
+ * round has already passed them by they are noted here, in order, so
+ * that they are checked again when the walk gets to them.
+ */
+#define PASS4_RECHECK	2
+
+struct pass4_walk {
+	e2fsck_t		ctx;
 	struct ext2_inode_large	*inode;
+	char			*buf;
+	dgrp_t			group;
+	__u64			end;	/* first inode not scanned yet */
+	ext2_ino_t		recheck[PASS4_RECHECK];
+};
+
+static void note_recheck(struct pass4_walk *walk, ext2_ino_t ino,
+			 ext2_ino_t after)
+{
+	ext2_ino_t	tmp;
+	int		i;
+
+	if (ino <= after || ino >= walk->end)
+		return;
+	for (i = 0; i < PASS4_RECHECK && ino; i++) {
+		if (walk->recheck[i] == ino)
+			return;
+		if (!walk->recheck[i] || walk->recheck[i] > ino) {
+			tmp = walk->recheck[i];
+			walk->recheck[i] = ino;
+			ino = tmp;
+		}
+	}
+}
+
+static int walk_check(struct pass4_walk *walk, ext2_ino_t ino)
+{
+	e2fsck_t ctx = walk->ctx;
+
+	if (ctx->flags & E2F_FLAG_SIGNAL_MASK)
+		return 1;
+	if (pass4_progress(ctx, ino, &walk->group))
+		return 1;
+	if (check_link_count(ctx, ino, walk->inode, &walk->buf)) {
+		note_recheck(walk, ctx->lost_and_found, ino);
+		note_recheck(walk, EXT2_ROOT_INO, ino);
+	}
+	return 0;
+}
+
+/*
+ * Check the inodes noted for a recheck which come before ino.  One
+ * noted at ino itself is dropped, since the caller is about to check
+ * it anyway.
+ */
+static int walk_rechecks(struct pass4_walk *walk, __u64 ino)
+{
+	ext2_ino_t	next;
+	int		i;
+
+	while (walk->recheck[0] && walk->recheck[0] <= ino) {
+		next = walk->recheck[0];
+		for (i = 1; i < PASS4_RECHECK; i++)
+			walk->recheck[i - 1] = walk->recheck[i];
+		walk->recheck[PASS4_RECHECK - 1] = 0;
+		if (next < ino && walk_check(walk, next))
+			return 1;
+	}
+	return 0;
+}
+
+void e2fsck_pass4(e2fsck_t ctx)
+{
+	ext2_filsys fs = ctx->fs;
+	ext2_ino_t	i, n, ino;
 	int inode_size = EXT2_INODE_SIZE(fs->super);
 #ifdef RESOURCE_TRACK
 	struct resource_track	rtrack;
 #endif
 	struct problem_context	pctx;
-	__u16	link_count, link_counted;
-	char	*buf = 0;
-	dgrp_t	group, maxgroup;
+	struct pass4_scan	scan;
+	struct pass4_slice	*slice;
+	struct pass4_walk	walk;
+	__u64	next, last = fs->super->s_inodes_count;
+	int	threads = 1, max_slices, s;
 
 	init_resource_track(&rtrack, ctx->fs->io);
 
@@ -168,88 +522,83 @@ void e2fsck_pass4(e2fsck_t ctx)
 	if (!(ctx->options & E2F_OPT_PREEN))
 		fix_problem(ctx, PR_4_PASS_HEADER, &pctx);
 
-	group = 0;
-	maxgroup = fs->group_desc_count;
 	if (ctx->progress)
-		if ((ctx->progress)(ctx, 4, 0, maxgroup))
+		if ((ctx->progress)(ctx, 4, 0, fs->group_desc_count))
 			return;
 
-	inode = e2fsck_allocate_memory(ctx, inode_size, "scratch inode");
-
-	/* Protect loop from wrap-around if s_inodes_count maxed */
-	for (i=1; i <= fs->super->s_inodes_count && i > 0; i++) {
-		int isdir;
+	memset(&walk, 0, sizeof(walk));
+	walk.ctx = ctx;
+	walk.inode = e2fsck_allocate_memory(ctx, inode_size, "scratch inode");
 
-		if (ctx->flags & E2F_FLAG_SIGNAL_MASK)
-			goto errout;
-		if ((i % fs->super->s_inodes_per_group) == 0) {
-			group++;
-			if (ctx->progress)
-				if ((ctx->progress)(ctx, 4, group, maxgroup))
-					goto errout;
-		}
-		if (i == quota_type2inum(PRJQUOTA, ctx->fs->super) ||
-		    i == EXT2_BAD_INO ||
-		    (i > EXT2_ROOT_INO && i < EXT2_FIRST_INODE(fs->super)))
-			continue;
-		if (!(ext2fs_test_inode_bitmap2(ctx->inode_used_map, i)) ||
-		    (ctx->inode_imagic_map &&
-		     ext2fs_test_inode_bitmap2(ctx->inode_imagic_map, i)) ||
-		    (ctx->inode_bb_map &&
-		     ext2fs_test_inode_bitmap2(ctx->inode_bb_map, i)))
-			continue;
-		ext2fs_icount_fetch(ctx->inode_link_info, i, &link_count);
-		ext2fs_icount_fetch(ctx->inode_count, i, &link_counted);
+	/* A tdb file can only be read by one thread at a time */
+#ifdef HAVE_PTHREAD_H
+	if (!(ctx->flags & E2F_FLAG_ICOUNT_TDB))
+		threads = e2fsck_worker_threads(ctx, "pass4_threads",
+						PASS4_MAX_THREADS);
+#endif
+	max_slices = threads * PASS4_ROUND;
+	memset(&scan, 0, sizeof(scan));
+	scan.ctx = ctx;
+	scan.slices = e2fsck_allocate_memory(ctx,
+			max_slices * sizeof(struct pass4_slice),
+			"pass4 slices");
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&scan.lock, NULL);
+#endif
 
-		if (link_counted == 0) {
-			/*
-			 * link_counted is expected to be 0 for an ea_inode.
-			 * check_ea_inode() will update link_counted if
-			 * necessary.
-			 */
-			check_ea_inode(ctx, i, inode, &link_counted);
+	next = 1;
+	while (next <= last) {
+		for (scan.count = 0; scan.count < max_slices && next <= last;
+		     scan.count++) {
+			slice = scan.slices + scan.count;
+			slice->start = next;
+			slice->num = PASS4_SLICE;
+			if (slice->num > last - next + 1)
+				slice->num = last - next + 1;
+			next += slice->num;
 		}
+		walk.end = next;
+		scan.next = 0;
+#ifdef HAVE_PTHREAD_H
+		if (threads > 1 && scan.count > 1)
+			scan_slices_threaded(&scan, threads < scan.count ?
+					     threads : scan.count);
+		else
+#endif
+			scan_slices(&scan);
 
-		if (link_counted == 0) {
-			if (!buf)
-				buf = e2fsck_allocate_memory(ctx,
-				     fs->blocksize, "bad_inode buffer");
-			if (e2fsck_process_bad_inode(ctx, 0, i, buf))
-				continue;
-			if (disconnect_inode(ctx, i, inode))
-				continue;
-			ext2fs_icount_fetch(ctx->inode_link_info, i,
-					    &link_count);
-			ext2fs_icount_fetch(ctx->inode_count, i,
-					    &link_counted);
-		}
-		isdir = ext2fs_test_inode_bitmap2(ctx->inode_dir_map, i);
-		if (isdir && (link_counted > EXT2_LINK_MAX))
-			link_counted = 1;
-		if (link_counted != link_count) {
-			e2fsck_read_inode_full(ctx, i, EXT2_INODE(inode),
-					       inode_size, "pass4");
-			pctx.ino = i;
-			pctx.inode = EXT2_INODE(inode);
-			if ((link_count != inode->i_links_count) && !isdir &&
-			    (inode->i_links_count <= EXT2_LINK_MAX)) {
-				pctx.num = link_count;
-				fix_problem(ctx,
-					    PR_4_INCONSISTENT_COUNT, &pctx);
-			}
-			pctx.num = link_counted;
-			/* i_link_count was previously exceeded, but no longer
-			 * is, fix this but don't consider it an error */
-			if ((isdir && link_counted > 1 &&
-			     (inode->i_flags & EXT2_INDEX_FL) &&
-			     link_count == 1 && !(ctx->options & E2F_OPT_NO)) ||
-			    fix_problem(ctx, PR_4_BAD_REF_COUNT, &pctx)) {
-				inode->i_links_count = link_counted;
-				e2fsck_write_inode_full(ctx, i,
-							EXT2_INODE(inode),
-							inode_size, "pass4");
+		/*
+		 * Check the inodes noted in inode order.  check_link_count()
+		 * fetches the counts afresh, so it doesn't matter if a fix
+		 * made along the way has changed them since the scan.
+		 */
+		for (s = 0; s < scan.count; s++) {
+			slice = scan.slices + s;
+			n = slice->retval ? slice->num : slice->nr_cand;
+			for (i = 0; i < n; i++) {
+				if (slice->retval) {
+					ino = slice->start + i;
+					if (!ext2fs_test_inode_bitmap2(
+						    ctx->inode_used_map, ino) ||
+					    (ctx->inode_imagic_map &&
+					     ext2fs_test_inode_bitmap2(
+						  ctx->inode_imagic_map, ino)) ||
+					    (ctx->inode_bb_map &&
+					     ext2fs_test_inode_bitmap2(
+						  ctx->inode_bb_map, ino)) ||
+					    skip_inode(ctx, ino))
+						continue;
+				} else
+					ino = slice->cand[i];
+				if (walk_rechecks(&walk, ino) ||
+				    walk_check(&walk, ino))
+					goto errout;
 			}
 		}
+		if (walk_rechecks(&walk, walk.end) ||
+		    (ctx->flags & E2F_FLAG_SIGNAL_MASK) ||
+		    pass4_progress(ctx, next - 1, &walk.group))
+			goto errout;
 	}
 	ext2fs_free_icount(ctx->inode_link_info); ctx->inode_link_info = 0;
 	ext2fs_free_icount(ctx->inode_count); ctx->inode_count = 0;
@@ -260,10 +609,16 @@ void e2fsck_pass4(e2fsck_t ctx)
 	ext2fs_free_inode_bitmap(ctx->inode_imagic_map);
 	ctx->inode_imagic_map = 0;
 errout:
-	if (buf)
-		ext2fs_free_mem(&buf);
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&scan.lock);
+#endif
+	for (s = 0; s < max_slices; s++)
+		if (scan.slices[s].cand)
+			ext2fs_free_mem(&scan.slices[s].cand);
+	ext2fs_free_mem(&scan.slices);
+	if (walk.buf)
+		ext2fs_free_mem(&walk.buf);
 
-	ext2fs_free_mem(&inode);
-	print_resource_track(ctx, _("Pass 4"), &rtrack, ctx->fs->io);
+	ext2fs_free_mem(&walk.inode);
+	print_resource_track(ctx, N_("Pass 4"), &rtrack, ctx->fs->io);
 }
-
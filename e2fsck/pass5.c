@@ -76,7 +76,7 @@ void e2fsck_pass5(e2fsck_t ctx)
 	ext2fs_free_block_bitmap(ctx->block_metadata_map);
 	ctx->block_metadata_map = 0;
 
-	print_resource_track(ctx, _("Pass 5"), &rtrack, ctx->fs->io);
+	print_resource_track(ctx, N_("Pass 5"), &rtrack, ctx->fs->io);
 }
 
 static void check_inode_bitmap_checksum(e2fsck_t ctx)
@@ -2053,6 +2053,64 @@ static struct e2fsck_problem problem_table[] = {
 	  N_("Error writing quota info for quota type %N: %m\n"),
 	  PROMPT_NULL, 0 },
 
+	/* Metadata verification (-E verify_only) errors */
+
+	/* Verifying metadata */
+	{ PR_7_PASS_HEADER,
+	  N_("Verifying @f metadata\n"),
+	  PROMPT_NONE, PR_PREEN_NOMSG },
+
+	/* Superblock fails verification */
+	{ PR_7_SUPER_BAD,
+	  N_("@S: %m\n"),
+	  PROMPT_NONE, 0 },
+
+	/* Group descriptor checksum is invalid */
+	{ PR_7_GDT_CSUM,
+	  N_("@g descriptor %g checksum is %04x, should be %04y.\n"),
+	  PROMPT_NONE, 0 },
+
+	/* Bitmap or inode table of a group fails verification */
+	{ PR_7_GROUP_BAD,
+	  N_("@g %g: %m\n"),
+	  PROMPT_NONE, 0 },
+
+	/* Inode fails verification */
+	{ PR_7_INODE_BAD,
+	  N_("@i %i: %m\n"),
+	  PROMPT_NONE, 0 },
+
+	/* Metadata block of an inode fails verification */
+	{ PR_7_BLOCK_BAD,
+	  N_("@i %i @b %b: %m\n"),
+	  PROMPT_NONE, 0 },
+
+	/* Error while verifying metadata */
+	{ PR_7_VERIFY_ERROR,
+	  N_("Error while verifying @f metadata: %m\n"),
+	  PROMPT_NONE, 0 },
+
+	/* Block groups skipped because they are unchanged since the snapshot */
+	{ PR_7_SNAPSHOT_SKIP,
+	  N_("%N of %g @gs unchanged since the last verification were not "
+	     "checked again\n"),
+	  PROMPT_NONE, PR_PREEN_NOMSG },
+
+	/* Metadata snapshot does not match the file system */
+	{ PR_7_SNAPSHOT_INVALID,
+	  N_("Ignoring metadata snapshot %s, which does not match this @f\n"),
+	  PROMPT_NONE, 0 },
+
+	/* Error reading the metadata snapshot */
+	{ PR_7_SNAPSHOT_READ,
+	  N_("Error reading metadata snapshot %s: %m\n"),
+	  PROMPT_NONE, 0 },
+
+	/* Error writing the metadata snapshot */
+	{ PR_7_SNAPSHOT_WRITE,
+	  N_("Error writing metadata snapshot %s: %m\n"),
+	  PROMPT_NONE, 0 },
+
 	{ 0 }
 };
 
@@ -2164,7 +2222,7 @@ int fix_problem(e2fsck_t ctx, problem_t code, struct problem_context *pctx)
 	ext2_filsys fs = ctx->fs;
 	struct e2fsck_problem *ptr;
 	struct latch_descr *ldesc = 0;
-	const char *message;
+	const char *message, *action;
 	int		def_yn, answer, ans;
 	int		print_answer = 0;
 	int		suppress = 0;
@@ -2233,6 +2291,8 @@ int fix_problem(e2fsck_t ctx, problem_t code, struct problem_context *pctx)
 	    ((ctx->options & E2F_OPT_NO) || (ptr->flags & PR_FORCE_NO)))
 		suppress++;
 	if (ptr->max_count && (ptr->count > ptr->max_count)) {
+		int was_suppressed = suppress;
+
 		if (ctx->options & (E2F_OPT_NO | E2F_OPT_YES))
 			suppress++;
 		if ((ctx->options & E2F_OPT_PREEN) &&
@@ -2246,6 +2306,8 @@ int fix_problem(e2fsck_t ctx, problem_t code, struct problem_context *pctx)
 			       ptr->e2p_code);
 			fflush(stdout);
 		}
+		if (suppress && !was_suppressed)
+			ptr->suppressed++;
 	}
 	message = ptr->e2p_description;
 	if (*message)
@@ -2261,11 +2323,18 @@ int fix_problem(e2fsck_t ctx, problem_t code, struct problem_context *pctx)
 	}
 	if (ctx->logf && message)
 		print_e2fsck_message(ctx->logf, ctx, message, pctx, 1, 0);
-	if (!(ptr->flags & PR_PREEN_OK) && (ptr->prompt != PROMPT_NONE))
+	if (!(ptr->flags & PR_PREEN_OK) && (ptr->prompt != PROMPT_NONE)) {
+		if (ctx->options & E2F_OPT_PREEN)
+			e2fsck_problem_log(ctx, code, ptr->e2p_description, pctx,
+					   "HALTED");
 		preenhalt(ctx);
+	}
 
-	if (ptr->flags & PR_FATAL)
+	if (ptr->flags & PR_FATAL) {
+		e2fsck_problem_log(ctx, code, ptr->e2p_description, pctx,
+				   "ABORTED");
 		fatal_error(ctx, 0);
+	}
 
 	if (ptr->prompt == PROMPT_NONE) {
 		if (ptr->flags & PR_NOCOLLATE)
@@ -2305,6 +2374,17 @@ int fix_problem(e2fsck_t ctx, problem_t code, struct problem_context *pctx)
 		}
 	}
 
+	/* The problem log gets the untranslated action */
+	if (ptr->prompt == PROMPT_NONE)
+		action = NULL;
+	else if (!answer)
+		action = "IGNORED";
+	else if (*preen_msg[(int) ptr->prompt])
+		action = preen_msg[(int) ptr->prompt];
+	else
+		action = "YES";
+	e2fsck_problem_log(ctx, code, ptr->e2p_description, pctx, action);
+
 	if ((ptr->prompt == PROMPT_ABORT) && answer)
 		fatal_error(ctx, 0);
 
@@ -2318,6 +2398,28 @@ int fix_problem(e2fsck_t ctx, problem_t code, struct problem_context *pctx)
 	return answer;
 }
 
+/*
+ * Since only the first max_count instances of a problem are reported,
+ * print how often each problem which was cut short occurred in all.
+ */
+void print_problem_summary(e2fsck_t ctx)
+{
+	struct e2fsck_problem *ptr;
+	int	first = 1;
+
+	for (ptr = problem_table; ptr->e2p_code; ptr++) {
+		if (!ptr->suppressed)
+			continue;
+		if (first) {
+			log_out(ctx, "%s", _("\nProblems not reported "
+					     "every time:\n"));
+			first = 0;
+		}
+		log_out(ctx, _("  problem 0x%06x: %d found, %d not shown\n"),
+			ptr->e2p_code, ptr->count, ptr->suppressed);
+	}
+}
+
 #ifdef UNITTEST
 
 #include <stdlib.h>
@@ -2354,6 +2456,17 @@ void preenhalt(e2fsck_t ctx)
 	return;
 }
 
+void log_out(e2fsck_t ctx, const char *fmt, ...)
+{
+	return;
+}
+
+void e2fsck_problem_log(e2fsck_t ctx, problem_t code, const char *desc,
+			struct problem_context *pctx, const char *action)
+{
+	return;
+}
+
 errcode_t
 profile_get_string(profile_t profile, const char *name, const char *subname,
 		   const char *subsubname, const char *def_val,
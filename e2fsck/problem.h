@@ -1247,6 +1247,43 @@ struct problem_context {
 /* Error updating quota information */
 #define PR_6_WRITE_QUOTAS		0x060006
 
+/*
+ * Metadata verification (-E verify_only) errors
+ */
+
+/* Verifying metadata */
+#define PR_7_PASS_HEADER		0x070000
+
+/* Superblock fails verification */
+#define PR_7_SUPER_BAD			0x070001
+
+/* Group descriptor checksum is invalid */
+#define PR_7_GDT_CSUM			0x070002
+
+/* Bitmap or inode table of a group fails verification */
+#define PR_7_GROUP_BAD			0x070003
+
+/* Inode fails verification */
+#define PR_7_INODE_BAD			0x070004
+
+/* Metadata block of an inode fails verification */
+#define PR_7_BLOCK_BAD			0x070005
+
+/* Error while verifying metadata */
+#define PR_7_VERIFY_ERROR		0x070006
+
+/* Block groups skipped because they are unchanged since the snapshot */
+#define PR_7_SNAPSHOT_SKIP		0x070007
+
+/* Metadata snapshot does not match the file system */
+#define PR_7_SNAPSHOT_INVALID		0x070008
+
+/* Error reading the metadata snapshot */
+#define PR_7_SNAPSHOT_READ		0x070009
+
+/* Error writing the metadata snapshot */
+#define PR_7_SNAPSHOT_WRITE		0x07000A
+
 
 /*
  * Function declarations
@@ -1256,6 +1293,11 @@ int end_problem_latch(e2fsck_t ctx, int mask);
 int set_latch_flags(int mask, int setflags, int clearflags);
 int get_latch_flags(int mask, int *value);
 void clear_problem_context(struct problem_context *pctx);
+void print_problem_summary(e2fsck_t ctx);
+
+/* problem_log.c */
+void e2fsck_problem_log(e2fsck_t ctx, problem_t code, const char *desc,
+			struct problem_context *pctx, const char *action);
 
 /* message.c */
 void print_e2fsck_message(FILE *f, e2fsck_t ctx, const char *msg,
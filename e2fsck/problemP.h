@@ -17,6 +17,7 @@ struct e2fsck_problem {
 	problem_t	second_code;
 	int		count;
 	int		max_count;
+	int		suppressed;	/* instances not shown due to max_count */
 };
 
 struct latch_descr {
@@ -0,0 +1,386 @@
+/*
+ * problem_log.c --- machine-readable log of the problems e2fsck finds
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ *
+ * Each problem passed to fix_problem() is written to the problem log as
+ * one line of JSON, giving the problem code, the fields of the problem
+ * context which are set, and the action taken.  The lines are gathered
+ * into a buffer, and full buffers are written out by a thread of their
+ * own so that a file system with millions of problems isn't held up
+ * waiting for the log.
+ */
+
+#include "config.h"
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "e2fsck.h"
+#include "problem.h"
+#include "../version.h"
+
+#define PROBLEM_LOG_BUFSIZE	65536
+#define PROBLEM_LOG_MAXLINE	4096
+
+struct problem_log {
+	FILE		*f;
+	char		*buf;		/* being filled */
+	size_t		len;
+	char		*spare;		/* free, or being written out */
+#ifdef HAVE_PTHREAD_H
+	int		threaded;
+	pthread_t	thread;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	char		*out;		/* handed to the writer thread */
+	size_t		out_len;
+	int		done;
+#endif
+};
+
+struct json_line {
+	char	*s;
+	size_t	len;
+	size_t	max;
+};
+
+static void json_add(struct json_line *l, const char *fmt, ...)
+#ifdef __GNUC__
+	__attribute__ ((format (printf, 2, 3)))
+#endif
+	;
+
+static void json_add(struct json_line *l, const char *fmt, ...)
+{
+	va_list	args;
+	int	n;
+
+	if (l->len >= l->max)
+		return;
+	va_start(args, fmt);
+	n = vsnprintf(l->s + l->len, l->max - l->len, fmt, args);
+	va_end(args);
+	if (n < 0)
+		return;
+	l->len += n;
+	if (l->len > l->max)
+		l->len = l->max;
+}
+
+/*
+ * Add a string field; anything outside of printable ASCII is escaped,
+ * since file names need not be valid UTF-8.
+ */
+static void json_add_string(struct json_line *l, const char *field,
+			    const char *str, int len)
+{
+	unsigned char	c;
+	int		i;
+
+	if (len < 0)
+		len = strlen(str);
+	json_add(l, ",\"%s\":\"", field);
+	for (i = 0; i < len; i++) {
+		c = str[i];
+		if (c == '"' || c == '\\')
+			json_add(l, "\\%c", c);
+		else if (c < 0x20 || c >= 0x7f)
+			json_add(l, "\\u%04x", c);
+		else
+			json_add(l, "%c", c);
+	}
+	json_add(l, "\"");
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *problem_log_writer(void *arg)
+{
+	struct problem_log *log = arg;
+	char	*buf;
+	size_t	len;
+
+	pthread_mutex_lock(&log->lock);
+	while (1) {
+		while (!log->out && !log->done)
+			pthread_cond_wait(&log->cond, &log->lock);
+		if (!log->out)
+			break;
+		buf = log->out;
+		len = log->out_len;
+		pthread_mutex_unlock(&log->lock);
+
+		fwrite(buf, 1, len, log->f);
+		fflush(log->f);
+
+		pthread_mutex_lock(&log->lock);
+		log->out = NULL;
+		pthread_cond_broadcast(&log->cond);
+	}
+	pthread_mutex_unlock(&log->lock);
+	return NULL;
+}
+#endif
+
+/*
+ * Write out the buffer being filled, and start filling the spare.
+ */
+static void problem_log_flush(struct problem_log *log)
+{
+	if (!log->len)
+		return;
+#ifdef HAVE_PTHREAD_H
+	if (log->threaded) {
+		char	*buf;
+
+		pthread_mutex_lock(&log->lock);
+		while (log->out)
+			pthread_cond_wait(&log->cond, &log->lock);
+		log->out = log->buf;
+		log->out_len = log->len;
+		pthread_cond_broadcast(&log->cond);
+		pthread_mutex_unlock(&log->lock);
+
+		buf = log->buf;
+		log->buf = log->spare;
+		log->spare = buf;
+		log->len = 0;
+		return;
+	}
+#endif
+	fwrite(log->buf, 1, log->len, log->f);
+	log->len = 0;
+}
+
+static void problem_log_write(struct problem_log *log, const char *line,
+			      size_t len)
+{
+	if (log->len + len > PROBLEM_LOG_BUFSIZE)
+		problem_log_flush(log);
+	memcpy(log->buf + log->len, line, len);
+	log->len += len;
+}
+
+void e2fsck_problem_log_open(e2fsck_t ctx, FILE *f)
+{
+	struct problem_log	*log;
+	char			line[PROBLEM_LOG_MAXLINE];
+	struct json_line	l = { line, 0, sizeof(line) - 1 };
+
+	log = e2fsck_allocate_memory(ctx, sizeof(struct problem_log),
+				     "problem log");
+	log->f = f;
+	log->buf = e2fsck_allocate_memory(ctx, PROBLEM_LOG_BUFSIZE,
+					  "problem log buffer");
+	log->spare = e2fsck_allocate_memory(ctx, PROBLEM_LOG_BUFSIZE,
+					    "problem log buffer");
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&log->lock, NULL);
+	pthread_cond_init(&log->cond, NULL);
+	if (pthread_create(&log->thread, NULL, problem_log_writer, log) == 0)
+		log->threaded = 1;
+#endif
+	ctx->problem_log = log;
+
+	json_add(&l, "{\"version\":\"%s\"", E2FSPROGS_VERSION);
+	if (ctx->filesystem_name)
+		json_add_string(&l, "filesystem", ctx->filesystem_name, -1);
+	json_add(&l, ",\"time\":%lld}\n", (long long) ctx->now);
+	problem_log_write(log, line, l.len);
+}
+
+/*
+ * The fields of the problem context which a problem's message uses
+ */
+#define PL_ERRCODE	0x0001
+#define PL_INO		0x0002
+#define PL_INO2		0x0004
+#define PL_DIR		0x0008
+#define PL_DIRENT	0x0010
+#define PL_BLK		0x0020
+#define PL_BLK2		0x0040
+#define PL_BLKCOUNT	0x0080
+#define PL_GROUP	0x0100
+#define PL_NUM		0x0200
+#define PL_NUM2		0x0400
+#define PL_CSUM		0x0800
+#define PL_STR		0x1000
+
+/*
+ * Find which fields the message refers to, following the expansions
+ * done by print_e2fsck_message().  The context often holds leftovers
+ * from earlier problems, and those don't belong in the log.
+ */
+static int message_fields(const char *msg)
+{
+	const char	*cp;
+	int		fields = 0;
+
+	for (cp = msg; *cp; cp++) {
+		if (cp[0] == '@' && cp[1]) {
+			cp++;
+			if (*cp == 'E')		/* Entry '%Dn' in %p (%i) */
+				fields |= PL_DIRENT | PL_INO;
+			else if (*cp == 'F')	/* for @i %i (%Q) is */
+				fields |= PL_INO | PL_DIR;
+			continue;
+		}
+		if (cp[0] != '%' || !cp[1])
+			continue;
+		cp++;
+		while (isdigit(*cp))
+			cp++;
+		switch (*cp) {
+		case 'I':
+		case 'p':
+			fields |= PL_INO;
+			break;
+		case 'D':
+			fields |= PL_DIRENT;
+			break;
+		case 'P':
+			fields |= PL_INO2 | PL_DIRENT;
+			break;
+		case 'Q':
+			fields |= PL_INO | PL_DIR;
+			break;
+		case 'b':
+			fields |= PL_BLK;
+			break;
+		case 'B':
+		case 'r':
+			fields |= PL_BLKCOUNT;
+			break;
+		case 'c':
+			fields |= PL_BLK2;
+			break;
+		case 'd':
+		case 'q':
+			fields |= PL_DIR;
+			break;
+		case 'g':
+			fields |= PL_GROUP;
+			break;
+		case 'i':
+			fields |= PL_INO;
+			break;
+		case 'j':
+			fields |= PL_INO2;
+			break;
+		case 'm':
+			fields |= PL_ERRCODE;
+			break;
+		case 'N':
+		case 't':
+		case 'U':
+		case 'X':
+			fields |= PL_NUM;
+			break;
+		case 'n':
+			fields |= PL_NUM2;
+			break;
+		case 's':
+			fields |= PL_STR;
+			break;
+		case 'x':
+		case 'y':
+			fields |= PL_CSUM;
+			break;
+		case '\0':
+			cp--;
+			break;
+		}
+	}
+	return fields;
+}
+
+void e2fsck_problem_log(e2fsck_t ctx, problem_t code, const char *desc,
+			struct problem_context *pctx, const char *action)
+{
+	char			line[PROBLEM_LOG_MAXLINE];
+	struct json_line	l = { line, 0, sizeof(line) - 2 };
+	int			fields;
+
+	if (!ctx->problem_log)
+		return;
+
+	fields = message_fields(desc);
+	json_add(&l, "{\"code\":\"0x%06x\"", code);
+	if (fields & PL_ERRCODE)
+		json_add(&l, ",\"errcode\":%ld", (long) pctx->errcode);
+	if (fields & PL_INO)
+		json_add(&l, ",\"ino\":%u", pctx->ino);
+	if (fields & PL_INO2)
+		json_add(&l, ",\"ino2\":%u", pctx->ino2);
+	if (fields & PL_DIR)
+		json_add(&l, ",\"dir\":%u", pctx->dir);
+	if ((fields & PL_DIRENT) && pctx->dirent)
+		json_add_string(&l, "name", pctx->dirent->name,
+				ext2fs_dirent_name_len(pctx->dirent));
+	if (fields & PL_BLK)
+		json_add(&l, ",\"blk\":%llu", (unsigned long long) pctx->blk);
+	if (fields & PL_BLK2)
+		json_add(&l, ",\"blk2\":%llu",
+			 (unsigned long long) pctx->blk2);
+	if (fields & PL_BLKCOUNT)
+		json_add(&l, ",\"blkcount\":%lld",
+			 (long long) pctx->blkcount);
+	if (fields & PL_GROUP)
+		json_add(&l, ",\"group\":%u", pctx->group);
+	if (fields & PL_NUM)
+		json_add(&l, ",\"num\":%llu", (unsigned long long) pctx->num);
+	if (fields & PL_NUM2)
+		json_add(&l, ",\"num2\":%llu",
+			 (unsigned long long) pctx->num2);
+	if (fields & PL_CSUM)
+		json_add(&l, ",\"csum1\":%u,\"csum2\":%u",
+			 pctx->csum1, pctx->csum2);
+	if ((fields & PL_STR) && pctx->str)
+		json_add_string(&l, "str", pctx->str, -1);
+	if (action)
+		json_add_string(&l, "action", action, -1);
+	json_add(&l, "}");
+	line[l.len++] = '\n';
+	problem_log_write(ctx->problem_log, line, l.len);
+}
+
+/*
+ * Write out what is left of the log, ending it with the exit status
+ * unless that is negative.
+ */
+void e2fsck_problem_log_close(e2fsck_t ctx, int exit_value)
+{
+	struct problem_log	*log = ctx->problem_log;
+	char			line[64];
+
+	if (!log)
+		return;
+	ctx->problem_log = NULL;
+
+	if (exit_value >= 0) {
+		snprintf(line, sizeof(line), "{\"exit\":%d}\n", exit_value);
+		problem_log_write(log, line, strlen(line));
+	}
+	problem_log_flush(log);
+#ifdef HAVE_PTHREAD_H
+	if (log->threaded) {
+		pthread_mutex_lock(&log->lock);
+		log->done = 1;
+		pthread_cond_broadcast(&log->cond);
+		pthread_mutex_unlock(&log->lock);
+		pthread_join(log->thread, NULL);
+	}
+	pthread_cond_destroy(&log->cond);
+	pthread_mutex_destroy(&log->lock);
+#endif
+	fclose(log->f);
+	ext2fs_free_mem(&log->buf);
+	ext2fs_free_mem(&log->spare);
+	ext2fs_free_mem(&log);
+}
@@ -117,8 +117,26 @@ struct jbd2_revoke_table_s
 	int		  hash_size;
 	int		  hash_shift;
 	struct list_head *hash_table;
+#ifndef __KERNEL__
+	/* Number of records in the table, so that it can be grown */
+	int		  hash_count;
+#endif
 };
 
+#ifndef __KERNEL__
+/*
+ * During recovery e2fsck starts out with a modest hash table, but a
+ * journal may contain millions of revoke records, and with a fixed
+ * table size every lookup ends up walking a long chain.  So we double
+ * the size of the table whenever the average chain length exceeds
+ * REVOKE_MAX_LOAD, up to REVOKE_MAX_HASH_SHIFT.
+ */
+#define REVOKE_MAX_LOAD		2
+#define REVOKE_MAX_HASH_SHIFT	24
+
+static void grow_revoke_table(struct jbd2_revoke_table_s *table);
+#endif
+
 
 #ifdef __KERNEL__
 static void write_one_revoke_record(journal_t *, transaction_t *,
@@ -155,6 +173,11 @@ repeat:
 	spin_lock(&journal->j_revoke_lock);
 	list_add(&record->hash, hash_list);
 	spin_unlock(&journal->j_revoke_lock);
+#ifndef __KERNEL__
+	if (++journal->j_revoke->hash_count >
+	    journal->j_revoke->hash_size * REVOKE_MAX_LOAD)
+		grow_revoke_table(journal->j_revoke);
+#endif
 	return 0;
 
 oom:
@@ -246,11 +269,54 @@ static struct jbd2_revoke_table_s *journal_init_revoke_table(int hash_size)
 
 	for (tmp = 0; tmp < hash_size; tmp++)
 		INIT_LIST_HEAD(&table->hash_table[tmp]);
+#ifndef __KERNEL__
+	table->hash_count = 0;
+#endif
 
 out:
 	return table;
 }
 
+#ifndef __KERNEL__
+/*
+ * Double the size of the hash table, and move all of the records to
+ * their new hash chains.  If we can't get the memory, we just keep
+ * on using the old table.
+ */
+static void grow_revoke_table(struct jbd2_revoke_table_s *table)
+{
+	struct list_head *new_table, *hash_list;
+	struct jbd2_revoke_record_s *record;
+	int new_shift = table->hash_shift + 1;
+	int new_size = table->hash_size << 1;
+	int i;
+
+	if (new_shift > REVOKE_MAX_HASH_SHIFT)
+		return;
+	new_table = kmalloc(new_size * sizeof(struct list_head), GFP_KERNEL);
+	if (!new_table)
+		return;
+	for (i = 0; i < new_size; i++)
+		INIT_LIST_HEAD(&new_table[i]);
+
+	for (i = 0; i < table->hash_size; i++) {
+		hash_list = &table->hash_table[i];
+		while (!list_empty(hash_list)) {
+			record = list_entry(hash_list->next,
+					    struct jbd2_revoke_record_s, hash);
+			list_del(&record->hash);
+			list_add(&record->hash,
+				 &new_table[hash_64(record->blocknr,
+						    new_shift)]);
+		}
+	}
+	kfree(table->hash_table);
+	table->hash_table = new_table;
+	table->hash_size = new_size;
+	table->hash_shift = new_shift;
+}
+#endif
+
 static void journal_destroy_revoke_table(struct jbd2_revoke_table_s *table)
 {
 	int i;
@@ -549,8 +615,8 @@ void journal_write_revoke_records(journal_t *journal,
 		hash_list = &revoke->hash_table[i];
 
 		while (!list_empty(hash_list)) {
-			record = (struct jbd2_revoke_record_s *)
-				hash_list->next;
+			record = list_entry(hash_list->next,
+					    struct jbd2_revoke_record_s, hash);
 			write_one_revoke_record(journal, transaction, log_bufs,
 						&descriptor, &offset,
 						record, write_op);
@@ -763,4 +829,91 @@ void journal_clear_revoke(journal_t *journal)
 			kmem_cache_free(jbd2_revoke_record_cache, record);
 		}
 	}
+#ifndef __KERNEL__
+	revoke->hash_count = 0;
+#endif
+}
+
+#ifdef TEST_PROGRAM
+#include <stdio.h>
+
+e2fsck_t e2fsck_global_ctx;
+
+void fatal_error(e2fsck_t ctx EXT2FS_ATTR((unused)), const char *msg)
+{
+	if (msg)
+		fprintf(stderr, "fatal: %s\n", msg);
+	exit(1);
+}
+
+/*
+ * Insert a large number of revoke records, check that the hash table
+ * grew to keep the chains short, and that every record (and none of
+ * the blocks in between) can be found again.
+ */
+int main(int argc, char **argv)
+{
+	journal_t	journal;
+	unsigned long long blk, num = 200000;
+	int		retval, errors = 0;
+
+	if (argc > 1)
+		num = strtoull(argv[1], NULL, 0);
+
+	memset(&journal, 0, sizeof(journal));
+	if (journal_init_revoke_caches() ||
+	    journal_init_revoke(&journal, 1024)) {
+		fprintf(stderr, "tst_revoke: couldn't create revoke table\n");
+		exit(1);
+	}
+
+	for (blk = 0; blk < num; blk++) {
+		retval = journal_set_revoke(&journal, blk * 2,
+					    (tid_t) (blk & 0xff));
+		if (retval) {
+			fprintf(stderr, "tst_revoke: set_revoke(%llu) "
+				"failed: %d\n", blk * 2, retval);
+			exit(1);
+		}
+	}
+	/* Revoking a block a second time only updates the sequence */
+	for (blk = 0; blk < num; blk += 7)
+		journal_set_revoke(&journal, blk * 2, 0x100);
+
+	if ((unsigned long long) journal.j_revoke->hash_count != num ||
+	    (journal.j_revoke->hash_count >
+	     journal.j_revoke->hash_size * REVOKE_MAX_LOAD &&
+	     journal.j_revoke->hash_size < (1 << REVOKE_MAX_HASH_SHIFT))) {
+		printf("hash table has %d buckets for %d records\n",
+		       journal.j_revoke->hash_size,
+		       journal.j_revoke->hash_count);
+		errors++;
+	}
+
+	for (blk = 0; blk < num; blk++) {
+		tid_t seq = (blk % 7) ? (tid_t) (blk & 0xff) : 0x100;
+
+		if (!journal_test_revoke(&journal, blk * 2, seq)) {
+			if (errors++ < 10)
+				printf("block %llu not revoked\n", blk * 2);
+		}
+		if (journal_test_revoke(&journal, blk * 2 + 1, seq)) {
+			if (errors++ < 10)
+				printf("block %llu wrongly revoked\n",
+				       blk * 2 + 1);
+		}
+	}
+
+	journal_clear_revoke(&journal);
+	if (journal_test_revoke(&journal, 0, 0x100)) {
+		printf("revoke table not cleared\n");
+		errors++;
+	}
+	journal_destroy_revoke(&journal);
+	journal_destroy_revoke_caches();
+
+	printf("tst_revoke: %llu records, %s\n", num,
+	       errors ? "FAILED" : "ok");
+	return errors ? 1 : 0;
 }
+#endif /* TEST_PROGRAM */
@@ -0,0 +1,350 @@
+/*
+ * stats.c --- export e2fsck resource usage as JSON
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ *
+ * When e2fsck is run with "-E stats=<file>", each call to
+ * print_resource_track() also records the wall clock time, CPU time
+ * and I/O counters of the pass it is reporting on, and samples the
+ * memory used by e2fsck's large data structures.  At the end of the
+ * run the collected records are written out as a single JSON object,
+ * so that the cost of a check can be tracked across many systems.
+ */
+
+#include "config.h"
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_MALLOC_H
+#include <malloc.h>
+#endif
+#ifdef HAVE_GETRUSAGE
+#include <sys/resource.h>
+#endif
+
+#include "e2fsck.h"
+#include "../version.h"
+
+#ifdef RESOURCE_TRACK
+
+struct stats_io {
+	unsigned long long	bytes_read;
+	unsigned long long	bytes_written;
+	unsigned long long	read_ops;
+	unsigned long long	write_ops;
+	unsigned long long	cache_hits;
+	unsigned long long	cache_misses;
+	unsigned long long	readahead_bytes;
+};
+
+struct stats_pass {
+	char			*name;
+	double			wall, user, sys;
+	struct stats_io		io;
+};
+
+/*
+ * The data structures whose memory usage we sample.
+ */
+enum stats_mem {
+	MEM_INODE_USED_MAP,
+	MEM_INODE_BAD_MAP,
+	MEM_INODE_DIR_MAP,
+	MEM_INODE_BB_MAP,
+	MEM_INODE_IMAGIC_MAP,
+	MEM_INODE_REG_MAP,
+	MEM_INODES_TO_REBUILD,
+	MEM_BLOCK_FOUND_MAP,
+	MEM_BLOCK_DUP_MAP,
+	MEM_BLOCK_EA_MAP,
+	MEM_BLOCK_METADATA_MAP,
+	MEM_INODE_COUNT,
+	MEM_INODE_LINK_INFO,
+	MEM_DIR_INFO,
+	MEM_DX_DIR_INFO,
+	MEM_DBLIST,
+	MEM_HEAP_IN_USE,
+	MEM_MAX
+};
+
+static const char *stats_mem_names[MEM_MAX] = {
+	"inode_used_map",
+	"inode_bad_map",
+	"inode_dir_map",
+	"inode_bb_map",
+	"inode_imagic_map",
+	"inode_reg_map",
+	"inodes_to_rebuild",
+	"block_found_map",
+	"block_dup_map",
+	"block_ea_map",
+	"block_metadata_map",
+	"inode_count",
+	"inode_link_info",
+	"dir_info",
+	"dx_dir_info",
+	"dblist",
+	"heap_in_use",
+};
+
+struct e2fsck_stats {
+	int			num_passes;
+	int			max_passes;
+	struct stats_pass	*passes;
+	unsigned long long	peak_mem[MEM_MAX];
+};
+
+static double tv_diff(struct timeval *tv1, struct timeval *tv2)
+{
+	return ((tv1->tv_sec - tv2->tv_sec) +
+		((double) (tv1->tv_usec - tv2->tv_usec)) / 1000000);
+}
+
+static unsigned long long bmap_mem(ext2fs_generic_bitmap bmap)
+{
+	return ext2fs_get_generic_bmap_mem_usage(bmap);
+}
+
+static void sample_memory(e2fsck_t ctx, struct e2fsck_stats *stats)
+{
+	unsigned long long mem[MEM_MAX];
+	int i;
+#if defined(HAVE_MALLINFO2)
+	struct mallinfo2 malloc_info;
+#elif defined(HAVE_MALLINFO)
+	struct mallinfo	malloc_info;
+#endif
+
+	memset(mem, 0, sizeof(mem));
+	mem[MEM_INODE_USED_MAP] = bmap_mem(ctx->inode_used_map);
+	mem[MEM_INODE_BAD_MAP] = bmap_mem(ctx->inode_bad_map);
+	mem[MEM_INODE_DIR_MAP] = bmap_mem(ctx->inode_dir_map);
+	mem[MEM_INODE_BB_MAP] = bmap_mem(ctx->inode_bb_map);
+	mem[MEM_INODE_IMAGIC_MAP] = bmap_mem(ctx->inode_imagic_map);
+	mem[MEM_INODE_REG_MAP] = bmap_mem(ctx->inode_reg_map);
+	mem[MEM_INODES_TO_REBUILD] = bmap_mem(ctx->inodes_to_rebuild);
+	mem[MEM_BLOCK_FOUND_MAP] = bmap_mem(ctx->block_found_map);
+	mem[MEM_BLOCK_DUP_MAP] = bmap_mem(ctx->block_dup_map);
+	mem[MEM_BLOCK_EA_MAP] = bmap_mem(ctx->block_ea_map);
+	mem[MEM_BLOCK_METADATA_MAP] = bmap_mem(ctx->block_metadata_map);
+	mem[MEM_INODE_COUNT] = ext2fs_get_icount_mem_usage(ctx->inode_count);
+	mem[MEM_INODE_LINK_INFO] =
+		ext2fs_get_icount_mem_usage(ctx->inode_link_info);
+	if (ctx->dir_info)
+		mem[MEM_DIR_INFO] = (unsigned long long)
+			e2fsck_get_num_dirinfo(ctx) * sizeof(struct dir_info);
+	mem[MEM_DX_DIR_INFO] = (unsigned long long) ctx->dx_dir_info_size *
+		sizeof(struct dx_dir_info);
+	if (ctx->fs)
+		mem[MEM_DBLIST] = ext2fs_get_dblist_mem_usage(ctx->fs->dblist);
+#if defined(HAVE_MALLINFO2)
+	malloc_info = mallinfo2();
+	mem[MEM_HEAP_IN_USE] = malloc_info.uordblks + malloc_info.hblkhd;
+#elif defined(HAVE_MALLINFO)
+	malloc_info = mallinfo();
+	mem[MEM_HEAP_IN_USE] = (unsigned long) malloc_info.uordblks +
+		(unsigned long) malloc_info.hblkhd;
+#endif
+
+	for (i = 0; i < MEM_MAX; i++)
+		if (mem[i] > stats->peak_mem[i])
+			stats->peak_mem[i] = mem[i];
+}
+
+static void io_delta(struct stats_io *io, struct resource_track *track,
+		     io_channel channel)
+{
+	io_stats	cur = 0;
+
+	memset(io, 0, sizeof(struct stats_io));
+	if (channel && channel->manager && channel->manager->get_stats)
+		channel->manager->get_stats(channel, &cur);
+	if (!cur)
+		return;
+	io->bytes_read = cur->bytes_read - track->bytes_read;
+	io->bytes_written = cur->bytes_written - track->bytes_written;
+	if (cur->num_fields < 7)
+		return;
+	io->read_ops = cur->read_ops - track->read_ops;
+	io->write_ops = cur->write_ops - track->write_ops;
+	io->cache_hits = cur->cache_hits - track->cache_hits;
+	io->cache_misses = cur->cache_misses - track->cache_misses;
+	io->readahead_bytes = cur->readahead_bytes - track->readahead_bytes;
+}
+
+/*
+ * Record the resource usage since track was initialized.  A NULL
+ * desc denotes the summary for the whole run.  Records without an
+ * I/O channel are only used to sample memory usage.
+ */
+void e2fsck_stats_record(e2fsck_t ctx, const char *desc,
+			 struct resource_track *track, io_channel channel)
+{
+	struct e2fsck_stats	*stats = ctx->stats;
+	struct stats_pass	*pass;
+	struct timeval		time_end;
+#ifdef HAVE_GETRUSAGE
+	struct rusage		r;
+#endif
+	errcode_t		retval;
+
+	if (!stats) {
+		retval = ext2fs_get_memzero(sizeof(struct e2fsck_stats),
+					    &stats);
+		if (retval)
+			return;
+		ctx->stats = stats;
+	}
+
+	sample_memory(ctx, stats);
+	if (!channel)
+		return;
+
+	if (stats->num_passes >= stats->max_passes) {
+		retval = ext2fs_resize_mem(stats->max_passes *
+					   sizeof(struct stats_pass),
+					   (stats->max_passes + 16) *
+					   sizeof(struct stats_pass),
+					   &stats->passes);
+		if (retval)
+			return;
+		stats->max_passes += 16;
+	}
+	pass = &stats->passes[stats->num_passes++];
+	memset(pass, 0, sizeof(struct stats_pass));
+	pass->name = desc ? string_copy(ctx, desc, 0) : NULL;
+
+	gettimeofday(&time_end, 0);
+	pass->wall = tv_diff(&time_end, &track->time_start);
+#ifdef HAVE_GETRUSAGE
+	getrusage(RUSAGE_SELF, &r);
+	pass->user = tv_diff(&r.ru_utime, &track->user_start);
+	pass->sys = tv_diff(&r.ru_stime, &track->system_start);
+#endif
+	io_delta(&pass->io, track, channel);
+}
+
+static void print_json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; s && *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char) *s < 0x20)
+			fprintf(f, "\\u%04x", (unsigned char) *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+static void print_json_pass(FILE *f, struct stats_pass *pass,
+			    const char *indent)
+{
+	unsigned long long lookups = pass->io.cache_hits +
+		pass->io.cache_misses;
+
+	fprintf(f, "{\n");
+	if (pass->name) {
+		fprintf(f, "%s  \"name\": ", indent);
+		print_json_string(f, pass->name);
+		fprintf(f, ",\n");
+	}
+	fprintf(f, "%s  \"wall_sec\": %.6f,\n", indent, pass->wall);
+	fprintf(f, "%s  \"user_sec\": %.6f,\n", indent, pass->user);
+	fprintf(f, "%s  \"sys_sec\": %.6f,\n", indent, pass->sys);
+	fprintf(f, "%s  \"bytes_read\": %llu,\n", indent,
+		pass->io.bytes_read);
+	fprintf(f, "%s  \"bytes_written\": %llu,\n", indent,
+		pass->io.bytes_written);
+	fprintf(f, "%s  \"read_ops\": %llu,\n", indent, pass->io.read_ops);
+	fprintf(f, "%s  \"write_ops\": %llu,\n", indent, pass->io.write_ops);
+	fprintf(f, "%s  \"cache_hits\": %llu,\n", indent,
+		pass->io.cache_hits);
+	fprintf(f, "%s  \"cache_misses\": %llu,\n", indent,
+		pass->io.cache_misses);
+	fprintf(f, "%s  \"cache_hit_pct\": %.2f,\n", indent,
+		lookups ? 100.0 * pass->io.cache_hits / lookups : 0.0);
+	fprintf(f, "%s  \"readahead_bytes\": %llu\n", indent,
+		pass->io.readahead_bytes);
+	fprintf(f, "%s}", indent);
+}
+
+/*
+ * Write out the collected statistics to the file given with
+ * "-E stats=<file>".
+ */
+void e2fsck_stats_write(e2fsck_t ctx)
+{
+	struct e2fsck_stats	*stats = ctx->stats;
+	struct stats_pass	*total = NULL;
+	FILE			*f;
+	int			i, first;
+#ifdef HAVE_GETRUSAGE
+	struct rusage		r;
+#endif
+
+	if (!stats || !ctx->stats_fn)
+		return;
+
+	f = fopen(ctx->stats_fn, "w");
+	if (!f) {
+		com_err(ctx->program_name, errno,
+			_("while opening %s for writing statistics"),
+			ctx->stats_fn);
+		return;
+	}
+
+	fprintf(f, "{\n  \"program\": \"e2fsck\",\n");
+	fprintf(f, "  \"version\": \"%s\",\n", E2FSPROGS_VERSION);
+	fprintf(f, "  \"device\": ");
+	print_json_string(f, ctx->filesystem_name);
+	fprintf(f, ",\n  \"passes\": [");
+	for (i = 0, first = 1; i < stats->num_passes; i++) {
+		if (!stats->passes[i].name) {
+			total = &stats->passes[i];
+			continue;
+		}
+		fprintf(f, "%s\n    ", first ? "" : ",");
+		print_json_pass(f, &stats->passes[i], "    ");
+		first = 0;
+	}
+	fprintf(f, "\n  ],\n");
+	if (total) {
+		fprintf(f, "  \"total\": ");
+		print_json_pass(f, total, "  ");
+		fprintf(f, ",\n");
+	}
+	fprintf(f, "  \"peak_memory\": {\n");
+#ifdef HAVE_GETRUSAGE
+	getrusage(RUSAGE_SELF, &r);
+	fprintf(f, "    \"max_rss_kb\": %ld,\n", r.ru_maxrss);
+#endif
+	for (i = 0; i < MEM_MAX; i++)
+		fprintf(f, "    \"%s\": %llu%s\n", stats_mem_names[i],
+			stats->peak_mem[i], (i == MEM_MAX - 1) ? "" : ",");
+	fprintf(f, "  }\n}\n");
+
+	if (fclose(f))
+		com_err(ctx->program_name, errno,
+			_("while writing statistics to %s"), ctx->stats_fn);
+}
+
+void e2fsck_stats_free(e2fsck_t ctx)
+{
+	struct e2fsck_stats	*stats = ctx->stats;
+	int			i;
+
+	if (!stats)
+		return;
+	for (i = 0; i < stats->num_passes; i++)
+		if (stats->passes[i].name)
+			ext2fs_free_mem(&stats->passes[i].name);
+	ext2fs_free_mem(&stats->passes);
+	ext2fs_free_mem(&ctx->stats);
+}
+
+#endif /* RESOURCE_TRACK */
@@ -329,6 +329,52 @@ static int is_on_batt(void)
 	return 0;
 }
 
+/*
+ * With -E verify_only, check_if_skip() calls this in place of skipping
+ * the check: sweep the metadata checksums and structures, and exit
+ * with E2FSCK_OK if they are fine.  Otherwise a full check is forced.
+ */
+static void check_verify_only(e2fsck_t ctx)
+{
+	ext2_filsys fs = ctx->fs;
+	const char *reason = NULL;
+	dgrp_t skipped;
+	int problems;
+
+	problems = e2fsck_verify_metadata(ctx);
+	if (ctx->flags & E2F_FLAG_SIGNAL_MASK)
+		fatal_error(ctx, 0);
+	if (problems < 0)
+		reason = _(" could not be verified");
+	else if (problems)
+		reason = _(" has metadata that failed verification");
+	skipped = e2fsck_verify_snapshot_done(ctx, reason == NULL);
+	if (reason) {
+		log_out(ctx, "%s", ctx->device_name);
+		log_out(ctx, "%s", reason);
+		log_out(ctx, "%s", _(", check forced.\n"));
+		ctx->options |= E2F_OPT_FORCE;
+		return;
+	}
+
+	/* Groups skipped as unchanged were trusted, not verified */
+	log_out(ctx, "%s: ", ctx->device_name);
+	if (skipped)
+		log_out(ctx, _("clean, %u unchanged group(s) not verified"),
+			skipped);
+	else
+		log_out(ctx, "%s", _("clean, metadata verified"));
+	log_out(ctx, _(", %u/%u files, %llu/%llu blocks\n"),
+		fs->super->s_inodes_count - fs->super->s_free_inodes_count,
+		fs->super->s_inodes_count,
+		ext2fs_blocks_count(fs->super) -
+		ext2fs_free_blocks_count(fs->super),
+		ext2fs_blocks_count(fs->super));
+	ext2fs_close_free(&ctx->fs);
+	e2fsck_free_context(ctx);
+	exit(FSCK_OK);
+}
+
 /*
  * This routine checks to see if a filesystem can be skipped; if so,
  * it will exit with E2FSCK_OK.  Under some conditions it will print a
@@ -404,6 +450,12 @@ static void check_if_skip(e2fsck_t ctx)
 		return;
 	}
 
+	/* Nothing else forces a check, so the sweep decides */
+	if (ctx->options & E2F_OPT_VERIFY_ONLY) {
+		check_verify_only(ctx);
+		return;
+	}
+
 	/*
 	 * Update the global counts from the block group counts.  This
 	 * is needed since modern kernels don't update the global
@@ -729,12 +781,40 @@ static void parse_extended_opts(e2fsck_t ctx, const char *opts)
 			else
 				ctx->log_fn = string_copy(ctx, arg, 0);
 			continue;
+		} else if (strcmp(token, "stats") == 0) {
+#ifdef RESOURCE_TRACK
+			if (!arg)
+				extended_usage++;
+			else
+				ctx->stats_fn = string_copy(ctx, arg, 0);
+#else
+			fprintf(stderr, "%s",
+				_("The stats option requires e2fsck to be "
+				  "built with resource tracking.\n"));
+			extended_usage++;
+#endif
+			continue;
+		} else if (strcmp(token, "snapshot") == 0) {
+			if (!arg)
+				extended_usage++;
+			else
+				ctx->snapshot_fn = string_copy(ctx, arg, 0);
+			continue;
+		} else if (strcmp(token, "problem_log") == 0) {
+			if (!arg)
+				extended_usage++;
+			else
+				ctx->problem_log_fn = string_copy(ctx, arg, 0);
+			continue;
 		} else if (strcmp(token, "bmap2extent") == 0) {
 			ctx->options |= E2F_OPT_CONVERT_BMAP;
 			continue;
 		} else if (strcmp(token, "fixes_only") == 0) {
 			ctx->options |= E2F_OPT_FIXES_ONLY;
 			continue;
+		} else if (strcmp(token, "verify_only") == 0) {
+			ctx->options |= E2F_OPT_VERIFY_ONLY;
+			continue;
 		} else {
 			fprintf(stderr, _("Unknown extended option: %s\n"),
 				token);
@@ -760,6 +840,12 @@ static void parse_extended_opts(e2fsck_t ctx, const char *opts)
 		fputs(_("\treadahead_kb=<buffer size>\n"), stderr);
 		fputs("\tbmap2extent\n", stderr);
 		fputs("\tfixes_only\n", stderr);
+		fputs("\tverify_only\n", stderr);
+#ifdef RESOURCE_TRACK
+		fputs(_("\tstats=<statistics file>\n"), stderr);
+#endif
+		fputs(_("\tsnapshot=<snapshot file>\n"), stderr);
+		fputs(_("\tproblem_log=<problem log file>\n"), stderr);
 		fputc('\n', stderr);
 		exit(1);
 	}
@@ -1011,6 +1097,11 @@ static errcode_t PRS(int argc, char *argv[], e2fsck_t *ret_ctx)
 			_("The -E bmap2extent and fixes_only options are incompatible."));
 		fatal_error(ctx, 0);
 	}
+	if (ctx->snapshot_fn && !(ctx->options & E2F_OPT_VERIFY_ONLY)) {
+		com_err(ctx->program_name, 0, "%s",
+			_("The -E snapshot option requires -E verify_only."));
+		fatal_error(ctx, 0);
+	}
 
 	if ((cp = getenv("E2FSCK_CONFIG")) != NULL)
 		config_fn[0] = cp;
@@ -1895,6 +1986,8 @@ no_journal:
 		goto restart;
 	}
 
+	print_problem_summary(ctx);
+
 #ifdef MTRACE
 	mtrace_print("Cleanup");
 #endif
@@ -1978,12 +2071,14 @@ no_journal:
 		show_stats(ctx);
 
 	print_resource_track(ctx, NULL, &ctx->global_rtrack, ctx->fs->io);
+	e2fsck_stats_write(ctx);
 
 	ext2fs_close_free(&ctx->fs);
 	free(ctx->journal_name);
 
 	if (ctx->logf)
 		fprintf(ctx->logf, "Exit status: %d\n", exit_value);
+	e2fsck_problem_log_close(ctx, exit_value);
 	e2fsck_free_context(ctx);
 	remove_error_table(&et_ext2_error_table);
 	remove_error_table(&et_prof_error_table);
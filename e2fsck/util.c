@@ -85,6 +85,7 @@ out:
 		longjmp(ctx->abort_loc, 1);
 	if (ctx->logf)
 		fprintf(ctx->logf, "Exit status: %d\n", exit_value);
+	e2fsck_problem_log_close(ctx, exit_value);
 	exit(exit_value);
 }
 
@@ -368,6 +369,7 @@ void preenhalt(e2fsck_t ctx)
 		ext2fs_mark_super_dirty(fs);
 		ext2fs_close_free(&fs);
 	}
+	e2fsck_problem_log_close(ctx, FSCK_UNCORRECTED);
 	exit(FSCK_UNCORRECTED);
 }
 
@@ -394,12 +396,22 @@ void init_resource_track(struct resource_track *track, io_channel channel)
 #endif
 	track->bytes_read = 0;
 	track->bytes_written = 0;
+	track->read_ops = track->write_ops = 0;
+	track->cache_hits = track->cache_misses = 0;
+	track->readahead_bytes = 0;
 	if (channel && channel->manager && channel->manager->get_stats)
 		channel->manager->get_stats(channel, &io_start);
 	if (io_start) {
 		track->bytes_read = io_start->bytes_read;
 		track->bytes_written = io_start->bytes_written;
 	}
+	if (io_start && io_start->num_fields >= 7) {
+		track->read_ops = io_start->read_ops;
+		track->write_ops = io_start->write_ops;
+		track->cache_hits = io_start->cache_hits;
+		track->cache_misses = io_start->cache_misses;
+		track->readahead_bytes = io_start->readahead_bytes;
+	}
 }
 
 #ifdef __GNUC__
@@ -426,6 +438,9 @@ void print_resource_track(e2fsck_t ctx, const char *desc,
 #endif
 	struct timeval time_end;
 
+	if (ctx->stats_fn)
+		e2fsck_stats_record(ctx, desc, track, channel);
+
 	if ((desc && !(ctx->options & E2F_OPT_TIME2)) ||
 	    (!desc && !(ctx->options & E2F_OPT_TIME)))
 		return;
@@ -434,7 +449,7 @@ void print_resource_track(e2fsck_t ctx, const char *desc,
 	gettimeofday(&time_end, 0);
 
 	if (desc)
-		log_out(ctx, "%s: ", desc);
+		log_out(ctx, "%s: ", _(desc));
 
 #ifdef HAVE_MALLINFO
 #define kbytes(x)	(((unsigned long)(x) + 1023) / 1024)
@@ -466,7 +481,7 @@ void print_resource_track(e2fsck_t ctx, const char *desc,
 		unsigned long long bytes_written = 0;
 
 		if (desc)
-			log_out(ctx, "%s: ", desc);
+			log_out(ctx, "%s: ", _(desc));
 
 		channel->manager->get_stats(channel, &delta);
 		if (delta) {
@@ -884,3 +899,80 @@ unsigned long long get_memory_size(void)
 	return 0;
 #endif
 }
+
+/*
+ * Number of threads to use for a parallel part of the check: the given
+ * e2fsck.conf relation, or one per online CPU.  Workers read through
+ * their own unix_io channel, so other I/O managers get a single thread.
+ */
+int e2fsck_worker_threads(e2fsck_t ctx, const char *relation, int max)
+{
+	int threads = 0;
+
+#ifdef HAVE_PTHREAD_H
+	if (ctx->fs->io->manager != unix_io_manager ||
+	    (ctx->fs->flags & EXT2_FLAG_IMAGE_FILE))
+		return 1;
+
+	profile_get_integer(ctx->profile, "options", relation, 0, 0, &threads);
+#ifdef _SC_NPROCESSORS_ONLN
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+#endif
+	if (threads < 1)
+		threads = 1;
+	if (threads > max)
+		threads = max;
+	return threads;
+}
+
+/*
+ * Make a copy of the file system handle for a worker thread, with an
+ * I/O channel (and inode cache) of its own.  The copy may only be used
+ * for reading, and only while the main handle is not being modified.
+ * Writes made through ctx->fs must be flushed before workers start.
+ */
+errcode_t e2fsck_open_worker_fs(e2fsck_t ctx, ext2_filsys *ret_fs)
+{
+	ext2_filsys	fs = ctx->fs, wfs;
+	errcode_t	retval;
+	int		flags = 0;
+
+	retval = ext2fs_get_mem(sizeof(struct struct_ext2_filsys), &wfs);
+	if (retval)
+		return retval;
+	*wfs = *fs;
+	wfs->icache = NULL;
+	if (fs->flags & EXT2_FLAG_DIRECT_IO)
+		flags |= IO_FLAG_DIRECT_IO;
+	retval = unix_io_manager->open(fs->device_name, flags, &wfs->io);
+	if (retval)
+		goto errout;
+	if (ctx->io_options) {
+		retval = io_channel_set_options(wfs->io, ctx->io_options);
+		if (retval)
+			goto errout_io;
+	}
+	retval = io_channel_set_blksize(wfs->io, fs->blocksize);
+	if (retval)
+		goto errout_io;
+	*ret_fs = wfs;
+	return 0;
+
+errout_io:
+	io_channel_close(wfs->io);
+errout:
+	ext2fs_free_mem(&wfs);
+	return retval;
+}
+
+void e2fsck_close_worker_fs(e2fsck_t ctx, ext2_filsys wfs)
+{
+	if (wfs->icache)
+		ext2fs_free_inode_cache(wfs->icache);
+	if (wfs->badblocks && wfs->badblocks != ctx->fs->badblocks)
+		ext2fs_badblocks_list_free(wfs->badblocks);
+	io_channel_close(wfs->io);
+	ext2fs_free_mem(&wfs);
+}
@@ -0,0 +1,1073 @@
+/*
+ * verify.c --- quick verification of metadata checksums and structure
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ *
+ * With "-E verify_only", e2fsck first reads the file system's metadata
+ * and checks everything that can be checked without cross-referencing:
+ * the superblock and group descriptor checksums, the bitmap checksums,
+ * every in-use inode's checksum, and the checksum and on-disk structure
+ * of every extent tree block, directory block and extended attribute
+ * block.  Passes 1 to 5 are only run if something is wrong.
+ *
+ * The inode tables are scanned one block group at a time.  The blocks
+ * found there are then read in physical block order, one level of the
+ * extent trees at a time.  Both steps are split over a pool of threads
+ * when we have them, each reading the device through its own channel,
+ * and reading ahead of where it currently is.  Problems are collected
+ * and reported at the end, in a stable order.
+ *
+ * With "-E snapshot=<file>", a digest of each group's descriptor and of
+ * the in-use part of its inode table is saved after a clean run.  On the
+ * next run, a group whose digests still match has its inode table read
+ * only to recompute them; the blocks its inodes point to are not read
+ * again.  Changing a file or directory changes its inode, and so the
+ * digest of its group, so on a file system where few groups change
+ * between checks most of the random reads are avoided.  Any problem
+ * found throws the snapshot away.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#include "e2fsck.h"
+#include "problem.h"
+
+#define VERIFY_MAX_THREADS	16
+#define VERIFY_ITABLE_BLOCKS	64	/* inode scan buffer */
+#define VERIFY_RUN_BLOCKS	256	/* largest single read */
+#define VERIFY_CHUNK		256	/* objects handed out at a time */
+#define VERIFY_READAHEAD	4	/* chunks to read ahead */
+
+/* Ends the scan of a single block group */
+#define VERIFY_GROUP_DONE	EXT2_ET_CANCEL_REQUESTED
+
+#define VERIFY_SNAP_MAGIC	0x53563245	/* "E2VS" */
+#define VERIFY_SNAP_VERSION	1
+
+/* Header of the snapshot file; everything in it is little endian */
+struct verify_snap_header {
+	__u32	vs_magic;
+	__u32	vs_version;
+	__u8	vs_uuid[16];
+	__u64	vs_blocks_count;
+	__u32	vs_inodes_count;
+	__u32	vs_groups;
+	__u32	vs_log_block_size;
+	__u32	vs_mkfs_time;
+	__u32	vs_pad;
+	__u32	vs_crc;		/* of the header and the group records */
+};
+
+/* One per block group, following the header */
+struct verify_snap_group {
+	__u32	vg_desc_crc;	/* the whole group descriptor */
+	__u32	vg_itable_crc;	/* the in-use part of the inode table */
+	__u16	vg_flags;
+	__u16	vg_checksum;
+};
+
+struct verify_snapshot {
+	struct verify_snap_group	*old;	/* as of the last clean run */
+	struct verify_snap_group	*cur;	/* as found by this run */
+	dgrp_t				skipped;
+};
+
+enum verify_type {
+	VERIFY_BLOCK_BITMAP,
+	VERIFY_INODE_BITMAP,
+	VERIFY_EXTENT,		/* extent tree block */
+	VERIFY_EXTENT_DIR,	/* extent tree block of a directory */
+	VERIFY_DIR,		/* run of directory blocks */
+	VERIFY_EA		/* extended attribute block */
+};
+
+struct verify_obj {
+	blk64_t		blk;
+	ext2_ino_t	ino;		/* owner, or group of a bitmap */
+	__u32		len;
+	__u16		type;
+	__u16		depth;		/* expected extent tree depth */
+};
+
+struct verify_list {
+	struct verify_obj	*objs;
+	size_t			count;
+	size_t			size;
+};
+
+struct verify_bad {
+	problem_t	code;
+	__u32		num;		/* inode or group */
+	blk64_t		blk;
+	errcode_t	err;
+};
+
+struct verify_ctx {
+	e2fsck_t		ctx;
+	int			threads;
+	unsigned long		next;	/* next group or chunk to hand out */
+	unsigned long		total;
+	struct verify_list	*work;	/* objects of the current round */
+	struct verify_bad	*bad;
+	size_t			bad_count;
+	size_t			bad_size;
+	errcode_t		retval;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		lock;
+#endif
+};
+
+struct verify_worker {
+	struct verify_ctx	*vc;
+	ext2_filsys		fs;
+	void			(*func)(struct verify_worker *);
+	struct verify_list	out;	/* objects for the next round */
+	char			*buf;
+#ifdef HAVE_PTHREAD_H
+	pthread_t		thread;
+#endif
+};
+
+static void verify_lock(struct verify_ctx *vc)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&vc->lock);
+#endif
+}
+
+static void verify_unlock(struct verify_ctx *vc)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&vc->lock);
+#endif
+}
+
+static int verify_stop(struct verify_ctx *vc)
+{
+	return vc->retval || (vc->ctx->flags & E2F_FLAG_SIGNAL_MASK);
+}
+
+static void report_bad(struct verify_ctx *vc, problem_t code, __u32 num,
+		       blk64_t blk, errcode_t err)
+{
+	errcode_t retval;
+
+	verify_lock(vc);
+	if (vc->bad_count == vc->bad_size) {
+		retval = ext2fs_resize_mem(0, (vc->bad_size + 64) *
+					   sizeof(struct verify_bad), &vc->bad);
+		if (retval) {
+			vc->retval = retval;
+			goto out;
+		}
+		vc->bad_size += 64;
+	}
+	vc->bad[vc->bad_count].code = code;
+	vc->bad[vc->bad_count].num = num;
+	vc->bad[vc->bad_count].blk = blk;
+	vc->bad[vc->bad_count].err = err;
+	vc->bad_count++;
+out:
+	verify_unlock(vc);
+}
+
+static void add_obj(struct verify_worker *w, blk64_t blk, ext2_ino_t ino,
+		    __u32 len, int type, int depth)
+{
+	struct verify_list	*list = &w->out;
+	struct verify_obj	*obj;
+	errcode_t		retval;
+
+	/* Directory blocks come in runs; keep them together */
+	if (type == VERIFY_DIR && list->count) {
+		obj = list->objs + list->count - 1;
+		if (obj->type == VERIFY_DIR && obj->ino == ino &&
+		    obj->blk + obj->len == blk && obj->len + len > obj->len) {
+			obj->len += len;
+			return;
+		}
+	}
+
+	if (list->count == list->size) {
+		retval = ext2fs_resize_mem(0, (list->size + 1024) *
+					   sizeof(struct verify_obj),
+					   &list->objs);
+		if (retval) {
+			verify_lock(w->vc);
+			w->vc->retval = retval;
+			verify_unlock(w->vc);
+			return;
+		}
+		list->size += 1024;
+	}
+	obj = list->objs + list->count++;
+	obj->blk = blk;
+	obj->ino = ino;
+	obj->len = len;
+	obj->type = type;
+	obj->depth = depth;
+}
+
+static int bad_blocks(ext2_filsys fs, blk64_t blk, blk64_t len)
+{
+	return (blk < fs->super->s_first_data_block ||
+		blk + len > ext2fs_blocks_count(fs->super) ||
+		blk + len < blk);
+}
+
+/*
+ * Queue the children of an extent tree node: the nodes of the next
+ * level down, or the blocks of a directory.
+ */
+static errcode_t add_extent_children(struct verify_worker *w,
+				     struct ext3_extent_header *eh,
+				     ext2_ino_t ino, int is_dir)
+{
+	ext2_filsys		fs = w->fs;
+	struct ext3_extent_idx	*ix;
+	struct ext3_extent	*ex;
+	errcode_t		retval = 0;
+	blk64_t			blk, lblk, prev = 0;
+	unsigned int		i, len, depth, entries;
+
+	depth = ext2fs_le16_to_cpu(eh->eh_depth);
+	entries = ext2fs_le16_to_cpu(eh->eh_entries);
+	if (depth) {
+		ix = EXT_FIRST_INDEX(eh);
+		for (i = 0; i < entries; i++, ix++) {
+			lblk = ext2fs_le32_to_cpu(ix->ei_block);
+			blk = ext2fs_le32_to_cpu(ix->ei_leaf) +
+				((blk64_t) ext2fs_le16_to_cpu(ix->ei_leaf_hi)
+				 << 32);
+			if (i && lblk <= prev)
+				retval = EXT2_ET_EXTENT_HEADER_BAD;
+			prev = lblk;
+			if (bad_blocks(fs, blk, 1)) {
+				retval = EXT2_ET_BAD_BLOCK_NUM;
+				continue;
+			}
+			add_obj(w, blk, ino, 1, is_dir ? VERIFY_EXTENT_DIR :
+				VERIFY_EXTENT, depth - 1);
+		}
+		return retval;
+	}
+
+	ex = EXT_FIRST_EXTENT(eh);
+	for (i = 0; i < entries; i++, ex++) {
+		lblk = ext2fs_le32_to_cpu(ex->ee_block);
+		blk = ext2fs_le32_to_cpu(ex->ee_start) +
+			((blk64_t) ext2fs_le16_to_cpu(ex->ee_start_hi) << 32);
+		len = ext2fs_le16_to_cpu(ex->ee_len);
+		if (i && lblk < prev)
+			retval = EXT2_ET_EXTENT_HEADER_BAD;
+		/* Unwritten extents hold no directory data */
+		if (len > EXT_INIT_MAX_LEN) {
+			len -= EXT_INIT_MAX_LEN;
+			prev = lblk + len;
+			if (bad_blocks(fs, blk, len))
+				retval = EXT2_ET_BAD_BLOCK_NUM;
+			continue;
+		}
+		prev = lblk + len;
+		if (bad_blocks(fs, blk, len)) {
+			retval = EXT2_ET_BAD_BLOCK_NUM;
+			continue;
+		}
+		if (is_dir && len)
+			add_obj(w, blk, ino, len, VERIFY_DIR, 0);
+	}
+	return retval;
+}
+
+struct dir_block_struct {
+	struct verify_worker	*w;
+	ext2_ino_t		ino;
+};
+
+static int dir_block_cb(ext2_filsys fs EXT2FS_ATTR((unused)),
+			blk64_t *blocknr,
+			e2_blkcnt_t blockcnt EXT2FS_ATTR((unused)),
+			blk64_t ref_blk EXT2FS_ATTR((unused)),
+			int ref_offset EXT2FS_ATTR((unused)), void *priv_data)
+{
+	struct dir_block_struct *db = priv_data;
+
+	if (bad_blocks(db->w->fs, *blocknr, 1))
+		return 0;
+	add_obj(db->w, *blocknr, db->ino, 1, VERIFY_DIR, 0);
+	return 0;
+}
+
+static void verify_inode(struct verify_worker *w, ext2_ino_t ino,
+			 struct ext2_inode_large *inode, errcode_t scan_err)
+{
+	ext2_filsys		fs = w->fs;
+	struct verify_ctx	*vc = w->vc;
+	struct dir_block_struct	db;
+	blk64_t			blk;
+	errcode_t		retval;
+	int			is_dir;
+
+	if (inode->i_links_count == 0)
+		return;
+	if (scan_err) {
+		report_bad(vc, PR_7_INODE_BAD, ino, 0, scan_err);
+		if (scan_err == EXT2_ET_INODE_IS_GARBAGE)
+			return;
+	}
+
+	blk = ext2fs_file_acl_block(fs, EXT2_INODE(inode));
+	if (blk) {
+		if (bad_blocks(fs, blk, 1))
+			report_bad(vc, PR_7_INODE_BAD, ino, 0,
+				   EXT2_ET_BAD_EA_BLOCK_NUM);
+		else
+			add_obj(w, blk, ino, 1, VERIFY_EA, 0);
+	}
+
+	if (inode->i_flags & EXT4_INLINE_DATA_FL)
+		return;
+	is_dir = LINUX_S_ISDIR(inode->i_mode);
+
+	if (inode->i_flags & EXT4_EXTENTS_FL) {
+		retval = ext2fs_extent_header_verify(inode->i_block,
+						     sizeof(inode->i_block));
+		if (!retval)
+			retval = add_extent_children(w,
+				(struct ext3_extent_header *) inode->i_block,
+				ino, is_dir);
+		if (retval)
+			report_bad(vc, PR_7_INODE_BAD, ino, 0, retval);
+		return;
+	}
+
+	if (!is_dir || !ext2fs_inode_has_valid_blocks2(fs, EXT2_INODE(inode)))
+		return;
+
+	/* Block mapped directory; this reads its indirect blocks */
+	db.w = w;
+	db.ino = ino;
+	retval = ext2fs_block_iterate3(fs, ino, BLOCK_FLAG_READ_ONLY |
+				       BLOCK_FLAG_DATA_ONLY, 0, dir_block_cb, &db);
+	if (retval && !scan_err)
+		report_bad(vc, PR_7_INODE_BAD, ino, 0, retval);
+}
+
+static errcode_t group_done(ext2_filsys fs EXT2FS_ATTR((unused)),
+			    ext2_inode_scan scan EXT2FS_ATTR((unused)),
+			    dgrp_t group EXT2FS_ATTR((unused)),
+			    void *priv_data EXT2FS_ATTR((unused)))
+{
+	return VERIFY_GROUP_DONE;
+}
+
+static void readahead_itable(ext2_filsys fs, dgrp_t group)
+{
+	blk64_t		blk = ext2fs_inode_table_loc(fs, group);
+	__u32		inodes = EXT2_INODES_PER_GROUP(fs->super);
+
+	if (!blk || ext2fs_bg_flags_test(fs, group, EXT2_BG_INODE_UNINIT))
+		return;
+	if (ext2fs_has_group_desc_csum(fs))
+		inodes -= ext2fs_bg_itable_unused(fs, group);
+	io_channel_cache_readahead(fs->io, blk,
+			DIV_ROUND_UP((blk64_t) inodes * EXT2_INODE_SIZE(fs->super),
+				     fs->blocksize));
+}
+
+/* Compute the snapshot record of a group */
+static errcode_t group_digest(struct verify_worker *w, dgrp_t group,
+			      struct verify_snap_group *vg)
+{
+	ext2_filsys	fs = w->fs;
+	blk64_t		blk = ext2fs_inode_table_loc(fs, group);
+	blk64_t		left;
+	__u32		inodes = EXT2_INODES_PER_GROUP(fs->super);
+	__u32		crc;
+	unsigned int	n;
+	errcode_t	retval;
+
+	crc = ext2fs_crc32c_le(~0U,
+			(unsigned char *) ext2fs_group_desc(fs, fs->group_desc,
+							    group),
+			EXT2_DESC_SIZE(fs->super));
+	vg->vg_desc_crc = ext2fs_cpu_to_le32(crc);
+	vg->vg_flags = ext2fs_cpu_to_le16(ext2fs_bg_flags(fs, group));
+	vg->vg_checksum = ext2fs_cpu_to_le16(ext2fs_bg_checksum(fs, group));
+
+	crc = ~0U;
+	if (blk && !ext2fs_bg_flags_test(fs, group, EXT2_BG_INODE_UNINIT)) {
+		if (ext2fs_has_group_desc_csum(fs))
+			inodes -= ext2fs_bg_itable_unused(fs, group);
+		left = DIV_ROUND_UP((blk64_t) inodes *
+				    EXT2_INODE_SIZE(fs->super), fs->blocksize);
+		for (; left; left -= n, blk += n) {
+			n = left > VERIFY_RUN_BLOCKS ? VERIFY_RUN_BLOCKS : left;
+			retval = io_channel_read_blk64(fs->io, blk, n, w->buf);
+			if (retval)
+				return retval;
+			crc = ext2fs_crc32c_le(crc, (unsigned char *) w->buf,
+					       (size_t) n * fs->blocksize);
+		}
+	}
+	vg->vg_itable_crc = ext2fs_cpu_to_le32(crc);
+	return 0;
+}
+
+/* Scan the inode tables, one block group at a time */
+static void scan_groups(struct verify_worker *w)
+{
+	struct verify_ctx	*vc = w->vc;
+	struct verify_snapshot	*snap = vc->ctx->verify_snap;
+	ext2_filsys		fs = w->fs;
+	ext2_inode_scan		scan;
+	struct ext2_inode_large	*inode;
+	int			inode_size = EXT2_INODE_SIZE(fs->super);
+	ext2_ino_t		ino;
+	dgrp_t			group;
+	errcode_t		retval;
+
+	retval = ext2fs_get_mem(inode_size, &inode);
+	if (retval)
+		goto err;
+	retval = ext2fs_open_inode_scan(fs, VERIFY_ITABLE_BLOCKS, &scan);
+	if (retval) {
+		ext2fs_free_mem(&inode);
+		goto err;
+	}
+	ext2fs_inode_scan_flags(scan, EXT2_SF_SKIP_MISSING_ITABLE |
+				EXT2_SF_WARN_GARBAGE_INODES, 0);
+	ext2fs_set_inode_callback(scan, group_done, 0);
+
+	while (1) {
+		verify_lock(vc);
+		group = vc->next++;
+		verify_unlock(vc);
+		if (group >= vc->total || verify_stop(vc))
+			break;
+
+		/* Start on the group this worker will probably get next */
+		if (group + vc->threads < vc->total)
+			readahead_itable(fs, group + vc->threads);
+
+		if (snap) {
+			retval = group_digest(w, group, snap->cur + group);
+			if (retval) {
+				report_bad(vc, PR_7_GROUP_BAD, group, 0,
+					   retval);
+				continue;
+			}
+			if (snap->old && !memcmp(snap->old + group,
+						 snap->cur + group,
+						 sizeof(*snap->cur))) {
+				verify_lock(vc);
+				snap->skipped++;
+				verify_unlock(vc);
+				continue;
+			}
+		}
+
+		retval = ext2fs_inode_scan_goto_blockgroup(scan, group);
+		while (!retval) {
+			retval = ext2fs_get_next_inode_full(scan, &ino,
+					EXT2_INODE(inode), inode_size);
+			if (retval == VERIFY_GROUP_DONE || (!retval && !ino))
+				break;
+			if (retval == EXT2_ET_BAD_BLOCK_IN_INODE_TABLE)
+				continue;
+			if (retval && retval != EXT2_ET_INODE_CSUM_INVALID &&
+			    retval != EXT2_ET_INODE_IS_GARBAGE)
+				break;
+			verify_inode(w, ino, inode, retval);
+			retval = 0;
+		}
+		if (retval && retval != VERIFY_GROUP_DONE)
+			report_bad(vc, PR_7_GROUP_BAD, group, 0, retval);
+	}
+	ext2fs_close_inode_scan(scan);
+	ext2fs_free_mem(&inode);
+	return;
+err:
+	verify_lock(vc);
+	vc->retval = retval;
+	verify_unlock(vc);
+}
+
+static errcode_t check_dir_block(ext2_filsys fs, ext2_ino_t ino, char *buf)
+{
+	struct ext2_dir_entry	*dirent;
+	unsigned int		offset = 0, rec_len;
+	errcode_t		retval;
+
+	while (offset < fs->blocksize) {
+		dirent = (struct ext2_dir_entry *) (buf + offset);
+		if (offset + 8 > fs->blocksize)
+			return EXT2_ET_DIR_CORRUPTED;
+		retval = ext2fs_get_rec_len(fs, dirent, &rec_len);
+		if (retval)
+			return retval;
+		if (rec_len < 8 || (rec_len % 4) ||
+		    offset + rec_len > fs->blocksize ||
+		    ext2fs_dirent_name_len(dirent) + 8 > (int) rec_len)
+			return EXT2_ET_DIR_CORRUPTED;
+		offset += rec_len;
+	}
+	if (!ext2fs_dir_block_csum_verify(fs, ino, (struct ext2_dir_entry *) buf))
+		return EXT2_ET_DIR_CSUM_INVALID;
+	return 0;
+}
+
+static void check_obj(struct verify_worker *w, struct verify_obj *obj,
+		      blk64_t blk, char *buf)
+{
+	ext2_filsys			fs = w->fs;
+	struct verify_ctx		*vc = w->vc;
+	struct ext3_extent_header	*eh;
+	struct ext2_ext_attr_header	*hdr;
+	errcode_t			retval = 0;
+	int				ok;
+
+	switch (obj->type) {
+	case VERIFY_BLOCK_BITMAP:
+		ok = ext2fs_block_bitmap_csum_verify(fs, obj->ino, buf,
+				EXT2_CLUSTERS_PER_GROUP(fs->super) / 8);
+		if (!ok)
+			report_bad(vc, PR_7_GROUP_BAD, obj->ino, 0,
+				   EXT2_ET_BLOCK_BITMAP_CSUM_INVALID);
+		return;
+	case VERIFY_INODE_BITMAP:
+		ok = ext2fs_inode_bitmap_csum_verify(fs, obj->ino, buf,
+				EXT2_INODES_PER_GROUP(fs->super) / 8);
+		if (!ok)
+			report_bad(vc, PR_7_GROUP_BAD, obj->ino, 0,
+				   EXT2_ET_INODE_BITMAP_CSUM_INVALID);
+		return;
+	case VERIFY_EXTENT:
+	case VERIFY_EXTENT_DIR:
+		eh = (struct ext3_extent_header *) buf;
+		retval = ext2fs_extent_header_verify(eh, fs->blocksize);
+		if (!retval && ext2fs_le16_to_cpu(eh->eh_depth) != obj->depth)
+			retval = EXT2_ET_EXTENT_HEADER_BAD;
+		if (retval)
+			break;
+		if (!ext2fs_extent_block_csum_verify(fs, obj->ino, eh))
+			report_bad(vc, PR_7_BLOCK_BAD, obj->ino, blk,
+				   EXT2_ET_EXTENT_CSUM_INVALID);
+		retval = add_extent_children(w, eh, obj->ino,
+					     obj->type == VERIFY_EXTENT_DIR);
+		break;
+	case VERIFY_DIR:
+		retval = check_dir_block(fs, obj->ino, buf);
+		break;
+	case VERIFY_EA:
+		hdr = (struct ext2_ext_attr_header *) buf;
+		if (ext2fs_le32_to_cpu(hdr->h_magic) != EXT2_EXT_ATTR_MAGIC ||
+		    ext2fs_le32_to_cpu(hdr->h_blocks) != 1)
+			retval = EXT2_ET_BAD_EA_HEADER;
+		else if (!ext2fs_ext_attr_block_csum_verify(fs, obj->ino,
+							    blk, hdr))
+			retval = EXT2_ET_EXT_ATTR_CSUM_INVALID;
+		break;
+	}
+	if (retval)
+		report_bad(vc, PR_7_BLOCK_BAD, obj->ino, blk, retval);
+}
+
+static void readahead_chunk(struct verify_worker *w, unsigned long chunk)
+{
+	struct verify_list	*work = w->vc->work;
+	struct verify_obj	*obj, *end;
+
+	if (chunk * VERIFY_CHUNK >= work->count)
+		return;
+	obj = work->objs + chunk * VERIFY_CHUNK;
+	end = obj + VERIFY_CHUNK;
+	if (end > work->objs + work->count)
+		end = work->objs + work->count;
+	for (; obj < end; obj++)
+		io_channel_cache_readahead(w->fs->io, obj->blk, obj->len);
+}
+
+/* Read and check the objects of the current round, in chunks */
+static void verify_objs(struct verify_worker *w)
+{
+	struct verify_ctx	*vc = w->vc;
+	struct verify_obj	*obj, *end;
+	unsigned long		chunk;
+	blk64_t			blk, left;
+	unsigned int		i, n;
+	errcode_t		retval;
+
+	while (1) {
+		verify_lock(vc);
+		chunk = vc->next++;
+		verify_unlock(vc);
+		if (chunk >= vc->total || verify_stop(vc))
+			break;
+
+		readahead_chunk(w, chunk + vc->threads * VERIFY_READAHEAD);
+
+		obj = vc->work->objs + chunk * VERIFY_CHUNK;
+		end = obj + VERIFY_CHUNK;
+		if (end > vc->work->objs + vc->work->count)
+			end = vc->work->objs + vc->work->count;
+		for (; obj < end; obj++) {
+			blk = obj->blk;
+			for (left = obj->len; left; left -= n, blk += n) {
+				n = left > VERIFY_RUN_BLOCKS ?
+					VERIFY_RUN_BLOCKS : left;
+				retval = io_channel_read_blk64(w->fs->io, blk,
+							       n, w->buf);
+				if (retval) {
+					report_bad(vc, obj->type <=
+						   VERIFY_INODE_BITMAP ?
+						   PR_7_GROUP_BAD :
+						   PR_7_BLOCK_BAD, obj->ino,
+						   obj->type <=
+						   VERIFY_INODE_BITMAP ? 0 : blk,
+						   retval);
+					continue;
+				}
+				for (i = 0; i < n; i++)
+					check_obj(w, obj, blk + i, w->buf +
+						  i * w->fs->blocksize);
+			}
+		}
+	}
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *verify_thread(void *arg)
+{
+	struct verify_worker *w = arg;
+
+	w->func(w);
+	return NULL;
+}
+#endif
+
+/*
+ * Run func on as many workers as we can get, and collect the objects
+ * they found into next.
+ */
+static errcode_t run_workers(struct verify_ctx *vc,
+			     void (*func)(struct verify_worker *),
+			     struct verify_list *next)
+{
+	e2fsck_t		ctx = vc->ctx;
+	struct verify_worker	w[VERIFY_MAX_THREADS];
+	errcode_t		retval = 0;
+	int			i, n;
+
+	memset(w, 0, sizeof(w));
+	vc->next = 0;
+	for (n = 0; n < vc->threads; n++) {
+		w[n].vc = vc;
+		w[n].func = func;
+		retval = ext2fs_get_mem((size_t) VERIFY_RUN_BLOCKS *
+					ctx->fs->blocksize, &w[n].buf);
+		if (retval)
+			break;
+		if (vc->threads == 1) {
+			w[n].fs = ctx->fs;
+			continue;
+		}
+		retval = e2fsck_open_worker_fs(ctx, &w[n].fs);
+		if (retval) {
+			ext2fs_free_mem(&w[n].buf);
+			break;
+		}
+	}
+	if (n == 0)
+		return retval;
+	/* Whatever we could set up will have to do */
+	vc->threads = n;
+
+#ifdef HAVE_PTHREAD_H
+	for (i = 1; i < n; i++)
+		if (pthread_create(&w[i].thread, NULL, verify_thread, &w[i]))
+			break;
+	func(&w[0]);
+	while (--i > 0)
+		pthread_join(w[i].thread, NULL);
+#else
+	func(&w[0]);
+#endif
+
+	retval = 0;
+	for (i = 0; i < n; i++) {
+		if (!retval && w[i].out.count) {
+			if (next->count + w[i].out.count > next->size) {
+				retval = ext2fs_resize_mem(0,
+					(next->count + w[i].out.count) *
+					sizeof(struct verify_obj), &next->objs);
+				if (!retval)
+					next->size = next->count +
+						     w[i].out.count;
+			}
+			if (!retval) {
+				memcpy(next->objs + next->count, w[i].out.objs,
+				       w[i].out.count *
+				       sizeof(struct verify_obj));
+				next->count += w[i].out.count;
+			}
+		}
+		ext2fs_free_mem(&w[i].out.objs);
+		ext2fs_free_mem(&w[i].buf);
+		if (w[i].fs != ctx->fs)
+			e2fsck_close_worker_fs(ctx, w[i].fs);
+	}
+	return retval;
+}
+
+static EXT2_QSORT_TYPE obj_cmp(const void *a, const void *b)
+{
+	const struct verify_obj *oa = a, *ob = b;
+
+	if (oa->blk != ob->blk)
+		return oa->blk < ob->blk ? -1 : 1;
+	if (oa->type != ob->type)
+		return (int) oa->type - (int) ob->type;
+	if (oa->ino != ob->ino)
+		return oa->ino < ob->ino ? -1 : 1;
+	return 0;
+}
+
+/* Sort a round into physical order; each EA block is only read once */
+static void sort_objs(struct verify_list *list)
+{
+	struct verify_obj	*in, *out, *end;
+
+	if (list->count == 0)
+		return;
+	qsort(list->objs, list->count, sizeof(struct verify_obj), obj_cmp);
+	out = list->objs;
+	end = list->objs + list->count;
+	for (in = list->objs + 1; in < end; in++) {
+		if (in->blk == out->blk && in->type == out->type &&
+		    (in->type == VERIFY_EA || in->ino == out->ino))
+			continue;
+		*++out = *in;
+	}
+	list->count = out - list->objs + 1;
+}
+
+static void snapshot_header(ext2_filsys fs, struct verify_snap_header *hdr)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->vs_magic = ext2fs_cpu_to_le32(VERIFY_SNAP_MAGIC);
+	hdr->vs_version = ext2fs_cpu_to_le32(VERIFY_SNAP_VERSION);
+	memcpy(hdr->vs_uuid, fs->super->s_uuid, sizeof(hdr->vs_uuid));
+	hdr->vs_blocks_count =
+		ext2fs_cpu_to_le64(ext2fs_blocks_count(fs->super));
+	hdr->vs_inodes_count = ext2fs_cpu_to_le32(fs->super->s_inodes_count);
+	hdr->vs_groups = ext2fs_cpu_to_le32(fs->group_desc_count);
+	hdr->vs_log_block_size =
+		ext2fs_cpu_to_le32(fs->super->s_log_block_size);
+	hdr->vs_mkfs_time = ext2fs_cpu_to_le32(fs->super->s_mkfs_time);
+}
+
+static __u32 snapshot_crc(struct verify_snap_header *hdr,
+			  struct verify_snap_group *groups, dgrp_t count)
+{
+	__u32	crc, saved = hdr->vs_crc;
+
+	hdr->vs_crc = 0;
+	crc = ext2fs_crc32c_le(~0U, (unsigned char *) hdr, sizeof(*hdr));
+	crc = ext2fs_crc32c_le(crc, (unsigned char *) groups,
+			       (size_t) count * sizeof(*groups));
+	hdr->vs_crc = saved;
+	return crc;
+}
+
+/*
+ * Read the snapshot left by the last clean run, if there is one that
+ * matches this file system.
+ */
+static errcode_t snapshot_load(e2fsck_t ctx, struct verify_snapshot *snap)
+{
+	ext2_filsys			fs = ctx->fs;
+	struct verify_snap_header	hdr, want;
+	struct problem_context		pctx;
+	size_t				size;
+	errcode_t			retval;
+	FILE				*f;
+
+	size = (size_t) fs->group_desc_count * sizeof(*snap->cur);
+	retval = ext2fs_get_memzero(size, &snap->cur);
+	if (retval)
+		return retval;
+
+	clear_problem_context(&pctx);
+	pctx.str = ctx->snapshot_fn;
+	f = fopen(ctx->snapshot_fn, "r");
+	if (!f) {
+		if (errno != ENOENT) {
+			pctx.errcode = errno;
+			fix_problem(ctx, PR_7_SNAPSHOT_READ, &pctx);
+		}
+		return 0;
+	}
+	retval = ext2fs_get_mem(size, &snap->old);
+	if (retval)
+		goto out;
+
+	snapshot_header(fs, &want);
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    fread(snap->old, size, 1, f) != 1) {
+		if (ferror(f)) {
+			pctx.errcode = errno;
+			fix_problem(ctx, PR_7_SNAPSHOT_READ, &pctx);
+			goto bad;
+		}
+		goto invalid;
+	}
+	want.vs_crc = hdr.vs_crc;
+	if (memcmp(&hdr, &want, sizeof(hdr)) ||
+	    ext2fs_le32_to_cpu(hdr.vs_crc) !=
+	    snapshot_crc(&hdr, snap->old, fs->group_desc_count))
+		goto invalid;
+	goto out;
+
+invalid:
+	fix_problem(ctx, PR_7_SNAPSHOT_INVALID, &pctx);
+bad:
+	ext2fs_free_mem(&snap->old);
+out:
+	fclose(f);
+	return retval;
+}
+
+static errcode_t snapshot_save(e2fsck_t ctx, struct verify_snapshot *snap)
+{
+	ext2_filsys			fs = ctx->fs;
+	struct verify_snap_header	hdr;
+	char				*tmp_fn;
+	errcode_t			retval;
+	FILE				*f;
+
+	retval = ext2fs_get_mem(strlen(ctx->snapshot_fn) + 5, &tmp_fn);
+	if (retval)
+		return retval;
+	sprintf(tmp_fn, "%s.tmp", ctx->snapshot_fn);
+
+	snapshot_header(fs, &hdr);
+	hdr.vs_crc = ext2fs_cpu_to_le32(snapshot_crc(&hdr, snap->cur,
+						     fs->group_desc_count));
+	f = fopen(tmp_fn, "w");
+	if (!f) {
+		retval = errno;
+		goto out;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    fwrite(snap->cur, sizeof(*snap->cur), fs->group_desc_count,
+		   f) != fs->group_desc_count)
+		retval = errno ? errno : EIO;
+	if (fclose(f) && !retval)
+		retval = errno;
+	/* Only replace the old snapshot with a complete one */
+	if (!retval && rename(tmp_fn, ctx->snapshot_fn) < 0)
+		retval = errno;
+	if (retval)
+		(void) unlink(tmp_fn);
+out:
+	ext2fs_free_mem(&tmp_fn);
+	return retval;
+}
+
+/*
+ * Called once the outcome of a verification is known.  The digests of
+ * a clean run are saved; otherwise no group can be trusted next time,
+ * so the snapshot is removed.  Returns the number of groups which were
+ * skipped as unchanged, and so weren't verified by this run.
+ */
+dgrp_t e2fsck_verify_snapshot_done(e2fsck_t ctx, int clean)
+{
+	struct verify_snapshot	*snap = ctx->verify_snap;
+	struct problem_context	pctx;
+	errcode_t		retval = 0;
+	dgrp_t			skipped;
+
+	if (!snap)
+		return 0;
+	skipped = snap->skipped;
+	if (clean)
+		retval = snapshot_save(ctx, snap);
+	else if (unlink(ctx->snapshot_fn) < 0 && errno != ENOENT)
+		retval = errno;
+	if (retval) {
+		clear_problem_context(&pctx);
+		pctx.str = ctx->snapshot_fn;
+		pctx.errcode = retval;
+		fix_problem(ctx, PR_7_SNAPSHOT_WRITE, &pctx);
+	}
+	ext2fs_free_mem(&snap->old);
+	ext2fs_free_mem(&snap->cur);
+	ext2fs_free_mem(&ctx->verify_snap);
+	return skipped;
+}
+
+static EXT2_QSORT_TYPE bad_cmp(const void *a, const void *b)
+{
+	const struct verify_bad *ba = a, *bb = b;
+
+	if (ba->code != bb->code)
+		return ba->code < bb->code ? -1 : 1;
+	if (ba->num != bb->num)
+		return ba->num < bb->num ? -1 : 1;
+	if (ba->blk != bb->blk)
+		return ba->blk < bb->blk ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Verify the file system's metadata.  Returns the number of problems
+ * found, or -1 if the verification itself failed.
+ */
+int e2fsck_verify_metadata(e2fsck_t ctx)
+{
+	ext2_filsys		fs = ctx->fs;
+	struct problem_context	pctx;
+#ifdef RESOURCE_TRACK
+	struct resource_track	rtrack;
+#endif
+	struct verify_ctx	vc;
+	struct verify_list	work, next;
+	struct verify_worker	w;
+	struct verify_bad	*bad;
+	int			flags = fs->flags;
+	int			csum = ext2fs_has_feature_metadata_csum(fs->super);
+	dgrp_t			group;
+	errcode_t		retval;
+	size_t			i;
+	int			problems;
+
+	init_resource_track(&rtrack, ctx->fs->io);
+	clear_problem_context(&pctx);
+	fix_problem(ctx, PR_7_PASS_HEADER, &pctx);
+
+	memset(&vc, 0, sizeof(vc));
+	memset(&work, 0, sizeof(work));
+	memset(&next, 0, sizeof(next));
+	vc.ctx = ctx;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&vc.lock, NULL);
+#endif
+	vc.threads = e2fsck_worker_threads(ctx, "verify_threads",
+					   VERIFY_MAX_THREADS);
+	fs->flags &= ~EXT2_FLAG_IGNORE_CSUM_ERRORS;
+
+	if (ctx->snapshot_fn) {
+		retval = ext2fs_get_memzero(sizeof(struct verify_snapshot),
+					    &ctx->verify_snap);
+		if (!retval)
+			retval = snapshot_load(ctx, ctx->verify_snap);
+		if (retval)
+			goto out;
+	}
+
+	/* Workers read the device directly */
+	retval = io_channel_flush(fs->io);
+	if (retval)
+		goto out;
+
+	if (!ext2fs_superblock_csum_verify(fs, fs->super))
+		report_bad(&vc, PR_7_SUPER_BAD, 0, 0, EXT2_ET_SB_CSUM_INVALID);
+
+	/* The group descriptors, and the bitmaps they point to */
+	memset(&w, 0, sizeof(w));
+	w.vc = &vc;
+	w.fs = fs;
+	for (group = 0; group < fs->group_desc_count; group++) {
+		if (!ext2fs_group_desc_csum_verify(fs, group)) {
+			report_bad(&vc, PR_7_GDT_CSUM, group, 0, 0);
+			continue;
+		}
+		if (!csum)
+			continue;
+		if (!ext2fs_bg_flags_test(fs, group, EXT2_BG_BLOCK_UNINIT) &&
+		    !bad_blocks(fs, ext2fs_block_bitmap_loc(fs, group), 1))
+			add_obj(&w, ext2fs_block_bitmap_loc(fs, group), group,
+				1, VERIFY_BLOCK_BITMAP, 0);
+		if (!ext2fs_bg_flags_test(fs, group, EXT2_BG_INODE_UNINIT) &&
+		    !bad_blocks(fs, ext2fs_inode_bitmap_loc(fs, group), 1))
+			add_obj(&w, ext2fs_inode_bitmap_loc(fs, group), group,
+				1, VERIFY_INODE_BITMAP, 0);
+	}
+	next = w.out;
+
+	/* The inode tables */
+	vc.total = fs->group_desc_count;
+	retval = run_workers(&vc, scan_groups, &next);
+	if (!retval)
+		retval = vc.retval;
+
+	/* ...and everything they lead to, one tree level at a time */
+	while (!retval && next.count && !verify_stop(&vc)) {
+		ext2fs_free_mem(&work.objs);
+		work = next;
+		memset(&next, 0, sizeof(next));
+		sort_objs(&work);
+		vc.work = &work;
+		vc.total = DIV_ROUND_UP(work.count, VERIFY_CHUNK);
+		retval = run_workers(&vc, verify_objs, &next);
+		if (!retval)
+			retval = vc.retval;
+	}
+
+out:
+	fs->flags = (flags & EXT2_FLAG_IGNORE_CSUM_ERRORS) |
+		    (fs->flags & ~EXT2_FLAG_IGNORE_CSUM_ERRORS);
+	ext2fs_free_mem(&work.objs);
+	ext2fs_free_mem(&next.objs);
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&vc.lock);
+#endif
+
+	if (ctx->verify_snap && ctx->verify_snap->skipped) {
+		clear_problem_context(&pctx);
+		pctx.num = ctx->verify_snap->skipped;
+		pctx.group = fs->group_desc_count;
+		fix_problem(ctx, PR_7_SNAPSHOT_SKIP, &pctx);
+	}
+	if (vc.bad_count)
+		qsort(vc.bad, vc.bad_count, sizeof(struct verify_bad),
+		      bad_cmp);
+	for (i = 0, bad = vc.bad; i < vc.bad_count; i++, bad++) {
+		clear_problem_context(&pctx);
+		if (bad->code == PR_7_GDT_CSUM) {
+			pctx.csum1 = ext2fs_bg_checksum(fs, bad->num);
+			pctx.csum2 = ext2fs_group_desc_csum(fs, bad->num);
+		}
+		if (bad->code == PR_7_GDT_CSUM || bad->code == PR_7_GROUP_BAD)
+			pctx.group = bad->num;
+		else
+			pctx.ino = bad->num;
+		pctx.blk = bad->blk;
+		pctx.errcode = bad->err;
+		fix_problem(ctx, bad->code, &pctx);
+	}
+	problems = vc.bad_count;
+	ext2fs_free_mem(&vc.bad);
+
+	if (retval) {
+		clear_problem_context(&pctx);
+		pctx.errcode = retval;
+		fix_problem(ctx, PR_7_VERIFY_ERROR, &pctx);
+		problems = -1;
+	}
+	print_resource_track(ctx, _("Metadata verification"), &rtrack,
+			     ctx->fs->io);
+	return problems;
+}
@@ -49,6 +49,8 @@ struct blkid_struct_dev
 	int			bid_pri;	/* Device priority */
 	dev_t			bid_devno;	/* Device major/minor number */
 	time_t			bid_time;	/* Last update time of device */
+	blkid_loff_t		bid_size;	/* Device size when probed */
+	unsigned long long	bid_gen;	/* Device generation (diskseq) */
 	unsigned int		bid_flags;	/* Device status bitflags */
 	char			*bid_label;	/* Shortcut to device LABEL */
 	char			*bid_uuid;	/* Shortcut to binary UUID */
@@ -102,6 +104,20 @@ struct blkid_struct_cache
 	time_t			bic_ftime; 	/* Mod time of the cachefile */
 	unsigned int		bic_flags;	/* Status flags of the cache */
 	char			*bic_filename;	/* filename of cache */
+	struct blkid_prefetch	*bic_prefetch;	/* Data read ahead by probe_all */
+	int			bic_nprefetch;
+};
+
+/*
+ * The start of a device, read ahead (possibly concurrently with other
+ * devices) by blkid_probe_all() so that blkid_verify() doesn't need
+ * to read it.
+ */
+struct blkid_prefetch {
+	char			*bpf_name;	/* Device to read */
+	dev_t			bpf_devno;	/* Device number it had */
+	unsigned char		*bpf_buf;	/* Data read, or NULL */
+	size_t			bpf_valid;	/* Bytes read */
 };
 
 #define BLKID_BIC_FL_PROBED	0x0002	/* We probed /proc/partition devices */
@@ -177,6 +193,10 @@ extern void blkid__scan_dir(const char *, dev_t, struct dir_list **, char **);
 /* lseek.c */
 extern blkid_loff_t blkid_llseek(int fd, blkid_loff_t offset, int whence);
 
+/* probe.c */
+extern size_t blkid__probe_window(void);
+extern int blkid__dev_is_current(blkid_dev dev);
+
 /* read.c */
 extern void blkid_read_cache(blkid_cache cache);
 
@@ -40,6 +40,10 @@
 #include <sys/sysmacros.h>
 #endif
 #include <time.h>
+#include <fcntl.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include "blkidP.h"
 
@@ -391,6 +395,168 @@ evms_probe_all(blkid_cache cache, int only_if_new)
 	return num;
 }
 
+/*
+ * probe_all() first reads /proc/partitions into a list of devices to
+ * probe (or to drop from the cache), so that the devices which need to
+ * be read can be read concurrently before the list is processed.
+ */
+struct probe_op {
+	dev_t	devno;
+	int	remove;
+	char	ptname[129];
+};
+
+static int add_probe_op(struct probe_op **ops, int *num, int *size,
+			const char *ptname, dev_t devno, int remove)
+{
+	struct probe_op *new_ops;
+
+	if (*num >= *size) {
+		new_ops = realloc(*ops, (*size + 64) * sizeof(struct probe_op));
+		if (!new_ops)
+			return -BLKID_ERR_MEM;
+		*ops = new_ops;
+		*size += 64;
+	}
+	(*ops)[*num].devno = devno;
+	(*ops)[*num].remove = remove;
+	strcpy((*ops)[*num].ptname, ptname);
+	(*num)++;
+	return 0;
+}
+
+#ifdef HAVE_PTHREAD_H
+#define BLKID_PROBE_THREADS	16
+
+struct prefetch_state {
+	pthread_mutex_t		lock;
+	struct blkid_prefetch	*pf;
+	int			num, next;
+};
+
+static void *prefetch_thread(void *arg)
+{
+	struct prefetch_state *ps = arg;
+	struct blkid_prefetch *pf;
+	size_t window = blkid__probe_window();
+	ssize_t ret;
+	int fd;
+
+	while (1) {
+		pthread_mutex_lock(&ps->lock);
+		pf = ps->next < ps->num ? &ps->pf[ps->next++] : NULL;
+		pthread_mutex_unlock(&ps->lock);
+		if (!pf)
+			break;
+
+		fd = open(pf->bpf_name, O_RDONLY);
+		if (fd < 0)
+			continue;
+		pf->bpf_buf = malloc(window);
+		if (pf->bpf_buf) {
+			ret = pread(fd, pf->bpf_buf, window, 0);
+			if (ret < 0) {
+				free(pf->bpf_buf);
+				pf->bpf_buf = NULL;
+			} else
+				pf->bpf_valid = ret;
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+/*
+ * Read the start of every device in ops that blkid_verify() will need
+ * to read, using a bounded pool of threads.
+ */
+static void prefetch_devs(blkid_cache cache, struct probe_op *ops, int num,
+			  int only_if_new)
+{
+	pthread_t threads[BLKID_PROBE_THREADS];
+	struct prefetch_state ps;
+	struct list_head *p;
+	const char **dir;
+	const char *name;
+	char device[256];
+	struct stat st;
+	blkid_dev dev;
+	int i, nthreads;
+
+	ps.pf = calloc(num ? num : 1, sizeof(struct blkid_prefetch));
+	if (!ps.pf)
+		return;
+	ps.num = ps.next = 0;
+	for (i = 0; i < num; i++) {
+		if (ops[i].remove)
+			continue;
+		dev = NULL;
+		list_for_each(p, &cache->bic_devs) {
+			dev = list_entry(p, struct blkid_struct_dev, bid_devs);
+			if (dev->bid_devno == ops[i].devno)
+				break;
+			dev = NULL;
+		}
+		name = NULL;
+		if (dev) {
+			if ((only_if_new && !access(dev->bid_name, F_OK)) ||
+			    blkid__dev_is_current(dev))
+				continue;
+			name = dev->bid_name;
+		} else {
+			for (dir = dirlist; *dir; dir++) {
+				sprintf(device, "%s/%s", *dir, ops[i].ptname);
+				if (stat(device, &st) == 0 &&
+				    blkidP_is_disk_device(st.st_mode) &&
+				    st.st_rdev == ops[i].devno) {
+					name = device;
+					break;
+				}
+			}
+		}
+		if (!name)
+			continue;
+		ps.pf[ps.num].bpf_name = blkid_strdup(name);
+		ps.pf[ps.num].bpf_devno = ops[i].devno;
+		if (ps.pf[ps.num].bpf_name)
+			ps.num++;
+	}
+
+	nthreads = ps.num < BLKID_PROBE_THREADS ? ps.num : BLKID_PROBE_THREADS;
+	if (nthreads > 1) {
+		DBG(DEBUG_DEVNAME, printf("reading %d devices with %d threads\n",
+					  ps.num, nthreads));
+		pthread_mutex_init(&ps.lock, NULL);
+		for (i = 0; i < nthreads; i++)
+			if (pthread_create(&threads[i], NULL, prefetch_thread,
+					   &ps))
+				break;
+		/* Whatever the threads didn't get to is read as usual */
+		nthreads = i;
+		if (!nthreads)
+			ps.next = ps.num;
+		for (i = 0; i < nthreads; i++)
+			pthread_join(threads[i], NULL);
+		pthread_mutex_destroy(&ps.lock);
+	}
+	cache->bic_prefetch = ps.pf;
+	cache->bic_nprefetch = ps.num;
+}
+#endif
+
+static void free_prefetch(blkid_cache cache)
+{
+	int i;
+
+	for (i = 0; i < cache->bic_nprefetch; i++) {
+		free(cache->bic_prefetch[i].bpf_name);
+		free(cache->bic_prefetch[i].bpf_buf);
+	}
+	free(cache->bic_prefetch);
+	cache->bic_prefetch = NULL;
+	cache->bic_nprefetch = 0;
+}
+
 /*
  * Read the device data for all available block devices in the system.
  */
@@ -406,6 +572,8 @@ static int probe_all(blkid_cache cache, int only_if_new)
 	int lens[2] = { 0, 0 };
 	int which = 0, last = 0;
 	struct list_head *p, *pnext;
+	struct probe_op *ops = NULL;
+	int num_ops = 0, size_ops = 0, i, ret = 0;
 
 	ptnames[0] = ptname0;
 	ptnames[1] = ptname1;
@@ -460,8 +628,8 @@ static int probe_all(blkid_cache cache, int only_if_new)
 				   ptname, (unsigned int) devs[which]));
 
 			if (sz > 1)
-				probe_one(cache, ptname, devs[which], 0,
-					  only_if_new);
+				ret = add_probe_op(&ops, &num_ops, &size_ops,
+						   ptname, devs[which], 0);
 			lens[which] = 0;	/* mark as checked */
 		}
 
@@ -471,21 +639,8 @@ static int probe_all(blkid_cache cache, int only_if_new)
 		 * it exists.
 		 */
 		if (lens[last] && !strncmp(ptnames[last], ptname, lens[last])) {
-			list_for_each_safe(p, pnext, &cache->bic_devs) {
-				blkid_dev tmp;
-
-				/* find blkid dev for the whole-disk devno */
-				tmp = list_entry(p, struct blkid_struct_dev,
-						 bid_devs);
-				if (tmp->bid_devno == devs[last]) {
-					DBG(DEBUG_DEVNAME,
-						printf("freeing %s\n",
-						       tmp->bid_name));
-					blkid_free_dev(tmp);
-					cache->bic_flags |= BLKID_BIC_FL_CHANGED;
-					break;
-				}
-			}
+			ret = add_probe_op(&ops, &num_ops, &size_ops,
+					   ptnames[last], devs[last], 1);
 			lens[last] = 0;
 		}
 		/*
@@ -497,19 +652,49 @@ static int probe_all(blkid_cache cache, int only_if_new)
 			DBG(DEBUG_DEVNAME,
 			    printf("whole dev %s, devno 0x%04X\n",
 				   ptnames[last], (unsigned int) devs[last]));
-			probe_one(cache, ptnames[last], devs[last], 0,
-				  only_if_new);
+			ret = add_probe_op(&ops, &num_ops, &size_ops,
+					   ptnames[last], devs[last], 0);
 			lens[last] = 0;
 		}
+		if (ret)
+			break;
 	}
 
 	/* Handle the last device if it wasn't partitioned */
-	if (lens[which])
-		probe_one(cache, ptname, devs[which], 0, only_if_new);
+	if (lens[which] && !ret)
+		ret = add_probe_op(&ops, &num_ops, &size_ops, ptname,
+				   devs[which], 0);
 
 	fclose(proc);
+
+#ifdef HAVE_PTHREAD_H
+	prefetch_devs(cache, ops, num_ops, only_if_new);
+#endif
+	for (i = 0; i < num_ops; i++) {
+		if (!ops[i].remove) {
+			probe_one(cache, ops[i].ptname, ops[i].devno, 0,
+				  only_if_new);
+			continue;
+		}
+		list_for_each_safe(p, pnext, &cache->bic_devs) {
+			blkid_dev tmp;
+
+			/* find blkid dev for the whole-disk devno */
+			tmp = list_entry(p, struct blkid_struct_dev, bid_devs);
+			if (tmp->bid_devno == ops[i].devno) {
+				DBG(DEBUG_DEVNAME,
+				    printf("freeing %s\n", tmp->bid_name));
+				blkid_free_dev(tmp);
+				cache->bic_flags |= BLKID_BIC_FL_CHANGED;
+				break;
+			}
+		}
+	}
+	free_prefetch(cache);
+	free(ops);
+
 	blkid_flush_cache(cache);
-	return 0;
+	return ret;
 }
 
 int blkid_probe_all(blkid_cache cache)
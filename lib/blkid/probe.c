@@ -27,6 +27,9 @@
 #ifdef HAVE_SYS_MKDEV_H
 #include <sys/mkdev.h>
 #endif
+#ifdef HAVE_SYS_SYSMACROS_H
+#include <sys/sysmacros.h>
+#endif
 #ifdef __linux__
 #include <sys/utsname.h>
 #endif
@@ -54,14 +57,14 @@ static unsigned char *get_buffer(struct blkid_probe *pr,
 	ssize_t		ret_read;
 	unsigned char	*newbuf;
 
-	if (off + len <= SB_BUFFER_SIZE) {
+	if (off + len <= pr->sb_size) {
 		if (!pr->sbbuf) {
-			pr->sbbuf = malloc(SB_BUFFER_SIZE);
+			pr->sbbuf = malloc(pr->sb_size);
 			if (!pr->sbbuf)
 				return NULL;
 			if (lseek(pr->fd, 0, SEEK_SET) < 0)
 				return NULL;
-			ret_read = read(pr->fd, pr->sbbuf, SB_BUFFER_SIZE);
+			ret_read = read(pr->fd, pr->sbbuf, pr->sb_size);
 			if (ret_read < 0)
 				ret_read = 0;
 			pr->sb_valid = ret_read;
@@ -1609,6 +1612,124 @@ static struct blkid_magic type_array[] = {
   {   NULL,	 0,	 0,  0, NULL,			NULL }
 };
 
+/*
+ * Return the size of a read from the start of a device which covers
+ * the magic numbers of every type in type_array, so that a full probe
+ * needs only one read.
+ */
+size_t blkid__probe_window(void)
+{
+	static size_t window;
+	struct blkid_magic *id;
+	size_t end;
+	long idx;
+
+	if (window)
+		return window;
+	end = SB_BUFFER_SIZE;
+	for (id = type_array; id->bim_type; id++) {
+		if (id->bim_kboff < 0)
+			continue;
+		idx = id->bim_kboff + (id->bim_sboff >> 10);
+		if (((size_t) idx << 10) + 1024 > end)
+			end = ((size_t) idx << 10) + 1024;
+	}
+	window = (end + 4095) & ~((size_t) 4095);
+	return window;
+}
+
+/*
+ * Return the kernel's sequence number for the media in the device, which
+ * changes whenever the media changes, or 0 if it isn't available.
+ */
+static unsigned long long get_dev_gen(dev_t devno)
+{
+	unsigned long long gen = 0;
+#ifdef __linux__
+	char path[64];
+	FILE *f;
+
+	sprintf(path, "/sys/dev/block/%u:%u/diskseq", major(devno),
+		minor(devno));
+	f = fopen(path, "r");
+	if (f) {
+		if (fscanf(f, "%llu", &gen) != 1)
+			gen = 0;
+		fclose(f);
+	}
+#endif
+	return gen;
+}
+
+/*
+ * Return 1 if the device still has the same device number, size and
+ * generation that it had when it was last probed, and hasn't been
+ * modified since, so that there is no need to read it again.  A
+ * modification in the same second as the probe might have come after
+ * it, so that doesn't count as unmodified.
+ */
+static int dev_key_matches(blkid_dev dev, struct stat *st, int fd)
+{
+	if (!dev->bid_type || !dev->bid_size ||
+	    st->st_rdev != dev->bid_devno ||
+	    st->st_mtime >= dev->bid_time)
+		return 0;
+	if (get_dev_gen(st->st_rdev) != dev->bid_gen)
+		return 0;
+	return blkid_get_dev_size(fd) == dev->bid_size;
+}
+
+static int dev_time_current(blkid_dev dev, struct stat *st, time_t now)
+{
+	double diff = difftime(now, dev->bid_time);
+
+	return ((now >= dev->bid_time) &&
+		(st->st_mtime <= dev->bid_time) &&
+		((diff < BLKID_PROBE_MIN) ||
+		 (dev->bid_flags & BLKID_BID_FL_VERIFIED &&
+		  diff < BLKID_PROBE_INTERVAL)));
+}
+
+/*
+ * Return 1 if blkid_verify() would accept dev without reading it.
+ */
+int blkid__dev_is_current(blkid_dev dev)
+{
+	struct stat st;
+	int fd, ret;
+
+	if (stat(dev->bid_name, &st) < 0)
+		return 0;
+	if (dev_time_current(dev, &st, time(0)))
+		return 1;
+	fd = open(dev->bid_name, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	ret = dev_key_matches(dev, &st, fd);
+	close(fd);
+	return ret;
+}
+
+/*
+ * Take over the data read ahead for a device by blkid_probe_all(), if any.
+ */
+static void use_prefetch(struct blkid_probe *probe, dev_t devno)
+{
+	struct blkid_prefetch *pf;
+	int i;
+
+	for (i = 0; i < probe->cache->bic_nprefetch; i++) {
+		pf = &probe->cache->bic_prefetch[i];
+		if (pf->bpf_devno != devno || !pf->bpf_buf)
+			continue;
+		probe->sbbuf = pf->bpf_buf;
+		probe->sb_valid = pf->bpf_valid;
+		probe->sb_size = blkid__probe_window();
+		pf->bpf_buf = NULL;
+		return;
+	}
+}
+
 /*
  * Verify that the data in dev is consistent with what is on the actual
  * block device (using the devname field only).  Normally this will be
@@ -1627,14 +1748,12 @@ blkid_dev blkid_verify(blkid_cache cache, blkid_dev dev)
 	const char *type, *value;
 	struct stat st;
 	time_t now;
-	double diff;
 	int idx;
 
 	if (!dev)
 		return NULL;
 
 	now = time(0);
-	diff = difftime(now, dev->bid_time);
 
 	if (stat(dev->bid_name, &st) < 0) {
 		DBG(DEBUG_PROBE,
@@ -1652,19 +1771,9 @@ blkid_dev blkid_verify(blkid_cache cache, blkid_dev dev)
 		return NULL;
 	}
 
-	if ((now >= dev->bid_time) &&
-	    (st.st_mtime <= dev->bid_time) &&
-	    ((diff < BLKID_PROBE_MIN) ||
-	     (dev->bid_flags & BLKID_BID_FL_VERIFIED &&
-	      diff < BLKID_PROBE_INTERVAL)))
+	if (dev_time_current(dev, &st, now))
 		return dev;
 
-	DBG(DEBUG_PROBE,
-	    printf("need to revalidate %s (cache time %lu, stat time %lu,\n\t"
-		   "time since last check %lu)\n",
-		   dev->bid_name, (unsigned long)dev->bid_time,
-		   (unsigned long)st.st_mtime, (unsigned long)diff));
-
 	if ((probe.fd = open(dev->bid_name, O_RDONLY)) < 0) {
 		DBG(DEBUG_PROBE, printf("blkid_verify: error %s (%d) while "
 					"opening %s\n", strerror(errno), errno,
@@ -1672,11 +1781,32 @@ blkid_dev blkid_verify(blkid_cache cache, blkid_dev dev)
 		goto open_err;
 	}
 
+	if (dev_key_matches(dev, &st, probe.fd)) {
+		DBG(DEBUG_PROBE, printf("%s unchanged since last probe\n",
+					dev->bid_name));
+		dev->bid_time = now;
+		dev->bid_flags |= BLKID_BID_FL_VERIFIED;
+		cache->bic_flags |= BLKID_BIC_FL_CHANGED;
+		close(probe.fd);
+		return dev;
+	}
+
+	DBG(DEBUG_PROBE,
+	    printf("need to revalidate %s (cache time %lu, stat time %lu,\n\t"
+		   "time since last check %lu)\n",
+		   dev->bid_name, (unsigned long)dev->bid_time,
+		   (unsigned long)st.st_mtime,
+		   (unsigned long)difftime(now, dev->bid_time)));
+
 	probe.cache = cache;
 	probe.dev = dev;
 	probe.sbbuf = 0;
 	probe.buf = 0;
 	probe.buf_max = 0;
+	probe.sb_valid = 0;
+	/* If the type isn't known, read enough to cover every magic */
+	probe.sb_size = dev->bid_type ? SB_BUFFER_SIZE : blkid__probe_window();
+	use_prefetch(&probe, st.st_rdev);
 
 	/*
 	 * Iterate over the type array.  If we already know the type,
@@ -1740,6 +1870,8 @@ found_type:
 	if (dev && type) {
 		dev->bid_devno = st.st_rdev;
 		dev->bid_time = time(0);
+		dev->bid_size = blkid_get_dev_size(probe.fd);
+		dev->bid_gen = get_dev_gen(st.st_rdev);
 		dev->bid_flags |= BLKID_BID_FL_VERIFIED;
 		cache->bic_flags |= BLKID_BIC_FL_CHANGED;
 
@@ -27,6 +27,7 @@ struct blkid_probe {
 	blkid_cache		cache;
 	blkid_dev		dev;
 	unsigned char		*sbbuf;
+	size_t			sb_size;
 	size_t			sb_valid;
 	unsigned char		*buf;
 	size_t			buf_max;
@@ -57,6 +57,10 @@ static void debug_dump_dev(blkid_dev dev);
  *	The following tags may be present, depending on the device contents
  *	<LABEL="label">	(user supplied) label (volume name, etc)
  *	<UUID="uuid">	(generated) universally unique identifier (serial no)
+ *
+ *	The following tags record the device's state when it was probed
+ *	<DEVSIZE="size">  size of the device in bytes
+ *	<DEVGEN="seq">	  kernel media sequence number (diskseq)
  */
 
 static char *skip_over_blank(char *cp)
@@ -322,6 +326,10 @@ static int parse_tag(blkid_cache cache, blkid_dev dev, char **cp)
 		dev->bid_pri = strtol(value, 0, 0);
 	else if (!strcmp(name, "TIME"))
 		dev->bid_time = STRTOULL(value, 0, 0);
+	else if (!strcmp(name, "DEVSIZE"))
+		dev->bid_size = STRTOULL(value, 0, 0);
+	else if (!strcmp(name, "DEVGEN"))
+		dev->bid_gen = STRTOULL(value, 0, 0);
 	else
 		ret = blkid_set_tag(dev, name, value, strlen(value));
 
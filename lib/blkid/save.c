@@ -47,6 +47,11 @@ static int save_dev(blkid_dev dev, FILE *file)
 		(unsigned long) dev->bid_devno, (long) dev->bid_time);
 	if (dev->bid_pri)
 		fprintf(file, " PRI=\"%d\"", dev->bid_pri);
+	if (dev->bid_size)
+		fprintf(file, " DEVSIZE=\"%llu\"",
+			(unsigned long long) dev->bid_size);
+	if (dev->bid_gen)
+		fprintf(file, " DEVGEN=\"%llu\"", dev->bid_gen);
 	list_for_each(p, &dev->bid_tags) {
 		blkid_tag tag = list_entry(p, struct blkid_struct_tag, bit_tags);
 		fprintf(file, " %s=\"%s\"", tag->bit_name,tag->bit_val);
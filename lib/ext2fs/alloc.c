@@ -24,7 +24,7 @@
 #endif
 
 #include "ext2_fs.h"
-#include "ext2fs.h"
+#include "ext2fsP.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
@@ -141,8 +141,41 @@ errcode_t ext2fs_new_inode(ext2_filsys fs, ext2_ino_t dir,
 }
 
 /*
- * Stupid algorithm --- we now just search forward starting from the
- * goal.  Should put in a smarter one someday....
+ * Find the first free block between start and end inclusive which
+ * might begin a free extent of len blocks.  The group containing start
+ * is searched directly; after that, the free extent index (see
+ * freefrag.c) lets us step over whole groups without enough room.
+ */
+static errcode_t find_free_block(ext2_filsys fs, ext2fs_block_bitmap map,
+				 blk64_t start, blk64_t end, blk64_t len,
+				 blk64_t *ret)
+{
+	blk64_t		last;
+	errcode_t	retval;
+
+	while (start <= end) {
+		last = ext2fs_group_last_block2(fs,
+					ext2fs_group_of_blk2(fs, start));
+		if (last > end)
+			last = end;
+		retval = ext2fs_find_first_zero_block_bitmap2(map, start, last,
+							      ret);
+		if (retval != ENOENT || last == end)
+			return retval;
+		start = last + 1;
+		retval = ext2fs_freefrag_skip(fs, map, len, &start);
+		if (retval == ENOENT)
+			return retval;
+		if (retval)
+			return ext2fs_find_first_zero_block_bitmap2(map, start,
+								    end, ret);
+	}
+	return ENOENT;
+}
+
+/*
+ * Search forward from the goal for the first free block, then wrap
+ * around to the start of the filesystem.
  */
 errcode_t ext2fs_new_block3(ext2_filsys fs, blk64_t goal,
 			    ext2fs_block_bitmap map, blk64_t *ret,
@@ -185,11 +218,12 @@ errcode_t ext2fs_new_block3(ext2_filsys fs, blk64_t goal,
 		goal = fs->super->s_first_data_block;
 	goal &= ~EXT2FS_CLUSTER_MASK(fs);
 
-	retval = ext2fs_find_first_zero_block_bitmap2(map,
-			goal, ext2fs_blocks_count(fs->super) - 1, &b);
+	retval = find_free_block(fs, map, goal,
+				 ext2fs_blocks_count(fs->super) - 1, 1, &b);
 	if ((retval == ENOENT) && (goal != fs->super->s_first_data_block))
-		retval = ext2fs_find_first_zero_block_bitmap2(map,
-			fs->super->s_first_data_block, goal - 1, &b);
+		retval = find_free_block(fs, map,
+					 fs->super->s_first_data_block,
+					 goal - 1, 1, &b);
 allocated:
 	if (retval == ENOENT)
 		return EXT2_ET_BLOCK_ALLOC_FAIL;
@@ -444,19 +478,20 @@ errcode_t ext2fs_new_range(ext2_filsys fs, int flags, blk64_t goal,
 
 	start = goal;
 	while (!looped || start <= goal) {
-		retval = ext2fs_find_first_zero_block_bitmap2(map, start,
-							      max_blocks - 1,
-							      &start);
+		retval = find_free_block(fs, map, start, max_blocks - 1,
+					 (flags & EXT2_NEWRANGE_MIN_LENGTH) ?
+					 len : 1, &start);
 		if (retval == ENOENT) {
 			/*
 			 * If there are no free blocks beyond the starting
 			 * point, try scanning the whole filesystem, unless the
 			 * user told us only to allocate from _goal_, or if
-			 * we're already scanning the whole filesystem.
+			 * we've already scanned the whole filesystem.
 			 */
-			if (flags & EXT2_NEWRANGE_FIXED_GOAL ||
-			    start == fs->super->s_first_data_block)
+			if (flags & EXT2_NEWRANGE_FIXED_GOAL || looped ||
+			    goal == fs->super->s_first_data_block)
 				goto fail;
+			looped = 1;
 			start = fs->super->s_first_data_block;
 			continue;
 		} else if (retval)
@@ -323,6 +323,12 @@ static void ba_print_stats(ext2fs_generic_bitmap bitmap EXT2FS_ATTR((unused)))
 }
 #endif
 
+static unsigned long long ba_get_mem_usage(ext2fs_generic_bitmap bitmap)
+{
+	return ((bitmap->real_end - bitmap->start) >> 3) + 1 +
+		sizeof(struct ext2fs_ba_private_struct);
+}
+
 /* Find the first zero bit between start and end, inclusive. */
 static errcode_t ba_find_first_zero(ext2fs_generic_bitmap bitmap,
 				    __u64 start, __u64 end, __u64 *out)
@@ -488,5 +494,6 @@ struct ext2_bitmap_ops ext2fs_blkmap64_bitarray = {
 	.clear_bmap = ba_clear_bmap,
 	.print_stats = ba_print_stats,
 	.find_first_zero = ba_find_first_zero,
-	.find_first_set = ba_find_first_set
+	.find_first_set = ba_find_first_set,
+	.get_mem_usage = ba_get_mem_usage,
 };
@@ -823,9 +823,6 @@ static errcode_t rb_find_first_zero(ext2fs_generic_bitmap bitmap,
 	if (start > end)
 		return EINVAL;
 
-	if (ext2fs_rb_empty_root(&bp->root))
-		return ENOENT;
-
 	while (*n) {
 		parent = *n;
 		ext = node_to_extent(parent);
@@ -959,6 +956,21 @@ static void rb_print_stats(ext2fs_generic_bitmap bitmap EXT2FS_ATTR((unused)))
 }
 #endif
 
+static unsigned long long rb_get_mem_usage(ext2fs_generic_bitmap bitmap)
+{
+	struct ext2fs_rb_private *bp;
+	struct rb_node *node;
+	unsigned long long count = 0;
+
+	bp = (struct ext2fs_rb_private *) bitmap->private;
+	for (node = ext2fs_rb_first(&bp->root); node != NULL;
+	     node = ext2fs_rb_next(node))
+		count++;
+
+	return count * sizeof(struct bmap_rb_extent) +
+		sizeof(struct ext2fs_rb_private);
+}
+
 struct ext2_bitmap_ops ext2fs_blkmap64_rbtree = {
 	.type = EXT2FS_BMAP64_RBTREE,
 	.new_bmap = rb_new_bmap,
@@ -977,4 +989,5 @@ struct ext2_bitmap_ops ext2fs_blkmap64_rbtree = {
 	.print_stats = rb_print_stats,
 	.find_first_zero = rb_find_first_zero,
 	.find_first_set = rb_find_first_set,
+	.get_mem_usage = rb_get_mem_usage,
 };
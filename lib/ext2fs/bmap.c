@@ -297,9 +297,16 @@ int ext2fs_file_block_offset_too_big(ext2_filsys fs,
 	return offset >= max_map_block;
 }
 
-errcode_t ext2fs_bmap2(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
-		       char *block_buf, int bmap_flags, blk64_t block,
-		       int *ret_flags, blk64_t *phys_blk)
+/*
+ * Like ext2fs_bmap2(), but takes an extent handle which the caller keeps
+ * open on the inode between calls, so that successive lookups can start
+ * from the leaf the last one ended in.  The handle must have been opened
+ * on this inode structure; if it is NULL one is opened for the call.
+ */
+errcode_t ext2fs_bmap3(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
+		       ext2_extent_handle_t ext_handle, char *block_buf,
+		       int bmap_flags, blk64_t block, int *ret_flags,
+		       blk64_t *phys_blk)
 {
 	struct ext2_inode inode_buf;
 	ext2_extent_handle_t handle = 0;
@@ -349,10 +356,13 @@ errcode_t ext2fs_bmap2(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
 	}
 
 	if (inode->i_flags & EXT4_EXTENTS_FL) {
-		retval = ext2fs_extent_open2(fs, ino, inode, &handle);
-		if (retval)
-			goto done;
-		retval = extent_bmap(fs, ino, inode, handle, block_buf,
+		if (!ext_handle) {
+			retval = ext2fs_extent_open2(fs, ino, inode, &handle);
+			if (retval)
+				goto done;
+			ext_handle = handle;
+		}
+		retval = extent_bmap(fs, ino, inode, ext_handle, block_buf,
 				     bmap_flags, block, ret_flags,
 				     &blocks_alloc, phys_blk);
 		goto done;
@@ -479,6 +489,134 @@ done:
 	return retval;
 }
 
+errcode_t ext2fs_bmap2(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
+		       char *block_buf, int bmap_flags, blk64_t block,
+		       int *ret_flags, blk64_t *phys_blk)
+{
+	return ext2fs_bmap3(fs, ino, inode, NULL, block_buf, bmap_flags,
+			    block, ret_flags, phys_blk);
+}
+
+/*
+ * Map the logical range [lblk, lblk + count) of a file.  Each mapped
+ * piece of the range is returned, in order, as an extent clipped to the
+ * range; holes are left out.  At most max_extents are returned, so if
+ * *ret_count == max_extents the caller should carry on from the end of
+ * the last one.  ext_handle is as for ext2fs_bmap3().
+ */
+errcode_t ext2fs_bmap_range(ext2_filsys fs, ext2_ino_t ino,
+			    struct ext2_inode *inode,
+			    ext2_extent_handle_t ext_handle,
+			    blk64_t lblk, blk64_t count,
+			    struct ext2fs_extent *extents, int max_extents,
+			    int *ret_count)
+{
+	struct ext2_inode	inode_buf;
+	ext2_extent_handle_t	handle = 0;
+	struct ext2fs_extent	extent, *out;
+	blk64_t			end = lblk + count, start, pblk;
+	char			*buf = 0;
+	int			n = 0, op;
+	errcode_t		retval = 0;
+
+	*ret_count = 0;
+	if (count == 0 || max_extents <= 0)
+		return 0;
+
+	if (!inode) {
+		retval = ext2fs_read_inode(fs, ino, &inode_buf);
+		if (retval)
+			return retval;
+		inode = &inode_buf;
+	}
+	if (inode->i_flags & EXT4_INLINE_DATA_FL)
+		return EXT2_ET_INLINE_DATA_NO_BLOCK;
+
+	if (!(inode->i_flags & EXT4_EXTENTS_FL)) {
+		/* Block mapped; look the blocks up one at a time */
+		retval = ext2fs_get_array(2, fs->blocksize, &buf);
+		if (retval)
+			return retval;
+		for (start = lblk; start < end; start++) {
+			if (ext2fs_file_block_offset_too_big(fs, inode, start))
+				break;
+			retval = ext2fs_bmap2(fs, ino, inode, buf, 0, start,
+					      0, &pblk);
+			if (retval)
+				goto out;
+			if (!pblk)
+				continue;
+			out = extents + n - 1;
+			if (n && out->e_lblk + out->e_len == start &&
+			    out->e_pblk + out->e_len == pblk) {
+				out->e_len++;
+				continue;
+			}
+			if (n == max_extents)
+				break;
+			out = extents + n++;
+			out->e_lblk = start;
+			out->e_pblk = pblk;
+			out->e_len = 1;
+			out->e_flags = 0;
+		}
+		goto out;
+	}
+
+	if (!ext_handle) {
+		retval = ext2fs_extent_open2(fs, ino, inode, &handle);
+		if (retval)
+			return retval;
+		ext_handle = handle;
+	}
+
+	/*
+	 * Land on the extent holding lblk, or the last one before it,
+	 * and walk forward through the leaves from there.  The goto may
+	 * leave the index above the leaf looking unvisited, in which case
+	 * the walk comes back through the leaf once more; lblk moves past
+	 * each extent returned so that they are skipped the second time.
+	 */
+	retval = ext2fs_extent_goto(ext_handle, lblk);
+	if (retval && retval != EXT2_ET_EXTENT_NOT_FOUND)
+		goto out;
+	op = EXT2_EXTENT_CURRENT;
+	while (n < max_extents) {
+		retval = ext2fs_extent_get(ext_handle, op, &extent);
+		op = EXT2_EXTENT_NEXT_LEAF;
+		if (retval == EXT2_ET_EXTENT_NO_NEXT ||
+		    retval == EXT2_ET_NO_CURRENT_NODE) {
+			retval = 0;
+			break;
+		}
+		if (retval)
+			goto out;
+		if (!(extent.e_flags & EXT2_EXTENT_FLAGS_LEAF))
+			continue;
+		if (extent.e_lblk >= end)
+			break;
+		if (extent.e_lblk + extent.e_len <= lblk)
+			continue;
+
+		out = extents + n++;
+		start = extent.e_lblk > lblk ? extent.e_lblk : lblk;
+		out->e_lblk = start;
+		out->e_pblk = extent.e_pblk + (start - extent.e_lblk);
+		out->e_len = extent.e_lblk + extent.e_len - start;
+		if (out->e_lblk + out->e_len > end)
+			out->e_len = end - out->e_lblk;
+		out->e_flags = extent.e_flags & EXT2_EXTENT_FLAGS_UNINIT;
+		lblk = out->e_lblk + out->e_len;
+	}
+out:
+	*ret_count = n;
+	if (buf)
+		ext2fs_free_mem(&buf);
+	if (handle)
+		ext2fs_extent_free(handle);
+	return retval;
+}
+
 errcode_t ext2fs_bmap(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
 		      char *block_buf, int bmap_flags, blk_t block,
 		      blk_t *phys_blk)
@@ -495,3 +633,330 @@ errcode_t ext2fs_bmap(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
 	*phys_blk = ret_blk;
 	return 0;
 }
+
+#ifdef DEBUG
+/*
+ * Test the extent leaf lookup (ext2fs_extent_goto() on a handle which
+ * already sits in a leaf) against freshly opened handles, and
+ * ext2fs_bmap_range() against ext2fs_bmap2(), on a file big enough for
+ * a two level extent tree.
+ */
+#include <stdlib.h>
+
+#define TST_EXTENTS	1000		/* extents of two blocks each */
+#define TST_BLOCKS	(TST_EXTENTS * 3 + 64)
+#define TST_DATA	20000		/* where the extent file's data goes */
+#define TST_IND_DATA	40000		/* and the block mapped file's */
+#define TST_IND_BLOCKS	600
+
+static int failures;
+
+static blk64_t	ref_pblk[TST_BLOCKS];
+static int	ref_uninit[TST_BLOCKS];
+
+static void tst_fail(const char *what, ext2_ino_t ino, blk64_t blk,
+		     errcode_t retval)
+{
+	printf("inode %u, block %llu: %s", ino, blk, what);
+	if (retval)
+		printf(" (%s)", error_message(retval));
+	printf("\n");
+	failures++;
+}
+
+/*
+ * Check that ext2fs_extent_goto() leaves handle where it leaves a
+ * freshly opened one, and (if walk is set) that both go on to the same
+ * places with EXT2_EXTENT_NEXT.  Without walk, handle stays in its leaf
+ * and the next lookup in that leaf is served from it.
+ */
+static void check_goto(ext2_filsys fs, ext2_ino_t ino,
+		       ext2_extent_handle_t handle, blk64_t blk, int walk)
+{
+	ext2_extent_handle_t	fresh;
+	struct ext2fs_extent	e1, e2;
+	struct ext2_extent_info	i1, i2;
+	errcode_t		r1, r2;
+	int			step;
+
+	r2 = ext2fs_extent_open(fs, ino, &fresh);
+	if (r2) {
+		tst_fail("can't open extent handle", ino, blk, r2);
+		return;
+	}
+	r1 = ext2fs_extent_goto(handle, blk);
+	r2 = ext2fs_extent_goto(fresh, blk);
+	if (r1 != r2) {
+		tst_fail("goto results differ", ino, blk, r1 ? r1 : r2);
+		goto out;
+	}
+	if (r1 && r1 != EXT2_ET_EXTENT_NOT_FOUND)
+		goto out;
+	for (step = 0; step <= (walk ? 3 : 0); step++) {
+		r1 = ext2fs_extent_get(handle, step ? EXT2_EXTENT_NEXT :
+				       EXT2_EXTENT_CURRENT, &e1);
+		r2 = ext2fs_extent_get(fresh, step ? EXT2_EXTENT_NEXT :
+				       EXT2_EXTENT_CURRENT, &e2);
+		if (r1 != r2) {
+			tst_fail("walk results differ", ino, blk,
+				 r1 ? r1 : r2);
+			break;
+		}
+		if (r1)
+			break;
+		ext2fs_extent_get_info(handle, &i1);
+		ext2fs_extent_get_info(fresh, &i2);
+		if (e1.e_lblk != e2.e_lblk || e1.e_pblk != e2.e_pblk ||
+		    e1.e_len != e2.e_len || e1.e_flags != e2.e_flags ||
+		    i1.curr_level != i2.curr_level ||
+		    i1.curr_entry != i2.curr_entry) {
+			tst_fail(step ? "handles part ways" :
+				 "handles land apart", ino, blk, 0);
+			break;
+		}
+	}
+out:
+	ext2fs_extent_free(fresh);
+}
+
+static void check_gotos(ext2_filsys fs, ext2_ino_t ino,
+			ext2_extent_handle_t handle)
+{
+	blk64_t	blk;
+
+	for (blk = 0; blk < TST_BLOCKS; blk++)
+		check_goto(fs, ino, handle, blk, 0);
+	for (blk = TST_BLOCKS; blk-- > 0; )
+		check_goto(fs, ino, handle, blk, 0);
+	for (blk = 0; blk < TST_BLOCKS; blk += 37)
+		check_goto(fs, ino, handle, blk, 1);
+}
+
+static void load_ref(ext2_filsys fs, ext2_ino_t ino, blk64_t nblocks)
+{
+	blk64_t		blk;
+	errcode_t	retval;
+	int		flags;
+
+	for (blk = 0; blk < nblocks; blk++) {
+		retval = ext2fs_bmap2(fs, ino, NULL, NULL, 0, blk, &flags,
+				      &ref_pblk[blk]);
+		if (retval)
+			tst_fail("bmap2 failed", ino, blk, retval);
+		ref_uninit[blk] = !!(flags & BMAP_RET_UNINIT);
+	}
+}
+
+/* Check one ext2fs_bmap_range() call against the per-block mapping */
+static void check_range(ext2_filsys fs, ext2_ino_t ino,
+			ext2_extent_handle_t handle, blk64_t start,
+			blk64_t count, int max)
+{
+	struct ext2fs_extent	ext[64], *e;
+	blk64_t			next = start, blk;
+	errcode_t		retval;
+	int			i, n;
+
+	retval = ext2fs_bmap_range(fs, ino, NULL, handle, start, count,
+				   ext, max, &n);
+	if (retval) {
+		tst_fail("bmap_range failed", ino, start, retval);
+		return;
+	}
+	if (n < 0 || n > max) {
+		tst_fail("bmap_range returned too many extents", ino, start,
+			 0);
+		return;
+	}
+	for (i = 0, e = ext; i < n; i++, e++) {
+		if (e->e_lblk < next || !e->e_len ||
+		    e->e_lblk + e->e_len > start + count) {
+			tst_fail("extent out of order or out of range", ino,
+				 e->e_lblk, 0);
+			return;
+		}
+		for (blk = next; blk < e->e_lblk; blk++)
+			if (ref_pblk[blk])
+				tst_fail("mapped block left out", ino, blk, 0);
+		for (blk = e->e_lblk; blk < e->e_lblk + e->e_len; blk++)
+			if (ref_pblk[blk] != e->e_pblk + blk - e->e_lblk ||
+			    ref_uninit[blk] !=
+			    !!(e->e_flags & EXT2_EXTENT_FLAGS_UNINIT))
+				tst_fail("block mapped wrongly", ino, blk, 0);
+		next = e->e_lblk + e->e_len;
+	}
+	if (n < max)
+		for (blk = next; blk < start + count; blk++)
+			if (ref_pblk[blk])
+				tst_fail("mapped block left out", ino, blk, 0);
+}
+
+static void check_ranges(ext2_filsys fs, ext2_ino_t ino,
+			 ext2_extent_handle_t handle, blk64_t nblocks)
+{
+	static const blk64_t	counts[] = { 1, 2, 5, 64, 300, 1000 };
+	static const int	maxes[] = { 1, 3, 64 };
+	blk64_t			start;
+	unsigned int		c, m;
+
+	load_ref(fs, ino, nblocks);
+	for (start = 0; start < nblocks; start += 13)
+		for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+			if (start + counts[c] > nblocks)
+				continue;
+			for (m = 0; m < sizeof(maxes) / sizeof(maxes[0]); m++)
+				check_range(fs, ino, handle, start, counts[c],
+					    maxes[m]);
+		}
+}
+
+static ext2_ino_t new_file(ext2_filsys fs, struct ext2_inode *inode,
+			   int extents)
+{
+	ext2_ino_t	ino;
+	errcode_t	retval;
+
+	retval = ext2fs_new_inode(fs, EXT2_ROOT_INO, LINUX_S_IFREG | 0644,
+				  0, &ino);
+	if (retval) {
+		com_err("tst_bmap", retval, "while allocating an inode");
+		exit(1);
+	}
+	ext2fs_inode_alloc_stats2(fs, ino, +1, 0);
+	memset(inode, 0, sizeof(struct ext2_inode));
+	inode->i_mode = LINUX_S_IFREG | 0644;
+	inode->i_links_count = 1;
+	if (extents)
+		inode->i_flags = EXT4_EXTENTS_FL;
+	retval = ext2fs_write_new_inode(fs, ino, inode);
+	if (retval) {
+		com_err("tst_bmap", retval, "while writing inode %u", ino);
+		exit(1);
+	}
+	return ino;
+}
+
+int main(int argc, char **argv)
+{
+	struct ext2_super_block param;
+	struct ext2_inode	inode;
+	struct ext2fs_extent	extent;
+	ext2_extent_handle_t	handle;
+	ext2_filsys		fs;
+	ext2_ino_t		ino;
+	blk64_t			lblk, pblk;
+	errcode_t		retval;
+	char			fn[] = "/tmp/tst_bmap.XXXXXX";
+	int			fd, i, k, flags;
+
+	initialize_ext2_error_table();
+
+	fd = mkstemp(fn);
+	if (fd < 0 || ftruncate(fd, 65536 * 1024) < 0) {
+		perror("tst_bmap: creating test file");
+		exit(1);
+	}
+	close(fd);
+
+	memset(&param, 0, sizeof(param));
+	ext2fs_blocks_count_set(&param, 65536);
+	param.s_feature_incompat = EXT3_FEATURE_INCOMPAT_EXTENTS;
+	retval = ext2fs_initialize(fn, EXT2_FLAG_RW | EXT2_FLAG_64BITS,
+				   &param, unix_io_manager, &fs);
+	if (!retval)
+		retval = ext2fs_allocate_tables(fs);
+	if (retval) {
+		com_err("tst_bmap", retval, "while setting up filesystem");
+		unlink(fn);
+		exit(1);
+	}
+
+	/*
+	 * Two block extents with a hole after each, every fifth one
+	 * uninitialized, inserted in scattered order so that leaves are
+	 * split in the middle as well as at the end.  After each batch the
+	 * handle which did the inserting must still find its way around.
+	 */
+	ext2fs_block_alloc_stats_range(fs, TST_DATA, TST_EXTENTS * 3, +1);
+	ino = new_file(fs, &inode, 1);
+	retval = ext2fs_extent_open2(fs, ino, &inode, &handle);
+	if (retval) {
+		com_err("tst_bmap", retval, "while opening extent handle");
+		exit(1);
+	}
+	for (k = 0; k < TST_EXTENTS; k++) {
+		i = (k * 379) % TST_EXTENTS;
+		lblk = i * 3;
+		pblk = TST_DATA + i * 3;
+		flags = (i % 5) ? 0 : EXT2_EXTENT_SET_BMAP_UNINIT;
+		retval = ext2fs_extent_set_bmap(handle, lblk, pblk, flags);
+		if (!retval)
+			retval = ext2fs_extent_set_bmap(handle, lblk + 1,
+							pblk + 1, flags);
+		if (retval) {
+			tst_fail("set_bmap failed", ino, lblk, retval);
+			break;
+		}
+		if (k % 100 == 99)
+			check_gotos(fs, ino, handle);
+	}
+
+	/*
+	 * Make two extents overlap.  The leaf is no longer in order, so
+	 * lookups in it must not be served from the cached leaf; then put
+	 * it back.
+	 */
+	retval = ext2fs_extent_goto(handle, 300);
+	if (!retval)
+		retval = ext2fs_extent_get(handle, EXT2_EXTENT_CURRENT,
+					   &extent);
+	if (!retval) {
+		extent.e_lblk = 297;
+		retval = ext2fs_extent_replace(handle, 0, &extent);
+	}
+	if (retval)
+		tst_fail("can't make extents overlap", ino, 300, retval);
+	for (lblk = 280; lblk < 320; lblk++)
+		check_goto(fs, ino, handle, lblk, 0);
+	retval = ext2fs_extent_get(handle, EXT2_EXTENT_ROOT, &extent);
+	while (!retval && extent.e_pblk != TST_DATA + 300)
+		retval = ext2fs_extent_get(handle, EXT2_EXTENT_NEXT_LEAF,
+					   &extent);
+	if (!retval) {
+		extent.e_lblk = 300;
+		retval = ext2fs_extent_replace(handle, 0, &extent);
+	}
+	if (retval)
+		tst_fail("can't restore extent", ino, 300, retval);
+	check_gotos(fs, ino, handle);
+
+	check_ranges(fs, ino, handle, TST_BLOCKS);
+	check_ranges(fs, ino, NULL, TST_BLOCKS);
+	ext2fs_extent_free(handle);
+
+	/* A block mapped file, through the direct and indirect blocks */
+	ext2fs_block_alloc_stats_range(fs, TST_IND_DATA, TST_IND_BLOCKS, +1);
+	ino = new_file(fs, &inode, 0);
+	for (lblk = 0; lblk < TST_IND_BLOCKS; lblk++) {
+		if (lblk % 7 >= 4)
+			continue;
+		pblk = TST_IND_DATA + lblk;
+		retval = ext2fs_bmap2(fs, ino, &inode, NULL,
+				      BMAP_ALLOC | BMAP_SET, lblk, 0, &pblk);
+		if (retval) {
+			tst_fail("bmap2 set failed", ino, lblk, retval);
+			break;
+		}
+	}
+	check_ranges(fs, ino, NULL, TST_IND_BLOCKS);
+
+	ext2fs_free(fs);
+	unlink(fn);
+	if (failures) {
+		printf("tst_bmap: %d failures\n", failures);
+		return 1;
+	}
+	printf("tst_bmap: OK\n");
+	return 0;
+}
+#endif
@@ -48,11 +48,30 @@ struct ext2fs_struct_generic_bitmap {
 	char			*description;
 	void			*private;
 	errcode_t		base_error_code;
+	struct ext2fs_lazy_bitmap	*lazy;
+	struct ext2fs_freefrag		*freefrag;	/* see freefrag.c */
 #ifdef ENABLE_BMAP_STATS
 	struct ext2_bmap_statistics	stats;
 #endif
 };
 
+/*
+ * State of a filesystem bitmap whose groups are read in from disk on
+ * first access (see EXT2_FLAG_LAZY_BITMAPS and rw_bitmaps.c).
+ */
+struct ext2fs_lazy_bitmap {
+	__u32		per_group;	/* bits per block group */
+	dgrp_t		unloaded;	/* groups not yet read in */
+	int		depth;		/* nesting of ext2fs_lazy_bitmap_load */
+	int		reported;	/* error has been reported */
+	errcode_t	error;		/* error of the first group to fail */
+	char		*loaded;	/* bitmap of groups already read in */
+	char		*failed;	/* groups which failed to load */
+	char		*uninit;	/* groups with no on-disk bitmap */
+	char		*block_uninit;	/* BLOCK_UNINIT groups at open time */
+	char		*buf;		/* I/O buffer for one bitmap block */
+};
+
 #define EXT2FS_IS_32_BITMAP(bmap) \
 	(((bmap)->magic == EXT2_ET_MAGIC_GENERIC_BITMAP) || \
 	 ((bmap)->magic == EXT2_ET_MAGIC_BLOCK_BITMAP) || \
@@ -98,6 +117,9 @@ struct ext2_bitmap_ops {
 	 * May be NULL, in which case a generic function is used. */
 	errcode_t (*find_first_set)(ext2fs_generic_bitmap bitmap,
 				    __u64 start, __u64 end, __u64 *out);
+	/* Return the number of bytes of memory used by the bitmap.
+	 * May be NULL, in which case 0 is reported. */
+	unsigned long long (*get_mem_usage)(ext2fs_generic_bitmap bitmap);
 };
 
 extern struct ext2_bitmap_ops ext2fs_blkmap64_bitarray;
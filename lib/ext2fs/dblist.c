@@ -23,27 +23,219 @@
 static EXT2_QSORT_TYPE dir_block_cmp(const void *a, const void *b);
 static EXT2_QSORT_TYPE dir_block_cmp2(const void *a, const void *b);
 static EXT2_QSORT_TYPE (*sortfunc32)(const void *a, const void *b);
+static void dblist_sort(ext2_dblist dblist,
+			EXT2_QSORT_TYPE (*sortfunc)(const void *,
+						    const void *));
+
+/*
+ * A directory block list can hold hundreds of millions of entries, so
+ * only the most recently added ones are kept as an array of struct
+ * ext2_db_entry2.  Every DBLIST_CHUNK entries are packed into a chunk,
+ * where each entry is stored relative to the one before it: a byte of
+ * flags saying which of the inode, block and logical block numbers do
+ * not simply follow on from the previous entry, and then a zigzag
+ * varint for each of those.  The blocks of a directory are usually
+ * contiguous, so most entries take a single byte.  Every chunk holds
+ * exactly DBLIST_CHUNK entries, so the chunk holding a given position
+ * is found directly; chunks also record the range of inodes in them.
+ * Chunks are unpacked into a small buffer to be iterated over, and
+ * packed again if the iterator changed any entry.
+ */
+#define DBLIST_CHUNK		256
+
+#define DB_INO_CHANGED		0x01
+#define DB_BLK_CHANGED		0x02
+#define DB_BLOCKCNT_CHANGED	0x04
+
+/* Longest possible encoding of an entry */
+#define DB_MAX_ENCODED		(1 + 3 * 10)
+
+#define ZIGZAG(x)	(((__u64) (x) << 1) ^ (__u64) ((__s64) (x) >> 63))
+#define UNZIGZAG(x)	((__s64) ((x) >> 1) ^ -(__s64) ((x) & 1))
+
+static unsigned long long packed_count(ext2_dblist dblist)
+{
+	return dblist->nr_chunks * DBLIST_CHUNK;
+}
+
+static unsigned char *put_varint(unsigned char *p, __u64 v)
+{
+	while (v >= 0x80) {
+		*p++ = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static const unsigned char *get_varint(const unsigned char *p, __u64 *ret)
+{
+	__u64	v = 0;
+	int	shift = 0;
+
+	while (*p & 0x80) {
+		v |= (__u64) (*p++ & 0x7f) << shift;
+		shift += 7;
+	}
+	*ret = v | ((__u64) *p++ << shift);
+	return p;
+}
+
+static unsigned char *encode_entry(unsigned char *p,
+				   const struct ext2_db_entry2 *prev,
+				   const struct ext2_db_entry2 *db)
+{
+	unsigned char	*flags = p++;
+	e2_blkcnt_t	next_cnt;
+
+	next_cnt = db->ino == prev->ino ? prev->blockcnt + 1 : 0;
+	*flags = 0;
+	if (db->ino != prev->ino) {
+		*flags |= DB_INO_CHANGED;
+		p = put_varint(p, ZIGZAG((__s64) db->ino - (__s64) prev->ino));
+	}
+	if (db->blk != prev->blk + 1) {
+		*flags |= DB_BLK_CHANGED;
+		p = put_varint(p, ZIGZAG(db->blk - prev->blk));
+	}
+	if (db->blockcnt != next_cnt) {
+		*flags |= DB_BLOCKCNT_CHANGED;
+		p = put_varint(p, ZIGZAG((__u64) db->blockcnt -
+					 (__u64) next_cnt));
+	}
+	return p;
+}
+
+static const unsigned char *decode_entry(const unsigned char *p,
+					 const struct ext2_db_entry2 *prev,
+					 struct ext2_db_entry2 *db)
+{
+	unsigned char	flags = *p++;
+	__u64		v;
+
+	db->ino = prev->ino;
+	if (flags & DB_INO_CHANGED) {
+		p = get_varint(p, &v);
+		db->ino += UNZIGZAG(v);
+	}
+	db->blk = prev->blk + 1;
+	if (flags & DB_BLK_CHANGED) {
+		p = get_varint(p, &v);
+		db->blk = prev->blk + UNZIGZAG(v);
+	}
+	db->blockcnt = db->ino == prev->ino ? prev->blockcnt + 1 : 0;
+	if (flags & DB_BLOCKCNT_CHANGED) {
+		p = get_varint(p, &v);
+		db->blockcnt = (__u64) db->blockcnt + UNZIGZAG(v);
+	}
+	return p;
+}
+
+/* Pack count entries into chunk, replacing whatever it held */
+static errcode_t pack_chunk(struct ext2_dblist_chunk *chunk,
+			    const struct ext2_db_entry2 *list,
+			    unsigned int count)
+{
+	unsigned char		buf[DBLIST_CHUNK * DB_MAX_ENCODED];
+	unsigned char		*p = buf;
+	struct ext2_db_entry2	zero;
+	unsigned char		*data;
+	errcode_t		retval;
+	unsigned int		i;
+
+	memset(&zero, 0, sizeof(zero));
+	chunk->min_ino = chunk->max_ino = count ? list[0].ino : 0;
+	for (i = 0; i < count; i++) {
+		p = encode_entry(p, i ? list + i - 1 : &zero, list + i);
+		if (list[i].ino < chunk->min_ino)
+			chunk->min_ino = list[i].ino;
+		if (list[i].ino > chunk->max_ino)
+			chunk->max_ino = list[i].ino;
+	}
+	retval = ext2fs_get_mem(p - buf, &data);
+	if (retval)
+		return retval;
+	memcpy(data, buf, p - buf);
+	if (chunk->data)
+		ext2fs_free_mem(&chunk->data);
+	chunk->data = data;
+	chunk->len = p - buf;
+	chunk->count = count;
+	return 0;
+}
+
+static void unpack_chunk(const struct ext2_dblist_chunk *chunk,
+			 struct ext2_db_entry2 *list)
+{
+	const unsigned char	*p = chunk->data;
+	struct ext2_db_entry2	zero;
+	unsigned int		i;
+
+	memset(&zero, 0, sizeof(zero));
+	for (i = 0; i < chunk->count; i++)
+		p = decode_entry(p, i ? list + i - 1 : &zero, list + i);
+}
+
+/* Pack count entries into a new chunk at the end of the list */
+static errcode_t add_chunk(ext2_dblist dblist,
+			   const struct ext2_db_entry2 *list,
+			   unsigned int count)
+{
+	struct ext2_dblist_chunk	*chunk;
+	unsigned long long		new_max;
+	errcode_t			retval;
+
+	if (dblist->nr_chunks == dblist->max_chunks) {
+		new_max = dblist->max_chunks + dblist->max_chunks / 2 + 16;
+		retval = ext2fs_resize_mem(dblist->max_chunks *
+				sizeof(struct ext2_dblist_chunk),
+				new_max * sizeof(struct ext2_dblist_chunk),
+				&dblist->chunks);
+		if (retval)
+			return retval;
+		dblist->max_chunks = new_max;
+	}
+	chunk = dblist->chunks + dblist->nr_chunks;
+	memset(chunk, 0, sizeof(*chunk));
+	retval = pack_chunk(chunk, list, count);
+	if (retval)
+		return retval;
+	dblist->nr_chunks++;
+	return 0;
+}
+
+/* Move the last chunk back into the array */
+static void unpack_last_chunk(ext2_dblist dblist)
+{
+	struct ext2_dblist_chunk *chunk;
+
+	chunk = dblist->chunks + --dblist->nr_chunks;
+	unpack_chunk(chunk, dblist->list);
+	ext2fs_free_mem(&chunk->data);
+}
+
+static void free_chunks(ext2_dblist dblist)
+{
+	unsigned long long	i;
+
+	for (i = 0; i < dblist->nr_chunks; i++)
+		ext2fs_free_mem(&dblist->chunks[i].data);
+	if (dblist->chunks)
+		ext2fs_free_mem(&dblist->chunks);
+	dblist->nr_chunks = dblist->max_chunks = 0;
+}
 
 /*
  * helper function for making a new directory block list (for
  * initialize and copy).
  */
-static errcode_t make_dblist(ext2_filsys fs, ext2_ino_t size,
-			     ext2_ino_t count,
-			     struct ext2_db_entry2 *list,
-			     ext2_dblist *ret_dblist)
+static errcode_t make_dblist(ext2_filsys fs, ext2_dblist *ret_dblist)
 {
 	ext2_dblist	dblist = NULL;
 	errcode_t	retval;
-	ext2_ino_t	num_dirs;
-	size_t		len;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
-	if ((ret_dblist == 0) && fs->dblist &&
-	    (fs->dblist->magic == EXT2_ET_MAGIC_DBLIST))
-		return 0;
-
 	retval = ext2fs_get_mem(sizeof(struct ext2_struct_dblist), &dblist);
 	if (retval)
 		goto cleanup;
@@ -51,29 +243,13 @@ static errcode_t make_dblist(ext2_filsys fs, ext2_ino_t size,
 
 	dblist->magic = EXT2_ET_MAGIC_DBLIST;
 	dblist->fs = fs;
-	if (size)
-		dblist->size = size;
-	else {
-		retval = ext2fs_get_num_dirs(fs, &num_dirs);
-		if (retval)
-			goto cleanup;
-		dblist->size = (num_dirs * 2) + 12;
-	}
-	len = (size_t) sizeof(struct ext2_db_entry2) * dblist->size;
-	dblist->count = count;
+	dblist->size = DBLIST_CHUNK;
 	retval = ext2fs_get_array(dblist->size, sizeof(struct ext2_db_entry2),
 		&dblist->list);
 	if (retval)
 		goto cleanup;
 
-	if (list)
-		memcpy(dblist->list, list, len);
-	else
-		memset(dblist->list, 0, len);
-	if (ret_dblist)
-		*ret_dblist = dblist;
-	else
-		fs->dblist = dblist;
+	*ret_dblist = dblist;
 	return 0;
 cleanup:
 	if (dblist)
@@ -89,11 +265,12 @@ errcode_t ext2fs_init_dblist(ext2_filsys fs, ext2_dblist *ret_dblist)
 	ext2_dblist	dblist;
 	errcode_t	retval;
 
-	retval = make_dblist(fs, 0, 0, 0, &dblist);
+	retval = make_dblist(fs, &dblist);
 	if (retval)
 		return retval;
 
 	dblist->sorted = 1;
+	dblist->default_order = 1;
 	if (ret_dblist)
 		*ret_dblist = dblist;
 	else
@@ -109,14 +286,49 @@ errcode_t ext2fs_copy_dblist(ext2_dblist src, ext2_dblist *dest)
 {
 	ext2_dblist	dblist;
 	errcode_t	retval;
+	unsigned long long i, unpacked;
 
-	retval = make_dblist(src->fs, src->size, src->count, src->list,
-			     &dblist);
+	retval = make_dblist(src->fs, &dblist);
 	if (retval)
 		return retval;
+	unpacked = src->count - packed_count(src);
+	if (unpacked > dblist->size) {
+		retval = ext2fs_resize_mem(0, unpacked *
+					   sizeof(struct ext2_db_entry2),
+					   &dblist->list);
+		if (retval)
+			goto errout;
+		dblist->size = unpacked;
+	}
+	memcpy(dblist->list, src->list,
+	       unpacked * sizeof(struct ext2_db_entry2));
+	if (src->nr_chunks) {
+		retval = ext2fs_get_arrayzero(src->nr_chunks,
+					      sizeof(struct ext2_dblist_chunk),
+					      &dblist->chunks);
+		if (retval)
+			goto errout;
+		dblist->max_chunks = src->nr_chunks;
+	}
+	for (i = 0; i < src->nr_chunks; i++) {
+		dblist->chunks[i] = src->chunks[i];
+		dblist->chunks[i].data = NULL;
+		retval = ext2fs_get_mem(src->chunks[i].len,
+					&dblist->chunks[i].data);
+		if (retval)
+			goto errout;
+		memcpy(dblist->chunks[i].data, src->chunks[i].data,
+		       src->chunks[i].len);
+		dblist->nr_chunks++;
+	}
+	dblist->count = src->count;
 	dblist->sorted = src->sorted;
+	dblist->default_order = src->default_order;
 	*dest = dblist;
 	return 0;
+errout:
+	ext2fs_free_dblist(dblist);
+	return retval;
 }
 
 /*
@@ -125,6 +337,25 @@ errcode_t ext2fs_copy_dblist(ext2_dblist src, ext2_dblist *dest)
  * (moved to closefs.c)
  */
 
+/* Return the last entry of the list, which must not be empty */
+static void get_last(ext2_dblist dblist, struct ext2_db_entry2 *last)
+{
+	struct ext2_dblist_chunk	*chunk;
+	const unsigned char		*p;
+	struct ext2_db_entry2		prev;
+	unsigned int			i;
+
+	if (dblist->count > packed_count(dblist)) {
+		*last = dblist->list[dblist->count - packed_count(dblist) - 1];
+		return;
+	}
+	chunk = dblist->chunks + dblist->nr_chunks - 1;
+	memset(&prev, 0, sizeof(prev));
+	for (i = 0, p = chunk->data; i < chunk->count; i++) {
+		p = decode_entry(p, &prev, last);
+		prev = *last;
+	}
+}
 
 /*
  * Add a directory block to the directory block list
@@ -132,13 +363,37 @@ errcode_t ext2fs_copy_dblist(ext2_dblist src, ext2_dblist *dest)
 errcode_t ext2fs_add_dir_block2(ext2_dblist dblist, ext2_ino_t ino,
 				blk64_t blk, e2_blkcnt_t blockcnt)
 {
-	struct ext2_db_entry2 	*new_entry;
+	struct ext2_db_entry2 	*new_entry, db, last;
 	errcode_t		retval;
 	unsigned long		old_size;
+	unsigned long long	unpacked;
 
 	EXT2_CHECK_MAGIC(dblist, EXT2_ET_MAGIC_DBLIST);
 
-	if (dblist->count >= dblist->size) {
+	/*
+	 * Directory blocks are mostly added in block order; as long as
+	 * they are, the list does not need to be sorted again.
+	 */
+	db.ino = ino;
+	db.blk = blk;
+	db.blockcnt = blockcnt;
+	if (dblist->default_order && dblist->count) {
+		get_last(dblist, &last);
+		if (dir_block_cmp2(&last, &db) > 0) {
+			dblist->sorted = 0;
+			dblist->default_order = 0;
+		}
+	} else if (!dblist->default_order)
+		dblist->sorted = 0;
+
+	unpacked = dblist->count - packed_count(dblist);
+	if (unpacked == DBLIST_CHUNK) {
+		retval = add_chunk(dblist, dblist->list, DBLIST_CHUNK);
+		if (retval)
+			return retval;
+		unpacked = 0;
+	}
+	if (unpacked >= dblist->size) {
 		old_size = dblist->size * sizeof(struct ext2_db_entry2);
 		dblist->size += dblist->size > 200 ? dblist->size / 2 : 100;
 		retval = ext2fs_resize_mem(old_size, (size_t) dblist->size *
@@ -149,12 +404,9 @@ errcode_t ext2fs_add_dir_block2(ext2_dblist dblist, ext2_ino_t ino,
 			return retval;
 		}
 	}
-	new_entry = dblist->list + ( dblist->count++);
-	new_entry->blk = blk;
-	new_entry->ino = ino;
-	new_entry->blockcnt = blockcnt;
-
-	dblist->sorted = 0;
+	new_entry = dblist->list + unpacked;
+	*new_entry = db;
+	dblist->count++;
 
 	return 0;
 }
@@ -165,30 +417,377 @@ errcode_t ext2fs_add_dir_block2(ext2_dblist dblist, ext2_ino_t ino,
 errcode_t ext2fs_set_dir_block2(ext2_dblist dblist, ext2_ino_t ino,
 				blk64_t blk, e2_blkcnt_t blockcnt)
 {
-	dgrp_t			i;
+	struct ext2_db_entry2	buf[DBLIST_CHUNK];
+	struct ext2_dblist_chunk *chunk;
+	unsigned long long	i, unpacked;
+	unsigned int		j;
 
 	EXT2_CHECK_MAGIC(dblist, EXT2_ET_MAGIC_DBLIST);
 
-	for (i=0; i < dblist->count; i++) {
+	for (i = 0; i < dblist->nr_chunks; i++) {
+		chunk = dblist->chunks + i;
+		if (ino < chunk->min_ino || ino > chunk->max_ino)
+			continue;
+		unpack_chunk(chunk, buf);
+		for (j = 0; j < chunk->count; j++) {
+			if ((buf[j].ino != ino) ||
+			    (buf[j].blockcnt != blockcnt))
+				continue;
+			buf[j].blk = blk;
+			dblist->sorted = 0;
+			dblist->default_order = 0;
+			return pack_chunk(chunk, buf, chunk->count);
+		}
+	}
+
+	unpacked = dblist->count - packed_count(dblist);
+	for (i = 0; i < unpacked; i++) {
 		if ((dblist->list[i].ino != ino) ||
 		    (dblist->list[i].blockcnt != blockcnt))
 			continue;
 		dblist->list[i].blk = blk;
 		dblist->sorted = 0;
+		dblist->default_order = 0;
 		return 0;
 	}
 	return EXT2_ET_DB_NOT_FOUND;
 }
 
+/*
+ * The entries are sorted with a natural merge sort.  Short stretches
+ * are put in order with an insertion sort, and then the runs that are
+ * in order are merged pairwise until only one is left.  The list is
+ * usually built almost in block order, so it often takes only a pass
+ * or two, and a sorted list costs a single scan.  The sort is stable,
+ * and with the default order the key is compared inline.
+ *
+ * Once chunks have been packed, each one is sorted on its own, and
+ * then the runs of chunks that follow on from each other are merged
+ * through a heap into new chunks.
+ */
+#define DBLIST_MIN_RUN	32
+
+typedef EXT2_QSORT_TYPE (*dblist_cmp_t)(const void *, const void *);
+
+static inline int db_cmp(dblist_cmp_t cmp, const struct ext2_db_entry2 *a,
+			 const struct ext2_db_entry2 *b)
+{
+	if (cmp)
+		return cmp(a, b);
+	if (a->blk != b->blk)
+		return a->blk < b->blk ? -1 : 1;
+	if (a->ino != b->ino)
+		return a->ino < b->ino ? -1 : 1;
+	if (a->blockcnt != b->blockcnt)
+		return a->blockcnt < b->blockcnt ? -1 : 1;
+	return 0;
+}
+
+/* Return the end of the run that is in order starting at start */
+static size_t run_end(dblist_cmp_t cmp, struct ext2_db_entry2 *list,
+		      size_t start, size_t count)
+{
+	size_t	i;
+
+	for (i = start + 1; i < count; i++)
+		if (db_cmp(cmp, list + i - 1, list + i) > 0)
+			break;
+	return i;
+}
+
+static void insertion_sort(dblist_cmp_t cmp, struct ext2_db_entry2 *list,
+			   size_t count)
+{
+	struct ext2_db_entry2	tmp;
+	size_t			i, j;
+
+	for (i = 1; i < count; i++) {
+		if (db_cmp(cmp, list + i - 1, list + i) <= 0)
+			continue;
+		tmp = list[i];
+		for (j = i; j > 0 && db_cmp(cmp, list + j - 1, &tmp) > 0; j--)
+			list[j] = list[j - 1];
+		list[j] = tmp;
+	}
+}
+
+static void merge_runs(dblist_cmp_t cmp,
+		       struct ext2_db_entry2 *a, size_t a_count,
+		       struct ext2_db_entry2 *b, size_t b_count,
+		       struct ext2_db_entry2 *out)
+{
+	struct ext2_db_entry2	*a_end = a + a_count, *b_end = b + b_count;
+
+	while (a < a_end && b < b_end) {
+		if (db_cmp(cmp, a, b) <= 0)
+			*out++ = *a++;
+		else
+			*out++ = *b++;
+	}
+	if (a < a_end)
+		memcpy(out, a, (a_end - a) * sizeof(struct ext2_db_entry2));
+	else if (b < b_end)
+		memcpy(out, b, (b_end - b) * sizeof(struct ext2_db_entry2));
+}
+
+/*
+ * Sort count entries, using tmp (which has room for as many) as the
+ * other buffer.  Returns whichever of the two holds the result.
+ */
+static struct ext2_db_entry2 *sort_entries(dblist_cmp_t cmp,
+					   struct ext2_db_entry2 *list,
+					   struct ext2_db_entry2 *tmp,
+					   size_t count)
+{
+	struct ext2_db_entry2	*src = list, *dst = tmp, *swap;
+	size_t			i, mid, end, runs;
+
+	if (run_end(cmp, src, 0, count) >= count)
+		return src;
+
+	for (i = 0; i < count; i += DBLIST_MIN_RUN)
+		insertion_sort(cmp, src + i, count - i < DBLIST_MIN_RUN ?
+			       count - i : DBLIST_MIN_RUN);
+
+	do {
+		runs = 0;
+		for (i = 0; i < count; i = end, runs++) {
+			mid = run_end(cmp, src, i, count);
+			end = mid < count ? run_end(cmp, src, mid, count) :
+					    count;
+			merge_runs(cmp, src + i, mid - i, src + mid,
+				   end - mid, dst + i);
+		}
+		swap = src;
+		src = dst;
+		dst = swap;
+	} while (runs > 1);
+	return src;
+}
+
+/* Reads one run of chunks, in order, for the merge */
+struct dblist_cursor {
+	struct ext2_dblist_chunk	*chunk;
+	struct ext2_dblist_chunk	*end;
+	const unsigned char		*p;
+	unsigned int			left;	/* in this chunk */
+	struct ext2_db_entry2		cur;
+};
+
+static int cursor_next(struct dblist_cursor *c)
+{
+	struct ext2_db_entry2	prev = c->cur;
+
+	if (c->left == 0) {
+		if (++c->chunk == c->end)
+			return 0;
+		c->p = c->chunk->data;
+		c->left = c->chunk->count;
+		memset(&prev, 0, sizeof(prev));
+	}
+	c->p = decode_entry(c->p, &prev, &c->cur);
+	c->left--;
+	return 1;
+}
+
+/* Earlier runs win ties, which keeps the sort stable */
+static int cursor_cmp(dblist_cmp_t cmp, struct dblist_cursor *a,
+		      struct dblist_cursor *b)
+{
+	int	ret = db_cmp(cmp, &a->cur, &b->cur);
+
+	if (ret)
+		return ret;
+	return a->chunk < b->chunk ? -1 : 1;
+}
+
+static void heap_down(dblist_cmp_t cmp, struct dblist_cursor **heap,
+		      size_t n, size_t i)
+{
+	struct dblist_cursor	*c = heap[i];
+	size_t			child;
+
+	while ((child = 2 * i + 1) < n) {
+		if (child + 1 < n &&
+		    cursor_cmp(cmp, heap[child + 1], heap[child]) < 0)
+			child++;
+		if (cursor_cmp(cmp, c, heap[child]) <= 0)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = c;
+}
+
+/* Merge the runs of chunks starting at runs[] into new chunks */
+static errcode_t merge_chunks(ext2_dblist dblist, dblist_cmp_t cmp,
+			      unsigned long long *runs, size_t nr_runs,
+			      struct ext2_db_entry2 *buf)
+{
+	struct dblist_cursor		*cursors = NULL, **heap = NULL;
+	struct ext2_dblist_chunk	*out = NULL;
+	unsigned long long		nr_out = 0, max_out, i;
+	unsigned int			n = 0;
+	size_t				nr_heap = 0;
+	errcode_t			retval;
+
+	max_out = dblist->count / DBLIST_CHUNK;
+	retval = ext2fs_get_arrayzero(max_out ? max_out : 1,
+				      sizeof(struct ext2_dblist_chunk), &out);
+	if (!retval)
+		retval = ext2fs_get_array(nr_runs,
+					  sizeof(struct dblist_cursor),
+					  &cursors);
+	if (!retval)
+		retval = ext2fs_get_array(nr_runs,
+					  sizeof(struct dblist_cursor *),
+					  &heap);
+	if (retval)
+		goto out;
+
+	for (i = 0; i < nr_runs; i++) {
+		cursors[i].chunk = dblist->chunks + runs[i];
+		cursors[i].end = dblist->chunks +
+			(i + 1 < nr_runs ? runs[i + 1] : dblist->nr_chunks);
+		cursors[i].p = cursors[i].chunk->data;
+		cursors[i].left = cursors[i].chunk->count;
+		memset(&cursors[i].cur, 0, sizeof(cursors[i].cur));
+		if (cursor_next(cursors + i))
+			heap[nr_heap++] = cursors + i;
+	}
+	for (i = nr_heap / 2; i-- > 0; )
+		heap_down(cmp, heap, nr_heap, i);
+
+	while (nr_heap) {
+		buf[n++] = heap[0]->cur;
+		if (n == DBLIST_CHUNK) {
+			retval = pack_chunk(out + nr_out, buf, n);
+			if (retval)
+				goto out;
+			nr_out++;
+			n = 0;
+		}
+		if (!cursor_next(heap[0]))
+			heap[0] = heap[--nr_heap];
+		if (nr_heap)
+			heap_down(cmp, heap, nr_heap, 0);
+	}
+
+	/* What does not fill a chunk goes back into the array */
+	free_chunks(dblist);
+	memcpy(dblist->list, buf, n * sizeof(struct ext2_db_entry2));
+	dblist->chunks = out;
+	dblist->nr_chunks = nr_out;
+	dblist->max_chunks = max_out ? max_out : 1;
+	out = NULL;
+out:
+	if (out) {
+		for (i = 0; i < nr_out; i++)
+			ext2fs_free_mem(&out[i].data);
+		ext2fs_free_mem(&out);
+	}
+	if (cursors)
+		ext2fs_free_mem(&cursors);
+	if (heap)
+		ext2fs_free_mem(&heap);
+	return retval;
+}
+
+static errcode_t sort_chunks(ext2_dblist dblist, dblist_cmp_t cmp)
+{
+	struct ext2_db_entry2	*buf, *tmp, *sorted, last;
+	unsigned long long	*runs = NULL, i;
+	unsigned long long	unpacked;
+	unsigned int		count;
+	size_t			nr_runs = 0;
+	errcode_t		retval;
+
+	retval = ext2fs_get_array(2 * DBLIST_CHUNK,
+				  sizeof(struct ext2_db_entry2), &buf);
+	if (retval)
+		return retval;
+	tmp = buf + DBLIST_CHUNK;
+
+	/* The unpacked entries are sorted along with the rest */
+	unpacked = dblist->count - packed_count(dblist);
+	if (unpacked) {
+		retval = add_chunk(dblist, dblist->list, unpacked);
+		if (retval)
+			goto out;
+	}
+	retval = ext2fs_get_array(dblist->nr_chunks, sizeof(*runs), &runs);
+	if (retval)
+		goto out_unpacked;
+
+	memset(&last, 0, sizeof(last));
+	for (i = 0; i < dblist->nr_chunks; i++) {
+		count = dblist->chunks[i].count;
+		unpack_chunk(dblist->chunks + i, buf);
+		sorted = buf;
+		if (run_end(cmp, buf, 0, count) < count) {
+			sorted = sort_entries(cmp, buf, tmp, count);
+			retval = pack_chunk(dblist->chunks + i, sorted, count);
+			if (retval)
+				goto out_unpacked;
+		}
+		if (!i || db_cmp(cmp, &last, sorted) > 0)
+			runs[nr_runs++] = i;
+		last = sorted[count - 1];
+	}
+
+	if (nr_runs > 1) {
+		retval = merge_chunks(dblist, cmp, runs, nr_runs, buf);
+		if (!retval)
+			goto out;
+	}
+
+out_unpacked:
+	if (unpacked)
+		unpack_last_chunk(dblist);
+out:
+	if (runs)
+		ext2fs_free_mem(&runs);
+	ext2fs_free_mem(&buf);
+	return retval;
+}
+
+static void dblist_sort(ext2_dblist dblist, dblist_cmp_t sortfunc)
+{
+	struct ext2_db_entry2	*tmp, *sorted;
+	size_t			count = dblist->count;
+
+	dblist->sorted = 1;
+	dblist->default_order = (sortfunc == NULL);
+
+	if (dblist->nr_chunks) {
+		/* If this fails, the next iteration will try again */
+		if (sort_chunks(dblist, sortfunc))
+			dblist->sorted = dblist->default_order = 0;
+		return;
+	}
+
+	if (run_end(sortfunc, dblist->list, 0, count) >= count)
+		return;
+	if (ext2fs_get_array(count, sizeof(struct ext2_db_entry2), &tmp)) {
+		qsort(dblist->list, count, sizeof(struct ext2_db_entry2),
+		      sortfunc ? sortfunc : dir_block_cmp2);
+		return;
+	}
+	sorted = sort_entries(sortfunc, dblist->list, tmp, count);
+	/* Keep whichever buffer ended up holding the sorted list */
+	if (sorted != dblist->list) {
+		tmp = dblist->list;
+		dblist->list = sorted;
+		dblist->size = count;
+	}
+	ext2fs_free_mem(&tmp);
+}
+
 void ext2fs_dblist_sort2(ext2_dblist dblist,
 			 EXT2_QSORT_TYPE (*sortfunc)(const void *,
 						     const void *))
 {
-	if (!sortfunc)
-		sortfunc = dir_block_cmp2;
-	qsort(dblist->list, (size_t) dblist->count,
-	      sizeof(struct ext2_db_entry2), sortfunc);
-	dblist->sorted = 1;
+	dblist_sort(dblist, sortfunc);
 }
 
 /*
@@ -202,8 +801,12 @@ errcode_t ext2fs_dblist_iterate3(ext2_dblist dblist,
 				 unsigned long long count,
 				 void *priv_data)
 {
-	unsigned long long	i, end;
-	int		ret;
+	struct ext2_db_entry2	*buf = NULL;
+	struct ext2_dblist_chunk *chunk;
+	unsigned long long	i, end, ci;
+	unsigned int		j;
+	errcode_t		retval = 0;
+	int		ret = 0;
 
 	EXT2_CHECK_MAGIC(dblist, EXT2_ET_MAGIC_DBLIST);
 
@@ -212,12 +815,45 @@ errcode_t ext2fs_dblist_iterate3(ext2_dblist dblist,
 		ext2fs_dblist_sort2(dblist, 0);
 	if (end > dblist->count)
 		end = dblist->count;
-	for (i = start; i < end; i++) {
-		ret = (*func)(dblist->fs, &dblist->list[i], priv_data);
+
+	/* Packed entries go through a buffer, and are packed if changed */
+	i = start;
+	if (i < end && i < packed_count(dblist)) {
+		retval = ext2fs_get_arrayzero(2 * DBLIST_CHUNK,
+					      sizeof(struct ext2_db_entry2),
+					      &buf);
+		if (retval)
+			return retval;
+	}
+	for (ci = i / DBLIST_CHUNK; i < end && ci < dblist->nr_chunks; ci++) {
+		chunk = dblist->chunks + ci;
+		unpack_chunk(chunk, buf);
+		memcpy(buf + DBLIST_CHUNK, buf,
+		       chunk->count * sizeof(struct ext2_db_entry2));
+		for (j = i % DBLIST_CHUNK; j < chunk->count && i < end;
+		     j++, i++) {
+			ret = (*func)(dblist->fs, &buf[j], priv_data);
+			if (ret & DBLIST_ABORT)
+				break;
+		}
+		if (memcmp(buf, buf + DBLIST_CHUNK,
+			   chunk->count * sizeof(struct ext2_db_entry2)))
+			retval = pack_chunk(chunk, buf, chunk->count);
+		if (retval || (ret & DBLIST_ABORT))
+			goto out;
+	}
+
+	for (; i < end; i++) {
+		ret = (*func)(dblist->fs,
+			      &dblist->list[i - packed_count(dblist)],
+			      priv_data);
 		if (ret & DBLIST_ABORT)
-			return 0;
+			break;
 	}
-	return 0;
+out:
+	if (buf)
+		ext2fs_free_mem(&buf);
+	return retval;
 }
 
 errcode_t ext2fs_dblist_iterate2(ext2_dblist dblist,
@@ -238,12 +874,15 @@ static EXT2_QSORT_TYPE dir_block_cmp2(const void *a, const void *b)
 		(const struct ext2_db_entry2 *) b;
 
 	if (db_a->blk != db_b->blk)
-		return (int) (db_a->blk - db_b->blk);
+		return db_a->blk < db_b->blk ? -1 : 1;
 
 	if (db_a->ino != db_b->ino)
-		return (int) (db_a->ino - db_b->ino);
+		return db_a->ino < db_b->ino ? -1 : 1;
+
+	if (db_a->blockcnt != db_b->blockcnt)
+		return db_a->blockcnt < db_b->blockcnt ? -1 : 1;
 
-	return (db_a->blockcnt - db_b->blockcnt);
+	return 0;
 }
 
 blk64_t ext2fs_dblist_count2(ext2_dblist dblist)
@@ -251,6 +890,25 @@ blk64_t ext2fs_dblist_count2(ext2_dblist dblist)
 	return dblist->count;
 }
 
+/*
+ * Return an estimate of the number of bytes of memory used by the
+ * directory block list.
+ */
+unsigned long long ext2fs_get_dblist_mem_usage(ext2_dblist dblist)
+{
+	unsigned long long	mem, i;
+
+	if (!dblist || dblist->magic != EXT2_ET_MAGIC_DBLIST)
+		return 0;
+
+	mem = sizeof(struct ext2_struct_dblist) +
+		dblist->size * sizeof(struct ext2_db_entry2) +
+		dblist->max_chunks * sizeof(struct ext2_dblist_chunk);
+	for (i = 0; i < dblist->nr_chunks; i++)
+		mem += dblist->chunks[i].len;
+	return mem;
+}
+
 errcode_t ext2fs_dblist_get_last2(ext2_dblist dblist,
 				  struct ext2_db_entry2 **entry)
 {
@@ -259,8 +917,11 @@ errcode_t ext2fs_dblist_get_last2(ext2_dblist dblist,
 	if (dblist->count == 0)
 		return EXT2_ET_DBLIST_EMPTY;
 
+	/* The caller may change the entry, so it must be in the array */
+	if (dblist->count == packed_count(dblist))
+		unpack_last_chunk(dblist);
 	if (entry)
-		*entry = dblist->list + ( dblist->count-1);
+		*entry = dblist->list + (dblist->count - packed_count(dblist) - 1);
 	return 0;
 }
 
@@ -271,6 +932,8 @@ errcode_t ext2fs_dblist_drop_last(ext2_dblist dblist)
 	if (dblist->count == 0)
 		return EXT2_ET_DBLIST_EMPTY;
 
+	if (dblist->count == packed_count(dblist))
+		unpack_last_chunk(dblist);
 	dblist->count--;
 	return 0;
 }
@@ -304,11 +967,8 @@ void ext2fs_dblist_sort(ext2_dblist dblist,
 	if (sortfunc) {
 		sortfunc32 = sortfunc;
 		sortfunc = dir_block_cmp;
-	} else
-		sortfunc = dir_block_cmp2;
-	qsort(dblist->list, (size_t) dblist->count,
-	      sizeof(struct ext2_db_entry2), sortfunc);
-	dblist->sorted = 1;
+	}
+	dblist_sort(dblist, sortfunc);
 }
 
 /*
@@ -382,16 +1042,11 @@ errcode_t ext2fs_dblist_get_last(ext2_dblist dblist,
 {
 	static struct ext2_db_entry ret_entry;
 	struct ext2_db_entry2 *last;
+	errcode_t retval;
 
-	EXT2_CHECK_MAGIC(dblist, EXT2_ET_MAGIC_DBLIST);
-
-	if (dblist->count == 0)
-		return EXT2_ET_DBLIST_EMPTY;
-
-	if (!entry)
-		return 0;
-
-	last = dblist->list + dblist->count -1;
+	retval = ext2fs_dblist_get_last2(dblist, &last);
+	if (retval || !entry)
+		return retval;
 
 	ret_entry.ino = last->ino;
 	ret_entry.blk = last->blk;
@@ -401,3 +1056,299 @@ errcode_t ext2fs_dblist_get_last(ext2_dblist dblist,
 	return 0;
 }
 
+
+#ifdef DEBUG
+/*
+ * Check the packed directory block list against a plain array of the
+ * same entries: enough of them, added out of order, that the list
+ * spans many chunks which have to be sorted and merged, and changes
+ * through set_dir_block2, iterate3 and get_last2 which land in packed
+ * chunks.
+ */
+#include <stdlib.h>
+
+#define TST_DIRS	1500
+
+static int failures;
+
+static struct ext2_db_entry2	*ref, *got, *saved;
+static unsigned long long	ref_count, got_count, saved_count;
+
+static void add_entry(ext2_dblist dblist, ext2_ino_t ino, blk64_t blk,
+		      e2_blkcnt_t blockcnt)
+{
+	errcode_t	retval;
+
+	retval = ext2fs_add_dir_block2(dblist, ino, blk, blockcnt);
+	if (retval) {
+		com_err("tst_dblist", retval, "while adding block %llu",
+			(unsigned long long) blk);
+		exit(1);
+	}
+	ref[ref_count].ino = ino;
+	ref[ref_count].blk = blk;
+	ref[ref_count].blockcnt = blockcnt;
+	ref_count++;
+}
+
+static int collect_func(ext2_filsys fs EXT2FS_ATTR((unused)),
+			struct ext2_db_entry2 *db,
+			void *priv_data EXT2FS_ATTR((unused)))
+{
+	got[got_count++] = *db;
+	return 0;
+}
+
+/* The list, in its own order, must match the reference */
+static void check_list(ext2_dblist dblist, const char *what)
+{
+	unsigned long long	i;
+	errcode_t		retval;
+
+	got_count = 0;
+	retval = ext2fs_dblist_iterate2(dblist, collect_func, 0);
+	if (retval) {
+		com_err("tst_dblist", retval, "while iterating (%s)", what);
+		exit(1);
+	}
+	if (got_count != ref_count ||
+	    ext2fs_dblist_count2(dblist) != ref_count) {
+		printf("%s: %llu entries, expected %llu\n", what,
+		       got_count, ref_count);
+		failures++;
+		return;
+	}
+	for (i = 0; i < ref_count; i++) {
+		if (got[i].ino == ref[i].ino && got[i].blk == ref[i].blk &&
+		    got[i].blockcnt == ref[i].blockcnt)
+			continue;
+		printf("%s: entry %llu is (%u, %llu, %lld), "
+		       "expected (%u, %llu, %lld)\n", what, i,
+		       got[i].ino, (unsigned long long) got[i].blk,
+		       (long long) got[i].blockcnt, ref[i].ino,
+		       (unsigned long long) ref[i].blk,
+		       (long long) ref[i].blockcnt);
+		failures++;
+		return;
+	}
+}
+
+static EXT2_QSORT_TYPE ino_cmp(const void *a, const void *b)
+{
+	const struct ext2_db_entry2 *db_a = a, *db_b = b;
+
+	if (db_a->ino != db_b->ino)
+		return db_a->ino < db_b->ino ? -1 : 1;
+	if (db_a->blockcnt != db_b->blockcnt)
+		return db_a->blockcnt < db_b->blockcnt ? -1 : 1;
+	return 0;
+}
+
+struct change_data {
+	unsigned long long	seen;
+	unsigned long long	abort_at;
+};
+
+/* Move every other block far away, and stop at abort_at if set */
+static int change_func(ext2_filsys fs EXT2FS_ATTR((unused)),
+		       struct ext2_db_entry2 *db, void *priv_data)
+{
+	struct change_data *cd = priv_data;
+
+	if (cd->seen++ & 1)
+		db->blk += 1ULL << 44;
+	return cd->seen == cd->abort_at ? DBLIST_ABORT : 0;
+}
+
+static void check_change(ext2_dblist dblist, unsigned long long start,
+			 unsigned long long count,
+			 unsigned long long abort_at)
+{
+	struct change_data	cd;
+	unsigned long long	i, end;
+	errcode_t		retval;
+
+	cd.seen = 0;
+	cd.abort_at = abort_at;
+	retval = ext2fs_dblist_iterate3(dblist, change_func, start, count,
+					&cd);
+	if (retval) {
+		com_err("tst_dblist", retval, "while changing entries");
+		exit(1);
+	}
+	end = start + (abort_at ? abort_at : count);
+	for (i = start; i < end; i++)
+		if ((i - start) & 1)
+			ref[i].blk += 1ULL << 44;
+	check_list(dblist, "iterate3 changes");
+}
+
+/* Take entries off the end down to keep, changing some on the way */
+static void check_drop(ext2_dblist dblist, unsigned long long keep)
+{
+	struct ext2_db_entry2	*last;
+	unsigned long long	chunks = dblist->nr_chunks;
+	errcode_t		retval;
+	int			changed = 0;
+
+	while (ref_count > keep) {
+		retval = ext2fs_dblist_get_last2(dblist, &last);
+		if (retval) {
+			com_err("tst_dblist", retval,
+				"with %llu entries left", ref_count);
+			failures++;
+			return;
+		}
+		if (last->ino != ref[ref_count - 1].ino ||
+		    last->blk != ref[ref_count - 1].blk ||
+		    last->blockcnt != ref[ref_count - 1].blockcnt) {
+			printf("last entry of %llu is (%u, %llu), "
+			       "expected (%u, %llu)\n", ref_count,
+			       last->ino, (unsigned long long) last->blk,
+			       ref[ref_count - 1].ino,
+			       (unsigned long long) ref[ref_count - 1].blk);
+			failures++;
+			return;
+		}
+		/* Changes to the last entry must stick */
+		if (ref_count % 97 == 0 && !changed) {
+			last->blk += 5;
+			ref[ref_count - 1].blk += 5;
+			changed = 1;
+			continue;
+		}
+		changed = 0;
+		ext2fs_dblist_drop_last(dblist);
+		ref_count--;
+	}
+	if (dblist->nr_chunks >= chunks) {
+		printf("drop_last never crossed a chunk boundary\n");
+		failures++;
+	}
+	check_list(dblist, "drop_last");
+}
+
+int main(int argc EXT2FS_ATTR((unused)), char **argv EXT2FS_ATTR((unused)))
+{
+	struct ext2_super_block param;
+	ext2_filsys		fs;
+	ext2_dblist		dblist, copy;
+	blk64_t			base, blk;
+	ext2_ino_t		ino;
+	unsigned long long	i;
+	errcode_t		retval;
+	int			d, j, nblocks;
+
+	initialize_ext2_error_table();
+
+	memset(&param, 0, sizeof(param));
+	ext2fs_blocks_count_set(&param, 12000);
+	retval = ext2fs_initialize("test fs", EXT2_FLAG_64BITS, &param,
+				   test_io_manager, &fs);
+	if (!retval)
+		retval = ext2fs_init_dblist(fs, &dblist);
+	if (!retval)
+		retval = ext2fs_get_array(TST_DIRS * 8,
+					  sizeof(struct ext2_db_entry2), &ref);
+	if (!retval)
+		retval = ext2fs_get_array(TST_DIRS * 8,
+					  sizeof(struct ext2_db_entry2), &got);
+	if (!retval)
+		retval = ext2fs_get_array(TST_DIRS * 8,
+					  sizeof(struct ext2_db_entry2), &saved);
+	if (retval) {
+		com_err("tst_dblist", retval, "while setting up");
+		exit(1);
+	}
+
+	/*
+	 * Directories of one to eight blocks in scattered inode and block
+	 * order.  Some have contiguous blocks, some go backwards, some
+	 * have holes, and some live above 2^32, so that every field of the
+	 * encoding is exercised.
+	 */
+	for (d = 0; d < TST_DIRS; d++) {
+		ino = 12 + (d * 1021) % TST_DIRS;
+		base = 1000 + ((blk64_t) ((d * 7919) % TST_DIRS)) * 16;
+		if (d % 11 == 0)
+			base += 1ULL << 40;
+		nblocks = 1 + (d * 13) % 8;
+		for (j = 0; j < nblocks; j++) {
+			blk = (d % 3) ? base + j : base + 15 - j;
+			add_entry(dblist, ino, blk, (d % 5) ? j : 2 * j);
+		}
+	}
+	if (dblist->nr_chunks < 8 || dblist->sorted) {
+		printf("%llu entries in %llu chunks, %ssorted\n",
+		       ref_count, dblist->nr_chunks,
+		       dblist->sorted ? "" : "not ");
+		failures++;
+	}
+
+	/* Move some blocks, most of them in packed chunks */
+	for (i = 5; i < ref_count; i += 331) {
+		ref[i].blk = (1ULL << 36) + i;
+		retval = ext2fs_set_dir_block2(dblist, ref[i].ino,
+					       ref[i].blk, ref[i].blockcnt);
+		if (retval) {
+			com_err("tst_dblist", retval,
+				"while moving entry %llu", i);
+			failures++;
+		}
+	}
+	if (ext2fs_set_dir_block2(dblist, 11, 1, 0) != EXT2_ET_DB_NOT_FOUND) {
+		printf("set_dir_block2 found a missing entry\n");
+		failures++;
+	}
+
+	retval = ext2fs_copy_dblist(dblist, &copy);
+	if (retval) {
+		com_err("tst_dblist", retval, "while copying the list");
+		exit(1);
+	}
+	memcpy(saved, ref, ref_count * sizeof(struct ext2_db_entry2));
+	saved_count = ref_count;
+
+	/* The default sort, done by the iterator */
+	qsort(ref, ref_count, sizeof(struct ext2_db_entry2), dir_block_cmp2);
+	check_list(dblist, "default sort");
+
+	check_change(dblist, DBLIST_CHUNK - 10, 2 * DBLIST_CHUNK + 20, 0);
+	check_change(dblist, 3 * DBLIST_CHUNK + 100, DBLIST_CHUNK, 77);
+	check_drop(dblist, ref_count - ref_count % DBLIST_CHUNK -
+		   DBLIST_CHUNK - 40);
+
+	/* Sort again after the changes, with some entries added */
+	for (j = 0; j < 300; j++)
+		add_entry(dblist, 5, 20000 - j, j);
+	ext2fs_dblist_sort2(dblist, 0);
+	qsort(ref, ref_count, sizeof(struct ext2_db_entry2), dir_block_cmp2);
+	check_list(dblist, "sort after changes");
+	ext2fs_free_dblist(dblist);
+
+	/* The copy, sorted another way, and taken apart completely */
+	memcpy(ref, saved, saved_count * sizeof(struct ext2_db_entry2));
+	ref_count = saved_count;
+	ext2fs_dblist_sort2(copy, ino_cmp);
+	qsort(ref, ref_count, sizeof(struct ext2_db_entry2), ino_cmp);
+	check_list(copy, "copy sorted by inode");
+	check_drop(copy, 0);
+	if (ext2fs_dblist_get_last2(copy, 0) != EXT2_ET_DBLIST_EMPTY ||
+	    ext2fs_dblist_drop_last(copy) != EXT2_ET_DBLIST_EMPTY) {
+		printf("copy not empty\n");
+		failures++;
+	}
+	ext2fs_free_dblist(copy);
+
+	ext2fs_free_mem(&ref);
+	ext2fs_free_mem(&got);
+	ext2fs_free_mem(&saved);
+	ext2fs_free(fs);
+	if (failures) {
+		printf("tst_dblist: %d failures\n", failures);
+		return 1;
+	}
+	printf("tst_dblist: OK\n");
+	return 0;
+}
+#endif /* DEBUG */
@@ -0,0 +1,584 @@
+/*
+ * defrag.c --- relocate the data of fragmented files on an unmounted
+ *	filesystem
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+/*
+ * ext2fs_defrag_inode() moves all of an extent-mapped file's data
+ * blocks into a single free extent, in logical block order:
+ *
+ * 1.  Allocate a free extent big enough for the whole file.
+ * 2.  Copy the data across, gathering the old extents into large
+ *     sequential writes.  Uninitialized extents are not read.
+ * 3.  Flush the copy, then point the extent tree at it.  The tree is
+ *     rewritten in place: each leaf entry is remapped, and entries
+ *     which have become contiguous with the one before them in the
+ *     same leaf are merged into it.  No tree blocks are allocated or
+ *     freed, so i_blocks (and the quota usage) do not change.
+ * 4.  Release the old blocks.
+ * 5.  If the file's extents would now fit in fewer tree blocks, and
+ *     there are no quota files to keep in step with i_blocks, write
+ *     out a new, minimal tree for it, point the inode at that, and
+ *     only then release the old tree blocks.
+ *
+ * If we are interrupted before step 3, the file still points at its
+ * old blocks and the new ones are merely leaked; after it, the old
+ * ones are.  Either way e2fsck can clean up.
+ *
+ * Choosing which files to move, and where, is left to the caller
+ * (see e4defrag -o); ext2fs_defrag_inode_info() describes how a file
+ * is laid out now.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+
+/* Size of the copy buffer */
+#define DEFRAG_IO_SIZE		(1024 * 1024)
+
+struct defrag_list {
+	struct ext2fs_extent	*extents;
+	unsigned int		count;
+	unsigned int		size;
+};
+
+static errcode_t defrag_load_extents(ext2_extent_handle_t handle,
+				     struct defrag_list *list,
+				     struct ext2fs_defrag_info *info)
+{
+	struct ext2fs_extent	extent, *last = NULL;
+	errcode_t		retval;
+
+	memset(info, 0, sizeof(struct ext2fs_defrag_info));
+	retval = ext2fs_extent_get(handle, EXT2_EXTENT_ROOT, &extent);
+	while (retval == 0) {
+		if (!(extent.e_flags & EXT2_EXTENT_FLAGS_LEAF) ||
+		    (extent.e_flags & EXT2_EXTENT_FLAGS_SECOND_VISIT))
+			goto next;
+
+		if (!info->di_extents)
+			info->di_first = extent.e_pblk;
+		info->di_extents++;
+		info->di_blocks += extent.e_len;
+		if (!last || last->e_pblk + last->e_len != extent.e_pblk)
+			info->di_fragments++;
+
+		if (list->count == list->size) {
+			retval = ext2fs_resize_mem(list->size *
+					sizeof(struct ext2fs_extent),
+					(list->size + 64) *
+					sizeof(struct ext2fs_extent),
+					&list->extents);
+			if (retval)
+				return retval;
+			list->size += 64;
+		}
+		last = list->extents + list->count++;
+		*last = extent;
+	next:
+		retval = ext2fs_extent_get(handle, EXT2_EXTENT_NEXT, &extent);
+	}
+	if (retval == EXT2_ET_EXTENT_NO_NEXT ||
+	    retval == EXT2_ET_EXTENT_NO_DOWN)
+		retval = 0;
+	return retval;
+}
+
+static int defrag_inode_ok(ext2_filsys fs, ext2_ino_t ino,
+			   struct ext2_inode *inode)
+{
+	if (ino < EXT2_FIRST_INODE(fs->super) && ino != EXT2_ROOT_INO)
+		return 0;
+	if (!inode->i_links_count || (inode->i_flags & EXT4_INLINE_DATA_FL))
+		return 0;
+	return LINUX_S_ISREG(inode->i_mode) || LINUX_S_ISDIR(inode->i_mode);
+}
+
+/*
+ * Describe how a file's data blocks are laid out.  Files which can't
+ * be defragmented are reported as having no blocks; block-mapped files
+ * give EXT2_ET_INODE_NOT_EXTENT.
+ */
+errcode_t ext2fs_defrag_inode_info(ext2_filsys fs, ext2_ino_t ino,
+				   struct ext2_inode *inode,
+				   struct ext2fs_defrag_info *info)
+{
+	struct ext2_inode	inode_buf;
+	struct defrag_list	list;
+	ext2_extent_handle_t	handle;
+	errcode_t		retval;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	memset(info, 0, sizeof(struct ext2fs_defrag_info));
+	if (!inode) {
+		retval = ext2fs_read_inode(fs, ino, &inode_buf);
+		if (retval)
+			return retval;
+		inode = &inode_buf;
+	}
+	if (!defrag_inode_ok(fs, ino, inode))
+		return 0;
+	if (!(inode->i_flags & EXT4_EXTENTS_FL))
+		return EXT2_ET_INODE_NOT_EXTENT;
+
+	retval = ext2fs_extent_open2(fs, ino, inode, &handle);
+	if (retval)
+		return retval;
+	memset(&list, 0, sizeof(list));
+	retval = defrag_load_extents(handle, &list, info);
+	ext2fs_free_mem(&list.extents);
+	ext2fs_extent_free(handle);
+	return retval;
+}
+
+static void defrag_alloc_stats(ext2_filsys fs, blk64_t blk, blk64_t num,
+			       int inuse)
+{
+	blk64_t	n;
+
+	for (; num; blk += n, num -= n) {
+		n = num > EXT_INIT_MAX_LEN ? EXT_INIT_MAX_LEN : num;
+		ext2fs_block_alloc_stats_range(fs, blk, n, inuse);
+	}
+}
+
+/* Copy the extents in list, in order, to the blocks starting at dest */
+static errcode_t defrag_copy(ext2_filsys fs, struct defrag_list *list,
+			     blk64_t dest)
+{
+	struct ext2fs_extent	*ex;
+	unsigned int	i, bufblocks, fill = 0, n;
+	blk64_t		done;
+	char		*buf;
+	errcode_t	retval;
+
+	bufblocks = DEFRAG_IO_SIZE / fs->blocksize;
+	if (!bufblocks)
+		bufblocks = 1;
+	retval = ext2fs_get_memalign((size_t) bufblocks * fs->blocksize,
+				     fs->blocksize, &buf);
+	if (retval)
+		return retval;
+
+	for (i = 0, ex = list->extents; i < list->count; i++, ex++) {
+		for (done = 0; done < ex->e_len; done += n) {
+			n = bufblocks - fill;
+			if (n > ex->e_len - done)
+				n = ex->e_len - done;
+			if (ex->e_flags & EXT2_EXTENT_FLAGS_UNINIT)
+				memset(buf + (size_t) fill * fs->blocksize, 0,
+				       (size_t) n * fs->blocksize);
+			else {
+				retval = io_channel_read_blk64(fs->io,
+						ex->e_pblk + done, n,
+						buf + (size_t) fill *
+						fs->blocksize);
+				if (retval)
+					goto out;
+			}
+			fill += n;
+			if (fill < bufblocks)
+				continue;
+			retval = io_channel_write_blk64(fs->io, dest, fill,
+							buf);
+			if (retval)
+				goto out;
+			dest += fill;
+			fill = 0;
+		}
+	}
+	if (fill)
+		retval = io_channel_write_blk64(fs->io, dest, fill, buf);
+	if (!retval)
+		retval = io_channel_flush(fs->io);
+out:
+	ext2fs_free_mem(&buf);
+	return retval;
+}
+
+static int defrag_can_merge(struct ext2fs_extent *prev,
+			    struct ext2fs_extent *extent)
+{
+	__u32	max;
+
+	if ((prev->e_flags ^ extent->e_flags) & EXT2_EXTENT_FLAGS_UNINIT)
+		return 0;
+	if (prev->e_lblk + prev->e_len != extent->e_lblk ||
+	    prev->e_pblk + prev->e_len != extent->e_pblk)
+		return 0;
+	max = (extent->e_flags & EXT2_EXTENT_FLAGS_UNINIT) ?
+		EXT_UNINIT_MAX_LEN : EXT_INIT_MAX_LEN;
+	return prev->e_len + extent->e_len <= max;
+}
+
+/*
+ * Point the leaf entries of the tree at the copy starting at dest, and
+ * merge entries within a leaf which have become contiguous.  The first
+ * entry of a leaf is never deleted, so no leaf empties and the index
+ * entries above stay valid.
+ */
+static errcode_t defrag_remap(ext2_extent_handle_t handle,
+			      struct defrag_list *list, blk64_t dest)
+{
+	struct ext2fs_extent	extent, prev;
+	unsigned int	i = 0;
+	int		have_prev = 0;
+	errcode_t	retval;
+
+	retval = ext2fs_extent_get(handle, EXT2_EXTENT_ROOT, &extent);
+	while (retval == 0) {
+		if (!(extent.e_flags & EXT2_EXTENT_FLAGS_LEAF)) {
+			have_prev = 0;
+			goto next;
+		}
+		if (extent.e_flags & EXT2_EXTENT_FLAGS_SECOND_VISIT)
+			goto next;
+		if (i >= list->count ||
+		    extent.e_lblk != list->extents[i].e_lblk ||
+		    extent.e_pblk != list->extents[i].e_pblk)
+			return EXT2_ET_EXTENT_NOT_FOUND;
+		i++;
+		extent.e_pblk = dest;
+		dest += extent.e_len;
+
+		if (!have_prev || !defrag_can_merge(&prev, &extent)) {
+			retval = ext2fs_extent_replace(handle, 0, &extent);
+			if (retval)
+				return retval;
+			prev = extent;
+			have_prev = 1;
+			goto next;
+		}
+
+		prev.e_len += extent.e_len;
+		retval = ext2fs_extent_get(handle, EXT2_EXTENT_PREV_SIB,
+					   &extent);
+		if (retval)
+			return retval;
+		retval = ext2fs_extent_replace(handle, 0, &prev);
+		if (retval)
+			return retval;
+		retval = ext2fs_extent_get(handle, EXT2_EXTENT_NEXT_SIB,
+					   &extent);
+		if (retval)
+			return retval;
+		retval = ext2fs_extent_delete(handle, 0);
+		if (retval)
+			return retval;
+		/*
+		 * Deleting the last entry of a leaf leaves us on prev;
+		 * otherwise we are now on the following entry, which
+		 * hasn't been looked at yet.
+		 */
+		retval = ext2fs_extent_get(handle, EXT2_EXTENT_CURRENT,
+					   &extent);
+		if (retval)
+			return retval;
+		if (extent.e_lblk != prev.e_lblk)
+			continue;
+	next:
+		retval = ext2fs_extent_get(handle, EXT2_EXTENT_NEXT, &extent);
+	}
+	if (retval == EXT2_ET_EXTENT_NO_NEXT ||
+	    retval == EXT2_ET_EXTENT_NO_DOWN)
+		retval = 0;
+	if (!retval && i != list->count)
+		retval = EXT2_ET_EXTENT_NOT_FOUND;
+	return retval;
+}
+
+/* Number of tree blocks needed to hold count extents */
+static unsigned int defrag_tree_blocks(ext2_filsys fs, unsigned int count)
+{
+	unsigned int	per_block, root, need = 0;
+
+	per_block = (fs->blocksize - sizeof(struct ext3_extent_header)) /
+		sizeof(struct ext3_extent);
+	root = (sizeof(((struct ext2_inode *) 0)->i_block) -
+		sizeof(struct ext3_extent_header)) / sizeof(struct ext3_extent);
+	while (count > root) {
+		count = (count + per_block - 1) / per_block;
+		need += count;
+	}
+	return need;
+}
+
+/* Fill in a tree node from the entries at items */
+static void defrag_fill_node(struct ext3_extent_header *eh,
+			     struct ext2fs_extent *items, unsigned int n,
+			     unsigned int max, int depth)
+{
+	struct ext3_extent	*ex;
+	struct ext3_extent_idx	*ix;
+	unsigned int		i;
+
+	eh->eh_magic = ext2fs_cpu_to_le16(EXT3_EXT_MAGIC);
+	eh->eh_entries = ext2fs_cpu_to_le16(n);
+	eh->eh_max = ext2fs_cpu_to_le16(max);
+	eh->eh_depth = ext2fs_cpu_to_le16(depth);
+	eh->eh_generation = 0;
+
+	ex = EXT_FIRST_EXTENT(eh);
+	ix = EXT_FIRST_INDEX(eh);
+	for (i = 0; i < n; i++, items++) {
+		if (depth) {
+			ix->ei_block = ext2fs_cpu_to_le32(items->e_lblk);
+			ix->ei_leaf = ext2fs_cpu_to_le32(items->e_pblk &
+							 0xFFFFFFFF);
+			ix->ei_leaf_hi = ext2fs_cpu_to_le16(items->e_pblk >> 32);
+			ix->ei_unused = 0;
+			ix++;
+			continue;
+		}
+		ex->ee_block = ext2fs_cpu_to_le32(items->e_lblk);
+		ex->ee_start = ext2fs_cpu_to_le32(items->e_pblk & 0xFFFFFFFF);
+		ex->ee_start_hi = ext2fs_cpu_to_le16(items->e_pblk >> 32);
+		if (items->e_flags & EXT2_EXTENT_FLAGS_UNINIT)
+			ex->ee_len = ext2fs_cpu_to_le16(items->e_len +
+							EXT_INIT_MAX_LEN);
+		else
+			ex->ee_len = ext2fs_cpu_to_le16(items->e_len);
+		ex++;
+	}
+}
+
+/*
+ * Replace the extent tree of a file whose data now starts at dest with
+ * the smallest one that will hold it.  The new tree is written out in
+ * full before the inode is switched over to it, and the old tree
+ * blocks are only released after that, so an error (or a crash) part
+ * way through leaves the file with one complete tree or the other.
+ */
+static errcode_t defrag_rebuild(ext2_filsys fs, ext2_ino_t ino,
+				struct defrag_list *list, blk64_t dest)
+{
+	struct ext2_inode	inode;
+	ext2_extent_handle_t	handle;
+	struct ext2fs_extent	extent, *merged;
+	struct ext3_extent_header *eh;
+	blk64_t			*tree = NULL, *new_tree = NULL, goal = dest;
+	unsigned int		i, j, n, count = 0, have = 0, size = 0;
+	unsigned int		need, used = 0, per_block, root;
+	int			depth = 0;
+	char			*buf = NULL;
+	errcode_t		retval;
+
+	retval = ext2fs_get_array(list->count, sizeof(struct ext2fs_extent),
+				  &merged);
+	if (retval)
+		return retval;
+	for (i = 0; i < list->count; i++) {
+		extent = list->extents[i];
+		extent.e_pblk = dest;
+		extent.e_flags &= EXT2_EXTENT_FLAGS_UNINIT;
+		dest += extent.e_len;
+		if (count && defrag_can_merge(&merged[count - 1], &extent))
+			merged[count - 1].e_len += extent.e_len;
+		else
+			merged[count++] = extent;
+	}
+
+	retval = ext2fs_read_inode(fs, ino, &inode);
+	if (retval)
+		goto out;
+	retval = ext2fs_extent_open2(fs, ino, &inode, &handle);
+	if (retval)
+		goto out;
+	retval = ext2fs_extent_get(handle, EXT2_EXTENT_ROOT, &extent);
+	while (retval == 0) {
+		if (!(extent.e_flags & EXT2_EXTENT_FLAGS_LEAF) &&
+		    !(extent.e_flags & EXT2_EXTENT_FLAGS_SECOND_VISIT)) {
+			if (have == size) {
+				retval = ext2fs_resize_mem(size *
+						sizeof(blk64_t),
+						(size + 64) * sizeof(blk64_t),
+						&tree);
+				if (retval)
+					break;
+				size += 64;
+			}
+			tree[have++] = extent.e_pblk;
+		}
+		retval = ext2fs_extent_get(handle, EXT2_EXTENT_NEXT, &extent);
+	}
+	ext2fs_extent_free(handle);
+	if (retval != EXT2_ET_EXTENT_NO_NEXT &&
+	    retval != EXT2_ET_EXTENT_NO_DOWN)
+		goto out;
+	retval = 0;
+	need = defrag_tree_blocks(fs, count);
+	if (have <= need)
+		goto out;
+
+	/*
+	 * Build the tree from the bottom up.  Each level's entries are
+	 * replaced in merged by the index entries pointing at the nodes
+	 * that hold them; entry j of the new level is only written after
+	 * the node which read entry j * per_block.
+	 */
+	per_block = (fs->blocksize - sizeof(struct ext3_extent_header)) /
+		sizeof(struct ext3_extent);
+	root = (sizeof(inode.i_block) - sizeof(struct ext3_extent_header)) /
+		sizeof(struct ext3_extent);
+	if (need) {
+		retval = ext2fs_get_array(need, sizeof(blk64_t), &new_tree);
+		if (retval)
+			goto out;
+		retval = ext2fs_get_mem(fs->blocksize, &buf);
+		if (retval)
+			goto out;
+	}
+	for (; count > root; count = j, depth++) {
+		for (i = 0, j = 0; i < count; i += n, j++) {
+			n = count - i > per_block ? per_block : count - i;
+			retval = ext2fs_new_block2(fs, goal, 0, &goal);
+			if (retval)
+				goto out;
+			ext2fs_block_alloc_stats2(fs, goal, +1);
+			new_tree[used++] = goal;
+
+			memset(buf, 0, fs->blocksize);
+			eh = (struct ext3_extent_header *) buf;
+			defrag_fill_node(eh, merged + i, n, per_block, depth);
+			retval = ext2fs_extent_block_csum_set(fs, ino, eh);
+			if (retval)
+				goto out;
+			retval = io_channel_write_blk64(fs->io, goal, 1, buf);
+			if (retval)
+				goto out;
+			merged[j].e_lblk = merged[i].e_lblk;
+			merged[j].e_pblk = goal;
+		}
+	}
+	retval = io_channel_flush(fs->io);
+	if (retval)
+		goto out;
+
+	memset(inode.i_block, 0, sizeof(inode.i_block));
+	defrag_fill_node((struct ext3_extent_header *) inode.i_block, merged,
+			 count, root, depth);
+	retval = ext2fs_iblk_sub_blocks(fs, &inode, have);
+	if (!retval)
+		retval = ext2fs_iblk_add_blocks(fs, &inode, used);
+	if (!retval)
+		retval = ext2fs_write_inode(fs, ino, &inode);
+	if (retval)
+		goto out;
+
+	for (i = 0; i < have; i++)
+		ext2fs_block_alloc_stats2(fs, tree[i], -1);
+	used = 0;
+out:
+	/* used is still set only if the inode never got the new tree */
+	for (i = 0; i < used; i++)
+		ext2fs_block_alloc_stats2(fs, new_tree[i], -1);
+	ext2fs_free_mem(&buf);
+	ext2fs_free_mem(&new_tree);
+	ext2fs_free_mem(&tree);
+	ext2fs_free_mem(&merged);
+	return retval;
+}
+
+/*
+ * Move a file's data into one free extent, searching forward from
+ * goal.  A file which is already contiguous is left alone, unless
+ * EXT2_DEFRAG_COMPACT is given and it can be moved to an earlier
+ * block.  On return *new_start (if not NULL) is where the data now
+ * starts, or zero if it wasn't moved.
+ */
+errcode_t ext2fs_defrag_inode(ext2_filsys fs, ext2_ino_t ino,
+			      struct ext2_inode *inode, blk64_t goal,
+			      int flags, blk64_t *new_start)
+{
+	struct ext2_inode	inode_buf;
+	struct ext2fs_defrag_info info;
+	struct defrag_list	list;
+	ext2_extent_handle_t	handle;
+	struct ext2fs_extent	*ex;
+	blk64_t			start, len;
+	unsigned int		i;
+	errcode_t		retval;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	if (new_start)
+		*new_start = 0;
+	if (!(fs->flags & EXT2_FLAG_RW))
+		return EXT2_ET_RO_FILSYS;
+	if (!fs->block_map)
+		return EXT2_ET_NO_BLOCK_BITMAP;
+	if (ext2fs_has_feature_bigalloc(fs->super))
+		return EXT2_ET_OP_NOT_SUPPORTED;
+	if (!inode) {
+		retval = ext2fs_read_inode(fs, ino, &inode_buf);
+		if (retval)
+			return retval;
+		inode = &inode_buf;
+	}
+	if (!defrag_inode_ok(fs, ino, inode))
+		return 0;
+	if (!(inode->i_flags & EXT4_EXTENTS_FL))
+		return EXT2_ET_INODE_NOT_EXTENT;
+
+	retval = ext2fs_extent_open2(fs, ino, inode, &handle);
+	if (retval)
+		return retval;
+	memset(&list, 0, sizeof(list));
+	retval = defrag_load_extents(handle, &list, &info);
+	if (retval || !info.di_blocks)
+		goto out;
+	if (info.di_fragments <= 1 && !(flags & EXT2_DEFRAG_COMPACT))
+		goto out;
+
+	retval = ext2fs_new_range(fs, EXT2_NEWRANGE_MIN_LENGTH, goal,
+				  info.di_blocks, fs->block_map, &start, &len);
+	if (info.di_fragments <= 1 &&
+	    (retval == EXT2_ET_BLOCK_ALLOC_FAIL ||
+	     (!retval && start >= info.di_first))) {
+		/* Only worth moving if it ends up further down */
+		retval = 0;
+		goto out;
+	}
+	if (retval)
+		goto out;
+	defrag_alloc_stats(fs, start, info.di_blocks, +1);
+
+	retval = defrag_copy(fs, &list, start);
+	if (retval) {
+		defrag_alloc_stats(fs, start, info.di_blocks, -1);
+		goto out;
+	}
+	retval = defrag_remap(handle, &list, start);
+	if (retval)
+		goto out;
+	for (i = 0, ex = list.extents; i < list.count; i++, ex++)
+		defrag_alloc_stats(fs, ex->e_pblk, ex->e_len, -1);
+	if (new_start)
+		*new_start = start;
+	if (!ext2fs_has_feature_quota(fs->super))
+		retval = defrag_rebuild(fs, ino, &list, start);
+	if (inode != &inode_buf) {
+		/* Refresh the caller's copy, but report the first error */
+		errcode_t err = ext2fs_read_inode(fs, ino, inode);
+
+		if (!retval)
+			retval = err;
+	}
+out:
+	ext2fs_free_mem(&list.extents);
+	ext2fs_extent_free(handle);
+	return retval;
+}
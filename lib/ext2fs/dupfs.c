@@ -43,6 +43,7 @@ errcode_t ext2fs_dup_handle(ext2_filsys src, ext2_filsys *dest)
 	fs->mmp_buf = 0;
 	fs->mmp_cmp = 0;
 	fs->mmp_fd = -1;
+	ext2fs_freefrag_dup(src, fs);
 
 	io_channel_bumpcount(fs->io);
 	if (fs->icache)
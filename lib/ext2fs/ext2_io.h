@@ -68,6 +68,12 @@ struct struct_io_stats {
 	int			reserved;
 	unsigned long long	bytes_read;
 	unsigned long long	bytes_written;
+	/* Only valid if num_fields >= 7 */
+	unsigned long long	read_ops;
+	unsigned long long	write_ops;
+	unsigned long long	cache_hits;
+	unsigned long long	cache_misses;
+	unsigned long long	readahead_bytes;
 };
 
 struct struct_io_manager {
@@ -195,6 +195,7 @@ typedef struct ext2_file *ext2_file_t;
 #define EXT2_FLAG_DIRECT_IO		0x80000
 #define EXT2_FLAG_SKIP_MMP		0x100000
 #define EXT2_FLAG_IGNORE_CSUM_ERRORS	0x200000
+#define EXT2_FLAG_LAZY_BITMAPS		0x400000
 
 /*
  * Special flag in the ext2 inode i_flag field that means that this is
@@ -209,6 +210,37 @@ typedef struct ext2_file *ext2_file_t;
 #define EXT2_MKJOURNAL_LAZYINIT	0x0000002 /* don't zero journal inode before use*/
 #define EXT2_MKJOURNAL_NO_MNT_CHECK 0x0000004 /* don't check mount status */
 
+/*
+ * Histogram of free extent sizes, see freefrag.c.  Bucket i counts
+ * the free extents of 2^i to 2^(i+1)-1 blocks; the last bucket also
+ * holds everything larger.
+ */
+#define EXT2FS_FREEFRAG_BUCKETS	32
+
+struct ext2fs_freefrag_hist {
+	__u64	fh_extents[EXT2FS_FREEFRAG_BUCKETS];
+	__u64	fh_blocks[EXT2FS_FREEFRAG_BUCKETS];
+	__u64	fh_total_extents;
+	__u64	fh_total_blocks;
+	__u64	fh_min_extent;
+	__u64	fh_max_extent;
+	__u64	fh_free_chunks;		/* aligned, entirely free chunks */
+};
+
+/*
+ * Layout of a file's data blocks, see defrag.c.  A fragment is a run
+ * of physically contiguous extents.
+ */
+struct ext2fs_defrag_info {
+	blk64_t		di_blocks;
+	blk64_t		di_first;	/* first physical block */
+	unsigned int	di_extents;
+	unsigned int	di_fragments;
+};
+
+#define EXT2_DEFRAG_COMPACT	0x0001	/* move contiguous files down too */
+
+struct ext2fs_freefrag;
 struct blk_alloc_ctx;
 struct opaque_ext2_group_desc;
 
@@ -295,6 +327,9 @@ struct struct_ext2_filsys {
 			       blk64_t len, blk64_t *pblk, blk64_t *plen);
 	void (*block_alloc_stats_range)(ext2_filsys fs, blk64_t blk, blk_t num,
 					int inuse);
+
+	/* Free space fragmentation tracking, see freefrag.c */
+	struct ext2fs_freefrag *freefrag;
 };
 
 #if EXT2_FLAT_INCLUDES
@@ -978,6 +1013,17 @@ extern errcode_t ext2fs_bmap2(ext2_filsys fs, ext2_ino_t ino,
 			      struct ext2_inode *inode,
 			      char *block_buf, int bmap_flags, blk64_t block,
 			      int *ret_flags, blk64_t *phys_blk);
+extern errcode_t ext2fs_bmap3(ext2_filsys fs, ext2_ino_t ino,
+			      struct ext2_inode *inode,
+			      ext2_extent_handle_t ext_handle,
+			      char *block_buf, int bmap_flags, blk64_t block,
+			      int *ret_flags, blk64_t *phys_blk);
+extern errcode_t ext2fs_bmap_range(ext2_filsys fs, ext2_ino_t ino,
+				   struct ext2_inode *inode,
+				   ext2_extent_handle_t ext_handle,
+				   blk64_t lblk, blk64_t count,
+				   struct ext2fs_extent *extents,
+				   int max_extents, int *ret_count);
 errcode_t ext2fs_map_cluster_block(ext2_filsys fs, ext2_ino_t ino,
 				   struct ext2_inode *inode, blk64_t lblk,
 				   blk64_t *pblk);
@@ -1113,6 +1159,7 @@ extern errcode_t ext2fs_dblist_get_last(ext2_dblist dblist,
 extern errcode_t ext2fs_dblist_get_last2(ext2_dblist dblist,
 					struct ext2_db_entry2 **entry);
 extern errcode_t ext2fs_dblist_drop_last(ext2_dblist dblist);
+extern unsigned long long ext2fs_get_dblist_mem_usage(ext2_dblist dblist);
 
 /* dblist_dir.c */
 extern errcode_t
@@ -1128,6 +1175,14 @@ extern errcode_t
 					      void	*priv_data),
 				  void *priv_data);
 
+/* defrag.c */
+extern errcode_t ext2fs_defrag_inode_info(ext2_filsys fs, ext2_ino_t ino,
+					  struct ext2_inode *inode,
+					  struct ext2fs_defrag_info *info);
+extern errcode_t ext2fs_defrag_inode(ext2_filsys fs, ext2_ino_t ino,
+				     struct ext2_inode *inode, blk64_t goal,
+				     int flags, blk64_t *new_start);
+
 #if 0
 /* digest_encode.c */
 #define EXT2FS_DIGEST_SIZE EXT2FS_SHA256_LENGTH
@@ -1323,6 +1378,17 @@ extern char *ext2fs_find_block_device(dev_t device);
 /* flushb.c */
 extern errcode_t ext2fs_sync_device(int fd, int flushb);
 
+/* freefrag.c */
+extern errcode_t ext2fs_freefrag_open(ext2_filsys fs, int chunk_bits);
+extern void ext2fs_freefrag_close(ext2_filsys fs);
+extern void ext2fs_freefrag_invalidate(ext2_filsys fs, blk64_t blk,
+				       blk64_t num);
+extern errcode_t ext2fs_freefrag_get_hist(ext2_filsys fs,
+					  struct ext2fs_freefrag_hist *hist);
+extern errcode_t ext2fs_freefrag_get_group_hist(ext2_filsys fs,
+					dgrp_t group,
+					struct ext2fs_freefrag_hist *hist);
+
 /* freefs.c */
 extern void ext2fs_free(ext2_filsys fs);
 extern void ext2fs_free_dblist(ext2_dblist dblist);
@@ -1398,6 +1464,7 @@ errcode_t ext2fs_get_generic_bmap_range(ext2fs_generic_bitmap bmap,
 errcode_t ext2fs_set_generic_bmap_range(ext2fs_generic_bitmap bmap,
 					__u64 start, unsigned int num,
 					void *in);
+unsigned long long ext2fs_get_generic_bmap_mem_usage(ext2fs_generic_bitmap bmap);
 errcode_t ext2fs_convert_subcluster_bitmap(ext2_filsys fs,
 					   ext2fs_block_bitmap *bitmap);
 
@@ -1451,6 +1518,9 @@ extern errcode_t ext2fs_create_icount(ext2_filsys fs, int flags,
 				      ext2_icount_t *ret);
 extern errcode_t ext2fs_icount_fetch(ext2_icount_t icount, ext2_ino_t ino,
 				     __u16 *ret);
+extern errcode_t ext2fs_icount_fetch_range(ext2_icount_t icount,
+					   ext2_ino_t start, ext2_ino_t num,
+					   __u16 *counts);
 extern errcode_t ext2fs_icount_increment(ext2_icount_t icount, ext2_ino_t ino,
 					 __u16 *ret);
 extern errcode_t ext2fs_icount_decrement(ext2_icount_t icount, ext2_ino_t ino,
@@ -1458,6 +1528,7 @@ extern errcode_t ext2fs_icount_decrement(ext2_icount_t icount, ext2_ino_t ino,
 extern errcode_t ext2fs_icount_store(ext2_icount_t icount, ext2_ino_t ino,
 				     __u16 count);
 extern ext2_ino_t ext2fs_get_icount_size(ext2_icount_t icount);
+extern unsigned long long ext2fs_get_icount_mem_usage(ext2_icount_t icount);
 errcode_t ext2fs_icount_validate(ext2_icount_t icount, FILE *);
 
 /* inline.c */
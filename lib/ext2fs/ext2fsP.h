@@ -47,13 +47,26 @@ struct ext2_struct_u32_iterate {
 /*
  * Directory block iterator definition
  */
+/* A packed run of directory block list entries (see dblist.c) */
+struct ext2_dblist_chunk {
+	unsigned char		*data;
+	unsigned int		len;		/* bytes of data */
+	unsigned int		count;		/* entries */
+	ext2_ino_t		min_ino;
+	ext2_ino_t		max_ino;
+};
+
 struct ext2_struct_dblist {
 	int			magic;
 	ext2_filsys		fs;
-	unsigned long long	size;
-	unsigned long long	count;
+	unsigned long long	size;		/* room in list */
+	unsigned long long	count;		/* entries, packed or not */
 	int			sorted;
-	struct ext2_db_entry2 *	list;
+	int			default_order;	/* sorted by dir_block_cmp2 */
+	struct ext2_db_entry2 *	list;		/* entries not packed yet */
+	struct ext2_dblist_chunk *chunks;
+	unsigned long long	nr_chunks;
+	unsigned long long	max_chunks;
 };
 
 /*
@@ -176,9 +189,19 @@ extern errcode_t ext2fs_get_generic_bmap_range(ext2fs_generic_bitmap bitmap,
 					       __u64 start, unsigned int num,
 					       void *out);
 extern void ext2fs_warn_bitmap32(ext2fs_generic_bitmap bitmap,const char *func);
+extern errcode_t ext2fs_lazy_bitmap_load(ext2fs_generic_bitmap bmap,
+					 __u64 start, __u64 end);
+extern void ext2fs_lazy_bitmap_free(ext2fs_generic_bitmap bmap);
 
 extern int ext2fs_mem_is_zero(const char *mem, size_t len);
 
+extern void ext2fs_freefrag_dup(ext2_filsys src, ext2_filsys dest);
+extern void ext2fs_freefrag_changed(struct ext2fs_freefrag *ff, blk64_t blk,
+				    blk64_t num);
+extern void ext2fs_freefrag_forget(struct ext2fs_freefrag *ff);
+extern errcode_t ext2fs_freefrag_skip(ext2_filsys fs, ext2fs_block_bitmap map,
+				      blk64_t len, blk64_t *blk);
+
 extern int ext2fs_file_block_offset_too_big(ext2_filsys fs,
 					    struct ext2_inode *inode,
 					    blk64_t offset);
@@ -50,6 +50,9 @@ struct extent_path {
 	void		*curr;
 };
 
+#define EXTENT_PATH_CSUM_INVALID	0x0001	/* node failed its checksum */
+#define EXTENT_PATH_SORTED		0x0002	/* entries known to be in order */
+
 
 struct ext2_extent_handle {
 	errcode_t		magic;
@@ -486,10 +489,13 @@ retry:
 			return retval;
 		}
 
+		newpath->flags = 0;
 		if (!(handle->fs->flags & EXT2_FLAG_IGNORE_CSUM_ERRORS) &&
 		    !ext2fs_extent_block_csum_verify(handle->fs, handle->ino,
-						     eh))
+						     eh)) {
 			failed_csum = 1;
+			newpath->flags |= EXTENT_PATH_CSUM_INVALID;
+		}
 
 		newpath->left = newpath->entries =
 			ext2fs_le16_to_cpu(eh->eh_entries);
@@ -581,6 +587,11 @@ static errcode_t update_path(ext2_extent_handle_t handle)
 	errcode_t			retval;
 	struct ext3_extent_idx		*ix;
 	struct ext3_extent_header	*eh;
+	int				i;
+
+	/* The node changed; extent_goto_leaf() has to check it again */
+	for (i = 0; i < handle->max_paths; i++)
+		handle->path[i].flags &= ~EXTENT_PATH_SORTED;
 
 	if (handle->level == 0) {
 		retval = ext2fs_write_inode(handle->fs, handle->ino,
@@ -643,6 +654,137 @@ errcode_t ext2fs_extent_free_path(ext2_extent_path_t path)
 }
 #endif
 
+/*
+ * Check that the entries of a node are in strictly increasing order and,
+ * for a leaf, do not overlap.  Only then is a binary search guaranteed to
+ * land where the linear walk of ext2fs_extent_goto2() would.
+ */
+static int extent_path_sorted(struct extent_path *path, int leaf)
+{
+	struct ext3_extent_header	*eh;
+	struct ext3_extent		*ex;
+	struct ext3_extent_idx		*ix;
+	blk64_t				end = 0;
+	unsigned int			len;
+	int				i;
+
+	if (path->flags & EXTENT_PATH_SORTED)
+		return 1;
+	eh = (struct ext3_extent_header *) path->buf;
+	if (leaf) {
+		ex = EXT_FIRST_EXTENT(eh);
+		for (i = 0; i < path->entries; i++, ex++) {
+			if (i && ext2fs_le32_to_cpu(ex->ee_block) < end)
+				return 0;
+			len = ext2fs_le16_to_cpu(ex->ee_len);
+			if (len > EXT_INIT_MAX_LEN)
+				len -= EXT_INIT_MAX_LEN;
+			if (len == 0)
+				return 0;
+			end = ext2fs_le32_to_cpu(ex->ee_block) + (blk64_t) len;
+		}
+	} else {
+		ix = EXT_FIRST_INDEX(eh);
+		for (i = 0; i < path->entries; i++, ix++) {
+			if (i && ext2fs_le32_to_cpu(ix->ei_block) < end)
+				return 0;
+			end = ext2fs_le32_to_cpu(ix->ei_block) + 1;
+		}
+	}
+	path->flags |= EXTENT_PATH_SORTED;
+	return 1;
+}
+
+/*
+ * If the handle is already in the leaf which covers blk, find blk in
+ * that leaf instead of walking down from the root again.  Lookups which
+ * move steadily through a file then cost next to nothing.  The handle
+ * ends up where ext2fs_extent_goto2() would have left it.  Returns 0 if
+ * the caller has to do the full walk.
+ */
+static int extent_goto_leaf(ext2_extent_handle_t handle, blk64_t blk,
+			    errcode_t *ret)
+{
+	struct extent_path	*path;
+	struct ext3_extent_idx	*ix;
+	struct ext3_extent	*first, *ex;
+	int			i, cur, lo, hi, mid;
+	unsigned int		len;
+
+	if (!handle->path || handle->level != handle->max_depth)
+		return 0;
+	path = handle->path + handle->level;
+	if (!path->curr || path->entries <= 0 ||
+	    (path->flags & EXTENT_PATH_CSUM_INVALID))
+		return 0;
+	if (handle->level > 0) {
+		ix = path[-1].curr;
+		if (!ix || blk < ext2fs_le32_to_cpu(ix->ei_block) ||
+		    blk >= path->end_blk)
+			return 0;
+	}
+	for (i = 0; i <= handle->level; i++)
+		if (!extent_path_sorted(handle->path + i,
+					i == handle->level))
+			return 0;
+
+	first = EXT_FIRST_EXTENT((struct ext3_extent_header *) path->buf);
+	cur = (struct ext3_extent *) path->curr - first;
+	if (cur < 0 || cur >= path->entries)
+		return 0;
+
+	/* Find the last extent starting at or before blk */
+#define EX_LBLK(i)	((blk64_t) ext2fs_le32_to_cpu(first[(i)].ee_block))
+	if (EX_LBLK(cur) <= blk &&
+	    (cur + 1 == path->entries || EX_LBLK(cur + 1) > blk))
+		lo = cur;
+	else if (cur + 1 < path->entries && EX_LBLK(cur + 1) <= blk &&
+		 (cur + 2 == path->entries || EX_LBLK(cur + 2) > blk))
+		lo = cur + 1;
+	else {
+		lo = 0;
+		hi = path->entries - 1;
+		while (lo < hi) {
+			mid = (lo + hi + 1) / 2;
+			if (EX_LBLK(mid) <= blk)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
+	}
+#undef EX_LBLK
+
+	ex = first + lo;
+	path->curr = ex;
+	path->left = path->entries - lo - 1;
+	path->visit_num = 0;
+
+	/*
+	 * The walk down leaves an index marked as visited if it had to
+	 * step back to it from the next one; callers which go on to walk
+	 * the tree with EXT2_EXTENT_NEXT depend on that.
+	 */
+	for (path = handle->path; path < handle->path + handle->level;
+	     path++) {
+		ix = path->curr;
+		cur = ix - EXT_FIRST_INDEX((struct ext3_extent_header *)
+					   path->buf);
+		path->visit_num = (path->left > 0 &&
+				   !(cur > 0 &&
+				     blk == ext2fs_le32_to_cpu(ix->ei_block)));
+	}
+
+	len = ext2fs_le16_to_cpu(ex->ee_len);
+	if (len > EXT_INIT_MAX_LEN)
+		len -= EXT_INIT_MAX_LEN;
+	if (blk >= ext2fs_le32_to_cpu(ex->ee_block) &&
+	    blk < ext2fs_le32_to_cpu(ex->ee_block) + (blk64_t) len)
+		*ret = 0;
+	else
+		*ret = EXT2_ET_EXTENT_NOT_FOUND;
+	return 1;
+}
+
 /*
  * Go to the node at leaf_level which contains logical block blk.
  *
@@ -658,6 +800,11 @@ errcode_t ext2fs_extent_goto2(ext2_extent_handle_t handle,
 	struct ext2fs_extent	extent;
 	errcode_t		retval;
 
+	EXT2_CHECK_MAGIC(handle, EXT2_ET_MAGIC_EXTENT_HANDLE);
+
+	if (leaf_level == 0 && extent_goto_leaf(handle, blk, &retval))
+		return retval;
+
 	retval = ext2fs_extent_get(handle, EXT2_EXTENT_ROOT, &extent);
 	if (retval) {
 		if (retval == EXT2_ET_EXTENT_NO_NEXT)
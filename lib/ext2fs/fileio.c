@@ -30,10 +30,50 @@ struct ext2_file {
 	blk64_t			blockno;
 	blk64_t			physblock;
 	char 			*buf;
+	ext2_extent_handle_t	handle;		/* kept open for bmap lookups */
 };
 
 #define BMAP_BUFFER (file->buf + fs->blocksize)
 
+#define FILE_READ_EXTENTS	32
+
+/*
+ * An extent handle is kept open on file->inode from one block lookup to
+ * the next, so that lookups which move steadily through the file don't
+ * walk the tree from the top each time.  If it can't be opened, the
+ * lookups open their own.
+ */
+static void file_get_handle(ext2_file_t file)
+{
+	if (!file->handle && (file->inode.i_flags & EXT4_EXTENTS_FL) &&
+	    ext2fs_extent_open2(file->fs, file->ino, &file->inode,
+				&file->handle))
+		file->handle = NULL;
+}
+
+static errcode_t file_bmap(ext2_file_t file, int bmap_flags, blk64_t block,
+			   int *ret_flags, blk64_t *phys_blk)
+{
+	ext2_filsys	fs = file->fs;
+
+	file_get_handle(file);
+	return ext2fs_bmap3(fs, file->ino, &file->inode, file->handle,
+			    BMAP_BUFFER, bmap_flags, block, ret_flags,
+			    phys_blk);
+}
+
+/*
+ * The cached handle has to go whenever the extent tree might be changed
+ * behind its back.
+ */
+static void file_forget_handle(ext2_file_t file)
+{
+	if (file->handle) {
+		ext2fs_extent_free(file->handle);
+		file->handle = NULL;
+	}
+}
+
 errcode_t ext2fs_file_open2(ext2_filsys fs, ext2_ino_t ino,
 			    struct ext2_inode *inode,
 			    int flags, ext2_file_t *ret)
@@ -135,15 +175,13 @@ errcode_t ext2fs_file_flush(ext2_file_t file)
 
 	/* Is this an uninit block? */
 	if (file->physblock && file->inode.i_flags & EXT4_EXTENTS_FL) {
-		retval = ext2fs_bmap2(fs, file->ino, &file->inode, BMAP_BUFFER,
-				      0, file->blockno, &ret_flags, &dontcare);
+		retval = file_bmap(file, 0, file->blockno, &ret_flags,
+				   &dontcare);
 		if (retval)
 			return retval;
 		if (ret_flags & BMAP_RET_UNINIT) {
-			retval = ext2fs_bmap2(fs, file->ino, &file->inode,
-					      BMAP_BUFFER, BMAP_SET,
-					      file->blockno, 0,
-					      &file->physblock);
+			retval = file_bmap(file, BMAP_SET, file->blockno, 0,
+					   &file->physblock);
 			if (retval)
 				return retval;
 		}
@@ -154,9 +192,8 @@ errcode_t ext2fs_file_flush(ext2_file_t file)
 	 * Allocate it.
 	 */
 	if (!file->physblock) {
-		retval = ext2fs_bmap2(fs, file->ino, &file->inode,
-				     BMAP_BUFFER, file->ino ? BMAP_ALLOC : 0,
-				     file->blockno, 0, &file->physblock);
+		retval = file_bmap(file, file->ino ? BMAP_ALLOC : 0,
+				   file->blockno, 0, &file->physblock);
 		if (retval)
 			return retval;
 	}
@@ -206,9 +243,8 @@ static errcode_t load_buffer(ext2_file_t file, int dontfill)
 	int		ret_flags;
 
 	if (!(file->flags & EXT2_FILE_BUF_VALID)) {
-		retval = ext2fs_bmap2(fs, file->ino, &file->inode,
-				     BMAP_BUFFER, 0, file->blockno, &ret_flags,
-				     &file->physblock);
+		retval = file_bmap(file, 0, file->blockno, &ret_flags,
+				   &file->physblock);
 		if (retval)
 			return retval;
 		if (!dontfill) {
@@ -236,6 +272,7 @@ errcode_t ext2fs_file_close(ext2_file_t file)
 
 	retval = ext2fs_file_flush(file);
 
+	file_forget_handle(file);
 	if (file->buf)
 		ext2fs_free_mem(&file->buf);
 	ext2fs_free_mem(&file);
@@ -276,6 +313,57 @@ out:
 }
 
 
+/*
+ * Read whole blocks straight into the caller's buffer, one I/O for each
+ * extent rather than one for each block.
+ */
+static errcode_t file_read_blocks(ext2_file_t file, char *ptr,
+				  blk64_t nblocks)
+{
+	ext2_filsys		fs = file->fs;
+	struct ext2fs_extent	extents[FILE_READ_EXTENTS], *ex;
+	blk64_t			lblk, next, end;
+	errcode_t		retval;
+	int			i, n;
+
+	/* What's on disk must be up to date with the block buffer */
+	retval = ext2fs_file_flush(file);
+	if (retval)
+		return retval;
+	file_get_handle(file);
+
+	lblk = next = file->pos / fs->blocksize;
+	end = lblk + nblocks;
+	while (next < end) {
+		retval = ext2fs_bmap_range(fs, file->ino, &file->inode,
+					   file->handle, next, end - next,
+					   extents, FILE_READ_EXTENTS, &n);
+		if (retval)
+			return retval;
+		for (i = 0, ex = extents; i < n; i++, ex++) {
+			memset(ptr + (next - lblk) * fs->blocksize, 0,
+			       (ex->e_lblk - next) * fs->blocksize);
+			if (ex->e_flags & EXT2_EXTENT_FLAGS_UNINIT)
+				memset(ptr + (ex->e_lblk - lblk) * fs->blocksize,
+				       0, ex->e_len * fs->blocksize);
+			else {
+				retval = io_channel_read_blk64(fs->io,
+					ex->e_pblk, ex->e_len,
+					ptr + (ex->e_lblk - lblk) * fs->blocksize);
+				if (retval)
+					return retval;
+			}
+			next = ex->e_lblk + ex->e_len;
+		}
+		if (n < FILE_READ_EXTENTS) {
+			memset(ptr + (next - lblk) * fs->blocksize, 0,
+			       (end - next) * fs->blocksize);
+			next = end;
+		}
+	}
+	return 0;
+}
+
 errcode_t ext2fs_file_read(ext2_file_t file, void *buf,
 			   unsigned int wanted, unsigned int *got)
 {
@@ -293,6 +381,24 @@ errcode_t ext2fs_file_read(ext2_file_t file, void *buf,
 		return ext2fs_file_read_inline_data(file, buf, wanted, got);
 
 	while ((file->pos < EXT2_I_SIZE(&file->inode)) && (wanted > 0)) {
+		/* Runs of whole blocks bypass the block buffer */
+		left = EXT2_I_SIZE(&file->inode) - file->pos;
+		if (left > wanted)
+			left = wanted;
+		if ((file->pos % fs->blocksize) == 0 &&
+		    left >= 2 * fs->blocksize) {
+			c = left - (left % fs->blocksize);
+			retval = file_read_blocks(file, ptr,
+						  c / fs->blocksize);
+			if (retval)
+				goto fail;
+			file->pos += c;
+			ptr += c;
+			count += c;
+			wanted -= c;
+			continue;
+		}
+
 		retval = sync_buffer_position(file);
 		if (retval)
 			goto fail;
@@ -365,6 +471,7 @@ ext2fs_file_write_inline_data(ext2_file_t file, const void *buf,
 	}
 
 expand:
+	file_forget_handle(file);
 	retval = ext2fs_inline_data_expand(fs, file->ino);
 	if (retval)
 		return retval;
@@ -429,11 +536,8 @@ errcode_t ext2fs_file_write(ext2_file_t file, const void *buf,
 		 * Allocate it.
 		 */
 		if (!file->physblock) {
-			retval = ext2fs_bmap2(fs, file->ino, &file->inode,
-					      BMAP_BUFFER,
-					      file->ino ? BMAP_ALLOC : 0,
-					      file->blockno, 0,
-					      &file->physblock);
+			retval = file_bmap(file, file->ino ? BMAP_ALLOC : 0,
+					   file->blockno, 0, &file->physblock);
 			if (retval)
 				goto fail;
 		}
@@ -605,6 +709,7 @@ errcode_t ext2fs_file_set_size2(ext2_file_t file, ext2_off64_t size)
 	if (truncate_block >= old_truncate)
 		return 0;
 
+	file_forget_handle(file);
 	return ext2fs_punch(file->fs, file->ino, &file->inode, 0,
 			    truncate_block, ~0ULL);
 }
@@ -0,0 +1,992 @@
+/*
+ * freefrag.c --- track the fragmentation of free space
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+/*
+ * A free extent histogram is kept for each block group.  The free
+ * extents which touch either end of a group are remembered separately
+ * (as the group's head and tail), so that extents which span several
+ * groups can be stitched back together when the histogram for the
+ * whole file system is requested.
+ *
+ * Groups are scanned with the bitmap find_first_zero/find_first_set
+ * operations, which step over whole words (bitarray) or whole extents
+ * (rbtree) at a time, instead of testing every bit.  A group is only
+ * rescanned after it has changed: the tracker attaches itself to
+ * fs->block_map, and gen_bitmap64.c tells it about every block which is
+ * marked or unmarked there.
+ *
+ * The block allocators use the same state as an index of where the
+ * free extents are.  For each group we know the longest free extent
+ * which starts in it (counting a tail which runs on into the next
+ * group), and those lengths are kept in a max segment tree, so that
+ * ext2fs_freefrag_skip() can find the first group at or after the goal
+ * with room for an extent of a given length in O(log groups) steps.
+ * Groups are only scanned when a search reaches them; until then they
+ * are assumed to have room for anything.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <string.h>
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fsP.h"
+#include "bmap64.h"
+
+struct freefrag_group {
+	__u32		head;		/* free blocks at the group's start */
+	__u32		tail;		/* free blocks at the group's end */
+	__u32		min;		/* shortest interior free extent */
+	__u32		max;		/* longest free extent in the group */
+	__u32		chunks;		/* free chunks in interior extents */
+	int		stale;
+};
+
+struct ext2fs_freefrag {
+	ext2_filsys		fs;
+	ext2fs_block_bitmap	map;	/* bitmap the groups were scanned in */
+	dgrp_t			groups;
+	__u32			bpg;	/* blocks per group */
+	int			buckets;	/* per group */
+	int			chunk_bits;
+	struct freefrag_group	*group;
+	/*
+	 * Max segment tree over the groups: the leaves, starting at
+	 * tree[tsize], hold the longest free extent starting in each
+	 * group, or ~0U for a group which hasn't been scanned.
+	 */
+	__u32			*tree;
+	dgrp_t			tsize;
+	/* Interior extents, buckets entries per group, if wanted */
+	__u32			*extents;
+	__u32			*blocks;
+};
+
+static int freefrag_bucket(blk64_t len)
+{
+	int	bucket = 0;
+
+	while (len >>= 1)
+		bucket++;
+	return bucket;
+}
+
+/*
+ * Number of aligned chunks of 2^chunk_bits blocks lying entirely
+ * inside the free extent [blk, blk + len).
+ */
+static __u64 freefrag_chunks(int chunk_bits, blk64_t blk, blk64_t len)
+{
+	blk64_t	first, last;
+
+	first = (blk + (1ULL << chunk_bits) - 1) >> chunk_bits;
+	last = (blk + len) >> chunk_bits;
+	return last > first ? last - first : 0;
+}
+
+static void hist_add(struct ext2fs_freefrag_hist *hist, int chunk_bits,
+		     blk64_t blk, blk64_t len)
+{
+	int	bucket = freefrag_bucket(len);
+
+	if (bucket >= EXT2FS_FREEFRAG_BUCKETS)
+		bucket = EXT2FS_FREEFRAG_BUCKETS - 1;
+	hist->fh_extents[bucket]++;
+	hist->fh_blocks[bucket] += len;
+	hist->fh_total_extents++;
+	hist->fh_total_blocks += len;
+	if (len < hist->fh_min_extent)
+		hist->fh_min_extent = len;
+	if (len > hist->fh_max_extent)
+		hist->fh_max_extent = len;
+	hist->fh_free_chunks += freefrag_chunks(chunk_bits, blk, len);
+}
+
+static void hist_init(struct ext2fs_freefrag_hist *hist)
+{
+	memset(hist, 0, sizeof(struct ext2fs_freefrag_hist));
+	hist->fh_min_extent = ~0ULL;
+}
+
+static void hist_done(struct ext2fs_freefrag_hist *hist)
+{
+	if (!hist->fh_total_extents)
+		hist->fh_min_extent = 0;
+}
+
+/*
+ * The longest free extent which starts in a group.  If the next group
+ * hasn't been scanned, assume that it is entirely free.
+ */
+static __u32 freefrag_group_room(struct ext2fs_freefrag *ff, dgrp_t group)
+{
+	struct freefrag_group *grp = &ff->group[group];
+	__u64	room;
+
+	if (grp->stale)
+		return ~0U;
+	room = grp->max;
+	if (grp->tail && group + 1 < ff->groups) {
+		if (ff->group[group + 1].stale)
+			room = (__u64) grp->tail + ff->bpg;
+		else
+			room = (__u64) grp->tail + ff->group[group + 1].head;
+		if (room < grp->max)
+			room = grp->max;
+	}
+	return room > ~0U ? ~0U : room;
+}
+
+static void tree_update(struct ext2fs_freefrag *ff, dgrp_t group)
+{
+	size_t	i = (size_t) ff->tsize + group;
+	__u32	val;
+
+	ff->tree[i] = freefrag_group_room(ff, group);
+	for (i >>= 1; i; i >>= 1) {
+		val = ff->tree[2 * i] > ff->tree[2 * i + 1] ?
+			ff->tree[2 * i] : ff->tree[2 * i + 1];
+		if (ff->tree[i] == val)
+			break;
+		ff->tree[i] = val;
+	}
+}
+
+/* A group's room depends on the head of the group after it */
+static void freefrag_group_changed(struct ext2fs_freefrag *ff, dgrp_t group)
+{
+	tree_update(ff, group);
+	if (group)
+		tree_update(ff, group - 1);
+}
+
+static void freefrag_all_stale(struct ext2fs_freefrag *ff)
+{
+	dgrp_t	i;
+
+	for (i = 0; i < ff->groups; i++)
+		ff->group[i].stale = 1;
+	for (i = 0; i < ff->tsize; i++)
+		ff->tree[ff->tsize + i] = i < ff->groups ? ~0U : 0;
+	for (i = ff->tsize - 1; i > 0; i--)
+		ff->tree[i] = ff->tree[2 * i] > ff->tree[2 * i + 1] ?
+			ff->tree[2 * i] : ff->tree[2 * i + 1];
+}
+
+/*
+ * Return the first group at or after from whose room is at least len,
+ * or ff->groups if there is none.
+ */
+static dgrp_t tree_find(struct ext2fs_freefrag *ff, dgrp_t from, __u32 len)
+{
+	size_t	i;
+
+	if (from >= ff->groups)
+		return ff->groups;
+	i = (size_t) ff->tsize + from;
+	if (ff->tree[i] >= len)
+		return from;
+	/* Climb until a right sibling has enough room, then go down */
+	for (; i > 1; i >>= 1) {
+		if (!(i & 1) && ff->tree[i + 1] >= len)
+			break;
+	}
+	if (i <= 1)
+		return ff->groups;
+	for (i++; i < ff->tsize; )
+		i = ff->tree[2 * i] >= len ? 2 * i : 2 * i + 1;
+	return i - ff->tsize;
+}
+
+static void freefrag_mark_stale(struct ext2fs_freefrag *ff, blk64_t blk,
+				blk64_t num)
+{
+	ext2_filsys fs = ff->fs;
+	blk64_t	first = fs->super->s_first_data_block;
+	blk64_t	count = ext2fs_blocks_count(fs->super);
+	dgrp_t	group, last;
+
+	if (!num || blk >= count || ff->groups != fs->group_desc_count)
+		return;
+	if (blk < first) {
+		if (num <= first - blk)
+			return;
+		num -= first - blk;
+		blk = first;
+	}
+	if (num > count - blk)
+		num = count - blk;
+	group = ext2fs_group_of_blk2(fs, blk);
+	last = ext2fs_group_of_blk2(fs, blk + num - 1);
+	for (; group <= last && group < ff->groups; group++) {
+		if (ff->group[group].stale)
+			continue;
+		ff->group[group].stale = 1;
+		freefrag_group_changed(ff, group);
+	}
+}
+
+static void freefrag_free_groups(struct ext2fs_freefrag *ff)
+{
+	if (ff->group)
+		ext2fs_free_mem(&ff->group);
+	if (ff->tree)
+		ext2fs_free_mem(&ff->tree);
+	if (ff->extents)
+		ext2fs_free_mem(&ff->extents);
+	if (ff->blocks)
+		ext2fs_free_mem(&ff->blocks);
+	ff->groups = 0;
+	ff->tsize = 0;
+}
+
+static errcode_t freefrag_alloc_groups(ext2_filsys fs,
+				       struct ext2fs_freefrag *ff)
+{
+	errcode_t	retval;
+
+	freefrag_free_groups(ff);
+	ff->bpg = EXT2_BLOCKS_PER_GROUP(fs->super);
+	ff->buckets = freefrag_bucket(ff->bpg) + 1;
+	for (ff->tsize = 1; ff->tsize < fs->group_desc_count; ff->tsize <<= 1)
+		;
+	retval = ext2fs_get_array(fs->group_desc_count,
+				  sizeof(struct freefrag_group), &ff->group);
+	if (retval)
+		goto errout;
+	retval = ext2fs_get_array(2 * (size_t) ff->tsize, sizeof(__u32),
+				  &ff->tree);
+	if (retval)
+		goto errout;
+	ff->groups = fs->group_desc_count;
+	freefrag_all_stale(ff);
+	return 0;
+
+errout:
+	freefrag_free_groups(ff);
+	return retval;
+}
+
+/* The per-group histograms are only kept once somebody asks for one */
+static errcode_t freefrag_alloc_buckets(struct ext2fs_freefrag *ff)
+{
+	size_t		size = (size_t) ff->groups * ff->buckets;
+	errcode_t	retval;
+
+	retval = ext2fs_get_array(size, sizeof(__u32), &ff->extents);
+	if (retval)
+		return retval;
+	retval = ext2fs_get_array(size, sizeof(__u32), &ff->blocks);
+	if (retval) {
+		ext2fs_free_mem(&ff->extents);
+		return retval;
+	}
+	freefrag_all_stale(ff);
+	return 0;
+}
+
+static void freefrag_scan_group(ext2_filsys fs, struct ext2fs_freefrag *ff,
+				dgrp_t group)
+{
+	struct freefrag_group *grp = &ff->group[group];
+	__u32	*extents = NULL, *blocks = NULL;
+	blk64_t	start, end, blk, zero, set, len;
+	int	bucket;
+
+	start = ext2fs_group_first_block2(fs, group);
+	end = ext2fs_group_last_block2(fs, group);
+
+	if (ff->extents) {
+		extents = ff->extents + (size_t) group * ff->buckets;
+		blocks = ff->blocks + (size_t) group * ff->buckets;
+		memset(extents, 0, ff->buckets * sizeof(__u32));
+		memset(blocks, 0, ff->buckets * sizeof(__u32));
+	}
+	grp->head = grp->tail = 0;
+	grp->min = ~0U;
+	grp->max = 0;
+	grp->chunks = 0;
+
+	for (blk = start; blk <= end; blk = set) {
+		if (ext2fs_find_first_zero_block_bitmap2(ff->map, blk, end,
+							 &zero))
+			break;
+		if (ext2fs_find_first_set_block_bitmap2(ff->map, zero, end,
+							&set))
+			set = end + 1;
+		len = set - zero;
+		if (len > grp->max)
+			grp->max = len;
+		if (zero == start)
+			grp->head = len;
+		if (set == end + 1)
+			grp->tail = len;
+		if (zero == start || set == end + 1)
+			continue;
+		if (extents) {
+			bucket = freefrag_bucket(len);
+			extents[bucket]++;
+			blocks[bucket] += len;
+		}
+		if (len < grp->min)
+			grp->min = len;
+		grp->chunks += freefrag_chunks(ff->chunk_bits, zero, len);
+	}
+	grp->stale = 0;
+	freefrag_group_changed(ff, group);
+}
+
+/*
+ * Make sure the tracker is watching fs->block_map, and that its
+ * geometry matches the file system's.  Groups are not scanned here.
+ */
+static errcode_t freefrag_sync(ext2_filsys fs, struct ext2fs_freefrag *ff)
+{
+	ext2fs_block_bitmap map = fs->block_map;
+	errcode_t	retval;
+
+	if (!map)
+		return EXT2_ET_NO_BLOCK_BITMAP;
+	if (ff->groups != fs->group_desc_count ||
+	    ff->bpg != EXT2_BLOCKS_PER_GROUP(fs->super)) {
+		retval = freefrag_alloc_groups(fs, ff);
+		if (retval)
+			return retval;
+	}
+	if (!EXT2FS_IS_64_BITMAP(map)) {
+		/* Changes to 32-bit bitmaps can't be tracked */
+		if (ff->map && ff->map->freefrag == ff)
+			ff->map->freefrag = NULL;
+		ff->map = map;
+		freefrag_all_stale(ff);
+		return 0;
+	}
+	if (ff->map != map || map->freefrag != ff) {
+		if (ff->map && EXT2FS_IS_64_BITMAP(ff->map) &&
+		    ff->map->freefrag == ff)
+			ff->map->freefrag = NULL;
+		ff->map = map;
+		map->freefrag = ff;
+		freefrag_all_stale(ff);
+	}
+	return 0;
+}
+
+/*
+ * Bring the per-group histograms up to date with fs->block_map,
+ * rescanning only the groups which have changed since they were last
+ * scanned.
+ */
+static errcode_t freefrag_refresh(ext2_filsys fs)
+{
+	struct ext2fs_freefrag *ff = fs->freefrag;
+	errcode_t	retval;
+	dgrp_t		i;
+
+	if (!ff)
+		return EXT2_ET_INVALID_ARGUMENT;
+	retval = freefrag_sync(fs, ff);
+	if (retval)
+		return retval;
+	if (!ff->extents) {
+		retval = freefrag_alloc_buckets(ff);
+		if (retval)
+			return retval;
+	}
+	for (i = 0; i < ff->groups; i++)
+		if (ff->group[i].stale)
+			freefrag_scan_group(fs, ff, i);
+	return 0;
+}
+
+static void freefrag_add_interior(struct ext2fs_freefrag *ff, dgrp_t group,
+				  struct ext2fs_freefrag_hist *hist)
+{
+	struct freefrag_group *grp = &ff->group[group];
+	__u32	*extents = ff->extents + (size_t) group * ff->buckets;
+	__u32	*blocks = ff->blocks + (size_t) group * ff->buckets;
+	int	i, bucket;
+
+	for (i = 0; i < ff->buckets; i++) {
+		if (!extents[i])
+			continue;
+		bucket = i < EXT2FS_FREEFRAG_BUCKETS ? i :
+			EXT2FS_FREEFRAG_BUCKETS - 1;
+		hist->fh_extents[bucket] += extents[i];
+		hist->fh_blocks[bucket] += blocks[i];
+		hist->fh_total_extents += extents[i];
+		hist->fh_total_blocks += blocks[i];
+	}
+	if (grp->min == ~0U)
+		return;		/* no interior extents */
+	if (grp->min < hist->fh_min_extent)
+		hist->fh_min_extent = grp->min;
+	if (grp->max > hist->fh_max_extent)
+		hist->fh_max_extent = grp->max;
+	hist->fh_free_chunks += grp->chunks;
+}
+
+errcode_t ext2fs_freefrag_open(ext2_filsys fs, int chunk_bits)
+{
+	struct ext2fs_freefrag *ff = fs->freefrag;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	if (chunk_bits < 0 || chunk_bits > 63)
+		return EXT2_ET_INVALID_ARGUMENT;
+	if (ff) {
+		if (ff->chunk_bits != chunk_bits) {
+			ff->chunk_bits = chunk_bits;
+			freefrag_all_stale(ff);
+		}
+		return 0;
+	}
+
+	retval = ext2fs_get_memzero(sizeof(struct ext2fs_freefrag), &ff);
+	if (retval)
+		return retval;
+	ff->fs = fs;
+	ff->chunk_bits = chunk_bits;
+	retval = freefrag_alloc_groups(fs, ff);
+	if (retval) {
+		ext2fs_free_mem(&ff);
+		return retval;
+	}
+	fs->freefrag = ff;
+	return 0;
+}
+
+void ext2fs_freefrag_close(ext2_filsys fs)
+{
+	struct ext2fs_freefrag *ff;
+
+	if (!fs || fs->magic != EXT2_ET_MAGIC_EXT2FS_FILSYS || !fs->freefrag)
+		return;
+	ff = fs->freefrag;
+	if (ff->map && EXT2FS_IS_64_BITMAP(ff->map) &&
+	    ff->map->freefrag == ff)
+		ff->map->freefrag = NULL;
+	freefrag_free_groups(ff);
+	ext2fs_free_mem(&fs->freefrag);
+}
+
+/*
+ * Called by ext2fs_dup_handle().  The copy gets its own bitmaps, so it
+ * starts out without a tracker.
+ */
+void ext2fs_freefrag_dup(ext2_filsys src EXT2FS_ATTR((unused)),
+			 ext2_filsys dest)
+{
+	dest->freefrag = NULL;
+}
+
+/* Called by gen_bitmap64.c when blocks in the watched bitmap change */
+void ext2fs_freefrag_changed(struct ext2fs_freefrag *ff, blk64_t blk,
+			     blk64_t num)
+{
+	freefrag_mark_stale(ff, blk, num);
+}
+
+/* Called by gen_bitmap64.c when the watched bitmap is freed */
+void ext2fs_freefrag_forget(struct ext2fs_freefrag *ff)
+{
+	ff->map = NULL;
+}
+
+void ext2fs_freefrag_invalidate(ext2_filsys fs, blk64_t blk, blk64_t num)
+{
+	if (fs->freefrag)
+		freefrag_mark_stale(fs->freefrag, blk, num);
+}
+
+/*
+ * Used by the block allocators.  Advance *blk to the start of the
+ * first block group, beginning with *blk's own, which might hold a
+ * free extent of len blocks starting in it; *blk is left alone if its
+ * own group qualifies.  Returns ENOENT if there is no such group, and
+ * EXT2_ET_OP_NOT_SUPPORTED if map can't be indexed, in which case the
+ * caller should fall back to searching the bitmap.
+ */
+errcode_t ext2fs_freefrag_skip(ext2_filsys fs, ext2fs_block_bitmap map,
+			       blk64_t len, blk64_t *blk)
+{
+	struct ext2fs_freefrag *ff;
+	struct freefrag_group *grp;
+	dgrp_t		group, first;
+	errcode_t	retval;
+
+	if (!map || map != fs->block_map || !EXT2FS_IS_64_BITMAP(map))
+		return EXT2_ET_OP_NOT_SUPPORTED;
+	if (!fs->freefrag) {
+		retval = ext2fs_freefrag_open(fs, 0);
+		if (retval)
+			return retval;
+	}
+	ff = fs->freefrag;
+	retval = freefrag_sync(fs, ff);
+	if (retval)
+		return retval;
+
+	if (*blk >= ext2fs_blocks_count(fs->super))
+		return ENOENT;
+	if (*blk < fs->super->s_first_data_block)
+		*blk = fs->super->s_first_data_block;
+	if (len < 1 || len > ff->bpg)
+		len = 1;
+
+	first = group = ext2fs_group_of_blk2(fs, *blk);
+	while ((group = tree_find(ff, group, len)) < ff->groups) {
+		grp = &ff->group[group];
+		if (grp->stale)
+			freefrag_scan_group(fs, ff, group);
+		else if (grp->max < len && group + 1 < ff->groups &&
+			 ff->group[group + 1].stale)
+			freefrag_scan_group(fs, ff, group + 1);
+		else
+			break;
+	}
+	if (group >= ff->groups)
+		return ENOENT;
+	if (group != first)
+		*blk = ext2fs_group_first_block2(fs, group);
+	return 0;
+}
+
+/*
+ * Return the histogram of the free extents in the whole file system.
+ * Extents which cross block group boundaries are counted once, at
+ * their full length.
+ */
+errcode_t ext2fs_freefrag_get_hist(ext2_filsys fs,
+				   struct ext2fs_freefrag_hist *hist)
+{
+	struct ext2fs_freefrag *ff;
+	struct freefrag_group *grp;
+	blk64_t		carry = 0, carry_start = 0, size;
+	errcode_t	retval;
+	dgrp_t		i;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	retval = freefrag_refresh(fs);
+	if (retval)
+		return retval;
+	ff = fs->freefrag;
+
+	hist_init(hist);
+	for (i = 0; i < ff->groups; i++) {
+		grp = &ff->group[i];
+		size = ext2fs_group_last_block2(fs, i) -
+			ext2fs_group_first_block2(fs, i) + 1;
+		if (grp->head == size) {
+			/* The whole group is free */
+			if (!carry)
+				carry_start = ext2fs_group_first_block2(fs, i);
+			carry += size;
+			continue;
+		}
+		freefrag_add_interior(ff, i, hist);
+		if (grp->head) {
+			if (!carry)
+				carry_start = ext2fs_group_first_block2(fs, i);
+			carry += grp->head;
+		}
+		if (carry)
+			hist_add(hist, ff->chunk_bits, carry_start, carry);
+		carry = grp->tail;
+		carry_start = ext2fs_group_last_block2(fs, i) - grp->tail + 1;
+	}
+	if (carry)
+		hist_add(hist, ff->chunk_bits, carry_start, carry);
+	hist_done(hist);
+	return 0;
+}
+
+/*
+ * Return the histogram of the free extents in one block group; extents
+ * which continue into the neighbouring groups are cut off at the group
+ * boundaries.
+ */
+errcode_t ext2fs_freefrag_get_group_hist(ext2_filsys fs, dgrp_t group,
+					 struct ext2fs_freefrag_hist *hist)
+{
+	struct ext2fs_freefrag *ff;
+	struct freefrag_group *grp;
+	blk64_t		start, end;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	if (group >= fs->group_desc_count)
+		return EXT2_ET_INVALID_ARGUMENT;
+	retval = freefrag_refresh(fs);
+	if (retval)
+		return retval;
+	ff = fs->freefrag;
+	grp = &ff->group[group];
+	start = ext2fs_group_first_block2(fs, group);
+	end = ext2fs_group_last_block2(fs, group);
+
+	hist_init(hist);
+	if (grp->head == end - start + 1) {
+		hist_add(hist, ff->chunk_bits, start, grp->head);
+	} else {
+		freefrag_add_interior(ff, group, hist);
+		if (grp->head)
+			hist_add(hist, ff->chunk_bits, start, grp->head);
+		if (grp->tail)
+			hist_add(hist, ff->chunk_bits, end - grp->tail + 1,
+				 grp->tail);
+	}
+	hist_done(hist);
+	return 0;
+}
+
+#ifdef DEBUG
+/*
+ * Check the block allocators, which search through the free extent
+ * index, against plain linear scans of the bitmap, over a long series
+ * of random allocations and frees in both bitmap backends.
+ */
+#include <stdlib.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#define TST_ROUNDS	600
+
+static int failures;
+
+static ext2_filsys	fs;
+static blk64_t		first, count;
+static __u32		*run;	/* free blocks from each block on */
+static unsigned int	seed = 1;
+
+static unsigned int tst_random(unsigned int n)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) % n;
+}
+
+static void fill_run(void)
+{
+	blk64_t	b;
+
+	run[count] = 0;
+	for (b = count; b-- > first; )
+		run[b] = ext2fs_test_block_bitmap2(fs->block_map, b) ?
+			0 : run[b + 1] + 1;
+}
+
+/* The first free block at or after goal, wrapping around */
+static errcode_t ref_new_block(blk64_t goal, blk64_t *ret)
+{
+	blk64_t	b;
+
+	if (!goal || goal >= count)
+		goal = first;
+	for (b = goal; b < count; b++)
+		if (run[b])
+			goto found;
+	for (b = first; b < goal; b++)
+		if (run[b])
+			goto found;
+	return EXT2_ET_BLOCK_ALLOC_FAIL;
+found:
+	*ret = b;
+	return 0;
+}
+
+/* The search done by ext2fs_new_range(), one block at a time */
+static errcode_t ref_new_range(int flags, blk64_t goal, blk64_t len,
+			       blk64_t *pblk, blk64_t *plen)
+{
+	blk64_t	start;
+	int	looped = 0;
+
+	if (!goal || goal >= count)
+		goal = first;
+	start = goal;
+	while (!looped || start <= goal) {
+		while (start < count && !run[start])
+			start++;
+		if (start >= count) {
+			if (flags & EXT2_NEWRANGE_FIXED_GOAL || looped ||
+			    goal == first)
+				break;
+			looped = 1;
+			start = first;
+			continue;
+		}
+		if (flags & EXT2_NEWRANGE_FIXED_GOAL && start != goal)
+			break;
+		if (!(flags & EXT2_NEWRANGE_MIN_LENGTH) || run[start] >= len) {
+			*pblk = start;
+			*plen = run[start] < len ? run[start] : len;
+			return 0;
+		}
+		if (flags & EXT2_NEWRANGE_FIXED_GOAL)
+			break;
+		start += run[start];
+		if (start >= count) {
+			if (looped)
+				break;
+			looped = 1;
+			start = first;
+		}
+	}
+	return EXT2_ET_BLOCK_ALLOC_FAIL;
+}
+
+/* Does an extent of len free blocks start in group? */
+static int group_has_room(dgrp_t group, blk64_t len)
+{
+	blk64_t	b, end = ext2fs_group_last_block2(fs, group);
+
+	for (b = ext2fs_group_first_block2(fs, group); b <= end; b++)
+		if (run[b] >= len)
+			return 1;
+	return 0;
+}
+
+/* skip may stop early at a group which only might have room, never late */
+static void check_skip(blk64_t blk, blk64_t len)
+{
+	dgrp_t		group, found, g;
+	blk64_t		b = blk;
+	errcode_t	retval;
+
+	group = ext2fs_group_of_blk2(fs, blk);
+	retval = ext2fs_freefrag_skip(fs, fs->block_map, len, &b);
+	for (g = group; g < fs->group_desc_count; g++)
+		if (group_has_room(g, len))
+			break;
+	if (retval == ENOENT) {
+		if (g < fs->group_desc_count) {
+			printf("skip(%llu, %llu): ENOENT, but group %u "
+			       "has room\n", (unsigned long long) blk,
+			       (unsigned long long) len, g);
+			failures++;
+		}
+		return;
+	}
+	if (retval) {
+		com_err("tst_freefrag", retval, "while skipping from %llu",
+			(unsigned long long) blk);
+		failures++;
+		return;
+	}
+	found = ext2fs_group_of_blk2(fs, b);
+	if (found > g || (b != blk &&
+			  (found <= group ||
+			   b != ext2fs_group_first_block2(fs, found) ||
+			   !group_has_room(found, 1)))) {
+		printf("skip(%llu, %llu): %llu, expected group %u\n",
+		       (unsigned long long) blk, (unsigned long long) len,
+		       (unsigned long long) b, g);
+		failures++;
+	}
+}
+
+static void check_new_block(blk64_t goal)
+{
+	blk64_t		got = 0, want = 0;
+	errcode_t	retval, ref;
+
+	retval = ext2fs_new_block2(fs, goal, 0, &got);
+	ref = ref_new_block(goal, &want);
+	if (retval != ref || (!retval && got != want)) {
+		printf("new_block2(%llu): %ld/%llu, expected %ld/%llu\n",
+		       (unsigned long long) goal, retval,
+		       (unsigned long long) got, ref,
+		       (unsigned long long) want);
+		failures++;
+	}
+}
+
+static errcode_t check_new_range(int flags, blk64_t goal, blk64_t len,
+				 blk64_t *pblk, blk64_t *plen)
+{
+	blk64_t		want = 0, want_len = 0;
+	errcode_t	retval, ref;
+
+	*pblk = *plen = 0;
+	retval = ext2fs_new_range(fs, flags, goal, len, 0, pblk, plen);
+	ref = ref_new_range(flags, goal, len, &want, &want_len);
+	if (retval != ref ||
+	    (!retval && (*pblk != want || *plen != want_len))) {
+		printf("new_range(0x%x, %llu, %llu): %ld/%llu+%llu, "
+		       "expected %ld/%llu+%llu\n", flags,
+		       (unsigned long long) goal, (unsigned long long) len,
+		       retval, (unsigned long long) *pblk,
+		       (unsigned long long) *plen, ref,
+		       (unsigned long long) want,
+		       (unsigned long long) want_len);
+		failures++;
+		return EXT2_ET_BLOCK_ALLOC_FAIL;
+	}
+	return retval;
+}
+
+static void mark_range(blk64_t blk, blk64_t num, int set)
+{
+	if (blk < first)
+		blk = first;
+	if (blk >= count)
+		return;
+	if (num > count - blk)
+		num = count - blk;
+	if (set)
+		ext2fs_mark_block_bitmap_range2(fs->block_map, blk, num);
+	else
+		ext2fs_unmark_block_bitmap_range2(fs->block_map, blk, num);
+}
+
+static void check_random(int bitmap_type)
+{
+	struct ext2fs_freefrag_hist hist;
+	blk64_t		bpg = EXT2_BLOCKS_PER_GROUP(fs->super);
+	blk64_t		goal, len, blk, num;
+	errcode_t	retval;
+	int		i, j, flags;
+
+	ext2fs_free_block_bitmap(fs->block_map);
+	fs->block_map = NULL;
+	fs->default_bitmap_type = bitmap_type;
+	retval = ext2fs_allocate_block_bitmap(fs, "block bitmap",
+					      &fs->block_map);
+	if (retval) {
+		com_err("tst_freefrag", retval, "while allocating bitmap");
+		exit(1);
+	}
+	mark_range(first, count, 1);
+	mark_range(first + bpg / 2, count / 2, 0);
+
+	for (i = 0; i < TST_ROUNDS; i++) {
+		/* Frees are shorter than allocations, so space fragments */
+		blk = first + tst_random(count - first);
+		switch (tst_random(4)) {
+		case 0:
+			mark_range(blk, 1 + tst_random(2 * bpg), 1);
+			break;
+		case 1:
+			mark_range(blk, 1 + tst_random(bpg / 4), 0);
+			break;
+		case 2:
+			for (j = 0; j < 20; j++)
+				mark_range(first + tst_random(count - first),
+					   1 + tst_random(8), 0);
+			break;
+		default:
+			break;
+		}
+		/* Now and then, bring every group up to date at once */
+		if (i % 50 == 0)
+			ext2fs_freefrag_get_hist(fs, &hist);
+		fill_run();
+
+		for (j = 0; j < 4; j++) {
+			goal = tst_random(count + 10);
+			len = 1 + tst_random(bpg + bpg / 2);
+			check_skip(goal < first ? first :
+				   goal >= count ? count - 1 : goal,
+				   len > bpg ? bpg : len);
+			check_new_block(goal);
+			flags = EXT2_NEWRANGE_MIN_LENGTH;
+			if (tst_random(8) == 0)
+				flags |= EXT2_NEWRANGE_FIXED_GOAL;
+			check_new_range(flags, goal, len, &blk, &num);
+			check_new_range(0, goal, len, &blk, &num);
+		}
+
+		/* Allocate a range, as the extent code would */
+		goal = tst_random(count);
+		len = 1 + tst_random(bpg);
+		if (!check_new_range(EXT2_NEWRANGE_MIN_LENGTH, goal, len,
+				     &blk, &num))
+			mark_range(blk, num, 1);
+	}
+}
+
+/*
+ * No free extent is long enough, and there are short ones on both
+ * sides of the goal: the search must give up after one trip around
+ * the file system instead of going around forever.
+ */
+static void check_wrap_around(void)
+{
+	blk64_t		b, blk, num;
+	errcode_t	retval;
+
+	mark_range(first, count, 1);
+	for (b = first + 10; b + 50 < count; b += 100)
+		mark_range(b, 3, 0);
+	fill_run();
+	retval = check_new_range(EXT2_NEWRANGE_MIN_LENGTH, count / 2, 8,
+				 &blk, &num);
+	if (retval != EXT2_ET_BLOCK_ALLOC_FAIL) {
+		printf("new_range found %llu+%llu with no room\n",
+		       (unsigned long long) blk, (unsigned long long) num);
+		failures++;
+	}
+	retval = check_new_range(0, count / 2, 8, &blk, &num);
+	if (retval || num != 3) {
+		printf("new_range without a minimum: %ld/%llu+%llu\n",
+		       retval, (unsigned long long) blk,
+		       (unsigned long long) num);
+		failures++;
+	}
+}
+
+int main(int argc EXT2FS_ATTR((unused)), char **argv EXT2FS_ATTR((unused)))
+{
+	struct ext2_super_block param;
+	errcode_t		retval;
+
+	initialize_ext2_error_table();
+#ifdef HAVE_UNISTD_H
+	/* A search which goes around forever fails the test */
+	alarm(60);
+#endif
+
+	memset(&param, 0, sizeof(param));
+	ext2fs_blocks_count_set(&param, 16000);
+	param.s_blocks_per_group = 256;
+	retval = ext2fs_initialize("test fs", EXT2_FLAG_64BITS, &param,
+				   test_io_manager, &fs);
+	if (retval) {
+		com_err("tst_freefrag", retval, "while setting up");
+		exit(1);
+	}
+	first = fs->super->s_first_data_block;
+	count = ext2fs_blocks_count(fs->super);
+	retval = ext2fs_get_array(count + 1, sizeof(__u32), &run);
+	if (retval) {
+		com_err("tst_freefrag", retval, "while setting up");
+		exit(1);
+	}
+
+	check_random(EXT2FS_BMAP64_BITARRAY);
+	check_random(EXT2FS_BMAP64_RBTREE);
+	check_wrap_around();
+
+	ext2fs_free_mem(&run);
+	ext2fs_free(fs);
+	if (failures) {
+		printf("tst_freefrag: %d failures\n", failures);
+		return 1;
+	}
+	printf("tst_freefrag: OK\n");
+	return 0;
+}
+#endif /* DEBUG */
@@ -59,6 +59,8 @@ void ext2fs_free(ext2_filsys fs)
 	if (fs->mmp_cmp)
 		ext2fs_free_mem(&fs->mmp_cmp);
 
+	ext2fs_freefrag_close(fs);
+
 	fs->magic = 0;
 
 	ext2fs_zero_blocks2(NULL, 0, 0, NULL, NULL);
@@ -96,6 +98,10 @@ void ext2fs_free_dblist(ext2_dblist dblist)
 	if (dblist->list)
 		ext2fs_free_mem(&dblist->list);
 	dblist->list = 0;
+	while (dblist->nr_chunks)
+		ext2fs_free_mem(&dblist->chunks[--dblist->nr_chunks].data);
+	if (dblist->chunks)
+		ext2fs_free_mem(&dblist->chunks);
 	if (dblist->fs && dblist->fs->dblist == dblist)
 		dblist->fs->dblist = 0;
 	dblist->magic = 0;
@@ -86,6 +86,46 @@ static void warn_bitmap(ext2fs_generic_bitmap bitmap,
 #define INC_STAT(map, name) ;;
 #endif
 
+/*
+ * Fault in the groups of a lazily loaded filesystem bitmap which
+ * cover bits start..end; see ext2fs_lazy_bitmap_load().  The callers
+ * which can't return an error rely on the failed groups being all
+ * ones; the error is reported the first time it is seen.
+ */
+static errcode_t lazy_load(ext2fs_generic_bitmap bitmap,
+			   __u64 start, __u64 end)
+{
+	errcode_t	retval;
+
+	retval = ext2fs_lazy_bitmap_load(bitmap, start, end);
+	if (retval && bitmap->lazy && !bitmap->lazy->reported) {
+		bitmap->lazy->reported = 1;
+#ifndef OMIT_COM_ERR
+		com_err(0, retval, "while reading %s",
+			bitmap->description ? bitmap->description : "bitmap");
+#endif
+	}
+	return retval;
+}
+
+#define LAZY_LOAD(map, start, end) \
+	do { if ((map)->lazy) lazy_load((map), (start), (end)); } while (0)
+
+/*
+ * Tell the free extent tracker watching a filesystem's block bitmap
+ * (see freefrag.c) which blocks have changed.  start and num are in
+ * bitmap units.  Reading in a lazily loaded group doesn't change what
+ * the bitmap says, so it doesn't count.
+ */
+#define FREEFRAG_CHANGED(map, start, num)				\
+	do {								\
+		if ((map)->freefrag &&					\
+		    !((map)->lazy && (map)->lazy->depth))		\
+			ext2fs_freefrag_changed((map)->freefrag,	\
+				(__u64) (start) << (map)->cluster_bits,	\
+				(__u64) (num) << (map)->cluster_bits);	\
+	} while (0)
+
 
 errcode_t ext2fs_alloc_generic_bmap(ext2_filsys fs, errcode_t magic,
 				    int type, __u64 start, __u64 end,
@@ -261,6 +301,9 @@ void ext2fs_free_generic_bmap(ext2fs_generic_bitmap bmap)
 	}
 #endif
 
+	if (bmap->freefrag)
+		ext2fs_freefrag_forget(bmap->freefrag);
+	ext2fs_lazy_bitmap_free(bmap);
 	bmap->bitmap_ops->free_bmap(bmap);
 
 	if (bmap->description) {
@@ -287,6 +330,13 @@ errcode_t ext2fs_copy_generic_bmap(ext2fs_generic_bitmap src,
 	if (!EXT2FS_IS_64_BITMAP(src))
 		return EINVAL;
 
+	if (src->lazy) {
+		retval = ext2fs_lazy_bitmap_load(src, src->start,
+						 src->real_end);
+		if (retval)
+			return retval;
+	}
+
 	/* Allocate a new bitmap struct */
 	retval = ext2fs_get_memzero(sizeof(struct ext2fs_struct_generic_bitmap),
 				    &new_bmap);
@@ -357,6 +407,16 @@ errcode_t ext2fs_resize_generic_bmap(ext2fs_generic_bitmap bmap,
 
 	INC_STAT(bmap, resize_count);
 
+	if (bmap->lazy) {
+		errcode_t retval;
+
+		retval = ext2fs_lazy_bitmap_load(bmap, bmap->start,
+						 bmap->real_end);
+		if (retval)
+			return retval;
+	}
+
+	FREEFRAG_CHANGED(bmap, 0, ~0ULL >> 16);
 	return bmap->bitmap_ops->resize_bmap(bmap, new_end, new_real_end);
 }
 
@@ -417,12 +477,35 @@ __u64 ext2fs_get_generic_bmap_end(ext2fs_generic_bitmap bitmap)
 	return bitmap->end;
 }
 
+/*
+ * Return an estimate of the number of bytes of memory used by a
+ * bitmap, for use in resource usage reports.
+ */
+unsigned long long ext2fs_get_generic_bmap_mem_usage(ext2fs_generic_bitmap bmap)
+{
+	if (!bmap)
+		return 0;
+
+	if (EXT2FS_IS_32_BITMAP(bmap))
+		return ((ext2fs_get_generic_bitmap_end(bmap) -
+			 ext2fs_get_generic_bitmap_start(bmap)) >> 3) + 1;
+
+	if (!EXT2FS_IS_64_BITMAP(bmap) || !bmap->bitmap_ops->get_mem_usage)
+		return 0;
+
+	return bmap->bitmap_ops->get_mem_usage(bmap) + sizeof(*bmap);
+}
+
 void ext2fs_clear_generic_bmap(ext2fs_generic_bitmap bitmap)
 {
 	if (EXT2FS_IS_32_BITMAP(bitmap))
 		ext2fs_clear_generic_bitmap(bitmap);
-	else
+	else {
+		/* There's no point reading in what we're about to clear */
+		ext2fs_lazy_bitmap_free(bitmap);
+		FREEFRAG_CHANGED(bitmap, 0, ~0ULL >> 16);
 		bitmap->bitmap_ops->clear_bmap (bitmap);
+	}
 }
 
 int ext2fs_mark_generic_bmap(ext2fs_generic_bitmap bitmap,
@@ -459,6 +542,9 @@ int ext2fs_mark_generic_bmap(ext2fs_generic_bitmap bitmap,
 		return 0;
 	}
 
+	LAZY_LOAD(bitmap, arg, arg);
+	FREEFRAG_CHANGED(bitmap, arg, 1);
+
 	return bitmap->bitmap_ops->mark_bmap(bitmap, arg);
 }
 
@@ -489,6 +575,9 @@ int ext2fs_unmark_generic_bmap(ext2fs_generic_bitmap bitmap,
 		return 0;
 	}
 
+	LAZY_LOAD(bitmap, arg, arg);
+	FREEFRAG_CHANGED(bitmap, arg, 1);
+
 	return bitmap->bitmap_ops->unmark_bmap(bitmap, arg);
 }
 
@@ -526,6 +615,8 @@ int ext2fs_test_generic_bmap(ext2fs_generic_bitmap bitmap,
 		return 0;
 	}
 
+	LAZY_LOAD(bitmap, arg, arg);
+
 	return bitmap->bitmap_ops->test_bmap(bitmap, arg);
 }
 
@@ -551,6 +642,15 @@ errcode_t ext2fs_set_generic_bmap_range(ext2fs_generic_bitmap bmap,
 
 	INC_STAT(bmap, set_range_count);
 
+	if (bmap->lazy && num) {
+		errcode_t retval;
+
+		retval = ext2fs_lazy_bitmap_load(bmap, start, start + num - 1);
+		if (retval)
+			return retval;
+	}
+	FREEFRAG_CHANGED(bmap, start, num);
+
 	return bmap->bitmap_ops->set_bmap_range(bmap, start, num, in);
 }
 
@@ -576,6 +676,14 @@ errcode_t ext2fs_get_generic_bmap_range(ext2fs_generic_bitmap bmap,
 
 	INC_STAT(bmap, get_range_count);
 
+	if (bmap->lazy && num) {
+		errcode_t retval;
+
+		retval = ext2fs_lazy_bitmap_load(bmap, start, start + num - 1);
+		if (retval)
+			return retval;
+	}
+
 	return bmap->bitmap_ops->get_bmap_range(bmap, start, num, out);
 }
 
@@ -620,6 +728,8 @@ void ext2fs_set_generic_bmap_padding(ext2fs_generic_bitmap bmap)
 
 	start = bmap->end + 1;
 	num = bmap->real_end - bmap->end;
+	if (num)
+		LAZY_LOAD(bmap, start, bmap->real_end);
 	bmap->bitmap_ops->mark_bmap_extent(bmap, start, num);
 	/* XXX ought to warn on error */
 }
@@ -663,6 +773,8 @@ int ext2fs_test_block_bitmap_range2(ext2fs_block_bitmap bmap,
 		return EINVAL;
 	}
 
+	LAZY_LOAD(bmap, block, block + num - 1);
+
 	return bmap->bitmap_ops->test_clear_bmap_extent(bmap, block, num);
 }
 
@@ -701,6 +813,9 @@ void ext2fs_mark_block_bitmap_range2(ext2fs_block_bitmap bmap,
 		return;
 	}
 
+	LAZY_LOAD(bmap, block, block + num - 1);
+	FREEFRAG_CHANGED(bmap, block, num);
+
 	bmap->bitmap_ops->mark_bmap_extent(bmap, block, num);
 }
 
@@ -739,6 +854,9 @@ void ext2fs_unmark_block_bitmap_range2(ext2fs_block_bitmap bmap,
 		return;
 	}
 
+	LAZY_LOAD(bmap, block, block + num - 1);
+	FREEFRAG_CHANGED(bmap, block, num);
+
 	bmap->bitmap_ops->unmark_bmap_extent(bmap, block, num);
 }
 
@@ -798,6 +916,52 @@ errcode_t ext2fs_convert_subcluster_bitmap(ext2_filsys fs,
 	return 0;
 }
 
+/*
+ * Find the first zero (or set) bit between start and end inclusive,
+ * in bitmap units.  Lazily loaded bitmaps are searched a group at a
+ * time, so that we only read in as many groups as we have to.
+ */
+static errcode_t find_first_bit(ext2fs_generic_bitmap bitmap, int set,
+				__u64 start, __u64 end, __u64 *out)
+{
+	errcode_t (*find_first)(ext2fs_generic_bitmap, __u64, __u64, __u64 *);
+	__u64 chunk_end, per_group, cout;
+	errcode_t retval;
+
+	find_first = set ? bitmap->bitmap_ops->find_first_set :
+		bitmap->bitmap_ops->find_first_zero;
+
+	while (1) {
+		chunk_end = end;
+		if (bitmap->lazy) {
+			per_group = bitmap->lazy->per_group;
+			chunk_end = bitmap->start - 1 + per_group *
+				((start - bitmap->start) / per_group + 1);
+			if (chunk_end > end)
+				chunk_end = end;
+			retval = lazy_load(bitmap, start, chunk_end);
+			if (retval)
+				return retval;
+		}
+
+		if (find_first) {
+			retval = find_first(bitmap, start, chunk_end, out);
+			if (retval != ENOENT)
+				return retval;
+		} else {
+			for (cout = start; cout <= chunk_end; cout++)
+				if (!bitmap->bitmap_ops->test_bmap(bitmap,
+								   cout) == !set) {
+					*out = cout;
+					return 0;
+				}
+		}
+		if (chunk_end >= end)
+			return ENOENT;
+		start = chunk_end + 1;
+	}
+}
+
 errcode_t ext2fs_find_first_zero_generic_bmap(ext2fs_generic_bitmap bitmap,
 					      __u64 start, __u64 end, __u64 *out)
 {
@@ -834,22 +998,12 @@ errcode_t ext2fs_find_first_zero_generic_bmap(ext2fs_generic_bitmap bitmap,
 		return EINVAL;
 	}
 
-	if (bitmap->bitmap_ops->find_first_zero) {
-		retval = bitmap->bitmap_ops->find_first_zero(bitmap, cstart,
-							     cend, &cout);
-		if (retval)
-			return retval;
-	found:
-		cout <<= bitmap->cluster_bits;
-		*out = (cout >= start) ? cout : start;
-		return 0;
-	}
-
-	for (cout = cstart; cout <= cend; cout++)
-		if (!bitmap->bitmap_ops->test_bmap(bitmap, cout))
-			goto found;
-
-	return ENOENT;
+	retval = find_first_bit(bitmap, 0, cstart, cend, &cout);
+	if (retval)
+		return retval;
+	cout <<= bitmap->cluster_bits;
+	*out = (cout >= start) ? cout : start;
+	return 0;
 }
 
 errcode_t ext2fs_find_first_set_generic_bmap(ext2fs_generic_bitmap bitmap,
@@ -888,20 +1042,10 @@ errcode_t ext2fs_find_first_set_generic_bmap(ext2fs_generic_bitmap bitmap,
 		return EINVAL;
 	}
 
-	if (bitmap->bitmap_ops->find_first_set) {
-		retval = bitmap->bitmap_ops->find_first_set(bitmap, cstart,
-							    cend, &cout);
-		if (retval)
-			return retval;
-	found:
-		cout <<= bitmap->cluster_bits;
-		*out = (cout >= start) ? cout : start;
-		return 0;
-	}
-
-	for (cout = cstart; cout <= cend; cout++)
-		if (bitmap->bitmap_ops->test_bmap(bitmap, cout))
-			goto found;
-
-	return ENOENT;
+	retval = find_first_bit(bitmap, 1, cstart, cend, &cout);
+	if (retval)
+		return retval;
+	cout <<= bitmap->cluster_bits;
+	*out = (cout >= start) ? cout : start;
+	return 0;
 }
@@ -550,6 +550,107 @@ errcode_t ext2fs_icount_fetch(ext2_icount_t icount, ext2_ino_t ino, __u16 *ret)
 	return 0;
 }
 
+/*
+ * Fetch the counts of the num inodes starting at start into counts[].
+ * This walks the bitmaps and the sorted list in step with the range
+ * instead of looking up each inode, and it doesn't touch the lookup
+ * cursor, so several threads may fetch ranges at the same time as
+ * long as nobody changes the icount meanwhile.  (That doesn't hold
+ * for an icount kept in a tdb file, which must be fetched serially.)
+ */
+errcode_t ext2fs_icount_fetch_range(ext2_icount_t icount, ext2_ino_t start,
+				    ext2_ino_t num, __u16 *counts)
+{
+	struct ext2_icount_el	*el, *end;
+	unsigned char		*single = 0, *multiple = 0;
+	size_t			bytes;
+	ext2_ino_t		i;
+	__u32			val;
+	int			low, high, mid;
+	errcode_t		retval;
+
+	EXT2_CHECK_MAGIC(icount, EXT2_ET_MAGIC_ICOUNT);
+
+	if (!start || (start > icount->num_inodes) ||
+	    (num > icount->num_inodes - start + 1))
+		return EXT2_ET_INVALID_ARGUMENT;
+	if (!num)
+		return 0;
+
+	if (icount->fullmap) {
+		for (i = 0; i < num; i++)
+			counts[i] = icount_16_xlate(icount->fullmap[start + i]);
+		return 0;
+	}
+
+	bytes = ((size_t) num + 7) / 8;
+	retval = ext2fs_get_memzero(bytes, &single);
+	if (retval)
+		return retval;
+	retval = ext2fs_get_inode_bitmap_range2(icount->single, start, num,
+						single);
+	if (retval)
+		goto errout;
+	if (icount->multiple) {
+		retval = ext2fs_get_memzero(bytes, &multiple);
+		if (retval)
+			goto errout;
+		retval = ext2fs_get_inode_bitmap_range2(icount->multiple,
+							start, num, multiple);
+		if (retval)
+			goto errout;
+	}
+
+	memset(counts, 0, num * sizeof(*counts));
+#ifdef CONFIG_TDB
+	if (icount->tdb) {
+		for (i = 0; i < num; i++) {
+			if (ext2fs_test_bit(i, single))
+				counts[i] = 1;
+			else if (!multiple || ext2fs_test_bit(i, multiple)) {
+				get_inode_count(icount, start + i, &val);
+				counts[i] = icount_16_xlate(val);
+			}
+		}
+		goto errout;
+	}
+#endif
+	for (i = 0; i < num; i++)
+		if (ext2fs_test_bit(i, single))
+			counts[i] = 1;
+
+	if (!icount->list)
+		goto errout;
+
+	/* Find the first list entry in the range, then walk forward */
+	low = 0;
+	high = (int) icount->count - 1;
+	while (low <= high) {
+		mid = ((unsigned) low + (unsigned) high) >> 1;
+		if (icount->list[mid].ino < start)
+			low = mid + 1;
+		else
+			high = mid - 1;
+	}
+	end = icount->list + icount->count;
+	for (el = icount->list + low; el < end; el++) {
+		i = el->ino - start;
+		if (i >= num)
+			break;
+		if (ext2fs_test_bit(i, single) ||
+		    (multiple && !ext2fs_test_bit(i, multiple)))
+			continue;
+		val = el->count;
+		counts[i] = icount_16_xlate(val);
+	}
+
+errout:
+	ext2fs_free_mem(&single);
+	if (multiple)
+		ext2fs_free_mem(&multiple);
+	return retval;
+}
+
 errcode_t ext2fs_icount_increment(ext2_icount_t icount, ext2_ino_t ino,
 				  __u16 *ret)
 {
@@ -709,6 +810,31 @@ ext2_ino_t ext2fs_get_icount_size(ext2_icount_t icount)
 	return icount->size;
 }
 
+/*
+ * Return an estimate of the number of bytes of memory used by the
+ * icount structure (not counting any on-disk tdb file).
+ */
+unsigned long long ext2fs_get_icount_mem_usage(ext2_icount_t icount)
+{
+	unsigned long long	mem;
+
+	if (!icount || icount->magic != EXT2_ET_MAGIC_ICOUNT)
+		return 0;
+
+	mem = sizeof(struct ext2_icount);
+	if (icount->fullmap)
+		mem += (unsigned long long) icount->num_inodes *
+			sizeof(*icount->fullmap);
+	else
+		mem += (unsigned long long) icount->size *
+			sizeof(struct ext2_icount_el);
+	mem += ext2fs_get_generic_bmap_mem_usage(
+		(ext2fs_generic_bitmap) icount->single);
+	mem += ext2fs_get_generic_bmap_mem_usage(
+		(ext2fs_generic_bitmap) icount->multiple);
+	return mem;
+}
+
 #ifdef DEBUG
 
 ext2_filsys	test_fs;
@@ -815,6 +941,45 @@ static void setup(void)
 	}
 }
 
+/*
+ * Check that ext2fs_icount_fetch_range() agrees with ext2fs_icount_fetch()
+ * over the whole inode table and over a range starting mid-way.
+ */
+static int check_fetch_range(ext2_icount_t icount)
+{
+	ext2_ino_t	ino, num = test_fs->super->s_inodes_count;
+	ext2_ino_t	starts[2] = { 1, 7 };
+	__u16		*counts, result;
+	errcode_t	retval;
+	int		i, problem = 0;
+
+	retval = ext2fs_get_array(num, sizeof(__u16), &counts);
+	if (retval) {
+		com_err("check_fetch_range", retval, "while allocating counts");
+		exit(1);
+	}
+	for (i = 0; i < 2; i++) {
+		retval = ext2fs_icount_fetch_range(icount, starts[i],
+						   num - starts[i] + 1, counts);
+		if (retval) {
+			com_err("check_fetch_range", retval,
+				"while calling icount_fetch_range");
+			exit(1);
+		}
+		for (ino = starts[i]; ino <= num; ino++) {
+			ext2fs_icount_fetch(icount, ino, &result);
+			if (counts[ino - starts[i]] != result) {
+				printf("icount_fetch_range(%u) = %u, "
+				       "expected %u (NOT OK)\n", ino,
+				       counts[ino - starts[i]], result);
+				problem++;
+			}
+		}
+	}
+	ext2fs_free_mem(&counts);
+	return problem;
+}
+
 int run_test(int flags, int size, char *dir, struct test_program *prog)
 {
 	errcode_t	retval;
@@ -888,6 +1053,7 @@ int run_test(int flags, int size, char *dir, struct test_program *prog)
 		if (result != pc->expected)
 			problem++;
 	}
+	problem += check_fetch_range(icount);
 	printf("icount size is %u\n", ext2fs_get_icount_size(icount));
 	retval = ext2fs_icount_validate(icount, stdout);
 	if (retval) {
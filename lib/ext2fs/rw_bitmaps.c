@@ -25,8 +25,12 @@
 #endif
 
 #include "ext2_fs.h"
-#include "ext2fs.h"
+#include "ext2fsP.h"
 #include "e2image.h"
+#include "bmap64.h"
+
+static int lazy_group_loaded(ext2fs_generic_bitmap bmap, dgrp_t group);
+static errcode_t lazy_bitmap_error(ext2fs_generic_bitmap bmap);
 
 static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 {
@@ -43,6 +47,17 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
+	/*
+	 * If a group of a lazily loaded bitmap couldn't be read in, the
+	 * allocations made since can't be trusted, so neither bitmap is
+	 * written out.
+	 */
+	retval = lazy_bitmap_error(fs->block_map);
+	if (!retval)
+		retval = lazy_bitmap_error(fs->inode_map);
+	if (retval)
+		return retval;
+
 	if (!(fs->flags & EXT2_FLAG_RW))
 		return EXT2_ET_RO_FILSYS;
 
@@ -73,6 +88,9 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		    )
 			goto skip_this_block_bitmap;
 
+		if (!lazy_group_loaded(fs->block_map, i))
+			goto skip_this_block_bitmap;
+
 		retval = ext2fs_get_block_bitmap_range2(fs->block_map,
 				blk_itr, block_nbytes << 3, block_buf);
 		if (retval)
@@ -116,6 +134,9 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		    )
 			goto skip_this_inode_bitmap;
 
+		if (!lazy_group_loaded(fs->inode_map, i))
+			goto skip_this_inode_bitmap;
+
 		retval = ext2fs_get_inode_bitmap_range2(fs->inode_map,
 				ino_itr, inode_nbytes << 3, inode_buf);
 		if (retval)
@@ -158,52 +179,330 @@ errout:
 	return retval;
 }
 
+/*
+ * Mark the group metadata blocks of a BLOCK_UNINIT group, which are
+ * not recorded in any on-disk bitmap.
+ */
+static void mark_uninit_group_blocks(ext2_filsys fs, ext2fs_block_bitmap bmap,
+				     dgrp_t i)
+{
+	blk64_t			blk;
+
+	ext2fs_reserve_super_and_bgd(fs, i, bmap);
+
+	/*
+	 * Mark the blocks used for the inode table
+	 */
+	blk = ext2fs_inode_table_loc(fs, i);
+	if (blk)
+		ext2fs_mark_block_bitmap_range2(bmap, blk,
+					fs->inode_blocks_per_group);
+
+	/*
+	 * Mark block used for the block bitmap
+	 */
+	blk = ext2fs_block_bitmap_loc(fs, i);
+	if (blk)
+		ext2fs_mark_block_bitmap2(bmap, blk);
+
+	/*
+	 * Mark block used for the inode bitmap
+	 */
+	blk = ext2fs_inode_bitmap_loc(fs, i);
+	if (blk)
+		ext2fs_mark_block_bitmap2(bmap, blk);
+}
+
 static errcode_t mark_uninit_bg_group_blocks(ext2_filsys fs)
 {
 	dgrp_t			i;
-	blk64_t			blk;
-	ext2fs_block_bitmap	bmap = fs->block_map;
 
 	for (i = 0; i < fs->group_desc_count; i++) {
 		if (!ext2fs_bg_flags_test(fs, i, EXT2_BG_BLOCK_UNINIT))
 			continue;
+		mark_uninit_group_blocks(fs, fs->block_map, i);
+	}
+	return 0;
+}
 
-		ext2fs_reserve_super_and_bgd(fs, i, bmap);
-
-		/*
-		 * Mark the blocks used for the inode table
-		 */
-		blk = ext2fs_inode_table_loc(fs, i);
-		if (blk)
-			ext2fs_mark_block_bitmap_range2(bmap, blk,
-						fs->inode_blocks_per_group);
+/*
+ * Return the location of a group's inode or block bitmap, or 0 if the
+ * bitmap is uninitialized and should be treated as all zeroes.  For a
+ * lazily loaded bitmap we go by the state of the group when the
+ * filesystem was opened, since the uninit flags may have been cleared
+ * by allocations in other groups since then.
+ */
+static blk64_t bitmap_loc(ext2_filsys fs, int do_inode, dgrp_t i,
+			  struct ext2fs_lazy_bitmap *lazy)
+{
+	blk64_t	blk;
+	int	uninit_flag;
 
-		/*
-		 * Mark block used for the block bitmap
-		 */
+	if (lazy && ext2fs_test_bit(i, lazy->uninit))
+		return 0;
+	if (do_inode) {
+		blk = ext2fs_inode_bitmap_loc(fs, i);
+		uninit_flag = EXT2_BG_INODE_UNINIT;
+	} else {
 		blk = ext2fs_block_bitmap_loc(fs, i);
-		if (blk)
-			ext2fs_mark_block_bitmap2(bmap, blk);
+		uninit_flag = EXT2_BG_BLOCK_UNINIT;
+	}
+	if (!lazy && ext2fs_has_group_desc_csum(fs) &&
+	    ext2fs_bg_flags_test(fs, i, uninit_flag) &&
+	    ext2fs_group_desc_csum_verify(fs, i))
+		return 0;
+	return blk;
+}
 
-		/*
-		 * Mark block used for the inode bitmap
-		 */
-		blk = ext2fs_inode_bitmap_loc(fs, i);
-		if (blk)
-			ext2fs_mark_block_bitmap2(bmap, blk);
+/*
+ * Maximum number of bitmap blocks read with a single I/O.  With
+ * flex_bg the bitmaps of a whole flex group are packed next to each
+ * other on disk, so reading them in runs instead of one block per
+ * group saves a request (and often a seek) per group.
+ */
+#define BITMAP_READ_RUN		64
+
+/*
+ * Read the inode or block bitmaps of groups first..last from disk
+ * into bmap.  buf must be at least run blocks long.  lazy is bmap's
+ * lazy loading state, or NULL if the bitmap is being read eagerly.
+ */
+static errcode_t load_bitmap_groups(ext2_filsys fs, int do_inode,
+				    ext2fs_generic_bitmap bmap,
+				    struct ext2fs_lazy_bitmap *lazy,
+				    dgrp_t first, dgrp_t last,
+				    char *buf, unsigned int run)
+{
+	int		nbytes;
+	__u64		itr;
+	blk64_t		blk;
+	dgrp_t		i;
+	unsigned int	j, n;
+	char		*bitmap;
+	errcode_t	retval;
+
+	if (do_inode) {
+		nbytes = EXT2_INODES_PER_GROUP(fs->super) / 8;
+		itr = (__u64) first * EXT2_INODES_PER_GROUP(fs->super) + 1;
+	} else {
+		nbytes = EXT2_CLUSTERS_PER_GROUP(fs->super) / 8;
+		itr = EXT2FS_B2C(fs, fs->super->s_first_data_block) +
+			(__u64) first * EXT2_CLUSTERS_PER_GROUP(fs->super);
+	}
+
+	for (i = first; i <= last; i += n) {
+		blk = bitmap_loc(fs, do_inode, i, lazy);
+		n = 1;
+		if (blk) {
+			while (n < run && i + n <= last &&
+			       bitmap_loc(fs, do_inode, i + n, lazy) == blk + n)
+				n++;
+			retval = io_channel_read_blk64(fs->io, blk, n, buf);
+			if (retval)
+				return do_inode ? EXT2_ET_INODE_BITMAP_READ :
+					EXT2_ET_BLOCK_BITMAP_READ;
+		}
+		for (j = 0; j < n; j++) {
+			bitmap = buf + j * fs->blocksize;
+			if (!blk)
+				memset(bitmap, 0, nbytes);
+			else if (fs->flags & EXT2_FLAG_IGNORE_CSUM_ERRORS)
+				;
+			else if (do_inode &&
+				 !ext2fs_inode_bitmap_csum_verify(fs, i + j,
+							bitmap, nbytes))
+				return EXT2_ET_INODE_BITMAP_CSUM_INVALID;
+			else if (!do_inode &&
+				 !ext2fs_block_bitmap_csum_verify(fs, i + j,
+							bitmap, nbytes))
+				return EXT2_ET_BLOCK_BITMAP_CSUM_INVALID;
+
+			/*
+			 * A lazily loaded group is filled in directly, as
+			 * it isn't marked as loaded until it is complete.
+			 */
+			if (lazy)
+				retval = bmap->bitmap_ops->set_bmap_range(bmap,
+						itr, nbytes << 3, bitmap);
+			else
+				retval = ext2fs_set_generic_bmap_range(bmap,
+						itr, nbytes << 3, bitmap);
+			if (retval)
+				return retval;
+			itr += nbytes << 3;
+		}
 	}
 	return 0;
 }
 
+/*
+ * Lazy bitmap loading
+ *
+ * When a filesystem is opened with EXT2_FLAG_LAZY_BITMAPS,
+ * ext2fs_read_bitmaps() only allocates the in-memory bitmaps, and
+ * each group's bitmap block is read in by ext2fs_lazy_bitmap_load()
+ * the first time one of its bits is touched.  This lets tools which
+ * only look at a handful of inodes or blocks start up quickly on very
+ * large filesystems.  A group which was never read in cannot have
+ * been changed, so write_bitmaps() skips it.
+ */
+static errcode_t setup_lazy_bitmap(ext2_filsys fs, ext2fs_generic_bitmap bmap,
+				   int do_inode, __u32 per_group)
+{
+	struct ext2fs_lazy_bitmap *lazy;
+	size_t		size = (fs->group_desc_count + 7) / 8;
+	dgrp_t		i;
+	errcode_t	retval;
+
+	retval = ext2fs_get_memzero(sizeof(struct ext2fs_lazy_bitmap), &lazy);
+	if (retval)
+		return retval;
+	retval = ext2fs_get_memzero(size, &lazy->loaded);
+	if (retval)
+		goto errout;
+	retval = ext2fs_get_memzero(size, &lazy->failed);
+	if (retval)
+		goto errout;
+	retval = ext2fs_get_memzero(size, &lazy->uninit);
+	if (retval)
+		goto errout;
+	if (!do_inode) {
+		retval = ext2fs_get_memzero(size, &lazy->block_uninit);
+		if (retval)
+			goto errout;
+	}
+	retval = io_channel_alloc_buf(fs->io, 0, &lazy->buf);
+	if (retval)
+		goto errout;
+
+	for (i = 0; i < fs->group_desc_count; i++) {
+		if (!bitmap_loc(fs, do_inode, i, NULL))
+			ext2fs_set_bit(i, lazy->uninit);
+		if (!do_inode &&
+		    ext2fs_bg_flags_test(fs, i, EXT2_BG_BLOCK_UNINIT))
+			ext2fs_set_bit(i, lazy->block_uninit);
+	}
+	lazy->per_group = per_group;
+	lazy->unloaded = fs->group_desc_count;
+	bmap->lazy = lazy;
+	return 0;
+
+errout:
+	ext2fs_free_mem(&lazy->block_uninit);
+	ext2fs_free_mem(&lazy->uninit);
+	ext2fs_free_mem(&lazy->failed);
+	ext2fs_free_mem(&lazy->loaded);
+	ext2fs_free_mem(&lazy);
+	return retval;
+}
+
+void ext2fs_lazy_bitmap_free(ext2fs_generic_bitmap bmap)
+{
+	struct ext2fs_lazy_bitmap *lazy = bmap->lazy;
+
+	if (!lazy)
+		return;
+	bmap->lazy = NULL;
+	ext2fs_free_mem(&lazy->buf);
+	ext2fs_free_mem(&lazy->block_uninit);
+	ext2fs_free_mem(&lazy->uninit);
+	ext2fs_free_mem(&lazy->failed);
+	ext2fs_free_mem(&lazy->loaded);
+	ext2fs_free_mem(&lazy);
+}
+
+static int lazy_group_loaded(ext2fs_generic_bitmap bmap, dgrp_t group)
+{
+	if (!EXT2FS_IS_64_BITMAP(bmap) || !bmap->lazy)
+		return 1;
+	return ext2fs_test_bit(group, bmap->lazy->loaded);
+}
+
+/*
+ * Return the error from a group of a lazily loaded bitmap which could
+ * not be read in, if there was one.
+ */
+static errcode_t lazy_bitmap_error(ext2fs_generic_bitmap bmap)
+{
+	if (!bmap || !EXT2FS_IS_64_BITMAP(bmap) || !bmap->lazy)
+		return 0;
+	return bmap->lazy->error;
+}
+
+/*
+ * Read in the groups covering bits start..end of a lazily loaded
+ * bitmap.  A group which can't be read in is set to all ones, so that
+ * nothing in it looks free, and the error sticks: touching the group
+ * again returns it, and the bitmap can't be written out.  An eager
+ * load would have failed the open, so the filesystem is made read-only
+ * from then on.
+ */
+errcode_t ext2fs_lazy_bitmap_load(ext2fs_generic_bitmap bmap,
+				  __u64 start, __u64 end)
+{
+	struct ext2fs_lazy_bitmap *lazy = bmap->lazy;
+	ext2_filsys	fs = bmap->fs;
+	int		do_inode = (bmap->magic == EXT2_ET_MAGIC_INODE_BITMAP64);
+	dgrp_t		group, last;
+	__u64		first;
+	unsigned int	num;
+	errcode_t	retval = 0, err;
+
+	if (!lazy || end < start || start < bmap->start)
+		return 0;
+	group = (start - bmap->start) / lazy->per_group;
+	last = (end - bmap->start) / lazy->per_group;
+	if (last >= fs->group_desc_count)
+		last = fs->group_desc_count - 1;
+
+	/*
+	 * Marking the metadata of a BLOCK_UNINIT group may fault in
+	 * other groups, so don't free the state until we unwind.
+	 */
+	lazy->depth++;
+	for (; group <= last; group++) {
+		if (ext2fs_test_bit(group, lazy->loaded))
+			continue;
+		if (ext2fs_test_bit(group, lazy->failed)) {
+			if (!retval)
+				retval = lazy->error;
+			continue;
+		}
+
+		err = load_bitmap_groups(fs, do_inode, bmap, lazy, group, group,
+					 lazy->buf, 1);
+		if (err) {
+			ext2fs_set_bit(group, lazy->failed);
+			if (!lazy->error)
+				lazy->error = err;
+			fs->flags &= ~EXT2_FLAG_RW;
+			if (!retval)
+				retval = err;
+			first = bmap->start + (__u64) group * lazy->per_group;
+			num = lazy->per_group;
+			if (first + num - 1 > bmap->real_end)
+				num = bmap->real_end - first + 1;
+			bmap->bitmap_ops->mark_bmap_extent(bmap, first, num);
+			continue;
+		}
+		ext2fs_set_bit(group, lazy->loaded);
+		lazy->unloaded--;
+		if (!do_inode && ext2fs_test_bit(group, lazy->block_uninit))
+			mark_uninit_group_blocks(fs, bmap, group);
+	}
+	if (--lazy->depth == 0 && lazy->unloaded == 0)
+		ext2fs_lazy_bitmap_free(bmap);
+	return retval;
+}
+
 static errcode_t read_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 {
-	dgrp_t i;
-	char *block_bitmap = 0, *inode_bitmap = 0;
+	char *bitmap_buf = 0;
 	char *buf;
 	errcode_t retval;
 	int block_nbytes = EXT2_CLUSTERS_PER_GROUP(fs->super) / 8;
 	int inode_nbytes = EXT2_INODES_PER_GROUP(fs->super) / 8;
-	int csum_flag;
+	int lazy_block = 0, lazy_inode = 0;
 	unsigned int	cnt;
 	blk64_t	blk;
 	blk64_t	blk_itr = EXT2FS_B2C(fs, fs->super->s_first_data_block);
@@ -219,52 +518,68 @@ static errcode_t read_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 
 	fs->write_bitmaps = ext2fs_write_bitmaps;
 
-	csum_flag = ext2fs_has_group_desc_csum(fs);
-
 	retval = ext2fs_get_mem(strlen(fs->device_name) + 80, &buf);
 	if (retval)
 		return retval;
 	if (do_block) {
 		if (fs->block_map)
 			ext2fs_free_block_bitmap(fs->block_map);
+		fs->block_map = 0;
 		strcpy(buf, "block bitmap for ");
 		strcat(buf, fs->device_name);
 		retval = ext2fs_allocate_block_bitmap(fs, buf, &fs->block_map);
 		if (retval)
 			goto cleanup;
-		retval = io_channel_alloc_buf(fs->io, 0, &block_bitmap);
-		if (retval)
-			goto cleanup;
-	} else
-		block_nbytes = 0;
+	}
 	if (do_inode) {
 		if (fs->inode_map)
 			ext2fs_free_inode_bitmap(fs->inode_map);
+		fs->inode_map = 0;
 		strcpy(buf, "inode bitmap for ");
 		strcat(buf, fs->device_name);
 		retval = ext2fs_allocate_inode_bitmap(fs, buf, &fs->inode_map);
 		if (retval)
 			goto cleanup;
-		retval = io_channel_alloc_buf(fs->io, 0, &inode_bitmap);
-		if (retval)
-			goto cleanup;
-	} else
-		inode_nbytes = 0;
+	}
 	ext2fs_free_mem(&buf);
 
+	if ((fs->flags & EXT2_FLAG_LAZY_BITMAPS) &&
+	    !(fs->flags & EXT2_FLAG_IMAGE_FILE)) {
+		if (do_block && EXT2FS_IS_64_BITMAP(fs->block_map)) {
+			retval = setup_lazy_bitmap(fs, fs->block_map, 0,
+					EXT2_CLUSTERS_PER_GROUP(fs->super));
+			if (retval)
+				goto cleanup;
+			lazy_block = 1;
+		}
+		if (do_inode && EXT2FS_IS_64_BITMAP(fs->inode_map)) {
+			retval = setup_lazy_bitmap(fs, fs->inode_map, 1,
+					EXT2_INODES_PER_GROUP(fs->super));
+			if (retval)
+				goto cleanup;
+			lazy_inode = 1;
+		}
+		if ((!do_block || lazy_block) && (!do_inode || lazy_inode))
+			return 0;
+	}
+
+	retval = io_channel_alloc_buf(fs->io, BITMAP_READ_RUN, &bitmap_buf);
+	if (retval)
+		goto cleanup;
+
 	if (fs->flags & EXT2_FLAG_IMAGE_FILE) {
 		blk = (fs->image_header->offset_inodemap / fs->blocksize);
 		ino_cnt = fs->super->s_inodes_count;
-		while (inode_bitmap && ino_cnt > 0) {
+		while (do_inode && ino_cnt > 0) {
 			retval = io_channel_read_blk64(fs->image_io, blk++,
-						     1, inode_bitmap);
+						     1, bitmap_buf);
 			if (retval)
 				goto cleanup;
 			cnt = fs->blocksize << 3;
 			if (cnt > ino_cnt)
 				cnt = ino_cnt;
 			retval = ext2fs_set_inode_bitmap_range2(fs->inode_map,
-					       ino_itr, cnt, inode_bitmap);
+					       ino_itr, cnt, bitmap_buf);
 			if (retval)
 				goto cleanup;
 			ino_itr += cnt;
@@ -274,16 +589,16 @@ static errcode_t read_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		       fs->blocksize);
 		blk_cnt = EXT2_GROUPS_TO_CLUSTERS(fs->super,
 						  fs->group_desc_count);
-		while (block_bitmap && blk_cnt > 0) {
+		while (do_block && blk_cnt > 0) {
 			retval = io_channel_read_blk64(fs->image_io, blk++,
-						     1, block_bitmap);
+						     1, bitmap_buf);
 			if (retval)
 				goto cleanup;
 			cnt = fs->blocksize << 3;
 			if (cnt > blk_cnt)
 				cnt = blk_cnt;
 			retval = ext2fs_set_block_bitmap_range2(fs->block_map,
-				       blk_itr, cnt, block_bitmap);
+				       blk_itr, cnt, bitmap_buf);
 			if (retval)
 				goto cleanup;
 			blk_itr += cnt;
@@ -292,99 +607,40 @@ static errcode_t read_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		goto success_cleanup;
 	}
 
-	for (i = 0; i < fs->group_desc_count; i++) {
-		if (block_bitmap) {
-			blk = ext2fs_block_bitmap_loc(fs, i);
-			if (csum_flag &&
-			    ext2fs_bg_flags_test(fs, i, EXT2_BG_BLOCK_UNINIT) &&
-			    ext2fs_group_desc_csum_verify(fs, i))
-				blk = 0;
-			if (blk) {
-				retval = io_channel_read_blk64(fs->io, blk,
-							       1, block_bitmap);
-				if (retval) {
-					retval = EXT2_ET_BLOCK_BITMAP_READ;
-					goto cleanup;
-				}
-				/* verify block bitmap checksum */
-				if (!(fs->flags &
-				      EXT2_FLAG_IGNORE_CSUM_ERRORS) &&
-				    !ext2fs_block_bitmap_csum_verify(fs, i,
-						block_bitmap, block_nbytes)) {
-					retval =
-					EXT2_ET_BLOCK_BITMAP_CSUM_INVALID;
-					goto cleanup;
-				}
-			} else
-				memset(block_bitmap, 0, block_nbytes);
-			cnt = block_nbytes << 3;
-			retval = ext2fs_set_block_bitmap_range2(fs->block_map,
-					       blk_itr, cnt, block_bitmap);
-			if (retval)
-				goto cleanup;
-			blk_itr += block_nbytes << 3;
-		}
-		if (inode_bitmap) {
-			blk = ext2fs_inode_bitmap_loc(fs, i);
-			if (csum_flag &&
-			    ext2fs_bg_flags_test(fs, i, EXT2_BG_INODE_UNINIT) &&
-			    ext2fs_group_desc_csum_verify(fs, i))
-				blk = 0;
-			if (blk) {
-				retval = io_channel_read_blk64(fs->io, blk,
-							       1, inode_bitmap);
-				if (retval) {
-					retval = EXT2_ET_INODE_BITMAP_READ;
-					goto cleanup;
-				}
-
-				/* verify inode bitmap checksum */
-				if (!(fs->flags &
-				      EXT2_FLAG_IGNORE_CSUM_ERRORS) &&
-				    !ext2fs_inode_bitmap_csum_verify(fs, i,
-						inode_bitmap, inode_nbytes)) {
-					retval =
-					EXT2_ET_INODE_BITMAP_CSUM_INVALID;
-					goto cleanup;
-				}
-			} else
-				memset(inode_bitmap, 0, inode_nbytes);
-			cnt = inode_nbytes << 3;
-			retval = ext2fs_set_inode_bitmap_range2(fs->inode_map,
-					       ino_itr, cnt, inode_bitmap);
-			if (retval)
-				goto cleanup;
-			ino_itr += inode_nbytes << 3;
-		}
-	}
-
-	/* Mark group blocks for any BLOCK_UNINIT groups */
-	if (do_block) {
+	if (do_block && !lazy_block) {
+		retval = load_bitmap_groups(fs, 0, fs->block_map, NULL, 0,
+					    fs->group_desc_count - 1,
+					    bitmap_buf, BITMAP_READ_RUN);
+		if (retval)
+			goto cleanup;
+		/* Mark group blocks for any BLOCK_UNINIT groups */
 		retval = mark_uninit_bg_group_blocks(fs);
 		if (retval)
 			goto cleanup;
 	}
+	if (do_inode && !lazy_inode) {
+		retval = load_bitmap_groups(fs, 1, fs->inode_map, NULL, 0,
+					    fs->group_desc_count - 1,
+					    bitmap_buf, BITMAP_READ_RUN);
+		if (retval)
+			goto cleanup;
+	}
 
 success_cleanup:
-	if (inode_bitmap)
-		ext2fs_free_mem(&inode_bitmap);
-	if (block_bitmap)
-		ext2fs_free_mem(&block_bitmap);
+	ext2fs_free_mem(&bitmap_buf);
 	return 0;
 
 cleanup:
 	if (do_block) {
-		ext2fs_free_mem(&fs->block_map);
+		ext2fs_free_block_bitmap(fs->block_map);
 		fs->block_map = 0;
 	}
 	if (do_inode) {
-		ext2fs_free_mem(&fs->inode_map);
+		ext2fs_free_inode_bitmap(fs->inode_map);
 		fs->inode_map = 0;
 	}
-	if (inode_bitmap)
-		ext2fs_free_mem(&inode_bitmap);
-	if (block_bitmap)
-		ext2fs_free_mem(&block_bitmap);
+	if (bitmap_buf)
+		ext2fs_free_mem(&bitmap_buf);
 	if (buf)
 		ext2fs_free_mem(&buf);
 	return retval;
@@ -104,6 +104,7 @@ struct undo_header {
 };
 
 #define E2UNDO_MAX_EXTENT_BLOCKS	512	/* max extent size, in blocks */
+#define E2UNDO_STAGE_SIZE	1048576	/* bytes of undo data to batch up */
 
 struct undo_key {
 	__le64 fsblk;		/* where in the fs does the block go */
@@ -135,6 +136,16 @@ struct undo_private_data {
 	struct undo_key_block *keyb;
 	size_t num_keys, keys_in_block;
 
+	/*
+	 * Original blocks are read into the capture buffer a run at a
+	 * time and appended to the stage.  The stage and its key block
+	 * are written to the undo file before the write which needed
+	 * them goes through, in as few writes as we can.
+	 */
+	unsigned char *capture, *stage;
+	blk64_t stage_blk;			/* undo file location of stage */
+	unsigned int stage_count, stage_max;	/* in undo blocks */
+
 	/* The backing io channel */
 	io_channel real;
 
@@ -185,13 +196,30 @@ errcode_t set_undo_io_backup_file(char *file_name)
 	return 0;
 }
 
-static errcode_t write_undo_indexes(struct undo_private_data *data, int flush)
+static errcode_t write_undo_stage(struct undo_private_data *data)
 {
 	errcode_t retval;
-	struct ext2_super_block super;
-	io_channel channel;
-	int block_size;
-	__u32 sb_crc, hdr_crc;
+
+	if (!data->stage_count)
+		return 0;
+	dbg_printf("Writing %u blocks to blk %llu\n", data->stage_count,
+		   data->stage_blk);
+	retval = io_channel_write_blk64(data->undo_file, data->stage_blk,
+					data->stage_count, data->stage);
+	if (retval)
+		return retval;
+	data->stage_count = 0;
+	return 0;
+}
+
+static errcode_t write_undo_keys(struct undo_private_data *data)
+{
+	errcode_t retval;
+
+	/* The keys must never reach the disk ahead of their data */
+	retval = write_undo_stage(data);
+	if (retval)
+		return retval;
 
 	/* Spit out a key block, if there's any data */
 	if (data->keys_in_block) {
@@ -215,6 +243,20 @@ static errcode_t write_undo_indexes(struct undo_private_data *data, int flush)
 			data->undo_blk_num++;
 		}
 	}
+	return 0;
+}
+
+static errcode_t write_undo_indexes(struct undo_private_data *data, int flush)
+{
+	errcode_t retval;
+	struct ext2_super_block super;
+	io_channel channel;
+	int block_size;
+	__u32 sb_crc, hdr_crc;
+
+	retval = write_undo_keys(data);
+	if (retval)
+		return retval;
 
 	/* Prepare superblock for write */
 	channel = data->real;
@@ -293,6 +335,20 @@ static errcode_t undo_setup_tdb(struct undo_private_data *data)
 		return retval;
 	data->key_blk_num = data->first_key_blk;
 
+	/* Allocate the capture and staging buffers */
+	data->stage_max = E2UNDO_STAGE_SIZE / data->tdb_data_size;
+	if (data->stage_max == 0)
+		data->stage_max = 1;
+	data->stage_count = 0;
+	retval = ext2fs_get_array(data->stage_max, data->tdb_data_size,
+				  &data->capture);
+	if (retval)
+		return retval;
+	retval = ext2fs_get_array(data->stage_max, data->tdb_data_size,
+				  &data->stage);
+	if (retval)
+		return retval;
+
 	/* Record block size */
 	dbg_printf("Undo block size %llu\n", data->tdb_data_size);
 	dbg_printf("Keys per block %llu\n", KEYS_PER_BLOCK(data));
@@ -317,6 +373,71 @@ static errcode_t undo_setup_tdb(struct undo_private_data *data)
 	return 0;
 }
 
+/*
+ * Append one block of original data to the undo stage, extending the
+ * previous key if the block follows on from it.
+ */
+static errcode_t undo_stage_block(io_channel channel,
+				  struct undo_private_data *data,
+				  blk64_t backing_blk_num,
+				  unsigned char *buf,
+				  unsigned long long data_size)
+{
+	struct undo_key *key;
+	__u32 keysz, blk_crc;
+	errcode_t retval;
+
+	/* extend this key? */
+	if (data->keys_in_block) {
+		key = data->keyb->keys + data->keys_in_block - 1;
+		keysz = ext2fs_le32_to_cpu(key->size);
+	} else {
+		key = NULL;
+		keysz = 0;
+	}
+	if (key != NULL &&
+	    (ext2fs_le64_to_cpu(key->fsblk) * channel->block_size +
+	     channel->block_size - 1 +
+	     keysz) / channel->block_size == backing_blk_num &&
+	    E2UNDO_MAX_EXTENT_BLOCKS * data->tdb_data_size >
+	    keysz + data_size) {
+		blk_crc = ext2fs_le32_to_cpu(key->blk_crc);
+		blk_crc = ext2fs_crc32c_le(blk_crc, buf, data_size);
+		key->blk_crc = ext2fs_cpu_to_le32(blk_crc);
+		key->size = ext2fs_cpu_to_le32(keysz + data_size);
+	} else {
+		data->num_keys++;
+		key = data->keyb->keys + data->keys_in_block;
+		data->keys_in_block++;
+		key->fsblk = ext2fs_cpu_to_le64(backing_blk_num);
+		blk_crc = ext2fs_crc32c_le(~0, buf, data_size);
+		key->blk_crc = ext2fs_cpu_to_le32(blk_crc);
+		key->size = ext2fs_cpu_to_le32(data_size);
+	}
+	dbg_printf("Staging FS block %llu at offset %llu size %llu key %zu\n",
+		   backing_blk_num, data->undo_blk_num, data_size,
+		   data->num_keys - 1);
+
+	if (data->stage_count == 0)
+		data->stage_blk = data->undo_blk_num;
+	memcpy(data->stage + data->stage_count * data->tdb_data_size, buf,
+	       data_size);
+	memset(data->stage + data->stage_count * data->tdb_data_size +
+	       data_size, 0, data->tdb_data_size - data_size);
+	data->stage_count++;
+	data->undo_blk_num++;
+
+	/* A full key block goes out now; it moves on to a new one. */
+	if (data->keys_in_block == KEYS_PER_BLOCK(data))
+		return write_undo_indexes(data, 0);
+	if (data->stage_count == data->stage_max) {
+		retval = write_undo_stage(data);
+		if (retval)
+			return retval;
+	}
+	return 0;
+}
+
 static errcode_t undo_write_tdb(io_channel channel,
 				unsigned long long block, int count)
 
@@ -326,11 +447,9 @@ static errcode_t undo_write_tdb(io_channel channel,
 	errcode_t retval = 0;
 	ext2_loff_t offset;
 	struct undo_private_data *data;
-	unsigned char *read_ptr;
-	unsigned long long end_block;
-	unsigned long long data_size;
-	struct undo_key *key;
-	__u32 blk_crc;
+	unsigned long long end_block, run_end, next;
+	unsigned long long data_size, read_size;
+	unsigned int i, run, staged = 0;
 
 	data = (struct undo_private_data *) channel->private_data;
 
@@ -364,21 +483,30 @@ static errcode_t undo_write_tdb(io_channel channel,
 	end_block = (offset + size - 1) / data->tdb_data_size;
 
 	while (block_num <= end_block) {
-		__u32 keysz;
-
 		/*
-		 * Check if we have the record already
+		 * Skip over the blocks we already have, and find the run
+		 * of blocks after them that we don't.
 		 */
-		if (ext2fs_test_block_bitmap2(data->written_block_map,
-						   block_num)) {
-			/* Try the next block */
-			block_num++;
-			continue;
-		}
-		ext2fs_mark_block_bitmap2(data->written_block_map, block_num);
+		retval = ext2fs_find_first_zero_block_bitmap2(
+				data->written_block_map, block_num,
+				end_block, &block_num);
+		if (retval == ENOENT)
+			break;
+		if (retval)
+			return retval;
+		run_end = end_block;
+		if (run_end - block_num >= data->stage_max)
+			run_end = block_num + data->stage_max - 1;
+		if (ext2fs_find_first_set_block_bitmap2(data->written_block_map,
+							block_num, run_end,
+							&next) == 0)
+			run_end = next - 1;
+		run = run_end - block_num + 1;
+		ext2fs_mark_block_bitmap_range2(data->written_block_map,
+						block_num, run);
 
 		/*
-		 * Read one block using the backing I/O manager
+		 * Read the whole run using the backing I/O manager
 		 * The backing I/O manager block size may be
 		 * different from the tdb_data_size.
 		 * Also we need to recalculate the block number with respect
@@ -388,93 +516,57 @@ static errcode_t undo_write_tdb(io_channel channel,
 				(data->offset % data->tdb_data_size);
 		backing_blk_num = (offset - data->offset) / channel->block_size;
 
-		retval = ext2fs_get_mem(data->tdb_data_size, &read_ptr);
-		if (retval) {
-			return retval;
-		}
-
-		memset(read_ptr, 0, data->tdb_data_size);
+		read_size = (unsigned long long) run * data->tdb_data_size;
+		memset(data->capture, 0, read_size);
 		actual_size = 0;
-		if ((data->tdb_data_size % channel->block_size) == 0)
-			sz = data->tdb_data_size / channel->block_size;
+		if ((read_size % channel->block_size) == 0)
+			sz = read_size / channel->block_size;
 		else
-			sz = -data->tdb_data_size;
+			sz = -read_size;
 		retval = io_channel_read_blk64(data->real, backing_blk_num,
-					     sz, read_ptr);
+					     sz, data->capture);
 		if (retval) {
-			if (retval != EXT2_ET_SHORT_READ) {
-				free(read_ptr);
+			if (retval != EXT2_ET_SHORT_READ)
 				return retval;
-			}
 			/*
 			 * short read so update the record size
 			 * accordingly
 			 */
-			data_size = actual_size;
-		} else {
-			data_size = data->tdb_data_size;
-		}
-		if (data_size == 0) {
-			free(read_ptr);
-			block_num++;
-			continue;
-		}
-		dbg_printf("Read %llu bytes from FS block %llu (blk=%llu cnt=%llu)\n",
-		       data_size, backing_blk_num, block, data->tdb_data_size);
-		if ((data_size % data->undo_file->block_size) == 0)
-			sz = data_size / data->undo_file->block_size;
-		else
-			sz = -data_size;;
-		/* extend this key? */
-		if (data->keys_in_block) {
-			key = data->keyb->keys + data->keys_in_block - 1;
-			keysz = ext2fs_le32_to_cpu(key->size);
-		} else {
-			key = NULL;
-			keysz = 0;
-		}
-		if (key != NULL &&
-		    (ext2fs_le64_to_cpu(key->fsblk) * channel->block_size +
-		     channel->block_size - 1 +
-		     keysz) / channel->block_size == backing_blk_num &&
-		    E2UNDO_MAX_EXTENT_BLOCKS * data->tdb_data_size >
-		    keysz + data_size) {
-			blk_crc = ext2fs_le32_to_cpu(key->blk_crc);
-			blk_crc = ext2fs_crc32c_le(blk_crc, read_ptr, data_size);
-			key->blk_crc = ext2fs_cpu_to_le32(blk_crc);
-			key->size = ext2fs_cpu_to_le32(keysz + data_size);
-		} else {
-			data->num_keys++;
-			key = data->keyb->keys + data->keys_in_block;
-			data->keys_in_block++;
-			key->fsblk = ext2fs_cpu_to_le64(backing_blk_num);
-			blk_crc = ext2fs_crc32c_le(~0, read_ptr, data_size);
-			key->blk_crc = ext2fs_cpu_to_le32(blk_crc);
-			key->size = ext2fs_cpu_to_le32(data_size);
+			read_size = actual_size;
 		}
-		dbg_printf("Writing block %llu to offset %llu size %d key %zu\n",
-		       block_num,
-		       data->undo_blk_num,
-		       sz, data->num_keys - 1);
-		retval = io_channel_write_blk64(data->undo_file,
-					data->undo_blk_num, sz, read_ptr);
-		if (retval) {
-			free(read_ptr);
-			return retval;
+		dbg_printf("Read %llu bytes from FS block %llu (blk=%llu cnt=%u)\n",
+		       read_size, backing_blk_num, block, run);
+
+		for (i = 0; i < run; i++) {
+			if (read_size <= i * data->tdb_data_size)
+				break;
+			data_size = read_size - i * data->tdb_data_size;
+			if (data_size > data->tdb_data_size)
+				data_size = data->tdb_data_size;
+			offset = (block_num + i) * data->tdb_data_size +
+				(data->offset % data->tdb_data_size);
+			retval = undo_stage_block(channel, data,
+				(offset - data->offset) / channel->block_size,
+				data->capture + i * data->tdb_data_size,
+				data_size);
+			if (retval)
+				return retval;
+			staged = 1;
 		}
-		data->undo_blk_num++;
-		free(read_ptr);
 
-		/* Write out the key block */
-		retval = write_undo_indexes(data, 0);
-		if (retval)
-			return retval;
-
-		/* Next block */
-		block_num++;
+		/* Next run */
+		block_num = run_end + 1;
 	}
 
-	return retval;
+	/*
+	 * The original data, its keys and a header which counts them have
+	 * to be in the undo file before the new data reaches the device,
+	 * or a crash would leave the change with nothing to undo it.  Only
+	 * the fsync waits for a commit point.
+	 */
+	if (staged)
+		return write_undo_indexes(data, 0);
+	return 0;
 }
 
 static errcode_t undo_io_read_error(io_channel channel ATTR((unused)),
@@ -671,6 +763,8 @@ bad_key_replay:
 	data->key_blk_num = data->undo_blk_num = 0;
 	data->keys_in_block = 0;
 	ext2fs_free_mem(&data->keyb);
+	ext2fs_free_mem(&data->capture);
+	ext2fs_free_mem(&data->stage);
 	ext2fs_free_generic_bitmap(data->written_block_map);
 	data->tdb_written = 0;
 	goto out;
@@ -816,6 +910,8 @@ static errcode_t undo_close(io_channel channel)
 	if (data->undo_file)
 		io_channel_close(data->undo_file);
 	ext2fs_free_mem(&data->keyb);
+	ext2fs_free_mem(&data->capture);
+	ext2fs_free_mem(&data->stage);
 	if (data->written_block_map)
 		ext2fs_free_generic_bitmap(data->written_block_map);
 	ext2fs_free_mem(&channel->private_data);
@@ -1003,7 +1099,9 @@ static errcode_t undo_cache_readahead(io_channel channel,
 }
 
 /*
- * Flush data buffers to disk.
+ * Flush data buffers to disk.  This is a commit point: the undo records
+ * for everything written so far must be safe on disk before the new
+ * data is.
  */
 static errcode_t undo_flush(io_channel channel)
 {
@@ -1014,6 +1112,11 @@ static errcode_t undo_flush(io_channel channel)
 	data = (struct undo_private_data *) channel->private_data;
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
 
+	if (data->undo_file && data->tdb_written == 1) {
+		retval = write_undo_indexes(data, 1);
+		if (retval)
+			return retval;
+	}
 	if (data->real)
 		retval = io_channel_flush(data->real);
 
@@ -168,6 +168,7 @@ static errcode_t raw_read_blk(io_channel channel,
 
 	size = (count < 0) ? -count : count * channel->block_size;
 	data->io_stats.bytes_read += size;
+	data->io_stats.read_ops++;
 	location = ((ext2_loff_t) block * channel->block_size) + data->offset;
 
 	if (data->flags & IO_FLAG_FORCE_BOUNCE) {
@@ -278,6 +279,7 @@ static errcode_t raw_write_blk(io_channel channel,
 			size = count * channel->block_size;
 	}
 	data->io_stats.bytes_written += size;
+	data->io_stats.write_ops++;
 
 	location = ((ext2_loff_t) block * channel->block_size) + data->offset;
 
@@ -592,7 +594,7 @@ static errcode_t unix_open_channel(const char *name, int fd,
 
 	memset(data, 0, sizeof(struct unix_private_data));
 	data->magic = EXT2_ET_MAGIC_UNIX_IO_CHANNEL;
-	data->io_stats.num_fields = 2;
+	data->io_stats.num_fields = 7;
 	data->flags = flags;
 	data->dev = fd;
 
@@ -852,12 +854,14 @@ static errcode_t unix_read_blk64(io_channel channel, unsigned long long block,
 #ifdef DEBUG
 			printf("Using cached block %lu\n", block);
 #endif
+			data->io_stats.cache_hits++;
 			memcpy(cp, cache->buf, channel->block_size);
 			count--;
 			block++;
 			cp += channel->block_size;
 			continue;
 		}
+		data->io_stats.cache_misses++;
 		if (count == 1) {
 			/*
 			 * Special case where we read directly into the
@@ -881,6 +885,7 @@ static errcode_t unix_read_blk64(io_channel channel, unsigned long long block,
 		for (i=1; i < count; i++)
 			if (find_cached_block(data, block+i, &reuse[i]))
 				break;
+		data->io_stats.cache_misses += i - 1;
 #ifdef DEBUG
 		printf("Reading %d blocks starting at %lu\n", i, block);
 #endif
@@ -968,6 +973,7 @@ static errcode_t unix_cache_readahead(io_channel channel,
 
 	data = (struct unix_private_data *)channel->private_data;
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+	data->io_stats.readahead_bytes += count * channel->block_size;
 	return posix_fadvise(data->dev,
 			     (ext2_loff_t)block * channel->block_size + data->offset,
 			     (ext2_loff_t)count * channel->block_size,
@@ -557,8 +557,9 @@ static int get_uuid_via_daemon(int op, uuid_t out, int *num)
 
 	ret = read_all(s, op_buf, reply_len);
 
+	/* The daemon may have handed out fewer than we asked for */
 	if (op == UUIDD_OP_BULK_TIME_UUID)
-		memcpy(op_buf+16, num, sizeof(int));
+		memcpy(num, op_buf+16, sizeof(int));
 
 	memcpy(out, op_buf, 16);
 
@@ -599,23 +600,44 @@ void uuid__generate_time(uuid_t out, int *num)
 	uuid_pack(&uu, out);
 }
 
+/*
+ * Each thread reserves a range of clock values at a time, either from
+ * uuidd or, failing that, directly from the clock state file, and then
+ * hands out UUIDs from the range without any further system calls or
+ * locking.  A thread which uses up its ranges quickly asks for larger
+ * ones, up to UUIDD_MAX_TIME_BULK.
+ */
+#define UUID_MIN_TIME_BULK	1000
+
 void uuid_generate_time(uuid_t out)
 {
 #ifdef TLS
 	THREAD_LOCAL int		num = 0;
+	THREAD_LOCAL int		bulk = UUID_MIN_TIME_BULK;
 	THREAD_LOCAL struct uuid	uu;
 	THREAD_LOCAL time_t		last_time = 0;
 	time_t				now;
 
 	if (num > 0) {
 		now = time(0);
-		if (now > last_time+1)
+		if (now > last_time+1) {
 			num = 0;
+			bulk = UUID_MIN_TIME_BULK;
+		}
+	} else if (last_time && time(0) == last_time &&
+		   bulk < UUIDD_MAX_TIME_BULK) {
+		bulk *= 2;
+		if (bulk > UUIDD_MAX_TIME_BULK)
+			bulk = UUIDD_MAX_TIME_BULK;
 	}
 	if (num <= 0) {
-		num = 1000;
+		num = bulk;
 		if (get_uuid_via_daemon(UUIDD_OP_BULK_TIME_UUID,
-					out, &num) == 0) {
+					out, &num) != 0) {
+			num = bulk;
+			uuid__generate_time(out, &num);
+		}
+		if (num > 0) {
 			last_time = time(0);
 			uuid_unpack(out, &uu);
 			num--;
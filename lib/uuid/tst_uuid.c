@@ -62,6 +62,43 @@ static int test_uuid(const char * uuid, int isValid)
 	return 0;
 }
 
+static int cmp_uuid(const void *a, const void *b)
+{
+	return uuid_compare(*(const uuid_t *) a, *(const uuid_t *) b);
+}
+
+/*
+ * Time-based UUIDs are handed out from ranges reserved in bulk; make
+ * sure that a burst of them, spanning many ranges, has no duplicates.
+ */
+#define NUM_BULK_UUIDS	200000
+
+static int test_bulk_time(void)
+{
+	uuid_t	*uus;
+	int	i, dups = 0;
+
+	uus = malloc(NUM_BULK_UUIDS * sizeof(uuid_t));
+	if (!uus) {
+		printf("Couldn't allocate memory for bulk UUIDs\n");
+		return 1;
+	}
+	for (i = 0; i < NUM_BULK_UUIDS; i++)
+		uuid_generate_time(uus[i]);
+	qsort(uus, NUM_BULK_UUIDS, sizeof(uuid_t), cmp_uuid);
+	for (i = 1; i < NUM_BULK_UUIDS; i++)
+		if (!uuid_compare(uus[i - 1], uus[i]))
+			dups++;
+	free(uus);
+	if (dups) {
+		printf("%d duplicate time UUIDs out of %d!\n", dups,
+		       NUM_BULK_UUIDS);
+		return 1;
+	}
+	printf("%d time UUIDs are unique.\n", NUM_BULK_UUIDS);
+	return 0;
+}
+
 #ifdef __GNUC__
 #define ATTR(x) __attribute__(x)
 #else
@@ -179,6 +216,8 @@ main(int argc ATTR((unused)) , char **argv ATTR((unused)))
 		failed++;
 	}
 
+	failed += test_bulk_time();
+
 	failed += test_uuid("84949cc5-4701-4a84-895b-354c584a981b", 1);
 	failed += test_uuid("84949CC5-4701-4A84-895B-354C584A981B", 1);
 	failed += test_uuid("84949cc5-4701-4a84-895b-354c584a981bc", 0);
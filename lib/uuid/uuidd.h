@@ -48,6 +48,9 @@
 #define UUIDD_OP_BULK_RANDOM_UUID	5
 #define UUIDD_MAX_OP			UUIDD_OP_BULK_RANDOM_UUID
 
+/* Largest range of time-based UUIDs handed out by one bulk request */
+#define UUIDD_MAX_TIME_BULK		65536
+
 extern void uuid__generate_time(uuid_t out, int *num);
 extern void uuid__generate_random(uuid_t out, int *num);
 
@@ -57,6 +57,9 @@ extern int optind;
 #include <sys/time.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include "et/com_err.h"
 #include "ext2fs/ext2_io.h"
@@ -88,6 +91,8 @@ static unsigned int max_bb = MAX_BAD_BLOCKS;	/* Abort test if more than this
 						 * number of bad blocks has been
 						 * encountered */
 static unsigned int d_flag;		/* delay factor between reads */
+static unsigned int num_threads;	/* requests in flight (-j) */
+static unsigned long slow_msecs = 1000;	/* report requests slower than this */
 static struct timeval time_start;
 
 #define T_INC 32
@@ -99,7 +104,8 @@ static void usage(void)
 	fprintf(stderr, _(
 "Usage: %s [-b block_size] [-i input_file] [-o output_file] [-svwnfBX]\n"
 "       [-c blocks_at_once] [-d delay_factor_between_reads] [-e max_bad_blocks]\n"
-"       [-p num_passes] [-t test_pattern [-t test_pattern [...]]]\n"
+"       [-j threads] [-L slow_msecs] [-p num_passes]\n"
+"       [-t test_pattern [-t test_pattern [...]]]\n"
 "       device [last_block [first_block]]\n"),
 		 program_name);
 	exit (1);
@@ -344,13 +350,12 @@ static void pattern_fill(unsigned char *buffer, unsigned int pattern,
 			pattern = pattern >> 8;
 		}
 		nb = i ? (i-1) : 0;
-		for (ptr = buffer, i = nb; ptr < buffer + n; ptr++) {
+		for (ptr = buffer, i = nb; ptr < buffer + n && ptr <= buffer + nb;
+		     ptr++, i--)
 			*ptr = bpattern[i];
-			if (i == 0)
-				i = nb;
-			else
-				i--;
-		}
+		/* Replicate the pattern by doubling, a whole period at a time */
+		for (i = nb + 1; i < n; i *= 2)
+			memcpy(buffer + i, buffer, (n - i < i) ? n - i : i);
 		if (s_flag | v_flag) {
 			fputs(_("Testing with pattern 0x"), stderr);
 			for (i = 0; i <= nb; i++)
@@ -991,6 +996,453 @@ static unsigned int test_nd (int dev, blk_t last_block,
 	return bb_count;
 }
 
+#ifdef HAVE_PTHREAD_H
+/*
+ * Asynchronous scanning (-j).  A pool of threads keeps several
+ * requests of blocks_at_once blocks in flight using pread/pwrite;
+ * each thread claims the next stripe of the range from a shared
+ * cursor, so consecutive requests land on different members of a
+ * striped array.  Blocks which fail or miscompare are collected and
+ * handed to bb_output() once the pass is over.  The latency of every
+ * request goes into a histogram, and requests slower than slow_msecs
+ * are reported even though they succeeded.
+ */
+
+#define SCAN_HIST_BUCKETS	32
+#define SCAN_MAX_SLOW		1024
+#define SCAN_MAX_THREADS	256
+
+struct scan_err {
+	blk_t			blk;
+	enum error_types	type;
+};
+
+struct scan_slow {
+	blk_t		blk;
+	unsigned int	num;
+	unsigned long	msecs;
+};
+
+struct scan_ctx {
+	int			dev;
+	int			block_size;
+	unsigned int		blocks_at_once;
+	blk_t			first_block;
+	blk_t			last_block;
+	int			writing;
+	int			skip_bad;	/* skip blocks in bb_list */
+	unsigned char		*pattern;	/* blocks_at_once blocks */
+	unsigned int		max_errs;
+	pthread_mutex_t		lock;
+	blk_t			next;
+	int			abort;
+	struct scan_err		*errs;
+	unsigned int		num_errs;
+	unsigned int		size_errs;
+	struct scan_slow	slow[SCAN_MAX_SLOW];
+	unsigned int		num_slow;
+	unsigned long		total_slow;
+	unsigned long long	bytes;
+	unsigned long		requests;
+	unsigned long		hist[SCAN_HIST_BUCKETS];
+};
+
+static unsigned long long scan_usecs(struct timeval *tv1,
+				     struct timeval *tv2)
+{
+	return (unsigned long long) (tv2->tv_sec - tv1->tv_sec) * 1000000 +
+		tv2->tv_usec - tv1->tv_usec;
+}
+
+static void scan_add_err(struct scan_ctx *ctx, blk_t blk,
+			 enum error_types type)
+{
+	struct scan_err *errs;
+
+	pthread_mutex_lock(&ctx->lock);
+	if (ctx->num_errs >= ctx->size_errs) {
+		errs = realloc(ctx->errs, (ctx->size_errs + 256) *
+			       sizeof(struct scan_err));
+		if (!errs) {
+			com_err(program_name, ENOMEM, "%s",
+				_("while allocating buffers"));
+			exit(1);
+		}
+		ctx->errs = errs;
+		ctx->size_errs += 256;
+	}
+	ctx->errs[ctx->num_errs].blk = blk;
+	ctx->errs[ctx->num_errs].type = type;
+	if (++ctx->num_errs >= ctx->max_errs)
+		ctx->abort = 1;
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+static void scan_account(struct scan_ctx *ctx, blk_t blk, unsigned int num,
+			 long got, unsigned long long usecs)
+{
+	unsigned int bucket = 0;
+
+	while (bucket < SCAN_HIST_BUCKETS - 1 && (usecs >> (bucket + 1)))
+		bucket++;
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->requests++;
+	ctx->hist[bucket]++;
+	if (got > 0)
+		ctx->bytes += got;
+	if (usecs >= (unsigned long long) slow_msecs * 1000) {
+		if (ctx->num_slow < SCAN_MAX_SLOW) {
+			ctx->slow[ctx->num_slow].blk = blk;
+			ctx->slow[ctx->num_slow].num = num;
+			ctx->slow[ctx->num_slow].msecs = usecs / 1000;
+			ctx->num_slow++;
+		}
+		ctx->total_slow++;
+	}
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+/*
+ * Issue one request for num blocks starting at blk.  A request which
+ * fails or comes back short is retried a block at a time, so only the
+ * blocks which actually fail are reported.
+ */
+static void scan_request(struct scan_ctx *ctx, unsigned char *buf,
+			 blk_t blk, unsigned int num)
+{
+	size_t len = (size_t) num * ctx->block_size;
+	off_t offset = (off_t) blk * ctx->block_size;
+	unsigned char *expect = NULL;
+	struct timeval tv1, tv2;
+	unsigned int i;
+	long got;
+
+	if (ctx->pattern)
+		expect = ctx->pattern + (size_t) ((blk - ctx->first_block) %
+				ctx->blocks_at_once) * ctx->block_size;
+
+	gettimeofday(&tv1, NULL);
+	if (ctx->writing)
+		got = pwrite(ctx->dev, expect, len, offset);
+	else
+		got = pread(ctx->dev, buf, len, offset);
+	gettimeofday(&tv2, NULL);
+	scan_account(ctx, blk, num, got, scan_usecs(&tv1, &tv2));
+
+	if (got != (long) len) {
+		if (num == 1) {
+			scan_add_err(ctx, blk, ctx->writing ? WRITE_ERROR :
+				     READ_ERROR);
+			return;
+		}
+		for (i = 0; i < num && !ctx->abort; i++)
+			scan_request(ctx, buf, blk + i, 1);
+		return;
+	}
+	if (ctx->writing || !expect || !memcmp(buf, expect, len))
+		return;
+	for (i = 0; i < num; i++)
+		if (memcmp(buf + i * ctx->block_size,
+			   expect + i * ctx->block_size, ctx->block_size))
+			scan_add_err(ctx, blk + i, CORRUPTION_ERROR);
+}
+
+static void *scan_worker(void *arg)
+{
+	struct scan_ctx *ctx = arg;
+	unsigned char *buf = NULL;
+	blk_t blk, end, run;
+
+	if (!ctx->writing) {
+		buf = allocate_buffer(ctx->blocks_at_once * ctx->block_size);
+		if (!buf) {
+			com_err(program_name, ENOMEM, "%s",
+				_("while allocating buffers"));
+			exit(1);
+		}
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&ctx->lock);
+		if (ctx->abort || ctx->next >= ctx->last_block) {
+			pthread_mutex_unlock(&ctx->lock);
+			break;
+		}
+		blk = ctx->next;
+		end = blk + ctx->blocks_at_once;
+		if (end > ctx->last_block || end < blk)
+			end = ctx->last_block;
+		ctx->next = end;
+		currently_testing = end;
+		pthread_mutex_unlock(&ctx->lock);
+
+		while (blk < end && !ctx->abort) {
+			if (ctx->skip_bad &&
+			    ext2fs_badblocks_list_test(bb_list, blk)) {
+				blk++;
+				continue;
+			}
+			for (run = 1; blk + run < end; run++)
+				if (ctx->skip_bad &&
+				    ext2fs_badblocks_list_test(bb_list,
+							       blk + run))
+					break;
+			scan_request(ctx, buf, blk, run);
+			blk += run;
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+static int scan_err_cmp(const void *a, const void *b)
+{
+	const struct scan_err *ea = a, *eb = b;
+
+	if (ea->blk != eb->blk)
+		return ea->blk < eb->blk ? -1 : 1;
+	return (int) ea->type - (int) eb->type;
+}
+
+static int scan_slow_cmp(const void *a, const void *b)
+{
+	const struct scan_slow *sa = a, *sb = b;
+
+	if (sa->blk == sb->blk)
+		return 0;
+	return sa->blk < sb->blk ? -1 : 1;
+}
+
+static void scan_report(struct scan_ctx *ctx, unsigned long long usecs)
+{
+	unsigned long long mib = ctx->bytes >> 20;
+	unsigned int i;
+
+	qsort(ctx->slow, ctx->num_slow, sizeof(struct scan_slow),
+	      scan_slow_cmp);
+	for (i = 0; i < ctx->num_slow; i++)
+		fprintf(stderr, ctx->writing ?
+			_("Slow write at blocks %lu-%lu: %lu ms\n") :
+			_("Slow read at blocks %lu-%lu: %lu ms\n"),
+			(unsigned long) ctx->slow[i].blk,
+			(unsigned long) ctx->slow[i].blk + ctx->slow[i].num - 1,
+			ctx->slow[i].msecs);
+	if (ctx->total_slow > ctx->num_slow)
+		fprintf(stderr, _("%lu more slow requests not shown\n"),
+			ctx->total_slow - ctx->num_slow);
+
+	if (!v_flag)
+		return;
+	fprintf(stderr, _("%llu MiB in %llu.%03llu seconds (%llu MiB/s), "
+			  "%lu requests\n"),
+		mib, usecs / 1000000, (usecs / 1000) % 1000,
+		usecs ? (ctx->bytes * 1000000 / usecs) >> 20 : mib,
+		ctx->requests);
+	fputs(_("Request latency:\n"), stderr);
+	for (i = 0; i < SCAN_HIST_BUCKETS; i++) {
+		if (!ctx->hist[i])
+			continue;
+		fprintf(stderr, "  %10llu - %10llu us: %lu\n",
+			i ? 1ULL << i : 0, (2ULL << i) - 1, ctx->hist[i]);
+	}
+}
+
+/* Leave the signal handlers to the main thread */
+static void *scan_thread(void *arg)
+{
+	sigset_t mask;
+
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+	return scan_worker(arg);
+}
+
+/*
+ * Run one pass over the range, reading (and comparing against the
+ * pattern, if there is one) or writing the pattern.  Returns the
+ * number of new bad blocks found.
+ */
+static unsigned int scan_pass(struct scan_ctx *ctx, int writing,
+			      unsigned int bb_count)
+{
+	pthread_t threads[SCAN_MAX_THREADS];
+	unsigned char *buf;
+	struct timeval tv1, tv2;
+	unsigned int i, started = 0, found = 0;
+
+	ctx->writing = writing;
+	ctx->max_errs = max_bb > bb_count ? max_bb - bb_count : 1;
+	ctx->next = ctx->first_block;
+	ctx->abort = 0;
+	ctx->num_errs = 0;
+	ctx->num_slow = 0;
+	ctx->total_slow = 0;
+	ctx->bytes = 0;
+	ctx->requests = 0;
+	memset(ctx->hist, 0, sizeof(ctx->hist));
+
+	/*
+	 * O_DIRECT is a property of the shared file descriptor, so only
+	 * turn it on if every request of the pass can satisfy it.
+	 */
+	buf = allocate_buffer(ctx->block_size);
+	if (!buf) {
+		com_err(program_name, ENOMEM, "%s",
+			_("while allocating buffers"));
+		exit(1);
+	}
+	set_o_direct(ctx->dev, buf, ctx->block_size,
+		     (ext2_loff_t) ctx->first_block * ctx->block_size);
+	free(buf);
+
+	num_blocks = ctx->last_block - 1;
+	currently_testing = ctx->first_block;
+	if (s_flag && v_flag <= 1)
+		alarm_intr(SIGALRM);
+
+	gettimeofday(&tv1, NULL);
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&threads[i], NULL, scan_thread, ctx))
+			break;
+		started++;
+	}
+	if (!started)
+		scan_worker(ctx);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	gettimeofday(&tv2, NULL);
+
+	num_blocks = 0;
+	alarm(0);
+	if (ctx->abort && (s_flag || v_flag))
+		fputs(_("Too many bad blocks, aborting test\n"), stderr);
+	if (s_flag || v_flag)
+		fputs(_(done_string), stderr);
+
+	qsort(ctx->errs, ctx->num_errs, sizeof(struct scan_err),
+	      scan_err_cmp);
+	for (i = 0; i < ctx->num_errs; i++)
+		found += bb_output(ctx->errs[i].blk, ctx->errs[i].type);
+	scan_report(ctx, scan_usecs(&tv1, &tv2));
+	return found;
+}
+
+static void scan_init(struct scan_ctx *ctx, int dev, blk_t last_block,
+		      int block_size, blk_t first_block,
+		      unsigned int blocks_at_once)
+{
+	memset(ctx, 0, sizeof(struct scan_ctx));
+	ctx->dev = dev;
+	ctx->block_size = block_size;
+	ctx->blocks_at_once = blocks_at_once;
+	ctx->first_block = first_block;
+	ctx->last_block = last_block;
+	pthread_mutex_init(&ctx->lock, NULL);
+}
+
+static unsigned char *scan_alloc_pattern(struct scan_ctx *ctx)
+{
+	ctx->pattern = allocate_buffer(ctx->blocks_at_once * ctx->block_size);
+	if (!ctx->pattern) {
+		com_err(program_name, ENOMEM, "%s",
+			_("while allocating buffers"));
+		exit(1);
+	}
+	return ctx->pattern;
+}
+
+static void scan_free(struct scan_ctx *ctx)
+{
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx->pattern);
+	free(ctx->errs);
+}
+
+static unsigned int test_ro_async(int dev, blk_t last_block,
+				  int block_size, blk_t first_block,
+				  unsigned int blocks_at_once)
+{
+	struct scan_ctx ctx;
+	unsigned int bb_count;
+
+	capture_terminate(NULL);
+	scan_init(&ctx, dev, last_block, block_size, first_block,
+		  blocks_at_once);
+	ctx.skip_bad = 1;
+
+	if (v_flag) {
+		fprintf(stderr, _("Checking blocks %lu to %lu\n"),
+			(unsigned long)first_block,
+			(unsigned long)last_block - 1);
+	}
+	if (t_flag) {
+		fputs(_("Checking for bad blocks in read-only mode\n"), stderr);
+		pattern_fill(scan_alloc_pattern(&ctx), t_patts[0],
+			     blocks_at_once * block_size);
+	}
+	flush_bufs();
+	if (!t_flag && (s_flag || v_flag))
+		fputs(_("Checking for bad blocks (read-only test): "), stderr);
+	bb_count = scan_pass(&ctx, 0, 0);
+
+	fflush(stderr);
+	scan_free(&ctx);
+	uncapture_terminate();
+	return bb_count;
+}
+
+static unsigned int test_rw_async(int dev, blk_t last_block,
+				  int block_size, blk_t first_block,
+				  unsigned int blocks_at_once)
+{
+	const unsigned int patterns[] = {0xaa, 0x55, 0xff, 0x00};
+	const unsigned int *pattern;
+	int nr_pattern, pat_idx;
+	struct scan_ctx ctx;
+	unsigned int bb_count = 0;
+
+	capture_terminate(NULL);
+	scan_init(&ctx, dev, last_block, block_size, first_block,
+		  blocks_at_once);
+	scan_alloc_pattern(&ctx);
+
+	flush_bufs();
+
+	if (v_flag) {
+		fputs(_("Checking for bad blocks in read-write mode\n"),
+		      stderr);
+		fprintf(stderr, _("From block %lu to %lu\n"),
+			(unsigned long) first_block,
+			(unsigned long) last_block - 1);
+	}
+	if (t_flag) {
+		pattern = t_patts;
+		nr_pattern = t_flag;
+	} else {
+		pattern = patterns;
+		nr_pattern = sizeof(patterns) / sizeof(patterns[0]);
+	}
+	for (pat_idx = 0; pat_idx < nr_pattern; pat_idx++) {
+		if (bb_count >= max_bb)
+			break;
+		pattern_fill(ctx.pattern, pattern[pat_idx],
+			     blocks_at_once * block_size);
+		bb_count += scan_pass(&ctx, 1, bb_count);
+		flush_bufs();
+		if (bb_count >= max_bb)
+			break;
+		if (s_flag | v_flag)
+			fputs(_("Reading and comparing: "), stderr);
+		bb_count += scan_pass(&ctx, 0, bb_count);
+		flush_bufs();
+	}
+	scan_free(&ctx);
+	uncapture_terminate();
+	return bb_count;
+}
+#endif /* HAVE_PTHREAD_H */
+
 static void check_mount(char *device_name)
 {
 	errcode_t	retval;
@@ -1094,7 +1546,7 @@ int main (int argc, char ** argv)
 
 	if (argc && *argv)
 		program_name = *argv;
-	while ((c = getopt (argc, argv, "b:d:e:fi:o:svwnc:p:h:t:BX")) != EOF) {
+	while ((c = getopt (argc, argv, "b:d:e:fi:j:L:o:svwnc:p:h:t:BX")) != EOF) {
 		switch (c) {
 		case 'b':
 			block_size = parse_uint(optarg, "block size");
@@ -1145,6 +1597,12 @@ int main (int argc, char ** argv)
 		case 'd':
 			d_flag = parse_uint(optarg, "read delay factor");
 			break;
+		case 'j':
+			num_threads = parse_uint(optarg, "number of threads");
+			break;
+		case 'L':
+			slow_msecs = parse_uint(optarg, "slow request time");
+			break;
 		case 'p':
 			num_passes = parse_uint(optarg,
 						"number of clean passes");
@@ -1201,6 +1659,23 @@ int main (int argc, char ** argv)
 			exit(1);
 		}
 	}
+	if (num_threads) {
+		if (w_flag == 2 || d_flag) {
+			com_err(program_name, 0, "%s",
+				_("The -j option can not be used with "
+				  "-n or -d"));
+			exit(1);
+		}
+#ifdef HAVE_PTHREAD_H
+		if (num_threads > SCAN_MAX_THREADS) {
+			com_err(program_name, 0,
+				_("Too many threads %u - maximum is %u"),
+				num_threads, SCAN_MAX_THREADS);
+			exit(1);
+		}
+		test_func = w_flag ? test_rw_async : test_ro_async;
+#endif
+	}
 	if (optind > argc - 1)
 		usage();
 	device_name = argv[optind++];
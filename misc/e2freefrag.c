@@ -92,6 +92,42 @@ static void init_chunk_info(ext2_filsys fs, struct chunk_info *info)
 	}
 }
 
+static errcode_t scan_block_bitmap(ext2_filsys fs, struct chunk_info *info)
+{
+	struct ext2fs_freefrag_hist hist;
+	errcode_t retval;
+	int i, idx;
+
+	/*
+	 * The free extent histogram is kept by the library, which only
+	 * rescans the groups that changed since it was last asked.
+	 */
+	retval = ext2fs_freefrag_open(fs, info->chunkbits -
+				      info->blocksize_bits);
+	if (retval)
+		return retval;
+	retval = ext2fs_freefrag_get_hist(fs, &hist);
+	if (retval)
+		return retval;
+
+	for (i = 0; i < EXT2FS_FREEFRAG_BUCKETS; i++) {
+		idx = i + 1;
+		if (idx >= MAX_HIST)
+			idx = MAX_HIST-1;
+		info->histogram.fc_chunks[idx] += hist.fh_extents[i];
+		info->histogram.fc_blocks[idx] += hist.fh_blocks[i];
+	}
+	if (hist.fh_total_extents) {
+		info->min = hist.fh_min_extent;
+		info->max = hist.fh_max_extent;
+	}
+	info->avg = hist.fh_total_blocks;
+	info->real_free_chunks = hist.fh_total_extents;
+	info->free_chunks = hist.fh_free_chunks;
+	return 0;
+}
+
+#if defined(HAVE_EXT2_IOCTLS) && !defined(DEBUGFS)
 static void update_chunk_stats(struct chunk_info *info,
 			       unsigned long chunk_size)
 {
@@ -111,57 +147,6 @@ static void update_chunk_stats(struct chunk_info *info,
 	info->real_free_chunks++;
 }
 
-static void scan_block_bitmap(ext2_filsys fs, struct chunk_info *info)
-{
-	unsigned long long blocks_count = ext2fs_blocks_count(fs->super);
-	unsigned long long chunks = (blocks_count + info->blks_in_chunk) >>
-				(info->chunkbits - info->blocksize_bits);
-	unsigned long long chunk_num;
-	unsigned long last_chunk_size = 0;
-	unsigned long long chunk_start_blk = 0;
-	int used;
-
-	for (chunk_num = 0; chunk_num < chunks; chunk_num++) {
-		unsigned long long blk, num_blks;
-		int chunk_free;
-
-		/* Last chunk may be smaller */
-		if (chunk_start_blk + info->blks_in_chunk > blocks_count)
-			num_blks = blocks_count - chunk_start_blk;
-		else
-			num_blks = info->blks_in_chunk;
-
-		chunk_free = 0;
-
-		/* Initialize starting block for first chunk correctly else
-		 * there is a segfault when blocksize = 1024 in which case
-		 * block_map->start = 1 */
-		for (blk = 0; blk < num_blks; blk++, chunk_start_blk++) {
-			if (chunk_num == 0 && blk == 0) {
-				blk = fs->super->s_first_data_block;
-				chunk_start_blk = blk;
-			}
-			used = ext2fs_fast_test_block_bitmap2(fs->block_map,
-				chunk_start_blk >> fs->cluster_ratio_bits);
-			if (!used) {
-				last_chunk_size++;
-				chunk_free++;
-			}
-
-			if (used && last_chunk_size != 0) {
-				update_chunk_stats(info, last_chunk_size);
-				last_chunk_size = 0;
-			}
-		}
-
-		if (chunk_free == info->blks_in_chunk)
-			info->free_chunks++;
-	}
-	if (last_chunk_size != 0)
-		update_chunk_stats(info, last_chunk_size);
-}
-
-#if defined(HAVE_EXT2_IOCTLS) && !defined(DEBUGFS)
 # define FSMAP_EXTENTS	1024
 static int scan_online(ext2_filsys fs, struct chunk_info *info)
 {
@@ -243,11 +228,13 @@ static errcode_t scan_offline(ext2_filsys fs, struct chunk_info *info)
 {
 	errcode_t retval;
 
-	retval = ext2fs_read_block_bitmap(fs);
-	if (retval)
-		return retval;
-	scan_block_bitmap(fs, info);
-	return 0;
+	/* Don't throw away a bitmap debugfs may have changed in memory */
+	if (!fs->block_map) {
+		retval = ext2fs_read_block_bitmap(fs);
+		if (retval)
+			return retval;
+	}
+	return scan_block_bitmap(fs, info);
 }
 
 static errcode_t dump_chunk_info(ext2_filsys fs, struct chunk_info *info,
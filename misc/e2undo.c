@@ -22,6 +22,9 @@
 #endif
 #include <unistd.h>
 #include <libgen.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 #include "ext2fs/ext2fs.h"
 #include "support/nls-enable.h"
 
@@ -90,6 +93,8 @@ struct undo_key_info {
 	blk64_t fileblk;
 	__u32 blk_crc;
 	unsigned int size;
+	errcode_t read_err;	/* set by verify_keys() */
+	int crc_err;
 };
 
 struct undo_context {
@@ -102,6 +107,12 @@ struct undo_context {
 };
 #define KEYS_PER_BLOCK(d) (((d)->blocksize / sizeof(struct undo_key)) - 1)
 
+#define E2UNDO_VERIFY_SIZE	1048576	/* bytes per checksum read */
+#define E2UNDO_VERIFY_BATCH	64	/* keys claimed by a verify thread */
+#define E2UNDO_REPLAY_SIZE	(8 * 1048576)	/* bytes per replay write */
+#define E2UNDO_REPLAY_BUFS	4	/* replay writes in flight */
+#define E2UNDO_MAX_THREADS	16
+
 #define E2UNDO_FEATURE_COMPAT_FS_OFFSET 0x1	/* the filesystem offset */
 
 static inline int e2undo_has_feature_fs_offset(struct undo_header *header) {
@@ -208,7 +219,393 @@ static int key_compare(const void *a, const void *b)
 
 	ka = a;
 	kb = b;
-	return ka->fsblk - kb->fsblk;
+	if (ka->fsblk < kb->fsblk)
+		return -1;
+	return ka->fsblk > kb->fsblk;
+}
+
+/*
+ * Verification.  Every block's crc is checked before anything is
+ * written to the filesystem, since a bad undo file should leave the
+ * filesystem alone.  The keys are shared out in batches to a pool of
+ * threads, each with its own channel on the undo file; the results are
+ * reported afterwards in undo file order.
+ */
+struct verify_ctx {
+	struct undo_context	*ctx;
+	size_t			next;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		lock;
+#endif
+};
+
+static void verify_key(struct undo_context *ctx, io_channel undo,
+		       char *buf, size_t buf_size,
+		       struct undo_key_info *ikey)
+{
+	size_t off, len;
+	__u32 blk_crc = ~0;
+	errcode_t retval;
+
+	for (off = 0; off < ikey->size; off += len) {
+		len = ikey->size - off;
+		if (len > buf_size)
+			len = buf_size;
+		retval = io_channel_read_blk64(undo,
+					ikey->fileblk + off / ctx->blocksize,
+					-(int)len, buf);
+		if (retval) {
+			ikey->read_err = retval;
+			return;
+		}
+		blk_crc = ext2fs_crc32c_le(blk_crc, (unsigned char *)buf, len);
+	}
+	ikey->crc_err = (blk_crc != ikey->blk_crc);
+}
+
+static int verify_next(struct verify_ctx *vctx, size_t *start, size_t *end)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&vctx->lock);
+#endif
+	*start = vctx->next;
+	*end = *start + E2UNDO_VERIFY_BATCH;
+	if (*end > vctx->ctx->num_keys)
+		*end = vctx->ctx->num_keys;
+	vctx->next = *end;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&vctx->lock);
+#endif
+	return *start < *end;
+}
+
+static void verify_run(struct verify_ctx *vctx, io_channel undo)
+{
+	struct undo_context *ctx = vctx->ctx;
+	size_t i, end, buf_size;
+	char *buf;
+
+	buf_size = E2UNDO_VERIFY_SIZE - E2UNDO_VERIFY_SIZE % ctx->blocksize;
+	if (buf_size == 0)
+		buf_size = ctx->blocksize;
+	if (ext2fs_get_mem(buf_size, &buf)) {
+		com_err(prg_name, EXT2_ET_NO_MEMORY, "%s",
+			_("while allocating memory"));
+		exit(1);
+	}
+	while (verify_next(vctx, &i, &end))
+		for (; i < end; i++)
+			verify_key(ctx, undo, buf, buf_size, ctx->keys + i);
+	ext2fs_free_mem(&buf);
+}
+
+#ifdef HAVE_PTHREAD_H
+struct verify_thread {
+	struct verify_ctx	*vctx;
+	io_channel		undo;
+	pthread_t		thread;
+};
+
+static void *verify_worker(void *arg)
+{
+	struct verify_thread *vt = arg;
+
+	verify_run(vt->vctx, vt->undo);
+	return NULL;
+}
+
+static unsigned int e2undo_threads(void)
+{
+	long n = 1;
+
+#if defined(HAVE_SYSCONF) && defined(_SC_NPROCESSORS_ONLN)
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (n < 1)
+		n = 1;
+	if (n > E2UNDO_MAX_THREADS)
+		n = E2UNDO_MAX_THREADS;
+	return n;
+}
+#endif
+
+static void verify_keys(struct undo_context *ctx, const char *tdb_file,
+			int force, int *csum_error, int *io_error)
+{
+	struct verify_ctx vctx;
+	struct undo_key_info *ikey;
+	size_t i;
+#ifdef HAVE_PTHREAD_H
+	struct verify_thread vt[E2UNDO_MAX_THREADS];
+	unsigned int t, nthreads, started = 0;
+#endif
+
+	memset(&vctx, 0, sizeof(vctx));
+	vctx.ctx = ctx;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&vctx.lock, NULL);
+	nthreads = e2undo_threads();
+	if (nthreads > 1) {
+		for (t = 0; t < nthreads; t++) {
+			vt[started].vctx = &vctx;
+			if (unix_io_manager->open(tdb_file, 0,
+						  &vt[started].undo))
+				break;
+			io_channel_set_blksize(vt[started].undo,
+					       ctx->blocksize);
+			if (pthread_create(&vt[started].thread, NULL,
+					   verify_worker, &vt[started])) {
+				io_channel_close(vt[started].undo);
+				break;
+			}
+			started++;
+		}
+	}
+	/* Whatever the threads have not got to, do here */
+	verify_run(&vctx, ctx->undo_file);
+	for (t = 0; t < started; t++) {
+		pthread_join(vt[t].thread, NULL);
+		io_channel_close(vt[t].undo);
+	}
+	pthread_mutex_destroy(&vctx.lock);
+#else
+	verify_run(&vctx, ctx->undo_file);
+#endif
+
+	for (i = 0, ikey = ctx->keys; i < ctx->num_keys; i++, ikey++) {
+		if (ikey->read_err) {
+			com_err(prg_name, ikey->read_err,
+				_("while fetching block %llu."),
+				ikey->fileblk);
+			if (!force)
+				exit(1);
+			*io_error = 1;
+		} else if (ikey->crc_err) {
+			fprintf(stderr,
+				_("checksum error in filesystem block "
+				  "%llu (undo blk %llu)\n"),
+				ikey->fsblk, ikey->fileblk);
+			if (!force)
+				exit(1);
+			*csum_error = 1;
+		}
+	}
+}
+
+/*
+ * Replay.  The keys are taken in filesystem block order, and the blocks
+ * of adjacent keys are gathered into large buffers, which a writer
+ * thread puts on the device while the next buffer is being read from
+ * the undo file.
+ */
+struct replay_buf {
+	char		*buf;
+	blk64_t		fsblk;
+	size_t		size;
+};
+
+struct replay_ctx {
+	io_channel		channel;
+	unsigned int		fs_blocksize;
+	size_t			buf_size;
+	struct replay_buf	bufs[E2UNDO_REPLAY_BUFS];
+	unsigned int		head, tail, count;
+	int			dry_run, io_error, threaded, done;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	pthread_t		writer;
+#endif
+};
+
+static void replay_write(struct replay_ctx *rctx, struct replay_buf *rb)
+{
+	errcode_t retval;
+
+	retval = io_channel_write_blk64(rctx->channel, rb->fsblk,
+					-(int)rb->size, rb->buf);
+	if (retval) {
+		com_err(prg_name, retval,
+			_("while writing block %llu."), rb->fsblk);
+		rctx->io_error = 1;
+	}
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *replay_writer(void *arg)
+{
+	struct replay_ctx *rctx = arg;
+	struct replay_buf *rb;
+
+	pthread_mutex_lock(&rctx->lock);
+	while (1) {
+		while (rctx->count == 0 && !rctx->done)
+			pthread_cond_wait(&rctx->cond, &rctx->lock);
+		if (rctx->count == 0)
+			break;
+		rb = rctx->bufs + rctx->tail;
+		pthread_mutex_unlock(&rctx->lock);
+
+		replay_write(rctx, rb);
+		rb->size = 0;
+
+		pthread_mutex_lock(&rctx->lock);
+		rctx->tail = (rctx->tail + 1) % E2UNDO_REPLAY_BUFS;
+		rctx->count--;
+		pthread_cond_broadcast(&rctx->cond);
+	}
+	pthread_mutex_unlock(&rctx->lock);
+	return NULL;
+}
+#endif
+
+/* Hand the current buffer over to be written, and move to a free one. */
+static void replay_submit(struct replay_ctx *rctx)
+{
+	struct replay_buf *rb = rctx->bufs + rctx->head;
+
+	if (rb->size == 0)
+		return;
+	if (rctx->dry_run) {
+		rb->size = 0;
+		return;
+	}
+#ifdef HAVE_PTHREAD_H
+	if (rctx->threaded) {
+		pthread_mutex_lock(&rctx->lock);
+		rctx->head = (rctx->head + 1) % E2UNDO_REPLAY_BUFS;
+		rctx->count++;
+		pthread_cond_broadcast(&rctx->cond);
+		while (rctx->count == E2UNDO_REPLAY_BUFS)
+			pthread_cond_wait(&rctx->cond, &rctx->lock);
+		pthread_mutex_unlock(&rctx->lock);
+		return;
+	}
+#endif
+	replay_write(rctx, rb);
+	rb->size = 0;
+}
+
+static int replay_keys(struct undo_context *ctx, io_channel channel,
+		       int dry_run, int verbose)
+{
+	struct replay_ctx rctx;
+	struct replay_buf *rb;
+	struct undo_key_info *ikey;
+	unsigned long long end;
+	size_t i, off, len, start;
+	unsigned int b;
+	int split;
+	errcode_t retval;
+
+	memset(&rctx, 0, sizeof(rctx));
+	rctx.channel = channel;
+	rctx.fs_blocksize = ctx->fs_blocksize;
+	rctx.dry_run = dry_run;
+	/* keys can be split at any multiple of both block sizes */
+	rctx.buf_size = E2UNDO_REPLAY_SIZE;
+	if (rctx.buf_size % ctx->blocksize || rctx.buf_size % ctx->fs_blocksize)
+		rctx.buf_size = E2UNDO_MAX_EXTENT_BLOCKS * ctx->blocksize;
+	for (b = 0; b < E2UNDO_REPLAY_BUFS; b++) {
+		retval = ext2fs_get_mem(rctx.buf_size, &rctx.bufs[b].buf);
+		if (retval) {
+			com_err(prg_name, retval, "%s",
+				_("while allocating memory"));
+			exit(1);
+		}
+	}
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&rctx.lock, NULL);
+	pthread_cond_init(&rctx.cond, NULL);
+	if (!dry_run && e2undo_threads() > 1 &&
+	    pthread_create(&rctx.writer, NULL, replay_writer, &rctx) == 0)
+		rctx.threaded = 1;
+#endif
+
+	io_channel_set_blksize(channel, ctx->fs_blocksize);
+	for (i = 0, ikey = ctx->keys; i < ctx->num_keys; i++, ikey++) {
+		/* verify_keys() couldn't read it either; skip all of it */
+		if (ikey->read_err) {
+			com_err(prg_name, ikey->read_err,
+				_("while fetching block %llu."),
+				ikey->fileblk);
+			rctx.io_error = 1;
+			continue;
+		}
+
+		/*
+		 * A key only joins the current buffer if it carries straight
+		 * on from it and all of it fits; so unless the key is bigger
+		 * than a buffer, nothing of it is written before all of it
+		 * has been read.  A bigger key which can't be read although
+		 * verify_keys() could is only partly replayed, so stop there.
+		 */
+		rb = rctx.bufs + rctx.head;
+		end = rb->fsblk * ctx->fs_blocksize + rb->size;
+		if (rb->size &&
+		    (end != ikey->fsblk * ctx->fs_blocksize ||
+		     rb->size + ikey->size > rctx.buf_size)) {
+			replay_submit(&rctx);
+			rb = rctx.bufs + rctx.head;
+		}
+		start = rb->size;
+		split = 0;
+		for (off = 0; off < ikey->size; off += len) {
+			if (rb->size == rctx.buf_size) {
+				replay_submit(&rctx);
+				rb = rctx.bufs + rctx.head;
+				split = 1;
+			}
+			len = ikey->size - off;
+			if (len > rctx.buf_size - rb->size)
+				len = rctx.buf_size - rb->size;
+			retval = io_channel_read_blk64(ctx->undo_file,
+					ikey->fileblk + off / ctx->blocksize,
+					-(int)len, rb->buf + rb->size);
+			if (retval)
+				break;
+			if (rb->size == 0)
+				rb->fsblk = ikey->fsblk +
+					off / ctx->fs_blocksize;
+			rb->size += len;
+		}
+		if (off < ikey->size) {
+			com_err(prg_name, retval,
+				_("while fetching block %llu."),
+				ikey->fileblk);
+			rctx.io_error = 1;
+			if (!split) {
+				/* Skip the key, as if it had never been read */
+				rb->size = start;
+				continue;
+			}
+			/* Part of it is on its way to the device already */
+			rb->size = 0;
+			fprintf(stderr, _("Replay stopped part way through "
+					  "block %llu.\n"), ikey->fsblk);
+			break;
+		}
+
+		if (verbose)
+			printf("Replayed block of size %u from %llu to %llu\n",
+				ikey->size, ikey->fileblk, ikey->fsblk);
+	}
+	replay_submit(&rctx);
+
+#ifdef HAVE_PTHREAD_H
+	if (rctx.threaded) {
+		pthread_mutex_lock(&rctx.lock);
+		rctx.done = 1;
+		pthread_cond_broadcast(&rctx.cond);
+		pthread_mutex_unlock(&rctx.lock);
+		pthread_join(rctx.writer, NULL);
+	}
+	pthread_cond_destroy(&rctx.cond);
+	pthread_mutex_destroy(&rctx.lock);
+#endif
+	for (b = 0; b < E2UNDO_REPLAY_BUFS; b++)
+		ext2fs_free_mem(&rctx.bufs[b].buf);
+	return rctx.io_error;
 }
 
 static int e2undo_setup_tdb(const char *name, io_manager *io_ptr)
@@ -300,7 +697,7 @@ int main(int argc, char *argv[])
 	struct undo_key_block *keyb;
 	struct undo_key *dkey;
 	struct undo_key_info *ikey;
-	__u32 key_crc, blk_crc, hdr_crc;
+	__u32 key_crc, hdr_crc;
 	blk64_t lblk;
 	ext2_filsys fs;
 	__u64 offset = 0;
@@ -467,8 +864,8 @@ int main(int argc, char *argv[])
 		exit(1);
 
 	/* prepare to read keys */
-	retval = ext2fs_get_mem(sizeof(struct undo_key_info) * undo_ctx.num_keys,
-				&undo_ctx.keys);
+	retval = ext2fs_get_memzero(sizeof(struct undo_key_info) *
+				    undo_ctx.num_keys, &undo_ctx.keys);
 	if (retval) {
 		com_err(prg_name, retval, "%s", _("while allocating memory"));
 		exit(1);
@@ -479,12 +876,6 @@ int main(int argc, char *argv[])
 		com_err(prg_name, retval, "%s", _("while allocating memory"));
 		exit(1);
 	}
-	retval = ext2fs_get_mem(E2UNDO_MAX_EXTENT_BLOCKS * undo_ctx.blocksize,
-				&buf);
-	if (retval) {
-		com_err(prg_name, retval, "%s", _("while allocating memory"));
-		exit(1);
-	}
 
 	/* load keys */
 	keys_per_block = KEYS_PER_BLOCK(&undo_ctx);
@@ -547,69 +938,20 @@ int main(int argc, char *argv[])
 					tdb_file, ikey->fsblk);
 				exit(1);
 			}
-
-			/* check each block's crc */
-			retval = io_channel_read_blk64(undo_ctx.undo_file,
-						       ikey->fileblk,
-						       -(int)ikey->size,
-						       buf);
-			if (retval) {
-				com_err(prg_name, retval,
-					_("while fetching block %llu."),
-					ikey->fileblk);
-				if (!force)
-					exit(1);
-				io_error = 1;
-				continue;
-			}
-
-			blk_crc = ext2fs_crc32c_le(~0, (unsigned char *)buf,
-						   ikey->size);
-			if (blk_crc != ikey->blk_crc) {
-				fprintf(stderr,
-					_("checksum error in filesystem block "
-					  "%llu (undo blk %llu)\n"),
-					ikey->fsblk, ikey->fileblk);
-				if (!force)
-					exit(1);
-				csum_error = 1;
-			}
 		}
 	}
 	ext2fs_free_mem(&keyb);
 
+	/* check each block's crc */
+	verify_keys(&undo_ctx, tdb_file, force, &csum_error, &io_error);
+
 	/* sort keys in fs block order */
 	qsort(undo_ctx.keys, undo_ctx.num_keys, sizeof(struct undo_key_info),
 	      key_compare);
 
 	/* replay */
-	io_channel_set_blksize(channel, undo_ctx.fs_blocksize);
-	for (i = 0, ikey = undo_ctx.keys; i < undo_ctx.num_keys; i++, ikey++) {
-		retval = io_channel_read_blk64(undo_ctx.undo_file,
-					       ikey->fileblk,
-					       -(int)ikey->size,
-					       buf);
-		if (retval) {
-			com_err(prg_name, retval,
-				_("while fetching block %llu."),
-				ikey->fileblk);
-			io_error = 1;
-			continue;
-		}
-
-		if (verbose)
-			printf("Replayed block of size %u from %llu to %llu\n",
-				ikey->size, ikey->fileblk, ikey->fsblk);
-		if (dry_run)
-			continue;
-		retval = io_channel_write_blk64(channel, ikey->fsblk,
-						-(int)ikey->size, buf);
-		if (retval) {
-			com_err(prg_name, retval,
-				_("while writing block %llu."), ikey->fsblk);
-			io_error = 1;
-		}
-	}
+	if (replay_keys(&undo_ctx, channel, dry_run, verbose))
+		io_error = 1;
 
 	if (csum_error)
 		fprintf(stderr, _("Undo file corruption; run e2fsck NOW!\n"));
@@ -619,7 +961,6 @@ int main(int argc, char *argv[])
 		force = 1;
 		fprintf(stderr, _("Incomplete undo record; run e2fsck.\n"));
 	}
-	ext2fs_free_mem(&buf);
 	ext2fs_free_mem(&undo_ctx.keys);
 	io_channel_close(channel);
 
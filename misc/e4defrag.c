@@ -87,6 +87,8 @@
 /* The mode of defrag */
 #define DETAIL			0x01
 #define STATISTIC		0x02
+#define OFFLINE			0x04
+#define COMPACT			0x08
 
 #define DEVNAME			0
 #define DIRNAME			1
@@ -115,7 +117,8 @@
 /* The following macros are error message */
 #define MSG_USAGE		\
 "Usage	: e4defrag [-v] file...| directory...| device...\n\
-	: e4defrag  -c  file...| directory...| device...\n"
+	: e4defrag  -c  file...| directory...| device...\n\
+	: e4defrag -o [-c] [-p] [-v] device...| image...\n"
 
 #define NGMSG_EXT4		"Filesystem is not ext4 filesystem"
 #define NGMSG_FILE_EXTENT	"Failed to get file extents"
@@ -1663,6 +1666,258 @@ out:
 	return 0;
 }
 
+/*
+ * Offline mode: the target is an unmounted device or filesystem image,
+ * which is opened with libext2fs.  Every extent-mapped file and
+ * directory is looked at up front; the fragmented ones are then moved,
+ * largest first so that they get the big free extents before the
+ * small files can break them up, each into a single free extent as
+ * close as possible to where it already is.  With -p (pack), every
+ * file is instead moved, in inode number order, into the first free
+ * extent from the start of the filesystem which will hold it, which
+ * gathers the files together and the free space at the end.
+ */
+struct offline_file {
+	ext2_ino_t	ino;
+	blk64_t		blocks;
+	blk64_t		first;
+};
+
+struct offline_stats {
+	unsigned int	files;
+	unsigned int	fragmented;
+	unsigned int	skipped;
+	unsigned long long extents;
+};
+
+static int offline_cmp_size(const void *a, const void *b)
+{
+	const struct offline_file *fa = a, *fb = b;
+
+	if (fa->blocks != fb->blocks)
+		return fa->blocks < fb->blocks ? 1 : -1;
+	return fa->ino < fb->ino ? -1 : fa->ino > fb->ino;
+}
+
+/*
+ * Gather the layout of every file.  If list is not NULL, the files
+ * which are worth moving are returned in it.
+ */
+static errcode_t offline_scan(ext2_filsys fs, struct offline_stats *stats,
+			      struct offline_file **list, unsigned int *count)
+{
+	ext2_inode_scan	scan;
+	struct ext2_inode inode;
+	struct ext2fs_defrag_info info;
+	struct offline_file *files = NULL;
+	unsigned int	size = 0;
+	ext2_ino_t	ino;
+	errcode_t	retval;
+
+	memset(stats, 0, sizeof(struct offline_stats));
+	if (count)
+		*count = 0;
+	retval = ext2fs_open_inode_scan(fs, 0, &scan);
+	if (retval)
+		return retval;
+	while (1) {
+		retval = ext2fs_get_next_inode(scan, &ino, &inode);
+		if (retval == EXT2_ET_BAD_BLOCK_IN_INODE_TABLE)
+			continue;
+		if (retval || !ino)
+			break;
+		retval = ext2fs_defrag_inode_info(fs, ino, &inode, &info);
+		if (retval == EXT2_ET_INODE_NOT_EXTENT) {
+			stats->skipped++;
+			continue;
+		}
+		if (retval) {
+			if (mode_flag & DETAIL)
+				com_err("e4defrag", retval,
+					"while reading extents of inode %u",
+					ino);
+			stats->skipped++;
+			continue;
+		}
+		if (!info.di_blocks)
+			continue;
+		stats->files++;
+		stats->extents += info.di_extents;
+		if (info.di_fragments > 1)
+			stats->fragmented++;
+		if (!list ||
+		    (info.di_fragments <= 1 && !(mode_flag & COMPACT)))
+			continue;
+		if (*count == size) {
+			struct offline_file *tmp;
+
+			size = size ? size * 2 : 1024;
+			tmp = realloc(files, size * sizeof(*files));
+			if (!tmp) {
+				retval = EXT2_ET_NO_MEMORY;
+				break;
+			}
+			files = tmp;
+		}
+		files[*count].ino = ino;
+		files[*count].blocks = info.di_blocks;
+		files[*count].first = info.di_first;
+		(*count)++;
+	}
+	ext2fs_close_inode_scan(scan);
+	if (list)
+		*list = files;
+	else
+		free(files);
+	return retval;
+}
+
+static void offline_free_space(ext2_filsys fs, const char *label)
+{
+	struct ext2fs_freefrag_hist hist;
+
+	if (ext2fs_freefrag_open(fs, 0) ||
+	    ext2fs_freefrag_get_hist(fs, &hist))
+		return;
+	printf("\t%s%llu blocks in %llu extents, largest %llu\n", label,
+	       (unsigned long long) hist.fh_total_blocks,
+	       (unsigned long long) hist.fh_total_extents,
+	       (unsigned long long) hist.fh_max_extent);
+}
+
+static int offline_defrag(const char *device)
+{
+	ext2_filsys	fs = NULL;
+	struct offline_file *files = NULL;
+	struct offline_stats before, after;
+	unsigned int	i, count = 0, moved = 0, failed = 0;
+	blk64_t		goal, start;
+	int		mount_flags, flags = EXT2_FLAG_64BITS;
+	errcode_t	retval;
+
+	retval = ext2fs_check_if_mounted(device, &mount_flags);
+	if (retval) {
+		com_err("e4defrag", retval, "while checking whether %s is "
+			"mounted", device);
+		return -1;
+	}
+	if (mount_flags & EXT2_MF_MOUNTED) {
+		fprintf(stderr, "%s is mounted; offline defragmentation "
+			"needs an unmounted filesystem\n", device);
+		return -1;
+	}
+	if (!(mode_flag & STATISTIC))
+		flags |= EXT2_FLAG_RW;
+	retval = ext2fs_open(device, flags, 0, 0, unix_io_manager, &fs);
+	if (retval) {
+		com_err("e4defrag", retval, "while trying to open %s", device);
+		return -1;
+	}
+	if (!(mode_flag & STATISTIC)) {
+		if (!(fs->super->s_state & EXT2_VALID_FS) ||
+		    (fs->super->s_state & EXT2_ERROR_FS) ||
+		    ext2fs_has_feature_journal_needs_recovery(fs->super)) {
+			fprintf(stderr, "%s is not clean; please run "
+				"e2fsck first\n", device);
+			goto errout;
+		}
+		if (ext2fs_has_feature_bigalloc(fs->super)) {
+			fprintf(stderr, "%s: offline defragmentation of "
+				"bigalloc filesystems is not supported\n",
+				device);
+			goto errout;
+		}
+	}
+	retval = ext2fs_read_bitmaps(fs);
+	if (retval) {
+		com_err("e4defrag", retval, "while reading bitmaps of %s",
+			device);
+		goto errout;
+	}
+
+	retval = offline_scan(fs, &before,
+			      (mode_flag & STATISTIC) ? NULL : &files, &count);
+	if (retval) {
+		com_err("e4defrag", retval, "while scanning inodes of %s",
+			device);
+		goto errout;
+	}
+
+	if (mode_flag & STATISTIC) {
+		printf("ext4 offline fragmentation report for %s\n", device);
+		printf("\tFiles:\t\t\t\t%u\n", before.files);
+		printf("\tFragmented files:\t\t%u\n", before.fragmented);
+		printf("\tTotal extents:\t\t\t%llu\n", before.extents);
+		if (before.skipped)
+			printf("\tSkipped (not extent mapped):\t%u\n",
+			       before.skipped);
+		offline_free_space(fs, "Free space:\t\t\t");
+		ext2fs_close_free(&fs);
+		return 0;
+	}
+
+	printf("ext4 offline %s for %s\n",
+	       (mode_flag & COMPACT) ? "compaction" : "defragmentation",
+	       device);
+	if (mode_flag & DETAIL)
+		offline_free_space(fs, "Free space before:\t\t");
+	if (!(mode_flag & COMPACT))
+		qsort(files, count, sizeof(*files), offline_cmp_size);
+
+	goal = fs->super->s_first_data_block;
+	for (i = 0; i < count; i++) {
+		if (!(mode_flag & COMPACT))
+			goal = files[i].first;
+		retval = ext2fs_defrag_inode(fs, files[i].ino, NULL, goal,
+				(mode_flag & COMPACT) ? EXT2_DEFRAG_COMPACT : 0,
+				&start);
+		if (retval) {
+			if (mode_flag & DETAIL)
+				com_err("e4defrag", retval,
+					"while moving inode %u", files[i].ino);
+			failed++;
+			start = files[i].first;
+		} else if (start)
+			moved++;
+		else
+			start = files[i].first;
+		if (mode_flag & COMPACT)
+			goal = start + files[i].blocks;
+	}
+	free(files);
+
+	retval = offline_scan(fs, &after, NULL, NULL);
+	if (retval) {
+		com_err("e4defrag", retval, "while scanning inodes of %s",
+			device);
+		goto errout;
+	}
+	printf("\n\tSuccess:\t\t\t[ %u/%u ]\n", count - failed, count);
+	printf("\tFailure:\t\t\t[ %u/%u ]\n", failed, count);
+	if (mode_flag & DETAIL) {
+		printf("\tFiles moved:\t\t\t%u\n", moved);
+		printf("\tTotal extents:\t\t\t%4llu->%llu\n",
+		       before.extents, after.extents);
+		printf("\tFragmented percentage:\t\t%3llu%%->%llu%%\n",
+		       !before.files ? 0 : (unsigned long long)
+		       before.fragmented * 100 / before.files,
+		       !after.files ? 0 : (unsigned long long)
+		       after.fragmented * 100 / after.files);
+		offline_free_space(fs, "Free space after:\t\t");
+	}
+
+	retval = ext2fs_close_free(&fs);
+	if (retval) {
+		com_err("e4defrag", retval, "while closing %s", device);
+		return -1;
+	}
+	return failed ? -1 : 0;
+
+errout:
+	ext2fs_close_free(&fs);
+	return -1;
+}
+
 /*
  * main() -		Ext4 online defrag.
  *
@@ -1688,7 +1943,7 @@ int main(int argc, char *argv[])
 	if (argc == 1)
 		goto out;
 
-	while ((opt = getopt(argc, argv, "vc")) != EOF) {
+	while ((opt = getopt(argc, argv, "vcop")) != EOF) {
 		switch (opt) {
 		case 'v':
 			mode_flag |= DETAIL;
@@ -1696,6 +1951,12 @@ int main(int argc, char *argv[])
 		case 'c':
 			mode_flag |= STATISTIC;
 			break;
+		case 'o':
+			mode_flag |= OFFLINE;
+			break;
+		case 'p':
+			mode_flag |= COMPACT;
+			break;
 		default:
 			goto out;
 		}
@@ -1703,6 +1964,21 @@ int main(int argc, char *argv[])
 
 	if (argc == optind)
 		goto out;
+	if ((mode_flag & COMPACT) && !(mode_flag & OFFLINE))
+		goto out;
+
+	if (mode_flag & OFFLINE) {
+		add_error_table(&et_ext2_error_table);
+		for (i = optind; i < argc; i++) {
+			if (i > optind)
+				printf("\n");
+			if (offline_defrag(argv[i]) == 0)
+				success_flag = 1;
+			else
+				ret = 1;
+		}
+		return ret;
+	}
 
 	current_uid = getuid();
 
@@ -57,6 +57,13 @@
 #ifdef HAVE_SIGNAL_H
 #include <signal.h>
 #endif
+#ifdef __linux__
+#include <fcntl.h>
+#include <dirent.h>
+#endif
+#ifdef HAVE_SYS_SYSMACROS_H
+#include <sys/sysmacros.h>
+#endif
 
 #include "../version.h"
 #include "support/nls-enable.h"
@@ -112,6 +119,8 @@ static int parallel_root = 0;
 static int progress = 0;
 static int progress_fd = 0;
 static int force_all_parallel = 0;
+static int use_topology = 0;
+static int max_per_device = 4;
 static int num_running = 0;
 static int max_running = 0;
 static volatile int cancel_requested = 0;
@@ -256,6 +265,9 @@ static struct fs_info *create_fs_device(const char *device, const char *mntpnt,
 	fs->freq = freq;
 	fs->passno = passno;
 	fs->flags = 0;
+	fs->disks = NULL;
+	fs->num_disks = 0;
+	fs->weight = 0;
 	fs->next = NULL;
 
 	if (!filesys_info)
@@ -434,7 +446,7 @@ static int progress_active(NOARGS)
  * child processes we are waiting for.
  */
 static int execute(const char *type, const char *device, const char *mntpt,
-		   int interactive)
+		   struct fs_info *fs, int interactive)
 {
 	char *s, *argv[80], prog[256];
 	int  argc, i;
@@ -515,6 +527,7 @@ static int execute(const char *type, const char *device, const char *mntpt,
 	inst->type = string_copy(type);
 	inst->device = string_copy(device);
 	inst->base_device = base_device(device);
+	inst->fs = fs;
 	inst->start_time = time(0);
 	inst->next = NULL;
 
@@ -719,7 +732,7 @@ static void fsck_device(struct fs_info *fs, int interactive)
 		type = DEFAULT_FSTYPE;
 
 	num_running++;
-	retval = execute(type, fs->device, fs->mountpt, interactive);
+	retval = execute(type, fs->device, fs->mountpt, fs, interactive);
 	if (retval) {
 		fprintf(stderr, _("%s: Error %d while executing fsck.%s "
 			"for %s\n"), progname, retval, type, fs->device);
@@ -957,6 +970,233 @@ static int device_already_active(char *device)
 	return 0;
 }
 
+#ifdef __linux__
+/*
+ * Device topology
+ *
+ * base_device() guesses which disk a device lives on from its name,
+ * which doesn't work for dm, md or NVMe devices.  Instead, when sysfs
+ * is available, we follow each device's slaves down to the physical
+ * disks it is built from, and only limit how many checks run at once
+ * on each of those disks: one for rotational disks, and
+ * FSCK_MAX_PER_DEVICE (4 by default) for others.  Within each pass the
+ * filesystems which will take longest to check are started first.
+ */
+#define SYSFS_DEV_BLOCK		"/sys/dev/block"
+#define MAX_TOPOLOGY_DEPTH	16
+
+static int sysfs_read_ull(const char *dir, const char *file,
+			  unsigned long long *val)
+{
+	char path[PATH_MAX];
+	FILE *f;
+	int ret;
+
+	if (snprintf(path, sizeof(path), "%s/%s", dir, file) >=
+	    (int) sizeof(path))
+		return -1;
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	ret = (fscanf(f, "%llu", val) == 1) ? 0 : -1;
+	fclose(f);
+	return ret;
+}
+
+static int add_disk(struct fs_info *fs, const char *sysdir)
+{
+	char disk[PATH_MAX], *cp;
+	struct fs_disk *new_disks;
+	unsigned long long val;
+	int i;
+
+	strcpy(disk, sysdir);
+	/* A partition's disk is its parent directory */
+	if (sysfs_read_ull(disk, "partition", &val) == 0) {
+		cp = strrchr(disk, '/');
+		if (cp)
+			*cp = 0;
+	}
+	cp = strrchr(disk, '/');
+	cp = cp ? cp + 1 : disk;
+	for (i = 0; i < fs->num_disks; i++)
+		if (!strcmp(fs->disks[i].name, cp))
+			return 0;
+
+	new_disks = realloc(fs->disks,
+			    (fs->num_disks + 1) * sizeof(struct fs_disk));
+	if (!new_disks)
+		return -1;
+	fs->disks = new_disks;
+	snprintf(fs->disks[fs->num_disks].name,
+		 sizeof(fs->disks[fs->num_disks].name), "%s", cp);
+	fs->disks[fs->num_disks].rotational =
+		(sysfs_read_ull(disk, "queue/rotational", &val) < 0 || val);
+	fs->num_disks++;
+	return 0;
+}
+
+static int resolve_disks(struct fs_info *fs, const char *sysdir, int depth)
+{
+	char path[PATH_MAX], slave[PATH_MAX];
+	struct dirent *de;
+	DIR *dir;
+	int found = 0, ret = 0;
+
+	if (depth > MAX_TOPOLOGY_DEPTH)
+		return -1;
+	snprintf(path, sizeof(path), "%s/slaves", sysdir);
+	dir = opendir(path);
+	if (dir) {
+		while (ret == 0 && (de = readdir(dir)) != NULL) {
+			if (de->d_name[0] == '.')
+				continue;
+			if (snprintf(path, sizeof(path), "%s/slaves/%s",
+				     sysdir, de->d_name) >= (int) sizeof(path) ||
+			    !realpath(path, slave)) {
+				ret = -1;
+				break;
+			}
+			ret = resolve_disks(fs, slave, depth + 1);
+			found++;
+		}
+		closedir(dir);
+	}
+	if (ret || found)
+		return ret;
+	return add_disk(fs, sysdir);
+}
+
+/*
+ * Estimate how long checking fs will take from the number of inodes in
+ * use (for ext2/3/4) or from the size of the device.
+ */
+static void estimate_weight(struct fs_info *fs, const char *sysdir)
+{
+	unsigned char sb[1024];
+	unsigned long long sectors;
+	unsigned int inodes, free_inodes;
+	int fd;
+
+	fd = open(fs->device, O_RDONLY);
+	if (fd >= 0) {
+		if (pread(fd, sb, sizeof(sb), 1024) == sizeof(sb) &&
+		    sb[56] == 0x53 && sb[57] == 0xEF) {
+			inodes = sb[0] | (sb[1] << 8) | (sb[2] << 16) |
+				((unsigned) sb[3] << 24);
+			free_inodes = sb[16] | (sb[17] << 8) | (sb[18] << 16) |
+				((unsigned) sb[19] << 24);
+			if (free_inodes <= inodes) {
+				fs->weight = inodes - free_inodes;
+				close(fd);
+				return;
+			}
+		}
+		close(fd);
+	}
+	/* Assume one inode in use per 16k of device */
+	if (sysfs_read_ull(sysdir, "size", &sectors) == 0)
+		fs->weight = sectors / 32;
+}
+
+static int fs_topology(struct fs_info *fs)
+{
+	char path[PATH_MAX], sysdir[PATH_MAX];
+	struct stat st;
+
+	if (stat(fs->device, &st) < 0 || !S_ISBLK(st.st_mode))
+		return -1;
+	sprintf(path, "%s/%u:%u", SYSFS_DEV_BLOCK, major(st.st_rdev),
+		minor(st.st_rdev));
+	if (!realpath(path, sysdir))
+		return -1;
+	fs->num_disks = 0;
+	if (resolve_disks(fs, sysdir, 0) || !fs->num_disks)
+		return -1;
+	estimate_weight(fs, sysdir);
+	return 0;
+}
+
+/*
+ * Sort the filesystems so that the largest are checked first, keeping
+ * the fstab order for filesystems of the same weight.
+ */
+static void sort_by_weight(void)
+{
+	struct fs_info *sorted = NULL, *fs, *next, **p;
+
+	for (fs = filesys_info; fs; fs = next) {
+		next = fs->next;
+		for (p = &sorted; *p && (*p)->weight >= fs->weight;
+		     p = &(*p)->next)
+			;
+		fs->next = *p;
+		*p = fs;
+	}
+	filesys_info = sorted;
+	for (fs = filesys_info; fs && fs->next; fs = fs->next)
+		;
+	filesys_last = fs;
+}
+
+/*
+ * Use the device topology if it can be found for every filesystem
+ * which is to be checked.
+ */
+static void setup_topology(void)
+{
+	struct fs_info *fs;
+	int i;
+
+	for (fs = filesys_info; fs; fs = fs->next) {
+		if (fs->flags & FLAG_DONE)
+			continue;
+		if (fs_topology(fs) < 0) {
+			if (verbose > 1)
+				printf(_("Couldn't find the device topology "
+					 "of %s\n"), fs->device);
+			return;
+		}
+		if (verbose > 1) {
+			printf(_("%s: weight %llu, on"), fs->device,
+			       fs->weight);
+			for (i = 0; i < fs->num_disks; i++)
+				printf(" %s%s", fs->disks[i].name,
+				       fs->disks[i].rotational ? "" : "(ssd)");
+			printf("\n");
+		}
+	}
+	sort_by_weight();
+	use_topology = 1;
+}
+
+/*
+ * Returns TRUE if one of the disks holding fs already has as many
+ * checks running as it should.
+ */
+static int disks_busy(struct fs_info *fs)
+{
+	struct fsck_instance *inst;
+	int i, j, count, limit;
+
+	for (i = 0; i < fs->num_disks; i++) {
+		count = 0;
+		for (inst = instance_list; inst; inst = inst->next) {
+			if (!inst->fs)
+				continue;
+			for (j = 0; j < inst->fs->num_disks; j++)
+				if (!strcmp(inst->fs->disks[j].name,
+					    fs->disks[i].name))
+					count++;
+		}
+		limit = fs->disks[i].rotational ? 1 : max_per_device;
+		if (count >= limit)
+			return 1;
+	}
+	return 0;
+}
+#endif
+
 /* Check all file systems, using the /etc/fstab table. */
 static int check_all(NOARGS)
 {
@@ -978,6 +1218,10 @@ static int check_all(NOARGS)
 		if (ignore(fs))
 			fs->flags |= FLAG_DONE;
 	}
+#ifdef __linux__
+	if (!force_all_parallel && !serialize)
+		setup_topology();
+#endif
 
 	/*
 	 * Find and check the root filesystem.
@@ -1034,7 +1278,12 @@ static int check_all(NOARGS)
 			 * already been spawned, then we need to defer
 			 * this to another pass.
 			 */
+#ifdef __linux__
+			if (use_topology ? disks_busy(fs) :
+			    device_already_active(fs->device)) {
+#else
 			if (device_already_active(fs->device)) {
+#endif
 				pass_done = 0;
 				continue;
 			}
@@ -1251,6 +1500,8 @@ static void PRS(int argc, char *argv[])
 		force_all_parallel++;
 	if ((tmp = getenv("FSCK_MAX_INST")))
 	    max_running = atoi(tmp);
+	if ((tmp = getenv("FSCK_MAX_PER_DEVICE")) && atoi(tmp) > 0)
+	    max_per_device = atoi(tmp);
 }
 
 int main(int argc, char *argv[])
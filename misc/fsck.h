@@ -45,9 +45,20 @@ struct fs_info {
 	int   freq;
 	int   passno;
 	int   flags;
+	struct fs_disk *disks;		/* Physical disks holding the fs */
+	int   num_disks;
+	unsigned long long weight;	/* Estimated cost of checking it */
 	struct fs_info *next;
 };
 
+/*
+ * A physical disk, as found by following a device's slaves in sysfs
+ */
+struct fs_disk {
+	char	name[64];
+	int	rotational;
+};
+
 #define FLAG_DONE 1
 #define FLAG_PROGRESS 2
 
@@ -63,6 +74,7 @@ struct fsck_instance {
 	char *	type;
 	char *	device;
 	char *	base_device;
+	struct fs_info *fs;
 	struct fsck_instance *next;
 };
 
@@ -46,6 +46,9 @@ extern int optind;
 #ifdef HAVE_SYS_IOCTL_H
 #include <sys/ioctl.h>
 #endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
 #include <libgen.h>
 #include <limits.h>
 #include <blkid/blkid.h>
@@ -72,6 +75,7 @@ extern int optind;
 #endif
 
 #define DISCARD_STEP_MB		(2048)
+#define ITABLE_ZERO_STEP_MB	(1024)
 
 extern int isatty(int);
 extern FILE *fpopen(const char *cmd, const char *mode);
@@ -401,18 +405,65 @@ static errcode_t packed_allocate_tables(ext2_filsys fs)
 	return 0;
 }
 
-static void write_inode_tables(ext2_filsys fs, int lazy_flag, int itable_zeroed)
+static double mke2fs_time(void)
+{
+#ifdef HAVE_SYS_TIME_H
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+#else
+	return time(NULL);
+#endif
+}
+
+/*
+ * Print how fast a bulk operation (discard or inode table zeroing)
+ * went, when running verbosely.
+ */
+static void print_throughput(ext2_filsys fs, const char *what,
+			     blk64_t blocks, double start)
+{
+	double elapsed = mke2fs_time() - start;
+	double mb = (double) blocks * fs->blocksize / (1024 * 1024);
+
+	if (!verbose)
+		return;
+	if (elapsed > 0)
+		printf(_("%s %.0f MB in %.2f seconds (%.1f MB/s)\n"),
+		       what, mb, elapsed, mb / elapsed);
+	else
+		printf(_("%s %.0f MB\n"), what, mb);
+}
+
+static void zero_itable_range(ext2_filsys fs, blk64_t blk, int num)
 {
 	errcode_t	retval;
-	blk64_t		blk;
+
+	if (!num)
+		return;
+	retval = ext2fs_zero_blocks2(fs, blk, num, &blk, &num);
+	if (retval) {
+		fprintf(stderr, _("\nCould not write %d "
+			  "blocks in inode table starting at %llu: %s\n"),
+			num, blk, error_message(retval));
+		exit(1);
+	}
+}
+
+static void write_inode_tables(ext2_filsys fs, int lazy_flag, int itable_zeroed)
+{
+	blk64_t		blk, zero_blk = 0, zeroed = 0;
 	dgrp_t		i;
-	int		num;
+	int		num, zero_num = 0, max_num;
+	double		start = mke2fs_time();
 	struct ext2fs_numeric_progress_struct progress;
 
 	ext2fs_numeric_progress_init(fs, &progress,
 				     _("Writing inode tables: "),
 				     fs->group_desc_count);
 
+	max_num = ((blk64_t) ITABLE_ZERO_STEP_MB << 20) / fs->blocksize;
 	for (i = 0; i < fs->group_desc_count; i++) {
 		ext2fs_numeric_progress_update(fs, &progress, i);
 
@@ -430,23 +481,35 @@ static void write_inode_tables(ext2_filsys fs, int lazy_flag, int itable_zeroed)
 			ext2fs_group_desc_csum_set(fs, i);
 		}
 		if (!itable_zeroed) {
-			retval = ext2fs_zero_blocks2(fs, blk, num, &blk, &num);
-			if (retval) {
-				fprintf(stderr, _("\nCould not write %d "
-					  "blocks in inode table starting at %llu: %s\n"),
-					num, blk, error_message(retval));
-				exit(1);
+			/*
+			 * With flex_bg the inode tables of a flex group
+			 * are packed next to each other, so zero them with
+			 * one large request instead of one per group.
+			 */
+			if (zero_num && zero_blk + zero_num == blk &&
+			    zero_num + num <= max_num) {
+				zero_num += num;
+			} else {
+				zero_itable_range(fs, zero_blk, zero_num);
+				zero_blk = blk;
+				zero_num = num;
 			}
+			zeroed += num;
 		}
 		if (sync_kludge) {
+			zero_itable_range(fs, zero_blk, zero_num);
+			zero_num = 0;
 			if (sync_kludge == 1)
 				io_channel_flush(fs->io);
 			else if ((i % sync_kludge) == 0)
 				io_channel_flush(fs->io);
 		}
 	}
+	zero_itable_range(fs, zero_blk, zero_num);
 	ext2fs_numeric_progress_close(fs, &progress,
 				      _("done                            \n"));
+	if (zeroed)
+		print_throughput(fs, _("Zeroed inode tables:"), zeroed, start);
 
 	/* Reserved inodes must always have correct checksums */
 	if (ext2fs_has_feature_metadata_csum(fs->super))
@@ -2675,6 +2738,7 @@ static int mke2fs_discard_device(ext2_filsys fs)
 	blk64_t blocks = ext2fs_blocks_count(fs->super);
 	blk64_t count = DISCARD_STEP_MB;
 	blk64_t cur;
+	double start = mke2fs_time();
 	int retval = 0;
 
 	/*
@@ -2710,9 +2774,11 @@ static int mke2fs_discard_device(ext2_filsys fs)
 				      _("failed - "));
 		if (!quiet)
 			printf("%s\n",error_message(retval));
-	} else
+	} else {
 		ext2fs_numeric_progress_close(fs, &progress,
 				      _("done                            \n"));
+		print_throughput(fs, _("Discarded"), blocks, start);
+	}
 
 	return retval;
 }
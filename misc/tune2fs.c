@@ -50,6 +50,10 @@ extern int optind;
 #include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/time.h>
+#ifdef HAVE_GETRUSAGE
+#include <sys/resource.h>
+#endif
 #include <libgen.h>
 #include <limits.h>
 
@@ -101,6 +105,8 @@ static int rewrite_checksums;
 static int feature_64bit;
 static int fsck_requested;
 static char *undo_file;
+static char *stats_fn;
+static struct timeval stats_time_start;
 
 int journal_size, journal_flags;
 char *journal_device;
@@ -2184,6 +2190,12 @@ static int parse_extended_opts(ext2_filsys fs, const char *opts)
 				continue;
 			}
 			ext_mount_opts = strdup(arg);
+		} else if (!strcmp(token, "stats")) {
+			if (!arg || !*arg) {
+				r_usage++;
+				continue;
+			}
+			stats_fn = strdup(arg);
 		} else
 			r_usage++;
 	}
@@ -2197,6 +2209,7 @@ static int parse_extended_opts(ext2_filsys fs, const char *opts)
 			"\thash_alg=<hash algorithm>\n"
 			"\tmount_opts=<extended default mount options>\n"
 			"\tmmp_update_interval=<mmp update interval in seconds>\n"
+			"\tstats=<statistics file>\n"
 			"\tstride=<RAID per-disk chunk size in blocks>\n"
 			"\tstripe_width=<RAID stride*data disks in blocks>\n"
 			"\ttest_fs\n"
@@ -2209,6 +2222,71 @@ static int parse_extended_opts(ext2_filsys fs, const char *opts)
 	return 0;
 }
 
+/*
+ * Write the resources used by this run of tune2fs to the file given
+ * with "-E stats=<file>", in the same JSON format used by e2fsck and
+ * resize2fs.
+ */
+static void write_stats(ext2_filsys fs)
+{
+	FILE		*f;
+	struct timeval	time_end;
+	io_stats	io = 0;
+	const char	*cp;
+#ifdef HAVE_GETRUSAGE
+	struct rusage	r;
+#endif
+
+	f = fopen(stats_fn, "w");
+	if (!f) {
+		com_err(program_name, errno,
+			_("while opening %s for writing statistics"),
+			stats_fn);
+		return;
+	}
+	gettimeofday(&time_end, 0);
+	fprintf(f, "{\n  \"program\": \"tune2fs\",\n");
+	fprintf(f, "  \"version\": \"%s\",\n", E2FSPROGS_VERSION);
+	fputs("  \"device\": \"", f);
+	for (cp = fs->device_name; cp && *cp; cp++) {
+		if (*cp == '"' || *cp == '\\')
+			fputc('\\', f);
+		fputc(*cp, f);
+	}
+	fprintf(f, "\",\n  \"total\": {\n");
+	fprintf(f, "    \"wall_sec\": %.6f", (time_end.tv_sec -
+		stats_time_start.tv_sec) + ((double) (time_end.tv_usec -
+		stats_time_start.tv_usec) / 1000000));
+#ifdef HAVE_GETRUSAGE
+	getrusage(RUSAGE_SELF, &r);
+	fprintf(f, ",\n    \"user_sec\": %.6f", r.ru_utime.tv_sec +
+		(double) r.ru_utime.tv_usec / 1000000);
+	fprintf(f, ",\n    \"sys_sec\": %.6f", r.ru_stime.tv_sec +
+		(double) r.ru_stime.tv_usec / 1000000);
+	fprintf(f, ",\n    \"max_rss_kb\": %ld", r.ru_maxrss);
+#endif
+	if (fs->io->manager->get_stats)
+		fs->io->manager->get_stats(fs->io, &io);
+	if (io) {
+		fprintf(f, ",\n    \"bytes_read\": %llu", io->bytes_read);
+		fprintf(f, ",\n    \"bytes_written\": %llu",
+			io->bytes_written);
+	}
+	if (io && io->num_fields >= 7) {
+		fprintf(f, ",\n    \"read_ops\": %llu", io->read_ops);
+		fprintf(f, ",\n    \"write_ops\": %llu", io->write_ops);
+		fprintf(f, ",\n    \"cache_hits\": %llu", io->cache_hits);
+		fprintf(f, ",\n    \"cache_misses\": %llu",
+			io->cache_misses);
+		fprintf(f, ",\n    \"readahead_bytes\": %llu",
+			io->readahead_bytes);
+	}
+	fprintf(f, "\n  }\n}\n");
+	if (fclose(f))
+		com_err(program_name, errno,
+			_("while writing statistics to %s"), stats_fn);
+}
+
 /*
  * Fill in the block bitmap bmap with the information regarding the
  * blocks to be moved
@@ -2895,6 +2973,7 @@ int tune2fs_main(int argc, char **argv)
 	if (argc && *argv)
 		program_name = *argv;
 	add_error_table(&et_ext2_error_table);
+	gettimeofday(&stats_time_start, 0);
 
 #ifdef CONFIG_BUILD_FINDFS
 	if (strcmp(get_progname(argv[0]), "findfs") == 0)
@@ -3369,5 +3448,7 @@ closefs:
 
 	if (feature_64bit)
 		convert_64bit(fs, feature_64bit);
+	if (stats_fn)
+		write_stats(fs);
 	return (ext2fs_close_free(&fs) ? 1 : 0);
 }
@@ -23,6 +23,7 @@
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/time.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <string.h>
@@ -50,6 +51,8 @@ static void usage(const char *progname)
 			  "[-T timeout]\n"), progname);
 	fprintf(stderr, _("       %s [-r|t] [-n num] [-s socketpath]\n"),
 		progname);
+	fprintf(stderr, _("       %s -B seconds [-n num] [-s socketpath]\n"),
+		progname);
 	fprintf(stderr, _("       %s -k\n"), progname);
 	exit(1);
 }
@@ -211,7 +214,7 @@ static int call_daemon(const char *socket_path, int op, char *buf,
 
 	if ((ret > 0) && (op == 4)) {
 		if (reply_len >= (int) (16+sizeof(int)))
-			memcpy(buf+16, num, sizeof(int));
+			memcpy(num, buf+16, sizeof(int));
 		else
 			*num = -1;
 	}
@@ -394,6 +397,10 @@ static void server_loop(const char *socket_path, const char *pidfile_path,
 			reply_len = sizeof(uu);
 			break;
 		case UUIDD_OP_BULK_TIME_UUID:
+			if (num < 1)
+				num = 1;
+			if (num > UUIDD_MAX_TIME_BULK)
+				num = UUIDD_MAX_TIME_BULK;
 			uuid__generate_time(uu, &num);
 			if (debug) {
 				uuid_unparse(uu, str);
@@ -440,6 +447,80 @@ static void server_loop(const char *socket_path, const char *pidfile_path,
 	}
 }
 
+static double bench_elapsed(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, 0);
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+static void bench_report(const char *what, double count, double secs)
+{
+	printf(_("%-32s %12.0f UUIDs/sec\n"), what, secs ? count / secs : 0);
+}
+
+/*
+ * Measure how many time-based UUIDs per second can be had by asking
+ * uuidd for one at a time, by asking it for ranges of num UUIDs, and
+ * from libuuid's uuid_generate_time(), which reserves ranges itself.
+ */
+static void run_benchmark(const char *socket_path, int secs, int num)
+{
+	struct timeval	start;
+	const char	*err_context;
+	char		buf[1024];
+	double		count, elapsed;
+	uuid_t		uu;
+	int		n, ret;
+
+	if (!num)
+		num = 1000;
+
+	count = 0;
+	gettimeofday(&start, 0);
+	do {
+		ret = call_daemon(socket_path, UUIDD_OP_TIME_UUID, buf,
+				  sizeof(buf), 0, &err_context);
+		if (ret < 0) {
+			printf(_("Error calling uuidd daemon (%s): %s\n"),
+			       err_context, strerror(errno));
+			break;
+		}
+		count++;
+	} while ((elapsed = bench_elapsed(&start)) < secs);
+	if (ret >= 0)
+		bench_report(_("uuidd, one per request:"), count, elapsed);
+
+	count = 0;
+	gettimeofday(&start, 0);
+	do {
+		n = num;
+		ret = call_daemon(socket_path, UUIDD_OP_BULK_TIME_UUID, buf,
+				  sizeof(buf), &n, &err_context);
+		if (ret < 0) {
+			printf(_("Error calling uuidd daemon (%s): %s\n"),
+			       err_context, strerror(errno));
+			break;
+		}
+		count += n;
+	} while ((elapsed = bench_elapsed(&start)) < secs);
+	if (ret >= 0) {
+		sprintf(buf, _("uuidd, %d per request:"), num);
+		bench_report(buf, count, elapsed);
+	}
+
+	count = 0;
+	gettimeofday(&start, 0);
+	do {
+		for (n = 0; n < 1000; n++)
+			uuid_generate_time(uu);
+		count += n;
+	} while ((elapsed = bench_elapsed(&start)) < secs);
+	bench_report(_("uuid_generate_time():"), count, elapsed);
+}
+
 int main(int argc, char **argv)
 {
 	const char	*socket_path = UUIDD_SOCKET_PATH;
@@ -453,6 +534,7 @@ int main(int argc, char **argv)
 	int		i, c, ret;
 	int		debug = 0, do_type = 0, do_kill = 0, num = 0;
 	int		timeout = 0, quiet = 0, drop_privs = 0;
+	int		bench_secs = 0;
 
 #ifdef ENABLE_NLS
 	setlocale(LC_MESSAGES, "");
@@ -461,8 +543,16 @@ int main(int argc, char **argv)
 	textdomain(NLS_CAT_NAME);
 #endif
 
-	while ((c = getopt (argc, argv, "dkn:qp:s:tT:r")) != EOF) {
+	while ((c = getopt (argc, argv, "B:dkn:qp:s:tT:r")) != EOF) {
 		switch (c) {
+		case 'B':
+			bench_secs = strtol(optarg, &tmp, 0);
+			if ((bench_secs <= 0) || *tmp) {
+				fprintf(stderr, _("Bad number: %s\n"), optarg);
+				exit(1);
+			}
+			drop_privs = 1;
+			break;
 		case 'd':
 			debug++;
 			drop_privs = 1;
@@ -527,6 +617,10 @@ int main(int argc, char **argv)
 			die("setreuid");
 #endif
 	}
+	if (bench_secs) {
+		run_benchmark(socket_path, bench_secs, num);
+		exit(0);
+	}
 	if (num && do_type) {
 		ret = call_daemon(socket_path, do_type+2, buf,
 				  sizeof(buf), &num, &err_context);
@@ -48,12 +48,60 @@ static void usage (char *prog)
 {
 	fprintf (stderr, _("Usage: %s [-d debug_flags] [-f] [-F] [-M] [-P] "
 			   "[-p] device [-b|-s|new_size] [-S RAID-stride] "
-			   "[-z undo_file]\n\n"),
+			   "[-E extended-options] [-z undo_file]\n\n"),
 		 prog);
 
 	exit (1);
 }
 
+static char *stats_fn;
+
+static void parse_extended_opts(const char *opts)
+{
+	char	*buf, *token, *next, *p, *arg;
+	int	r_usage = 0;
+
+	buf = malloc(strlen(opts)+1);
+	if (!buf) {
+		fprintf(stderr, "%s",
+			_("Couldn't allocate memory to parse options!\n"));
+		exit(1);
+	}
+	strcpy(buf, opts);
+	for (token = buf; token && *token; token = next) {
+		p = strchr(token, ',');
+		next = 0;
+		if (p) {
+			*p = 0;
+			next = p+1;
+		}
+		arg = strchr(token, '=');
+		if (arg) {
+			*arg = 0;
+			arg++;
+		}
+		if (strcmp(token, "stats") == 0) {
+			if (!arg || !*arg) {
+				r_usage++;
+				continue;
+			}
+			stats_fn = strdup(arg);
+		} else
+			r_usage++;
+	}
+	if (r_usage) {
+		fprintf(stderr, "%s", _("\nBad options specified.\n\n"
+			"Extended options are separated by commas, "
+			"and may take an argument which\n"
+			"\tis set off by an equals ('=') sign.\n\n"
+			"Valid extended options are:\n"
+			"\tstats=<statistics file>\n\n"));
+		free(buf);
+		exit(1);
+	}
+	free(buf);
+}
+
 static errcode_t resize_progress_func(ext2_resize_t rfs, int pass,
 				      unsigned long cur, unsigned long max)
 {
@@ -285,7 +333,7 @@ int main (int argc, char ** argv)
 	if (argc && *argv)
 		program_name = *argv;
 
-	while ((c = getopt(argc, argv, "d:fFhMPpS:bsz:")) != EOF) {
+	while ((c = getopt(argc, argv, "d:E:fFhMPpS:bsz:")) != EOF) {
 		switch (c) {
 		case 'h':
 			usage(program_name);
@@ -305,6 +353,9 @@ int main (int argc, char ** argv)
 		case 'd':
 			flags |= atoi(optarg);
 			break;
+		case 'E':
+			parse_extended_opts(optarg);
+			break;
 		case 'p':
 			flags |= RESIZE_PERCENT_COMPLETE;
 			break;
@@ -609,6 +660,15 @@ int main (int argc, char ** argv)
 		retval = online_resize_fs(fs, mtpt, &new_size, flags);
 	} else {
 		bigalloc_check(fs, force);
+		if (stats_fn) {
+			retval = open_resource_stats(stats_fn, device_name);
+			if (retval) {
+				com_err(program_name, retval,
+					_("while opening %s for writing "
+					  "statistics"), stats_fn);
+				exit(1);
+			}
+		}
 		if (flags & RESIZE_ENABLE_64BIT)
 			printf(_("Converting the filesystem to 64-bit.\n"));
 		else if (flags & RESIZE_DISABLE_64BIT)
@@ -620,6 +680,7 @@ int main (int argc, char ** argv)
 		retval = resize_fs(fs, &new_size, flags,
 				   ((flags & RESIZE_PERCENT_COMPLETE) ?
 				    resize_progress_func : 0));
+		close_resource_stats();
 	}
 	free(mtpt);
 	if (retval) {
@@ -97,6 +97,11 @@ struct resource_track {
 	void	*brk_start;
 	unsigned long long bytes_read;
 	unsigned long long bytes_written;
+	unsigned long long read_ops;
+	unsigned long long write_ops;
+	unsigned long long cache_hits;
+	unsigned long long cache_misses;
+	unsigned long long readahead_bytes;
 };
 
 /*
@@ -176,6 +181,9 @@ extern void init_resource_track(struct resource_track *track, const char *desc,
 extern void print_resource_track(ext2_resize_t rfs,
 				 struct resource_track *track,
 				 io_channel channel);
+extern errcode_t open_resource_stats(const char *filename,
+				     const char *device);
+extern void close_resource_stats(void);
 
 /* sim_progress.c */
 extern errcode_t ext2fs_progress_init(ext2_sim_progmeter *ret_prog,
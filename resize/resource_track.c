@@ -12,6 +12,7 @@
 
 #include "config.h"
 #include "resize2fs.h"
+#include "../version.h"
 #include <time.h>
 #ifdef HAVE_MALLOC_H
 #include <malloc.h>
@@ -42,12 +43,22 @@ void init_resource_track(struct resource_track *track, const char *desc,
 #endif
 	track->bytes_read = 0;
 	track->bytes_written = 0;
+	track->read_ops = track->write_ops = 0;
+	track->cache_hits = track->cache_misses = 0;
+	track->readahead_bytes = 0;
 	if (channel && channel->manager && channel->manager->get_stats)
 		channel->manager->get_stats(channel, &io_start);
 	if (io_start) {
 		track->bytes_read = io_start->bytes_read;
 		track->bytes_written = io_start->bytes_written;
 	}
+	if (io_start && io_start->num_fields >= 7) {
+		track->read_ops = io_start->read_ops;
+		track->write_ops = io_start->write_ops;
+		track->cache_hits = io_start->cache_hits;
+		track->cache_misses = io_start->cache_misses;
+		track->readahead_bytes = io_start->readahead_bytes;
+	}
 }
 
 static float timeval_subtract(struct timeval *tv1,
@@ -57,6 +68,98 @@ static float timeval_subtract(struct timeval *tv1,
 		((float) (tv1->tv_usec - tv2->tv_usec)) / 1000000);
 }
 
+/*
+ * When resize2fs is run with "-E stats=<file>", every resource
+ * tracking record is also written to that file as JSON.
+ */
+static FILE *stats_f;
+static int stats_records;
+
+static void print_json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; s && *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char) *s < 0x20)
+			fprintf(f, "\\u%04x", (unsigned char) *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+errcode_t open_resource_stats(const char *filename, const char *device)
+{
+	stats_f = fopen(filename, "w");
+	if (!stats_f)
+		return errno;
+	fprintf(stats_f, "{\n  \"program\": \"resize2fs\",\n");
+	fprintf(stats_f, "  \"version\": \"%s\",\n", E2FSPROGS_VERSION);
+	fprintf(stats_f, "  \"device\": ");
+	print_json_string(stats_f, device);
+	fprintf(stats_f, ",\n  \"passes\": [");
+	return 0;
+}
+
+static void record_resource_stats(struct resource_track *track,
+				  io_channel channel)
+{
+	struct timeval time_end;
+	io_stats cur = 0;
+	unsigned long long hits = 0, misses = 0;
+#ifdef HAVE_GETRUSAGE
+	struct rusage r;
+#endif
+
+	gettimeofday(&time_end, 0);
+	fprintf(stats_f, "%s\n    {\n      \"name\": ",
+		stats_records++ ? "," : "");
+	print_json_string(stats_f, track->desc);
+	fprintf(stats_f, ",\n      \"wall_sec\": %.6f",
+		timeval_subtract(&time_end, &track->time_start));
+#ifdef HAVE_GETRUSAGE
+	getrusage(RUSAGE_SELF, &r);
+	fprintf(stats_f, ",\n      \"user_sec\": %.6f",
+		timeval_subtract(&r.ru_utime, &track->user_start));
+	fprintf(stats_f, ",\n      \"sys_sec\": %.6f",
+		timeval_subtract(&r.ru_stime, &track->system_start));
+	fprintf(stats_f, ",\n      \"max_rss_kb\": %ld", r.ru_maxrss);
+#endif
+	if (channel && channel->manager && channel->manager->get_stats)
+		channel->manager->get_stats(channel, &cur);
+	if (cur) {
+		fprintf(stats_f, ",\n      \"bytes_read\": %llu",
+			cur->bytes_read - track->bytes_read);
+		fprintf(stats_f, ",\n      \"bytes_written\": %llu",
+			cur->bytes_written - track->bytes_written);
+	}
+	if (cur && cur->num_fields >= 7) {
+		hits = cur->cache_hits - track->cache_hits;
+		misses = cur->cache_misses - track->cache_misses;
+		fprintf(stats_f, ",\n      \"read_ops\": %llu",
+			cur->read_ops - track->read_ops);
+		fprintf(stats_f, ",\n      \"write_ops\": %llu",
+			cur->write_ops - track->write_ops);
+		fprintf(stats_f, ",\n      \"cache_hits\": %llu", hits);
+		fprintf(stats_f, ",\n      \"cache_misses\": %llu", misses);
+		fprintf(stats_f, ",\n      \"cache_hit_pct\": %.2f",
+			(hits + misses) ? 100.0 * hits / (hits + misses) : 0.0);
+		fprintf(stats_f, ",\n      \"readahead_bytes\": %llu",
+			cur->readahead_bytes - track->readahead_bytes);
+	}
+	fprintf(stats_f, "\n    }");
+}
+
+void close_resource_stats(void)
+{
+	if (!stats_f)
+		return;
+	fprintf(stats_f, "\n  ]\n}\n");
+	fclose(stats_f);
+	stats_f = NULL;
+}
+
 void print_resource_track(ext2_resize_t rfs, struct resource_track *track,
 			  io_channel channel)
 {
@@ -68,6 +171,9 @@ void print_resource_track(ext2_resize_t rfs, struct resource_track *track,
 #endif
 	struct timeval time_end;
 
+	if (stats_f)
+		record_resource_stats(track, channel);
+
 	if ((rfs->flags & RESIZE_DEBUG_RTRACK) == 0)
 		return;
 